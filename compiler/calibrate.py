@@ -0,0 +1,490 @@
+#!/usr/bin/python
+
+"""
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+"""
+
+
+"""
+	This program calibrates the cost models of the operators.
+
+	It generates synthetic text corpora of varying size and vocabulary
+	and runs every operator variant over them with varying numbers of
+	threads, recording the execution time and peak memory. A linear
+	model of time and memory is fitted for each variant and written to
+	a JSON file, in the format of costmodel.json.
+
+	Operator variants:
+		src		the materialised operators in ../src:
+				tfidf_map, tfidf_list, tfidf_list_umap,
+				tfidf_best -a h|u|s, kmeans (sparse) and
+				kmeans -d (dense)
+		generated	the tfidf container variants the compiler
+				selects from (see "container_variants" in the
+				operator library), generated by jsontocpp.py
+
+	The text features are those computed by jsontocpp.py from a sample
+	of the input, such that the compiler evaluates the models on the
+	same estimates. The kmeans features are described in the output.
+"""
+
+import json
+import sys, getopt
+import os
+import math
+import random
+import bisect
+import shlex
+import subprocess
+import time
+import multiprocessing
+
+import jsontocpp
+
+
+""" Synthetic corpora: number of files, megabytes, vocabulary size """
+g_corpora = [
+    (10, 1, 1000),
+    (200, 2, 20000),
+    (1000, 4, 100000),
+    (2000, 6, 5000),
+    (20, 8, 300000),
+    (100, 8, 1000000),
+    (5, 12, 50000),
+    (400, 12, 200000),
+]
+
+""" Materialised operators in ../src: (variant, make target, arguments) """
+g_srcTfidf = [
+    ("tfidf_map", "tfidf_map", []),
+    ("tfidf_list", "tfidf_list", []),
+    ("tfidf_list_umap", "tfidf_list_umap", []),
+    ("tfidf_best_h", "tfidf_best", ["-a", "h"]),
+    ("tfidf_best_u", "tfidf_best", ["-a", "u"]),
+    ("tfidf_best_s", "tfidf_best", ["-a", "s"]),
+]
+g_srcKmeans = [
+    ("sparse", "kmeans", []),
+    ("dense", "kmeans", ["-d"]),
+]
+
+""" Features of the fitted models """
+g_tfidfTimeFeatures = ["const", "files", "bytes", "tokens_log", "file_words_log",
+                       "vocabulary_log", "vocabulary_threads"]
+g_tfidfMemoryFeatures = ["const", "bytes", "file_words", "vocabulary"]
+g_kmeansTimeFeatures = ["const", "nonzeros", "sparse_work", "dense_work", "centre_work"]
+g_kmeansMemoryFeatures = ["const", "nonzeros", "dense_values"]
+
+g_kmeansFeatureDoc = {
+    "const": "1",
+    "nonzeros": "non-zero values in the input",
+    "dense_values": "points * dimensions",
+    "sparse_work": "nonzeros * clusters * iterations / threads",
+    "dense_work": "points * dimensions * clusters * iterations / threads",
+    "centre_work": "clusters * dimensions * iterations"
+}
+
+"""
+	Write a corpus of text files with words drawn from a Zipf
+	distribution over a random vocabulary
+"""
+def writeCorpus(dirname, numFiles, megabytes, vocabulary, seed):
+
+    if os.path.isdir(dirname):
+        return
+    rnd = random.Random(seed)
+    words = set()
+    while len(words) < vocabulary:
+        n = rnd.randint(2, 10)
+        words.add(''.join([chr(ord('a') + rnd.randint(0, 25)) for i in range(n)]))
+    words = list(words)
+    cumulative = []
+    total = 0.0
+    for rank in range(1, vocabulary+1):
+        total += 1.0 / rank
+        cumulative.append(total)
+
+    os.makedirs(dirname + '.tmp')
+    perFile = int(megabytes * 1e6 / numFiles)
+    for f in range(numFiles):
+        text = []
+        size = 0
+        while size < perFile:
+            w = words[bisect.bisect(cumulative, rnd.random() * total)]
+            text.append(w)
+            size += len(w) + 1
+        out = open(os.path.join(dirname + '.tmp', 'f%05d' % f), 'w')
+        out.write(' '.join(text) + '\n')
+        out.close()
+    os.rename(dirname + '.tmp', dirname)
+
+"""
+	Number of points, dimensions and non-zero values of an ARFF file
+"""
+def arffStats(fname):
+
+    points = 0
+    dims = 0
+    nonzeros = 0
+    f = open(fname, 'r')
+    for line in f:
+        line = line.strip()
+        if line.startswith('@attribute'):
+            dims += 1
+        elif line.startswith('{'):
+            points += 1
+            body = line[1:line.find('}')].strip()
+            if body:
+                nonzeros += body.count(',') + 1
+        elif line and not line.startswith('@') and not line.startswith('%'):
+            points += 1
+            nonzeros += len([v for v in line.split(',') if float(v) != 0.0])
+    f.close()
+    return {"points": points, "dims": dims, "nonzeros": nonzeros}
+
+def kmeansFeatures(stats, clusters, iters, threads):
+
+    p = float(threads)
+    work = float(clusters * iters)
+    features = {}
+    features["const"] = 1.0
+    features["nonzeros"] = stats["nonzeros"]
+    features["dense_values"] = float(stats["points"]) * stats["dims"]
+    features["sparse_work"] = stats["nonzeros"] * work / p
+    features["dense_work"] = float(stats["points"]) * stats["dims"] * work / p
+    features["centre_work"] = stats["dims"] * work
+    return features
+
+"""
+	The programs are started by a launcher process. The peak resident
+	memory reported for a child includes the memory of the process it
+	was forked from, which the launcher keeps small. The launcher reads
+	a command per line and replies with its status, time and memory.
+"""
+def runLauncher():
+
+    devnull = open(os.devnull, 'w')
+    for line in iter(sys.stdin.readline, ''):
+        request = json.loads(line)
+        start = time.time()
+        proc = subprocess.Popen(request["command"], cwd=request["cwd"], env=request["env"],
+                                stdout=devnull, stderr=devnull)
+        pid, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.time() - start
+        sys.stdout.write(json.dumps([status, elapsed, usage.ru_maxrss * 1024]) + '\n')
+        sys.stdout.flush()
+
+"""
+	Run a program with the given number of threads. Returns the elapsed
+	time in seconds and the peak resident memory in bytes of the fastest
+	of the repeated runs.
+"""
+def measure(launcher, command, cwd, threads, repeats):
+
+    env = dict(os.environ)
+    env["ASAP_NUM_WORKERS"] = str(threads)
+    env["CILK_NWORKERS"] = str(threads)
+    best = None
+    for r in range(0, repeats):
+        launcher.stdin.write(json.dumps({"command": command, "cwd": cwd, "env": env}) + '\n')
+        launcher.stdin.flush()
+        (status, elapsed, memory) = json.loads(launcher.stdout.readline())
+        if status != 0:
+            print "Error: ", ' '.join(command), " failed with status ", status
+            return None
+        if best is None or elapsed < best[0]:
+            best = (elapsed, memory)
+    return best
+
+"""
+	Non-negative least squares by coordinate descent on normalised
+	features, such that every term of a model adds cost
+"""
+def fitModel(rows, y, iters=2000):
+
+    n = len(rows[0])
+    norms = [max(1e-30, math.sqrt(sum([r[j] ** 2 for r in rows]))) for j in range(n)]
+    A = [[r[j] / norms[j] for j in range(n)] for r in rows]
+    x = [0.0] * n
+    res = list(y)
+    for it in range(iters):
+        change = 0.0
+        for j in range(n):
+            g = sum([A[i][j] * res[i] for i in range(len(A))])
+            nx = max(0.0, x[j] + g)
+            d = nx - x[j]
+            if d != 0.0:
+                for i in range(len(A)):
+                    res[i] -= d * A[i][j]
+                x[j] = nx
+                change = max(change, abs(d))
+        if change < 1e-12:
+            break
+    return [x[j] / norms[j] for j in range(n)]
+
+"""
+	The terms of a model that contribute to some prediction
+"""
+def significantTerms(names, coefs, features, scale):
+
+    terms = {}
+    for (f, c) in zip(names, coefs):
+        if max([c * x[f] for x in features]) > 1e-4 * scale:
+            terms[f] = float('%.4g' % c)
+    return terms
+
+"""
+	Fit the time and memory models of one variant to its measurements.
+	Each measurement holds the features for the number of threads used,
+	the features for one thread, the time and the memory. Memory is
+	modelled on the features for one thread, i.e., the totals.
+"""
+def fitVariant(measurements, timeFeatures, memoryFeatures):
+
+    t = fitModel([[m[0][f] for f in timeFeatures] for m in measurements],
+                 [m[2] for m in measurements])
+    mem = fitModel([[m[1][f] for f in memoryFeatures] for m in measurements],
+                   [float(m[3]) for m in measurements])
+    model = {}
+    model["time"] = significantTerms(timeFeatures, t, [m[0] for m in measurements],
+                                     max([m[2] for m in measurements]))
+    model["memory"] = significantTerms(memoryFeatures, mem, [m[1] for m in measurements],
+                                       max([m[3] for m in measurements]))
+    errors = [abs(jsontocpp.predict(model["time"], m[0]) - m[2]) / max(1e-3, m[2])
+              for m in measurements]
+    model["error"] = float('%.3g' % (sum(errors) / len(errors)))
+    return model
+
+"""
+	Generate and build a tfidf program for every container variant in
+	the operator library. Returns a list of (variant, word bank, program).
+"""
+def buildGenerated(workDir, inputLink, makeArgs):
+
+    library = open('SwanMaterialised.json', 'r')
+    jsontocpp.loadOperatorLibraryData(json.load(library))
+    library.close()
+    variants = jsontocpp.g_variantsMap["tfidf"]
+
+    workflow = open('tfidf_auto.json', 'r')
+    flow = json.load(workflow)
+    workflow.close()
+    flow["workflow"]["tasks"][0]["operator"]["constraints"]["input0"] = inputLink
+
+    programs = []
+    for variant in sorted(variants["variants"].keys()):
+        for wordBank in sorted(variants["word_banks"].keys()):
+            name = os.path.join(workDir, 'tfidf_' + variant + '_' + wordBank)
+            force = {"operators": {"tfidf": [{"variant": variant, "word_bank": wordBank,
+                                              "time": {"const": 0}, "memory": {"const": 0}}]}}
+            f = open(name + '.cost.json', 'w')
+            json.dump(force, f)
+            f.close()
+            f = open(name + '.json', 'w')
+            json.dump(flow, f)
+            f.close()
+            devnull = open(os.devnull, 'w')
+            rc = subprocess.call([sys.executable, 'jsontocpp.py', '-i', name + '.json',
+                                  '-l', 'SwanMaterialised.json', '-c', name + '.cost.json'],
+                                 stdout=devnull)
+            devnull.close()
+            if rc != 0 or subprocess.call(['make', name + '.dir/tfidf'] + makeArgs) != 0:
+                print "Error: could not build ", name
+                continue
+            programs.append((variant, wordBank, os.path.abspath(name + '.dir/tfidf')))
+    return programs
+
+
+def main(argv):
+
+    if argv == ['-L']:
+        runLauncher()
+        return
+    launcher = subprocess.Popen([sys.executable, os.path.abspath(__file__), '-L'],
+                                stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    srcDir = '../src'
+    outfile = 'costmodel.json'
+    workDir = 'calibration.dir'
+    sets = ['src', 'generated']
+    threadCounts = []
+    repeats = 1
+    scale = 1.0
+    clusters = 8
+    iters = 5
+    makeArgs = []
+
+    usage = 'calibrate.py [-o <costmodelfile>] [-w <workdir>] [-s <srcdir>] ' \
+            '[-p src,generated] [-t <threads,...>] [-r <repeats>] [-x <size scale>] ' \
+            '[-M <make arguments>]'
+    try:
+        opts, args = getopt.getopt(argv, "ho:w:s:p:t:r:x:M:")
+    except getopt.GetoptError:
+        print usage
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt == '-h':
+            print usage
+            sys.exit()
+        elif opt == '-o':
+            outfile = os.path.abspath(arg)
+        elif opt == '-w':
+            workDir = os.path.abspath(arg)
+        elif opt == '-s':
+            srcDir = os.path.abspath(arg)
+        elif opt == '-p':
+            sets = arg.split(',')
+        elif opt == '-t':
+            threadCounts = [int(t) for t in arg.split(',')]
+        elif opt == '-r':
+            repeats = int(arg)
+        elif opt == '-x':
+            scale = float(arg)
+        elif opt == '-M':
+            makeArgs = shlex.split(arg)
+
+    """ Paths are relative to the compiler directory """
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    if not threadCounts:
+        t = 1
+        while t < multiprocessing.cpu_count():
+            threadCounts.append(t)
+            t *= 2
+        threadCounts.append(multiprocessing.cpu_count())
+    if not os.path.isdir(workDir):
+        os.makedirs(workDir)
+    workDir = os.path.relpath(workDir)
+    runDir = os.path.abspath(workDir)
+    inputLink = os.path.join(runDir, 'tfidf_input')
+
+    """
+        Generate the corpora
+    """
+    corpora = []
+    for (numFiles, megabytes, vocabulary) in g_corpora:
+        megabytes = megabytes * scale
+        name = os.path.join(runDir, 'corpus_%d_%g_%d' % (numFiles, megabytes, vocabulary))
+        print "Generating ", name
+        writeCorpus(name, numFiles, megabytes, vocabulary, len(corpora))
+        corpora.append(name)
+
+    """
+        Build the programs: (operator, variant, word bank, command)
+    """
+    programs = []
+    if 'src' in sets:
+        targets = sorted(set([p[1] for p in g_srcTfidf + g_srcKmeans]))
+        if subprocess.call(['make', '-C', srcDir] + targets + makeArgs) != 0:
+            print "Error: could not build ", ' '.join(targets), " in ", srcDir
+            sys.exit(1)
+        srcDir = os.path.abspath(srcDir)
+        for (variant, target, args) in g_srcTfidf:
+            command = [os.path.join(srcDir, target)] + args + ['-i', 'tfidf_input', '-o', 'tfidf_output.arff']
+            programs.append(("tfidf", variant, "pre_alloc", command))
+        for (variant, target, args) in g_srcKmeans:
+            command = [os.path.join(srcDir, target)] + args + \
+                      ['-c', str(clusters), '-m', str(iters), '-i', 'kmeans_input.arff', '-o', 'kmeans_output.txt']
+            programs.append(("kmeans", variant, None, command))
+    if 'generated' in sets:
+        if os.path.lexists(inputLink):
+            os.remove(inputLink)
+        os.symlink(corpora[0], inputLink)
+        for (variant, wordBank, program) in buildGenerated(workDir, inputLink, makeArgs):
+            programs.append(("tfidf", variant, wordBank, [program]))
+
+    """
+        Measure every program on every corpus with every thread count
+    """
+    measurements = {}
+    log = []
+    for corpus in corpora:
+        if os.path.lexists(inputLink):
+            os.remove(inputLink)
+        os.symlink(corpus, inputLink)
+        textStats = jsontocpp.sampleTextInput(inputLink)
+        arff = None
+        for (operator, variant, wordBank, command) in programs:
+            if operator == "kmeans" and arff is None:
+                continue
+            for threads in threadCounts:
+                result = measure(launcher, command, runDir, threads, repeats)
+                if result is None:
+                    continue
+                if operator == "tfidf":
+                    features = jsontocpp.costFeatures(textStats, threads)
+                    totals = jsontocpp.costFeatures(textStats, 1)
+                else:
+                    features = kmeansFeatures(arff, clusters, iters, threads)
+                    totals = kmeansFeatures(arff, clusters, iters, 1)
+                key = (operator, variant, wordBank, tuple(command))
+                measurements.setdefault(key, []).append((features, totals, result[0], result[1]))
+                log.append({"program": ' '.join(command), "corpus": corpus, "threads": threads,
+                            "time": result[0], "memory": result[1]})
+                print "%-60s %-40s %3d %8.3f s %8.1f MB" % (' '.join(command)[-60:], os.path.basename(corpus),
+                                                           threads, result[0], result[1] / 1e6)
+            """ The first tfidf output is the kmeans input """
+            if operator == "tfidf" and arff is None and os.path.isfile(os.path.join(runDir, 'tfidf_output.arff')):
+                os.rename(os.path.join(runDir, 'tfidf_output.arff'), os.path.join(runDir, 'kmeans_input.arff'))
+                arff = arffStats(os.path.join(runDir, 'kmeans_input.arff'))
+
+    launcher.stdin.close()
+    launcher.wait()
+
+    f = open(os.path.join(runDir, 'measurements.json'), 'w')
+    json.dump(log, f, indent=1, separators=(',', ': '))
+    f.close()
+
+    """
+        Fit the models
+    """
+    models = {}
+    for key in sorted(measurements.keys()):
+        (operator, variant, wordBank, command) = key
+        if operator == "tfidf":
+            timeFeatures = g_tfidfTimeFeatures
+            memoryFeatures = g_tfidfMemoryFeatures
+        else:
+            timeFeatures = g_kmeansTimeFeatures
+            memoryFeatures = g_kmeansMemoryFeatures
+        model = fitVariant(measurements[key], timeFeatures, memoryFeatures)
+        model["variant"] = variant
+        if wordBank is not None:
+            model["word_bank"] = wordBank
+        model["program"] = ' '.join([os.path.relpath(command[0])] + list(command[1:]))
+        models.setdefault(operator, []).append(model)
+        print "%-8s %-16s %-10s mean relative error %.2f" % (operator, variant, wordBank or '', model["error"])
+
+    out = {}
+    out["description"] = "Cost models for container selection by jsontocpp.py and for scheduling. " \
+                         "Execution time in seconds and peak memory in bytes are linear in the features. " \
+                         "Generated by calibrate.py."
+    out["calibration"] = {"threads": threadCounts, "corpora": len(corpora), "repeats": repeats,
+                          "kmeans": {"clusters": clusters, "iterations": iters}}
+    out["features"] = {"tfidf": "see costFeatures() in jsontocpp.py; memory uses the features for one thread",
+                       "kmeans": g_kmeansFeatureDoc}
+    out["operators"] = models
+    f = open(outfile, 'w')
+    json.dump(out, f, indent=1, sort_keys=True, separators=(',', ': '))
+    f.write('\n')
+    f.close()
+    print "Wrote ", outfile
+
+"""
+    Call main with passed params
+"""
+if __name__ == "__main__":
+   main(sys.argv[1:])
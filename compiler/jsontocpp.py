@@ -59,6 +59,8 @@ from collections import deque
 import re
 import unittest
 import os
+import math
+import multiprocessing
 
 
 
@@ -75,6 +77,7 @@ g_typedefMap = {}
 g_iodeclMap = {}
 g_argsdeclMap = {}
 g_argsdefaultsMap = {}
+g_variantsMap = {}
 
 """ workflow dictionaries """
 g_inputNodeMap = {}
@@ -94,6 +97,11 @@ g_nodeOutEdges = {}
 g_optimisedForward = {}
 g_optimisedBackward = {}
 
+""" cost model and target machine used for container selection """
+g_costModel = {}
+g_threads = 1
+g_memoryLimit = 0
+
 
 """
         SCHEMA CLASSES which hold data parsed from a 
@@ -441,6 +449,9 @@ def loadOperatorLibraryData(data):
 		g_iodeclMap[tuple([dataset,"input"])] = operator["input"]
 		g_iodeclMap[tuple([dataset,"output"])] = operator["output"]
 
+        elif operator["type"] == "container_variants":
+            for algorithmName in operator["algorithm.names"]:
+                g_variantsMap[algorithmName] = operator
         elif operator["type"] == "arg_declaration":
             for algorithm in operator["algorithm.names"]:
 		g_argsdeclMap[algorithm] = operator["argTemplates"]
@@ -509,63 +520,333 @@ def createIODeclaration(ioEdge, ioId, declaredIOFiles, opcode, ioCount, algName,
         ctr += 1 
 
 """
-        Test if the 'key' node is forward in-memory optimisable
-	and store a map of the edge so we can backwards check
-	when processing the next computation operator if it is
-	optimised/merged with this one
+        In-memory optimisation (operator fusion).
+
+	An edge between two computational operators is executed in memory
+	when the producer writes a file that only the consumer reads. The
+	producer's output section and the consumer's input section are then
+	omitted, and both operators are emitted into one program. The
+	data_set variable that the producer's calling sequence creates is
+	passed directly to the consumer's calling sequence. The consumer
+	introduces it with its <alg>inputim.template instead of reading it
+	from the file.
+
+	An edge is fused only if:
+	    the producer's output type matches the consumer's input type
+	    the consumer has an <alg>inputim.template
+	    the shared files are all of the producer's outputs and all of
+		the consumer's inputs
+	    no other operator reads the shared files
+	Fused edges form chains, which are compiled to a single program.
+"""
+def findInMemoryEdges():
+
+    """ Count the readers of every file """
+    readers = {}
+    for key in g_nodeInEdges:
+        for inEdge in g_nodeInEdges[key]:
+            name = g_nodeBoxMap[inEdge].inputSpec.name
+            readers[name] = readers.get(name, 0) + 1
+
+    for edge in g_compEdges:
+        src = edge['sourceId']
+        dst = edge['targetId']
+        if src in g_optimisedForward or dst in g_optimisedBackward:
+            continue
+
+        outFiles = [g_nodeBoxMap[e].outputSpec.name for e in g_nodeOutEdges.get(src, [])]
+        inFiles = [g_nodeBoxMap[e].inputSpec.name for e in g_nodeInEdges.get(dst, [])]
+        if len(outFiles) == 0 or sorted(outFiles) != sorted(inFiles):
+            continue
+        if [f for f in outFiles if readers[f] != 1]:
+            continue
+
+        srcAlg = g_nodeMap[src].name
+        dstAlg = g_nodeMap[dst].name
+        if not os.path.isfile('templates/'+dstAlg+'inputim.template'):
+            continue
+        outTypes = [c.iotype for c in g_operatorsMap[srcAlg].constraint.outputConstraint]
+        inTypes = [c.iotype for c in g_operatorsMap[dstAlg].constraint.inputConstraint]
+        if outTypes != inTypes:
+            continue
+
+        g_optimisedForward[src] = dst
+        g_optimisedBackward[dst] = src
+
+"""
+        Test if the 'key' node passes its output in memory to the next
+	operator, see findInMemoryEdges
 """
 def optimisableForward(key):
+    return key in g_optimisedForward
 
-        for edge in g_compEdges:
-            if edge['sourceId'] == key:
-                destNode = edge['targetId']
+"""
+        Test if the 'key' node receives its input in memory from the
+	previous operator, see findInMemoryEdges
+"""
+def optimisableBackward(key):
+    return key in g_optimisedBackward
+
+"""
+        Order the computational operators such that every operator follows
+	the operators it depends on, and the operators of a fused chain are
+	consecutive. Returns the order and, for every operator, the stage of
+	its chain: the chains in a stage do not depend on each other.
+"""
+def programOrder():
+
+    compNodes = sorted([key for key in g_nodeMap if isComputationalNode(key)])
+    preds = {}
+    for key in compNodes:
+        preds[key] = []
+    for edge in g_compEdges:
+        preds[edge['targetId']].append(edge['sourceId'])
+
+    """ The chain a node belongs to is identified by its first node """
+    head = {}
+    for key in compNodes:
+        h = key
+        while h in g_optimisedBackward:
+            h = g_optimisedBackward[h]
+        head[key] = h
+
+    """ Stage chains by longest path over the dependences between chains """
+    stage = {}
+    def chainStage(h):
+        if h not in stage:
+            stage[h] = 0
+            node = h
+            while True:
+                for p in preds[node]:
+                    if head[p] != h:
+                        stage[h] = max(stage[h], chainStage(head[p]) + 1)
+                if node not in g_optimisedForward:
+                    break
+                node = g_optimisedForward[node]
+        return stage[h]
+
+    heads = [key for key in compNodes if head[key] == key]
+    heads.sort(key=lambda h: (chainStage(h), h))
+    order = []
+    for h in heads:
+        node = h
+        order.append(node)
+        while node in g_optimisedForward:
+            node = g_optimisedForward[node]
+            order.append(node)
+    return order, dict([(key, chainStage(head[key])) for key in compNodes])
 
-                for i in range(0, len(g_nodeMap[key].taskids)):
-                    ioCount = 0
-                    for outEdge in g_nodeOutEdges[key]:
-                        outFilename = g_nodeBoxMap[outEdge].outputSpec.name
-                        ioCount = 0
+"""
+        Write a script that runs the programs compiled from the workflow.
+	Programs in the same stage are independent and run concurrently.
+"""
+def writeRunScript(genDir, workflowfile, programs):
+
+    stages = {}
+    for (program, stage) in programs:
+        stages.setdefault(stage, []).append(program)
+
+    script = "#!/bin/sh\n"
+    script += "# Generated from " + workflowfile + ". Programs in the same stage run concurrently.\n"
+    script += "DIR=`dirname $0`\n"
+    for stage in sorted(stages.keys()):
+        script += "\n# Stage " + str(stage) + "\n"
+        if len(stages[stage]) == 1:
+            script += "$DIR/" + stages[stage][0] + " || exit 1\n"
+            continue
+        for (i, program) in enumerate(stages[stage]):
+            script += "$DIR/" + program + " & p" + str(i) + "=$!\n"
+        for i in range(0, len(stages[stage])):
+            script += "wait $p" + str(i) + " || exit 1\n"
+
+    runFile = open(genDir+'/run.sh', "w")
+    runFile.write(script)
+    runFile.close()
+    os.chmod(genDir+'/run.sh', 0755)
 
-                for i in range(0, len(g_nodeMap[destNode].taskids)):
-                    ioCount = 0
-                    for inEdge in g_nodeInEdges[destNode]:
-                        inFilename = g_nodeBoxMap[inEdge].inputSpec.name
-                        ioCount = 0
 
-		g_optimisedForward[key] = destNode
-		return outFilename == inFilename
+"""
+        Container selection.
+
+	Operators with container variants in the operator library (see
+	"container_variants") can leave the choice of associative container
+	and word bank policy to the compiler by specifying the algorithm
+	"auto" in the workflow. The compiler samples the operator's input
+	and predicts the execution time and memory footprint of every
+	variant with the cost model (see -c). The fastest variant that fits
+	in memory is selected and recorded in the generated code.
+"""
 
-	return False
+""" Characters that make up a word, as in asap::text::word_catalog """
+g_wordPattern = re.compile(r"[A-Z][A-Z']*")
 
 """
-        Test if the 'key' node is backward in-memory optimisable
-	and store a map of the edge so we can backwards check
-	when processing the next computation operator if it is
-	optimised/merged with this one
+	Sample a text file or directory of text files. Returns the number of
+	files and bytes, and estimates of the number of words, the sum over
+	all files of the distinct words per file, and the number of distinct
+	words overall. The vocabulary is extrapolated from the sample with
+	Heaps' law, bounded by Chao's estimate from the words seen once and
+	twice, which detects vocabularies that saturate within the input.
+	Returns None if the input does not exist.
 """
-def optimisableBackward(key):
+def sampleTextInput(path, maxFiles=64, maxBytes=8<<20):
+
+    files = []
+    if os.path.isfile(path):
+        files.append((path, os.path.getsize(path)))
+    elif os.path.isdir(path):
+        for (dirpath, dirnames, filenames) in os.walk(path):
+            dirnames.sort()
+            for name in sorted(filenames):
+                fname = os.path.join(dirpath, name)
+                if os.path.isfile(fname):
+                    files.append((fname, os.path.getsize(fname)))
+    if len(files) == 0:
+        return None
+
+    numFiles = len(files)
+    numBytes = sum([size for (fname, size) in files])
+
+    """ Read a prefix of evenly spaced files """
+    step = max(1, numFiles / maxFiles)
+    sample = files[::step][:maxFiles]
+    perFile = max(4096, maxBytes / len(sample))
+    tokens = []
+    sampleBytes = 0
+    for (fname, size) in sample:
+        f = open(fname, 'r')
+        data = f.read(perFile)
+        f.close()
+        tokens.append((g_wordPattern.findall(data.upper()), float(size) / max(1, len(data))))
+        sampleBytes += len(data)
+
+    """ Heaps' law exponent from the growth of the vocabulary """
+    allWords = [w for (words, ratio) in tokens for w in words]
+    numTokens = len(allWords)
+    half = len(set(allWords[:numTokens/2]))
+    counts = {}
+    for w in allWords:
+        counts[w] = counts.get(w, 0) + 1
+    vocabulary = len(counts)
+    beta = 0.6
+    if half > 100:
+        beta = min(0.9, max(0.0, math.log(float(vocabulary) / half, 2)))
+    fileWords = sum([len(set(words)) * ratio ** beta for (words, ratio) in tokens])
+
+    """ Chao's estimate of the vocabulary of the whole input """
+    scale = float(numBytes) / max(1, sampleBytes)
+    once = len([c for c in counts.values() if c == 1])
+    twice = len([c for c in counts.values() if c == 2])
+    unseen = once * (once - 1) / (2.0 * (twice + 1))
+    chao = vocabulary
+    if unseen > 0:
+        extra = numTokens * (scale - 1)
+        chao += unseen * (1 - (1 - once / (numTokens * unseen + once)) ** extra)
+
+    stats = {}
+    stats["files"] = numFiles
+    stats["bytes"] = numBytes
+    stats["tokens"] = numTokens * scale
+    stats["file_words"] = fileWords * numFiles / len(sample)
+    stats["vocabulary"] = max(vocabulary, min(chao, vocabulary * scale ** beta))
+    return stats
 
-        for edge in g_compEdges:
-            if edge['targetId'] == key:
-                srcNode = edge['sourceId']
+"""
+	The features of the cost model for the sampled input, when run with
+	the given number of threads. Memory is modelled on the features for
+	one thread, i.e., the totals.
+"""
+def costFeatures(stats, threads):
+
+    def log2(x):
+        return math.log(max(2.0, x), 2)
+
+    p = float(threads)
+    words = float(stats["file_words"])
+    vocab = float(stats["vocabulary"])
+    features = {}
+    features["const"] = 1.0
+    features["files"] = stats["files"]
+    features["bytes"] = stats["bytes"] / p
+    features["tokens"] = stats["tokens"] / p
+    features["tokens_log"] = stats["tokens"] * log2(words / stats["files"]) / p
+    features["file_words"] = words / p
+    features["file_words_log"] = words * log2(vocab) / p
+    features["vocabulary"] = vocab
+    features["vocabulary_log"] = vocab * log2(vocab)
+    features["vocabulary_threads"] = vocab * p
+    return features
+
+def predict(model, features):
+    return sum([coef * features[name] for (name, coef) in model.items()])
 
-                for i in range(0, len(g_nodeMap[srcNode].taskids)):
-                    ioCount = 0
-                    for outEdge in g_nodeOutEdges[srcNode]:
-                        outFilename = g_nodeBoxMap[outEdge].outputSpec.name
-                        ioCount = 0
+"""
+	Select the container variant and word bank for the 'key' node.
+	Returns the data structure type, the typedefs and comments that
+	document the choice.
+"""
+def selectContainers(key):
 
-                for i in range(0, len(g_nodeMap[key].taskids)):
-                    ioCount = 0
-                    for inEdge in g_nodeInEdges[key]:
-                        inFilename = g_nodeBoxMap[inEdge].inputSpec.name
-                        ioCount = 0
+    algName = g_nodeMap[key].name
+    algorithm = g_nodeBoxMap[key].opSpecification.algorithm
 
-		g_optimisedBackward[srcNode] = key
-		return outFilename == inFilename
+    """ A materialised operator named in the workflow is used as is """
+    if algorithm in g_operatorsMap and g_operatorsMap[algorithm].constraint.algname == algName:
+        algStructType = g_operatorsMap[algorithm].constraint.algtype
+        return algStructType, g_typedefMap[tuple([algName, algStructType])], []
 
-	return False
+    if algorithm != "auto" or algName not in g_variantsMap:
+        algStructType = g_operatorsMap[algName].constraint.algtype
+        return algStructType, g_typedefMap[tuple([algName, algStructType])], []
+
+    library = g_variantsMap[algName]
+    choice = library["default"]
+    comments = []
+
+    inputs = [g_nodeBoxMap[e].inputSpec.name for e in g_nodeInEdges.get(key, [])]
+    stats = None
+    if len(inputs) > 0:
+        stats = sampleTextInput(inputs[0])
+    models = g_costModel.get("operators", {}).get(algName, [])
+
+    if stats is None or len(models) == 0:
+        print "Warning: no input sample or cost model for", algName, "- using default containers"
+        comments.append("default configuration, no input sample or cost model")
+    else:
+        features = costFeatures(stats, g_threads)
+        totals = costFeatures(stats, 1)
+        comments.append("input sample: %d files, %d bytes, ~%d words, ~%d distinct per file, ~%d distinct"
+                        % (stats["files"], stats["bytes"], stats["tokens"],
+                           stats["file_words"], stats["vocabulary"]))
+        comments.append("predicted cost with %d thread(s):" % g_threads)
+        best = None
+        for model in models:
+            if model["variant"] not in library["variants"] or model["word_bank"] not in library["word_banks"]:
+                continue
+            time = predict(model["time"], features)
+            memory = predict(model["memory"], totals)
+            comments.append("    %-10s %-9s %10.3g s %10.1f MB"
+                            % (model["variant"], model["word_bank"], time, memory / 1e6))
+            if g_memoryLimit > 0 and memory > g_memoryLimit:
+                continue
+            if best is None or time < best[0]:
+                best = (time, model)
+        if best is not None:
+            choice = best[1]
+        else:
+            comments.append("no variant fits in memory, using the default")
+
+    variant = library["variants"][choice["variant"]]
+    comments.insert(0, "containers selected by the compiler: %s with %s word bank"
+                    % (choice["variant"], choice["word_bank"]))
 
+    typedefs = []
+    for typedef in g_typedefMap[tuple([algName, "auto"])]:
+        typedef = typedef.replace("CATALOG_MAP", variant["CATALOG_MAP"]) \
+                         .replace("AGGREGATE_MAP", variant["AGGREGATE_MAP"]) \
+                         .replace("WORD_BANK", library["word_banks"][choice["word_bank"]])
+        typedefs.append(typedef)
+    return variant["dstruct_type"], typedefs, comments
 
 
 """                              
@@ -575,6 +856,12 @@ def main(argv):
     workflowfile = ''
     codefile = ''
     liboperatorsfile = ''
+    costmodelfile = 'costmodel.json'
+
+    global g_costModel
+    global g_threads
+    global g_memoryLimit
+    g_threads = multiprocessing.cpu_count()
     # g_compEdges
 
     # mystr = " This was added"
@@ -584,10 +871,10 @@ def main(argv):
 	Read arguments 
     """
     try:
-        opts, args = getopt.getopt(argv,"hi:o:l:",["ifile=","ofile=","lfile="])
+        opts, args = getopt.getopt(argv,"hi:o:l:c:t:m:",["ifile=","ofile=","lfile=","costmodel=","threads=","memory="])
 
     except getopt.GetoptError:
-        print 'tocpp.py -i <workflowfile> -l <operatorlibraryfile> -o <codefile>'
+        print 'tocpp.py -i <workflowfile> -l <operatorlibraryfile> -o <codefile> [-c <costmodelfile>] [-t <threads>] [-m <memory MB>]'
         sys.exit(2)
     for opt, arg in opts:
         if opt == '-h':
@@ -599,6 +886,12 @@ def main(argv):
             liboperatorsfile = arg
         elif opt in ("-o", "--ofile"):
             codefile = arg
+        elif opt in ("-c", "--costmodel"):
+            costmodelfile = arg
+        elif opt in ("-t", "--threads"):
+            g_threads = int(arg)
+        elif opt in ("-m", "--memory"):
+            g_memoryLimit = float(arg) * 1e6
 
     """ 
         Parse workflow description from workflow tool description
@@ -628,11 +921,24 @@ def main(argv):
     """
     loadOperatorLibraryData(libdata)
 
+    """
+        Load the cost model used to select containers, if any
+    """
+    if os.path.isfile(costmodelfile):
+        costmodel = open(costmodelfile, "r")
+        g_costModel = json.load(costmodel)
+        costmodel.close()
+
     """ 
         Load workflow data from json
     """
     loadWorkflowData(flow)
 
+    """
+        Identify the edges between operators that are executed in memory
+    """
+    findInMemoryEdges()
+
     # splitIOFromNodeTasks()
 
     """ DEBUG TRACE BLOCK
@@ -692,12 +998,12 @@ def main(argv):
 
     """
 
-    """ For each node(task) in the workflow """
-    for key in g_nodeMap:
+    """ Programs written, with their stage """
+    programs = []
 
-	if isComputationalNode(key) is False:
-	    # The computational operator will drive the compiler
-	    continue
+    """ For each computational node in dependence order """
+    order, stages = programOrder()
+    for key in order:
 
         """ 
 	    Prepare the output filename for this operator's code.
@@ -745,12 +1051,13 @@ def main(argv):
                 myfile.close()
     		collectCode(data+"\n", 0, "headerSection")
 	else:
-	    altFilename = 'templates/crossheaderim.template'
-	    if os.path.isfile(altFilename):
-                with open(altFilename, 'r') as myfile:
-                    data=myfile.read()
-		myfile.close()
-    		collectCode(data+"\n", 0, "headerSection")
+	    # Include the headers of the fused operator; the include
+	    # guards take care of headers shared with the previous operator.
+            algName = g_nodeMap[key].name
+            with open('templates/'+algName+'header.template', 'r') as myfile:
+                data=myfile.read()
+            myfile.close()
+    	    collectCode(data+"\n", 0, "headerSection")
 
         """ 
             STAGE 2
@@ -840,7 +1147,7 @@ def main(argv):
                     output start of main section 
                 """
 		collectCode("//  Start of main section \n\n", 0, "mainSection")
-	        algStructType = g_operatorsMap[g_nodeMap[key].name].constraint.algtype
+	        algStructType, typedefs, configuration = selectContainers(key)
                 with open('templates/'+algName+'maindeclarations.template', 'r') as myfile:
                     data=myfile.read()
                 myfile.close
@@ -850,7 +1157,8 @@ def main(argv):
 
     
 		collectCode("//  Start of typedefs section \n\n", tabcount, "mainSection")
-                typedefs = g_typedefMap[tuple([algName, algStructType])]
+                for line in configuration:
+		    collectCode("// "+line+"\n", tabcount, "mainSection")
                 for typedef in typedefs:
 		    collectCode(typedef+"\n", tabcount, "mainSection")
 		collectCode("\n", tabcount, "mainSection")
@@ -944,6 +1252,12 @@ def main(argv):
 		tabPrint(argsDeclSection, 0, codeFile)
 		tabPrint(mainSection, 0, codeFile)
                 codeFile.close()
+                programs.append((opcode, stages[key]))
+
+                # Start afresh for the next program
+                for section in ["headerSection", "ioDeclSection", "argsDeclSection", "mainSection"]:
+                    globals()[section] = ""
+                declaredIOFiles.clear()
 
 	# We may not want to close this code file if we have identified a merge-optimisation
 	# Though we may rename it op1_and_op2, so depends on the final solution for handling
@@ -951,6 +1265,8 @@ def main(argv):
 
         # opcode.close()
 
+    if programs:
+        writeRunScript(os.path.splitext(workflowfile)[0]+'.dir', workflowfile, programs)
 
 """
     Call main with passed params
@@ -23,6 +23,8 @@
 #include <stdexcept>
 #include <cctype>
 #include <cstdlib>
+#include <cassert>
+#include <fstream>
 
 #include "asap/memory.h"
 #include "asap/traits.h"
@@ -547,6 +549,30 @@ operator << ( std::ostream & os,
     return os;
 }
 
+template<size_t N, typename Type2>
+std::ostream &
+operator << ( std::ostream & os,
+	      const std::pair<asap::text::packed_ngram<N>,Type2> & val ) {
+    for( size_t i=0; i < N; ++i ) {
+	os << val.first[i];
+	if( i < N-1 )
+	    os << '#';
+    }
+    return os;
+}
+
+template<size_t N, typename Type2>
+std::ostream &
+operator << ( std::ostream & os,
+	      const std::pair<asap::text::ngram_tuple<N>,Type2> & val ) {
+    for( size_t i=0; i < val.first.size(); ++i ) {
+	os << val.first[i];
+	if( i < val.first.size()-1 )
+	    os << '#';
+    }
+    return os;
+}
+
 
 template<typename VectorIter, typename ColNameIter, typename RowNameIter>
 void arff_write( std::ostream & of,
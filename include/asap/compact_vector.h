@@ -0,0 +1,630 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef INCLUDED_ASAP_COMPACT_VECTOR_H
+#define INCLUDED_ASAP_COMPACT_VECTOR_H
+
+#include <iostream>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <type_traits>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include "asap/par.h"
+#include "asap/traits.h"
+#include "asap/vector_ops.h"
+#include "asap/memory.h"
+#include "asap/utils.h"
+
+// Compact, read-only storage for sets of sparse vectors. Coordinates are
+// stored as 32-bit integers or as delta-encoded varints, values as fp32,
+// fp16, bfloat16 or as int8 with a per-vector scale. The kernels decode
+// on the fly, which trades a few instructions per nonzero for a 2-4x
+// reduction in the memory traffic of the distance calculations.
+
+namespace asap {
+
+namespace internal {
+
+inline uint32_t float_bits( float f ) {
+    uint32_t u;
+    std::memcpy( &u, &f, sizeof(u) );
+    return u;
+}
+inline float bits_float( uint32_t u ) {
+    float f;
+    std::memcpy( &f, &u, sizeof(f) );
+    return f;
+}
+
+// IEEE half precision conversion, rounding to nearest even
+inline uint16_t float_to_half( float f ) {
+#if defined(__F16C__)
+    return _cvtss_sh( f, 0 );
+#else
+    const uint32_t f32infty = 255u << 23;
+    const uint32_t f16max = ( 127u + 16u ) << 23;
+    const uint32_t denorm_magic = ( ( 127u - 15u ) + ( 23u - 10u ) + 1u ) << 23;
+    uint32_t x = float_bits( f );
+    uint32_t sign = x & 0x80000000u;
+    uint16_t o;
+    x ^= sign;
+    if( x >= f16max ) // overflow to infinity; NaN stays NaN
+	o = x > f32infty ? 0x7e00 : 0x7c00;
+    else if( x < ( 113u << 23 ) ) // subnormal or zero
+	o = float_bits( bits_float( x ) + bits_float( denorm_magic ) )
+	    - denorm_magic;
+    else {
+	uint32_t mant_odd = ( x >> 13 ) & 1;
+	x += ( uint32_t( 15 - 127 ) << 23 ) + 0xfff;
+	x += mant_odd;
+	o = x >> 13;
+    }
+    return o | ( sign >> 16 );
+#endif
+}
+
+inline float half_to_float( uint16_t h ) {
+#if defined(__F16C__)
+    return _cvtsh_ss( h );
+#else
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t o = uint32_t( h & 0x7fff ) << 13;
+    uint32_t exp = shifted_exp & o;
+    o += ( 127u - 15u ) << 23;
+    if( exp == shifted_exp ) // infinity or NaN
+	o += ( 128u - 16u ) << 23;
+    else if( exp == 0 ) { // subnormal or zero
+	o += 1u << 23;
+	o = float_bits( bits_float( o ) - bits_float( 113u << 23 ) );
+    }
+    return bits_float( o | ( uint32_t( h & 0x8000 ) << 16 ) );
+#endif
+}
+
+// bfloat16 conversion, rounding to nearest even
+inline uint16_t float_to_bfloat( float f ) {
+    uint32_t x = float_bits( f );
+    if( ( x & 0x7fffffffu ) > 0x7f800000u ) // keep NaN quiet
+	return ( x >> 16 ) | 0x40;
+    return ( x + 0x7fffu + ( ( x >> 16 ) & 1 ) ) >> 16;
+}
+
+inline float bfloat_to_float( uint16_t b ) {
+    return bits_float( uint32_t( b ) << 16 );
+}
+
+} // namespace internal
+
+/***********************************************************************
+ * Coordinate encodings
+ ***********************************************************************/
+
+// Coordinates stored as 32-bit integers. The gather kernels interpret
+// coordinates as signed integers, which restricts them to [0,2^31).
+struct index_u32 {
+    typedef uint32_t unit_type;
+
+    template<typename IndexTy>
+    static size_t units( IndexTy const *, size_t n ) { return n; }
+
+    template<typename IndexTy>
+    static unit_type * encode( IndexTy const *c, size_t n, unit_type *p ) {
+	for( size_t i=0; i < n; ++i ) {
+	    if( uint64_t(c[i]) > uint64_t(std::numeric_limits<int32_t>::max()) )
+		fatal( "coordinate does not fit in 31 bits" );
+	    *p++ = unit_type( c[i] );
+	}
+	return p;
+    }
+
+    template<typename IndexTy>
+    class decoder {
+	unit_type const *m_p;
+    public:
+	decoder( unit_type const *p ) : m_p( p ) { }
+	IndexTy next() { return IndexTy( *m_p++ ); }
+    };
+};
+
+// Coordinates stored as LEB128 varints of the gaps between successive
+// coordinates. Requires coordinates sorted in increasing order.
+struct index_delta_varint {
+    typedef uint8_t unit_type;
+
+    template<typename IndexTy>
+    static size_t units( IndexTy const *c, size_t n ) {
+	size_t bytes = 0;
+	uint64_t prev = 0;
+	for( size_t i=0; i < n; ++i ) {
+	    if( i > 0 && uint64_t(c[i]) <= prev )
+		fatal( "delta encoding requires sorted, distinct coordinates" );
+	    uint64_t delta = uint64_t(c[i]) - prev;
+	    do {
+		++bytes;
+		delta >>= 7;
+	    } while( delta != 0 );
+	    prev = c[i];
+	}
+	return bytes;
+    }
+
+    template<typename IndexTy>
+    static unit_type * encode( IndexTy const *c, size_t n, unit_type *p ) {
+	uint64_t prev = 0;
+	for( size_t i=0; i < n; ++i ) {
+	    uint64_t delta = uint64_t(c[i]) - prev;
+	    while( delta >= 0x80 ) {
+		*p++ = unit_type( delta | 0x80 );
+		delta >>= 7;
+	    }
+	    *p++ = unit_type( delta );
+	    prev = c[i];
+	}
+	return p;
+    }
+
+    template<typename IndexTy>
+    class decoder {
+	unit_type const *m_p;
+	uint64_t m_prev;
+    public:
+	decoder( unit_type const *p ) : m_p( p ), m_prev( 0 ) { }
+	IndexTy next() {
+	    uint64_t b = *m_p++;
+	    uint64_t delta = b & 0x7f;
+	    for( unsigned shift=7; b & 0x80; shift += 7 ) {
+		b = *m_p++;
+		delta |= ( b & 0x7f ) << shift;
+	    }
+	    m_prev += delta;
+	    return IndexTy( m_prev );
+	}
+    };
+};
+
+/***********************************************************************
+ * Value encodings. Values are decoded as s * scale, where s is the
+ * decoded storage value and scale is chosen per vector.
+ ***********************************************************************/
+
+struct value_fp32 {
+    typedef float storage_type;
+    static const bool is_scaled = false;
+    template<typename ValueTy>
+    static float scale( ValueTy const *, size_t ) { return 1; }
+    static storage_type encode( float v, float ) { return v; }
+    static float decode( storage_type s ) { return s; }
+#if defined(__AVX2__)
+    static __m256 load8( storage_type const *s ) { return _mm256_loadu_ps( s ); }
+#endif
+};
+
+struct value_fp16 {
+    typedef uint16_t storage_type;
+    static const bool is_scaled = false;
+    template<typename ValueTy>
+    static float scale( ValueTy const *, size_t ) { return 1; }
+    static storage_type encode( float v, float ) {
+	return internal::float_to_half( v );
+    }
+    static float decode( storage_type s ) {
+	return internal::half_to_float( s );
+    }
+#if defined(__AVX2__)
+    static __m256 load8( storage_type const *s ) {
+#if defined(__F16C__)
+	return _mm256_cvtph_ps( _mm_loadu_si128( (__m128i const *)s ) );
+#else
+	float t[8];
+	for( int k=0; k < 8; ++k )
+	    t[k] = decode( s[k] );
+	return _mm256_loadu_ps( t );
+#endif
+    }
+#endif
+};
+
+struct value_bf16 {
+    typedef uint16_t storage_type;
+    static const bool is_scaled = false;
+    template<typename ValueTy>
+    static float scale( ValueTy const *, size_t ) { return 1; }
+    static storage_type encode( float v, float ) {
+	return internal::float_to_bfloat( v );
+    }
+    static float decode( storage_type s ) {
+	return internal::bfloat_to_float( s );
+    }
+#if defined(__AVX2__)
+    static __m256 load8( storage_type const *s ) {
+	__m256i w = _mm256_cvtepu16_epi32(
+	    _mm_loadu_si128( (__m128i const *)s ) );
+	return _mm256_castsi256_ps( _mm256_slli_epi32( w, 16 ) );
+    }
+#endif
+};
+
+// Symmetric linear quantisation to [-127,127] relative to the largest
+// absolute value in the vector.
+struct value_int8 {
+    typedef int8_t storage_type;
+    static const bool is_scaled = true;
+    template<typename ValueTy>
+    static float scale( ValueTy const *v, size_t n ) {
+	float m = 0;
+	for( size_t i=0; i < n; ++i )
+	    m = std::max( m, float( std::abs( v[i] ) ) );
+	return m > 0 ? m / 127.0f : 1.0f;
+    }
+    static storage_type encode( float v, float inv_scale ) {
+	float q = std::round( v * inv_scale );
+	return storage_type( std::max( -127.0f, std::min( 127.0f, q ) ) );
+    }
+    static float decode( storage_type s ) { return float( s ); }
+#if defined(__AVX2__)
+    static __m256 load8( storage_type const *s ) {
+	return _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32(
+				       _mm_loadl_epi64( (__m128i const *)s ) ) );
+    }
+#endif
+};
+
+/***********************************************************************
+ * Kernels on a compact sparse vector and a dense vector
+ ***********************************************************************/
+
+namespace internal {
+
+template<typename IndexEnc, typename ValueEnc, typename IndexTy,
+	 typename ValueTy>
+struct compact_dense_scalar_kernels {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef typename IndexEnc::unit_type unit_type;
+    typedef typename ValueEnc::storage_type storage_type;
+    typedef typename IndexEnc::template decoder<IndexTy> decoder;
+
+    // Returns sum_j s_j * d[c_j]; the caller applies the scale.
+    static value_type
+    dot( unit_type const *a_c, storage_type const *a_s, index_type a_length,
+	 value_type const *d ) {
+	decoder dec( a_c );
+	value_type sum = 0;
+	for( index_type j=0; j < a_length; ++j )
+	    sum += value_type( ValueEnc::decode( a_s[j] ) ) * d[dec.next()];
+	return sum;
+    }
+
+    // Calculates sum_j s_j * s_j and sum_j s_j * d[c_j] in one pass.
+    static void
+    sq_and_dot( unit_type const *a_c, storage_type const *a_s,
+		index_type a_length, value_type const *d,
+		value_type &ss, value_type &sd ) {
+	decoder dec( a_c );
+	ss = sd = 0;
+	for( index_type j=0; j < a_length; ++j ) {
+	    value_type s = ValueEnc::decode( a_s[j] );
+	    ss += s * s;
+	    sd += s * d[dec.next()];
+	}
+    }
+
+    static void
+    add( value_type *d, unit_type const *a_c, storage_type const *a_s,
+	 index_type a_length, value_type scale ) {
+	decoder dec( a_c );
+	for( index_type j=0; j < a_length; ++j )
+	    d[dec.next()] += scale * value_type( ValueEnc::decode( a_s[j] ) );
+    }
+};
+
+template<typename IndexEnc, typename ValueEnc, typename IndexTy,
+	 typename ValueTy, typename Enable = void>
+struct compact_dense_kernels
+    : public compact_dense_scalar_kernels<IndexEnc, ValueEnc, IndexTy, ValueTy> {
+};
+
+#if defined(__AVX2__)
+// 32-bit coordinates can be used directly as gather indices. Values are
+// widened to float eight at a time.
+template<typename ValueEnc, typename IndexTy>
+struct compact_dense_kernels<index_u32, ValueEnc, IndexTy, float,
+			     typename std::enable_if<
+				 std::is_integral<IndexTy>::value>::type>
+    : public compact_dense_scalar_kernels<index_u32, ValueEnc, IndexTy, float> {
+    typedef IndexTy index_type;
+    typedef float value_type;
+    typedef uint32_t unit_type;
+    typedef typename ValueEnc::storage_type storage_type;
+    typedef compact_dense_scalar_kernels<index_u32, ValueEnc, IndexTy, float>
+	scalar;
+
+    static value_type
+    dot( unit_type const *a_c, storage_type const *a_s, index_type a_length,
+	 value_type const *d ) {
+	__m256 acc = _mm256_setzero_ps();
+	index_type j = 0;
+	for( ; j + 8 <= a_length; j += 8 ) {
+	    prefetch( d, a_c, j, a_length );
+	    __m256 g = _mm256_i32gather_ps(
+		d, _mm256_loadu_si256( (__m256i const *)&a_c[j] ), 4 );
+	    acc = simd_add( acc, simd_mul( ValueEnc::load8( &a_s[j] ), g ) );
+	}
+	return simd_hsum( acc )
+	    + scalar::dot( &a_c[j], &a_s[j], a_length-j, d );
+    }
+
+    static void
+    sq_and_dot( unit_type const *a_c, storage_type const *a_s,
+		index_type a_length, value_type const *d,
+		value_type &ss, value_type &sd ) {
+	__m256 acc_ss = _mm256_setzero_ps();
+	__m256 acc_sd = _mm256_setzero_ps();
+	index_type j = 0;
+	for( ; j + 8 <= a_length; j += 8 ) {
+	    prefetch( d, a_c, j, a_length );
+	    __m256 g = _mm256_i32gather_ps(
+		d, _mm256_loadu_si256( (__m256i const *)&a_c[j] ), 4 );
+	    __m256 s = ValueEnc::load8( &a_s[j] );
+	    acc_ss = simd_add( acc_ss, simd_mul( s, s ) );
+	    acc_sd = simd_add( acc_sd, simd_mul( s, g ) );
+	}
+	scalar::sq_and_dot( &a_c[j], &a_s[j], a_length-j, d, ss, sd );
+	ss += simd_hsum( acc_ss );
+	sd += simd_hsum( acc_sd );
+    }
+
+private:
+    static void prefetch( value_type const *d, unit_type const *a_c,
+			  index_type j, index_type a_length ) {
+	index_type p = j + sparse_dense_prefetch_distance;
+	if( p + 8 <= a_length ) {
+	    for( int k=0; k < 8; ++k )
+		_mm_prefetch( (char const *)&d[a_c[p+k]], _MM_HINT_T0 );
+	}
+    }
+};
+#endif
+
+} // namespace internal
+
+/***********************************************************************
+ * Compact sparse vector. This is a read-only view on the data held by
+ * a compact_sparse_vector_set.
+ ***********************************************************************/
+template<typename IndexEnc, typename ValueEnc, typename IndexTy = size_t,
+	 typename ValueTy = float>
+class compact_sparse_vector
+{
+public:
+    static const bool is_vectorized = false;
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef IndexEnc index_encoding;
+    typedef ValueEnc value_encoding;
+    typedef typename IndexEnc::unit_type unit_type;
+    typedef typename ValueEnc::storage_type storage_type;
+    typedef mm_no_ownership_policy memory_mgmt_type;
+    typedef internal::compact_dense_kernels<IndexEnc, ValueEnc, IndexTy,
+					    ValueTy> kernels;
+    typedef dense_vector_operations<index_type, value_type> dense_ops;
+
+    struct _asap_tag : tag_compact, tag_vector { };
+    void asap_decl(void);
+
+private:
+    unit_type const *m_coord;
+    storage_type const *m_value;
+    index_type m_length;
+    index_type m_nonzeros;
+    value_type m_scale;
+
+public:
+    compact_sparse_vector()
+	: m_coord(nullptr), m_value(nullptr), m_length(0), m_nonzeros(0),
+	  m_scale(1) { }
+    compact_sparse_vector(unit_type const *coord_, storage_type const *value_,
+			  index_type length_, index_type nonzeros_,
+			  value_type scale_)
+	: m_coord(coord_), m_value(value_), m_length(length_),
+	  m_nonzeros(nonzeros_), m_scale(scale_) { }
+
+    index_type length() const { return m_length; }
+    index_type nonzeros() const { return m_nonzeros; }
+    value_type scale() const { return m_scale; }
+
+    // Calls fn(coordinate, value) for each nonzero in order
+    template<typename Fn>
+    void map( Fn & fn ) const {
+	typename IndexEnc::template decoder<index_type> dec( m_coord );
+	for( index_type j=0; j < m_nonzeros; ++j )
+	    fn( dec.next(), m_scale * value_type( ValueEnc::decode( m_value[j] ) ) );
+    }
+
+    value_type sq_norm() const {
+	value_type ss = 0;
+	for( index_type j=0; j < m_nonzeros; ++j ) {
+	    value_type s = ValueEnc::decode( m_value[j] );
+	    ss += s * s;
+	}
+	return m_scale * m_scale * ss;
+    }
+
+    void add_to( value_type *d ) const {
+	kernels::add( d, m_coord, m_value, m_nonzeros, m_scale );
+    }
+
+    // Inner product with a dense vector
+    template<typename VectorTy>
+    typename std::enable_if<is_dense_vector<VectorTy>::value, value_type>::type
+    dot( VectorTy const &p ) const {
+	return m_scale * kernels::dot( m_coord, m_value, m_nonzeros,
+				       p.get_value() );
+    }
+
+    // Square of Euclidean distance to a dense vector
+    template<typename VectorTy>
+    typename std::enable_if<is_dense_vector<VectorTy>::value && !is_vector_with_sqnorm_cache<VectorTy>::value, value_type>::type
+    sq_dist( VectorTy const &p ) const {
+	return sq_dist( p, dense_ops::square_norm( p.get_value(), p.length() ) );
+    }
+    // Square of Euclidean distance, optimized with precalculated sqnorm
+    template<typename VectorTy>
+    typename std::enable_if<is_dense_vector<VectorTy>::value && is_vector_with_sqnorm_cache<VectorTy>::value, value_type>::type
+    sq_dist( VectorTy const &p ) const {
+	return sq_dist( p, p.get_sqnorm() );
+    }
+
+private:
+    template<typename VectorTy>
+    value_type sq_dist( VectorTy const &p, value_type p_sqnorm ) const {
+	value_type ss, sd;
+	kernels::sq_and_dot( m_coord, m_value, m_nonzeros, p.get_value(),
+			     ss, sd );
+	value_type d = m_scale * ( m_scale * ss - value_type(2) * sd )
+	    + p_sqnorm;
+	// Hedge against in-accuracy in the short-cut above
+	return d < 0 ? value_type(0) : d;
+    }
+};
+
+template<typename VectorTy>
+typename std::enable_if<asap::is_compact_sparse_vector<VectorTy>::value,
+			std::ostream &>::type
+operator << ( std::ostream & os, const VectorTy & sv ) {
+    bool first = true;
+    auto fn = [&]( typename VectorTy::index_type c,
+		   typename VectorTy::value_type v ) {
+	if( !first )
+	    os << ", ";
+	os << c << ": " << v;
+	first = false;
+    };
+    os << '{';
+    sv.map( fn );
+    os << '}';
+    return os;
+}
+
+/***********************************************************************
+ * A set of compact sparse vectors, encoded from any range of sparse
+ * vectors. The set is immutable once constructed.
+ ***********************************************************************/
+template<typename IndexEnc, typename ValueEnc, typename IndexTy = size_t,
+	 typename ValueTy = float>
+class compact_sparse_vector_set
+{
+public:
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef compact_sparse_vector<IndexEnc, ValueEnc, IndexTy, ValueTy>
+	vector_type;
+    typedef typename IndexEnc::unit_type unit_type;
+    typedef typename ValueEnc::storage_type storage_type;
+
+    typedef const vector_type	* const_iterator;
+    typedef const vector_type	* iterator;
+
+private:
+    std::vector<vector_type> m_vectors;
+    std::vector<unit_type> m_alloc_i;
+    std::vector<storage_type> m_alloc_v;
+    size_t m_length;
+
+public:
+    compact_sparse_vector_set() : m_length(0) { }
+
+    // Encode the vectors in the range [I,E). The coordinates of each
+    // vector must be sorted by index.
+    template<typename InputIterator>
+    compact_sparse_vector_set( InputIterator I, InputIterator E )
+	: m_length(0) {
+	size_t number = std::distance( I, E );
+	std::vector<size_t> i_off( number+1, 0 ), v_off( number+1, 0 );
+	std::vector<value_type> scale( number );
+
+	// Size of the encoding of each vector
+	par::parallel_for( size_t(0), number, [&]( size_t n ) {
+	    auto const & v = *std::next( I, n );
+	    i_off[n+1] = IndexEnc::units( v.get_coord(), v.nonzeros() );
+	    v_off[n+1] = v.nonzeros();
+	    scale[n] = ValueEnc::scale( v.get_value(), v.nonzeros() );
+	} );
+	for( size_t n=0; n < number; ++n ) {
+	    i_off[n+1] += i_off[n];
+	    v_off[n+1] += v_off[n];
+	}
+
+	m_alloc_i.resize( i_off[number] );
+	m_alloc_v.resize( v_off[number] );
+	m_vectors.resize( number );
+
+	par::parallel_for( size_t(0), number, [&]( size_t n ) {
+	    auto const & v = *std::next( I, n );
+	    IndexEnc::encode( v.get_coord(), v.nonzeros(), &m_alloc_i[i_off[n]] );
+	    value_type inv = value_type(1) / scale[n];
+	    storage_type *s = &m_alloc_v[v_off[n]];
+	    for( size_t j=0, e=v.nonzeros(); j < e; ++j )
+		s[j] = ValueEnc::encode( v.get_value()[j], inv );
+	    m_vectors[n] = vector_type( m_alloc_i.data() + i_off[n],
+					m_alloc_v.data() + v_off[n],
+					v.length(), v.nonzeros(), scale[n] );
+	} );
+
+	for( size_t n=0; n < number; ++n )
+	    m_length = std::max( m_length, size_t( m_vectors[n].length() ) );
+    }
+
+    // Not copyable, as the vectors point into the storage
+    compact_sparse_vector_set( const compact_sparse_vector_set & ) = delete;
+    compact_sparse_vector_set( compact_sparse_vector_set && ) = default;
+    compact_sparse_vector_set &
+    operator = ( compact_sparse_vector_set && ) = default;
+
+    size_t number() const { return m_vectors.size(); }
+    size_t size() const { return m_vectors.size(); }
+    size_t length() const { return m_length; }
+
+    // Number of bytes taken by the coordinates and values
+    size_t storage_bytes() const {
+	return m_alloc_i.size() * sizeof(unit_type)
+	    + m_alloc_v.size() * sizeof(storage_type);
+    }
+
+    const vector_type & operator[] ( size_t idx ) const {
+	assert( idx < m_vectors.size() );
+	return m_vectors[idx];
+    }
+
+    const_iterator begin() const { return m_vectors.data(); }
+    const_iterator end() const { return m_vectors.data() + m_vectors.size(); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+};
+
+}
+
+#endif // INCLUDED_ASAP_COMPACT_VECTOR_H
@@ -21,6 +21,7 @@
 #define INCLUDED_ASAP_DATA_SET_H
 
 #include <vector>
+#include <cassert>
 #include "asap/traits.h"
 #include "asap/dense_vector.h"
 #include "asap/sparse_vector.h"
@@ -291,7 +292,7 @@ public:
     }
     const index_list_type & get_index() const { return *m_idx_names; }
     const vector_list_type & get_vectors() const { return *m_vectors; }
-    
+
     const_index_iterator index_cbegin() const { return m_idx_names->cbegin(); }
     const_index_iterator index_cend() const { return m_idx_names->cend(); }
 
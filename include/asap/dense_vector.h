@@ -23,8 +23,7 @@
 #include <memory>
 #include <type_traits>
 #include <limits>
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
+#include <cassert>
 
 #include "asap/traits.h"
 #include "asap/vector_ops.h"
@@ -234,12 +233,16 @@ public:
     template<typename OtherVectorTy>
     const typename std::enable_if<is_sparse_vector<OtherVectorTy>::value, dense_vector>::type &
     operator += ( const OtherVectorTy & pt ) {
-        for(int j = 0; j < pt.nonzeros(); j++) {
-	    value_type v;
-	    index_type c;
-	    pt.get( j, v, c );
-	    m_value[c] += v;
-	}
+	OtherVectorTy::mix_vector_ops::add( m_value, m_length, pt.get_value(),
+					    pt.get_coord(), pt.nonzeros() );
+	return *this;
+    }
+
+    /** Element-wise vector addition with a compactly stored sparse vector */
+    template<typename OtherVectorTy>
+    const typename std::enable_if<is_compact_sparse_vector<OtherVectorTy>::value, dense_vector>::type &
+    operator += ( const OtherVectorTy & pt ) {
+	pt.add_to( m_value );
 	return *this;
     }
 
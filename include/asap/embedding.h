@@ -0,0 +1,488 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Word embeddings: a binary, memory-mapped store of word vectors and a
+ * top-k cosine nearest neighbour search over it.
+ */
+
+#ifndef INCLUDED_ASAP_EMBEDDING_H
+#define INCLUDED_ASAP_EMBEDDING_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "asap/utils.h"
+#include "asap/par.h"
+#include "asap/vector_ops.h"
+#include "asap/dense_vector.h"
+#include "asap/radix_sort.h"
+#include "asap/top_k.h"
+#include "asap/kmeans.h"
+
+namespace asap {
+
+/*
+ * File layout of an embedding store. All sections start at a multiple of
+ * embedding_align bytes, such that the vectors can be used in place once
+ * the file is mapped. Offsets are relative to the start of the file.
+ */
+struct embedding_header {
+    char	magic[8];
+    uint64_t	num_words;
+    uint64_t	dimensions;
+    uint64_t	vector_offset;	// float[num_words][dimensions]
+    uint64_t	norm_offset;	// float[num_words], inverse L2 norms
+    uint64_t	word_offset;	// uint64_t[num_words+1], offsets into text
+    uint64_t	order_offset;	// uint64_t[num_words], IDs sorted by word
+    uint64_t	text_offset;	// NUL-terminated words
+    uint64_t	file_size;
+};
+
+static const char embedding_magic[8] = "ASAPEMB";
+static const size_t embedding_align = 64;
+
+namespace internal {
+
+inline void write_padded( FILE * fp, const char * fname, const void * data,
+			  size_t size, uint64_t & offset ) {
+    static const char zero[embedding_align] = { 0 };
+    if( size > 0 && fwrite( data, 1, size, fp ) != size )
+	fatale( "fwrite", fname );
+    offset += size;
+    size_t pad = ( embedding_align - offset % embedding_align )
+	% embedding_align;
+    if( pad > 0 && fwrite( zero, 1, pad, fp ) != pad )
+	fatale( "fwrite", fname );
+    offset += pad;
+}
+
+} // namespace internal
+
+/*
+ * Write the n vectors of d dimensions held row by row in vectors to an
+ * embedding store. word(i) returns the word of vector i; words must be
+ * unique.
+ */
+template<typename WordFn>
+void write_embeddings( const char * fname, size_t n, size_t d,
+		       const float * vectors, WordFn word ) {
+    std::vector<float> inv_norm( n );
+    par::parallel_for( size_t(0), n, [&]( size_t i ) {
+	const float * v = &vectors[i * d];
+	double s = 0;
+	for( size_t c=0; c < d; ++c )
+	    s += v[c] * v[c];
+	inv_norm[i] = s > 0 ? float( 1 / std::sqrt( s ) ) : 0;
+    } );
+
+    std::vector<uint64_t> word_off( n+1 );
+    std::vector<std::pair<const char *, uint64_t>> sorted( n );
+    word_off[0] = 0;
+    for( size_t i=0; i < n; ++i ) {
+	sorted[i] = std::make_pair( word( i ), uint64_t( i ) );
+	word_off[i+1] = word_off[i] + strlen( sorted[i].first ) + 1;
+    }
+    sort_words( sorted.begin(), sorted.end(), se_parallel_radix );
+    std::vector<uint64_t> order( n );
+    for( size_t i=0; i < n; ++i )
+	order[i] = sorted[i].second;
+
+    embedding_header hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, embedding_magic, sizeof(hdr.magic) );
+    hdr.num_words = n;
+    hdr.dimensions = d;
+
+    FILE * fp = fopen( fname, "wb" );
+    if( !fp )
+	fatale( "fopen", fname );
+    // The header is rewritten once all offsets are known
+    uint64_t offset = 0;
+    internal::write_padded( fp, fname, &hdr, sizeof(hdr), offset );
+    hdr.vector_offset = offset;
+    internal::write_padded( fp, fname, vectors, n * d * sizeof(float),
+			    offset );
+    hdr.norm_offset = offset;
+    internal::write_padded( fp, fname, &inv_norm[0], n * sizeof(float),
+			    offset );
+    hdr.word_offset = offset;
+    internal::write_padded( fp, fname, &word_off[0], (n+1) * sizeof(uint64_t),
+			    offset );
+    hdr.order_offset = offset;
+    internal::write_padded( fp, fname, order.data(), n * sizeof(uint64_t),
+			    offset );
+    hdr.text_offset = offset;
+    for( size_t i=0; i < n; ++i ) {
+	const char * w = word( i );
+	size_t len = strlen( w ) + 1;
+	if( fwrite( w, 1, len, fp ) != len )
+	    fatale( "fwrite", fname );
+    }
+    offset += word_off[n];
+    hdr.file_size = offset;
+
+    if( fseek( fp, 0, SEEK_SET ) != 0 )
+	fatale( "fseek", fname );
+    if( fwrite( &hdr, 1, sizeof(hdr), fp ) != sizeof(hdr) )
+	fatale( "fwrite", fname );
+    if( fclose( fp ) != 0 )
+	fatale( "fclose", fname );
+}
+
+/*
+ * embedding_store: a read-only view of an embedding store. The file is
+ * mapped in memory, such that opening a store does not read the vectors.
+ * Following data_set, the store holds get_num_points() vectors of
+ * get_dimensions() values. Words are looked up by binary search.
+ */
+class embedding_store {
+public:
+    static const size_t npos = ~size_t(0);
+
+private:
+    void *			m_map;
+    size_t			m_map_size;
+    const embedding_header *	m_hdr;
+    const float *		m_vectors;
+    const float *		m_inv_norm;
+    const uint64_t *		m_word;
+    const uint64_t *		m_order;
+    const char *		m_text;
+
+public:
+    embedding_store( const char * fname ) {
+	int fd = open( fname, O_RDONLY );
+	if( fd < 0 )
+	    fatale( "open", fname );
+	struct stat st;
+	if( fstat( fd, &st ) < 0 )
+	    fatale( "fstat", fname );
+	m_map_size = st.st_size;
+	if( m_map_size < sizeof(embedding_header) )
+	    fatal( "not an embedding store: ", fname );
+	m_map = mmap( nullptr, m_map_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if( m_map == MAP_FAILED )
+	    fatale( "mmap", fname );
+	close( fd );
+
+	const char * base = (const char *)m_map;
+	m_hdr = (const embedding_header *)base;
+	if( memcmp( m_hdr->magic, embedding_magic, sizeof(m_hdr->magic) ) )
+	    fatal( "not an embedding store: ", fname );
+	if( m_hdr->file_size != m_map_size )
+	    fatal( "embedding store is truncated: ", fname );
+	m_vectors = (const float *)( base + m_hdr->vector_offset );
+	m_inv_norm = (const float *)( base + m_hdr->norm_offset );
+	m_word = (const uint64_t *)( base + m_hdr->word_offset );
+	m_order = (const uint64_t *)( base + m_hdr->order_offset );
+	m_text = base + m_hdr->text_offset;
+    }
+    embedding_store( const embedding_store & ) = delete;
+    ~embedding_store() {
+	munmap( m_map, m_map_size );
+    }
+
+    size_t get_num_points() const { return m_hdr->num_words; }
+    size_t get_dimensions() const { return m_hdr->dimensions; }
+
+    const float * vector( size_t i ) const {
+	return &m_vectors[i * get_dimensions()];
+    }
+    float inv_norm( size_t i ) const { return m_inv_norm[i]; }
+    const char * word( size_t i ) const { return &m_text[m_word[i]]; }
+
+    // The ID of word w, or npos if it does not occur
+    size_t index_of( const char * w ) const {
+	size_t lo = 0, hi = get_num_points();
+	while( lo < hi ) {
+	    size_t mid = ( lo + hi ) / 2;
+	    int c = strcmp( word( m_order[mid] ), w );
+	    if( c == 0 )
+		return m_order[mid];
+	    else if( c < 0 )
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return npos;
+    }
+};
+
+// A word ID and its cosine similarity to the query
+typedef std::pair<size_t, float> neighbour;
+
+namespace internal {
+
+// Dot products of q with the four rows r[0..3] of length d
+inline void dot4( const float * q, const float * const * r, size_t d,
+		  float * out ) {
+    size_t c = 0;
+    out[0] = out[1] = out[2] = out[3] = 0;
+#if defined(__AVX2__)
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for( ; c + 8 <= d; c += 8 ) {
+	__m256 x = _mm256_loadu_ps( &q[c] );
+	a0 = simd_add( a0, simd_mul( x, _mm256_loadu_ps( &r[0][c] ) ) );
+	a1 = simd_add( a1, simd_mul( x, _mm256_loadu_ps( &r[1][c] ) ) );
+	a2 = simd_add( a2, simd_mul( x, _mm256_loadu_ps( &r[2][c] ) ) );
+	a3 = simd_add( a3, simd_mul( x, _mm256_loadu_ps( &r[3][c] ) ) );
+    }
+    out[0] = simd_hsum( a0 );
+    out[1] = simd_hsum( a1 );
+    out[2] = simd_hsum( a2 );
+    out[3] = simd_hsum( a3 );
+#endif
+    for( ; c < d; ++c ) {
+	out[0] += q[c] * r[0][c];
+	out[1] += q[c] * r[1][c];
+	out[2] += q[c] * r[2][c];
+	out[3] += q[c] * r[3][c];
+    }
+}
+
+// The k neighbours with highest similarity seen so far, as a min-heap
+class neighbour_heap {
+    size_t			m_k;
+    std::vector<neighbour>	m_heap;
+
+public:
+    neighbour_heap( size_t k ) : m_k( k ) { m_heap.reserve( k ); }
+
+    void push( size_t id, float s ) {
+	second_greater<neighbour> cmp;
+	if( m_heap.size() < m_k ) {
+	    m_heap.push_back( neighbour( id, s ) );
+	    std::push_heap( m_heap.begin(), m_heap.end(), cmp );
+	} else if( m_k > 0 && s > m_heap.front().second ) {
+	    std::pop_heap( m_heap.begin(), m_heap.end(), cmp );
+	    m_heap.back() = neighbour( id, s );
+	    std::push_heap( m_heap.begin(), m_heap.end(), cmp );
+	}
+    }
+
+    const std::vector<neighbour> & entries() const { return m_heap; }
+};
+
+// Score the n rows with IDs id(0..n-1) against the unit query q, four rows
+// at a time, and retain the best in heap.
+template<typename IdFn>
+void scan_rows( const embedding_store & s, const float * q, size_t n,
+		IdFn id, size_t exclude, neighbour_heap & heap ) {
+    size_t d = s.get_dimensions();
+    size_t ids[4];
+    const float * rows[4];
+    float dots[4];
+    for( size_t i=0; i < n; i += 4 ) {
+	size_t m = std::min( size_t(4), n - i );
+	for( size_t j=0; j < 4; ++j ) {
+	    ids[j] = id( i + std::min( j, m-1 ) );
+	    rows[j] = s.vector( ids[j] );
+	}
+	dot4( q, rows, d, dots );
+	for( size_t j=0; j < m; ++j )
+	    if( ids[j] != exclude )
+		heap.push( ids[j], dots[j] * s.inv_norm( ids[j] ) );
+    }
+}
+
+} // namespace internal
+
+/*
+ * embedding_index: top-k cosine similarity search over an embedding store.
+ *
+ * By default the search is exhaustive. The rows are split in blocks that
+ * are scanned in parallel, computing the dot products of the query with
+ * four rows at a time. Each block retains its best candidates in a bounded
+ * heap and the candidates of all blocks are merged with top_k.
+ *
+ * build_ivf() builds an inverted file index: the vectors are clustered
+ * with k-means on their directions and a query scans only the lists of
+ * the nprobe clusters with centroids closest to it. This trades recall for
+ * speed; nprobe is set with set_nprobe().
+ */
+class embedding_index {
+public:
+    static const size_t npos = embedding_store::npos;
+
+private:
+    // Blocks scanned by one task during an exhaustive search
+    static const size_t min_block = 4096;
+
+    const embedding_store &	m_store;
+    size_t			m_nlist;
+    size_t			m_nprobe;
+    std::vector<float>		m_centroids;	// unit length, nlist x d
+    std::vector<size_t>		m_list_start;	// nlist+1
+    std::vector<size_t>		m_list_ids;
+
+public:
+    embedding_index( const embedding_store & s )
+	: m_store( s ), m_nlist( 0 ), m_nprobe( 1 ) { }
+
+    bool has_ivf() const { return m_nlist > 0; }
+    size_t num_lists() const { return m_nlist; }
+    void set_nprobe( size_t nprobe ) { m_nprobe = std::max( size_t(1), nprobe ); }
+
+    /*
+     * Cluster the vectors in nlist lists. The centroids are calculated
+     * with k-means on an evenly spaced sample of sample unit vectors
+     * (64 per list by default); all vectors are then assigned to the list
+     * with the most similar centroid.
+     */
+    void build_ivf( size_t nlist, size_t max_iters = 10, size_t sample = 0 ) {
+	typedef dense_vector<size_t, float, false, mm_no_ownership_policy>
+	    vector_type;
+	size_t n = m_store.get_num_points();
+	size_t d = m_store.get_dimensions();
+	nlist = std::min( nlist, n );
+	if( nlist == 0 )
+	    return;
+	if( sample == 0 )
+	    sample = 64 * nlist;
+	sample = std::max( nlist, std::min( sample, n ) );
+
+	std::vector<float> points( sample * d );
+	par::parallel_for( size_t(0), sample, [&]( size_t k ) {
+	    size_t i = k * n / sample;
+	    const float * v = m_store.vector( i );
+	    for( size_t c=0; c < d; ++c )
+		points[k * d + c] = v[c] * m_store.inv_norm( i );
+	} );
+	std::vector<vector_type> views;
+	views.reserve( sample );
+	for( size_t k=0; k < sample; ++k )
+	    views.emplace_back( &points[k * d], d );
+
+	kmeans_operator<size_t, float, false> op( nlist, d );
+	op.cluster( views.begin(), views.end(), max_iters );
+
+	m_nlist = nlist;
+	m_centroids.assign( nlist * d, 0 );
+	for( size_t l=0; l < nlist; ++l ) {
+	    double s = 0;
+	    for( size_t c=0; c < d; ++c )
+		s += op.centres()[l][c] * op.centres()[l][c];
+	    float scale = s > 0 ? float( 1 / std::sqrt( s ) ) : 0;
+	    for( size_t c=0; c < d; ++c )
+		m_centroids[l * d + c] = op.centres()[l][c] * scale;
+	}
+
+	// Assign vectors to lists and lay out the lists consecutively
+	std::vector<size_t> list( n );
+	par::parallel_for( size_t(0), n, [&]( size_t i ) {
+	    std::vector<neighbour> best = closest_lists( m_store.vector( i ), 1 );
+	    list[i] = best[0].first;
+	} );
+	m_list_start.assign( nlist+1, 0 );
+	for( size_t i=0; i < n; ++i )
+	    ++m_list_start[list[i]+1];
+	for( size_t l=0; l < nlist; ++l )
+	    m_list_start[l+1] += m_list_start[l];
+	m_list_ids.resize( n );
+	std::vector<size_t> pos( m_list_start.begin(), m_list_start.end()-1 );
+	for( size_t i=0; i < n; ++i )
+	    m_list_ids[pos[list[i]]++] = i;
+    }
+
+    // The k vectors most similar to query, most similar first, excluding
+    // the vector with ID exclude
+    std::vector<neighbour> search( const float * query, size_t k,
+				   size_t exclude = npos ) const {
+	size_t n = m_store.get_num_points();
+	size_t d = m_store.get_dimensions();
+	std::vector<float> q( query, query + d );
+	double s = 0;
+	for( size_t c=0; c < d; ++c )
+	    s += q[c] * q[c];
+	if( s > 0 )
+	    for( size_t c=0; c < d; ++c )
+		q[c] /= std::sqrt( s );
+
+	std::vector<internal::neighbour_heap> heaps;
+	if( has_ivf() ) {
+	    std::vector<neighbour> probe = closest_lists( &q[0], m_nprobe );
+	    heaps.resize( probe.size(), internal::neighbour_heap( k ) );
+	    par::parallel_for( size_t(0), probe.size(), [&]( size_t p ) {
+		size_t l = probe[p].first;
+		const size_t * ids = &m_list_ids[m_list_start[l]];
+		internal::scan_rows(
+		    m_store, &q[0], m_list_start[l+1] - m_list_start[l],
+		    [&]( size_t j ) { return ids[j]; }, exclude, heaps[p] );
+	    }, 1 );
+	} else {
+	    size_t nblocks = std::max( size_t(1), std::min(
+		par::num_workers() * 4, ( n + min_block - 1 ) / min_block ) );
+	    size_t block = ( n + nblocks - 1 ) / nblocks;
+	    heaps.resize( nblocks, internal::neighbour_heap( k ) );
+	    par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+		size_t from = std::min( n, b * block );
+		size_t to = std::min( n, (b+1) * block );
+		internal::scan_rows(
+		    m_store, &q[0], to - from,
+		    [&]( size_t j ) { return from + j; }, exclude, heaps[b] );
+	    }, 1 );
+	}
+
+	std::vector<neighbour> cand;
+	for( const internal::neighbour_heap & h : heaps )
+	    cand.insert( cand.end(), h.entries().begin(), h.entries().end() );
+	return top_k( cand.begin(), cand.end(), k, second_greater<neighbour>() );
+    }
+
+    // The k words most similar to word w; empty if w does not occur
+    std::vector<neighbour> most_similar( const char * w, size_t k ) const {
+	size_t id = m_store.index_of( w );
+	if( id == npos )
+	    return std::vector<neighbour>();
+	return search( m_store.vector( id ), k, id );
+    }
+
+private:
+    // The m lists with the centroids most similar to q
+    std::vector<neighbour> closest_lists( const float * q, size_t m ) const {
+	size_t d = m_store.get_dimensions();
+	std::vector<neighbour> sim( m_nlist );
+	const float * rows[4];
+	float dots[4];
+	for( size_t l=0; l < m_nlist; l += 4 ) {
+	    size_t r = std::min( size_t(4), m_nlist - l );
+	    for( size_t j=0; j < 4; ++j )
+		rows[j] = &m_centroids[( l + std::min( j, r-1 ) ) * d];
+	    internal::dot4( q, rows, d, dots );
+	    for( size_t j=0; j < r; ++j )
+		sim[l+j] = neighbour( l+j, dots[j] );
+	}
+	return top_k( sim.begin(), sim.end(), m, second_greater<neighbour>() );
+    }
+};
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_EMBEDDING_H
@@ -315,6 +315,33 @@ public:
 	}
     }
 
+    // Remove the elements for which pred holds. Linear probing does not
+    // support removal of single elements, so the table is rebuilt. pred is
+    // applied once per element, in iteration order.
+    template<typename Predicate>
+    size_type erase_if( Predicate pred ) {
+	std::vector<bool> keep( msize, false );
+	size_type kept = 0;
+	for( size_type i=0; i < msize; ++i ) {
+	    if( occupied[i] && !pred( table[i] ) ) {
+		keep[i] = true;
+		++kept;
+	    }
+	}
+
+	size_type newsize = 256;
+	while( kept >= newsize>>log_grow )
+	    newsize <<= 1;
+	self_type h( newsize, log_grow, log_grow_by );
+	for( size_type i=0; i < msize; ++i )
+	    if( keep[i] )
+		h.insert( table[i] );
+
+	size_type erased = load - kept;
+	swap( h );
+	return erased;
+    }
+
     const_iterator find( const key_type &key ) const {
         size_type index = kh(key) & (msize-1);
         while(occupied[index] && !keql(table[index].first, key)) {
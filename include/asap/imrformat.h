@@ -23,6 +23,7 @@
 #include <stdexcept>
 #include <cctype>
 #include <cstdlib>
+#include <cassert>
 #include <array>
 
 #include "asap/memory.h"
@@ -23,75 +23,200 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #include <memory>
 #include <cerrno>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
+#include "asap/par.h"
 #include "asap/word_bank.h"
 
 namespace asap {
 
 namespace internal {
 
-template<typename ContainerTy>
-size_t getdir( const std::string & dirname, ContainerTy & files,
-	       bool recursive = true ) {
-    DIR *dp;
-    struct dirent *dirp;
-    if((dp  = opendir(dirname.c_str())) == NULL)
-	fatale( "opendir", dirname );
+/*
+ * Parallel directory walk. Every directory is read in large batches
+ * (getdents64 on Linux), entries are inspected with statx() relative to
+ * the directory's file descriptor, and subdirectories are walked in
+ * parallel. The tree of entries is flattened afterwards, such that files
+ * are listed in the same order as a sequential depth-first walk.
+ */
+struct dir_node {
+    struct entry {
+	std::string			name;	// relative to directory
+	std::string			path;	// file path, once resolved
+	size_t				size;
+	std::unique_ptr<dir_node>	sub;	// non-null for directories
+	bool				is_file;
 
-    size_t total_size = 0;
+	entry( const char * n ) : name( n ), size( 0 ), is_file( false ) { }
+    };
 
-    while ((dirp = readdir(dp)) != NULL) {
-	const char * file = files.append( 0, dirname.c_str(), dirname.length() );
-	file = files.append( file, "/", 1 );
-	file = files.append( file, dirp->d_name, strlen(dirp->d_name) );
-
-        struct stat buf;
-        if( lstat( file, &buf ) < 0 )
-	    fatale( "lstat", file );
-
-        if (S_ISREG(buf.st_mode)) {
-            files.index_only(file);
-	    total_size += buf.st_size;
-	} else if( S_ISLNK(buf.st_mode) ) {
-	    char lnk[256];
-	    strncpy( lnk, file, sizeof(lnk) );
-	    size_t nbp = strlen( file )-1;
-	    while( lnk[nbp] != '/' && nbp > 0 )
-		--nbp;
-	    if( lnk[nbp] == '/' )
-		++nbp; // forward from '/'
-	    ssize_t nb = readlink(file, &lnk[nbp], sizeof(lnk)-nbp);
-	    if( nb < 0 )
-		fatale( "readlink", file );
-
-	    lnk[nbp+nb] = '\0';
-
-	    if( lstat( lnk, &buf ) < 0 )
-		fatale( "lstat symlink", lnk );
-	    if( S_ISREG(buf.st_mode) ) {
-		files.erase(file);
-		files.index(lnk, nbp+nb);
-		total_size += buf.st_size;
-	    }
-	} else if( S_ISDIR(buf.st_mode) && recursive ) {
-	    if( strcmp( dirp->d_name, "." ) && strcmp( dirp->d_name, ".." ) ) {
-		std::string subdir = file;
-		files.erase(file);
-		total_size += getdir( subdir, files, recursive );
-	    } else
-		files.erase(file);
-	} else
-	    files.erase(file);
+    std::string		path;
+    std::vector<entry>	entries;
+
+    dir_node( const std::string & p ) : path( p ) { }
+};
+
+#if defined(__linux__)
+struct linux_dirent64 {
+    uint64_t		d_ino;
+    int64_t		d_off;
+    unsigned short	d_reclen;
+    unsigned char	d_type;
+    char		d_name[];
+};
+#endif
+
+// Read the names in a directory, skipping "." and ".."
+inline void read_dir_entries( int fd, dir_node & node ) {
+    auto skip = []( const char * n ) {
+	return n[0] == '.' && ( n[1] == '\0' || ( n[1] == '.' && n[2] == '\0' ) );
+    };
+#if defined(__linux__)
+    std::unique_ptr<char[]> buf( new char[size_t(1)<<16] );
+    while( true ) {
+	long nb = syscall( SYS_getdents64, fd, buf.get(), size_t(1)<<16 );
+	if( nb < 0 )
+	    fatale( "getdents64", node.path );
+	if( nb == 0 )
+	    break;
+	for( long off=0; off < nb; ) {
+	    const linux_dirent64 * d
+		= reinterpret_cast<const linux_dirent64 *>( &buf[off] );
+	    if( !skip( d->d_name ) )
+		node.entries.emplace_back( d->d_name );
+	    off += d->d_reclen;
+	}
+    }
+#else
+    DIR * dp = fdopendir( dup( fd ) );
+    if( !dp )
+	fatale( "fdopendir", node.path );
+    while( struct dirent * dirp = readdir( dp ) ) {
+	if( !skip( dirp->d_name ) )
+	    node.entries.emplace_back( dirp->d_name );
     }
+    closedir( dp );
+#endif
+}
+
+// Type and size of name, relative to dirfd, without following symlinks
+inline mode_t stat_entry( int dirfd, const char * name, size_t & size,
+			  const std::string & dirname ) {
+#if defined(STATX_TYPE)
+    struct statx buf;
+    if( statx( dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+	       STATX_TYPE | STATX_SIZE, &buf ) < 0 )
+	fatale( "statx", dirname, '/', name );
+    size = buf.stx_size;
+    return buf.stx_mode;
+#else
+    struct stat buf;
+    if( fstatat( dirfd, name, &buf, AT_SYMLINK_NOFOLLOW ) < 0 )
+	fatale( "fstatat", dirname, '/', name );
+    size = buf.st_size;
+    return buf.st_mode;
+#endif
+}
+
+// The target of the symbolic link name, relative to dirfd
+inline std::string read_link( int dirfd, const char * name,
+			      const std::string & dirname ) {
+    std::vector<char> buf( 256 );
+    while( true ) {
+	ssize_t nb = readlinkat( dirfd, name, &buf[0], buf.size() );
+	if( nb < 0 )
+	    fatale( "readlink", dirname, '/', name );
+	if( size_t(nb) < buf.size() )
+	    return std::string( &buf[0], nb );
+	buf.resize( 2 * buf.size() );
+    }
+}
+
+inline void walk_dir( dir_node & node, bool recursive ) {
+    int fd = open( node.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if( fd < 0 )
+	fatale( "opendir", node.path );
+
+    read_dir_entries( fd, node );
+
+    // Inspect the entries in parallel, which matters for large, flat
+    // directories.
+    par::parallel_for( size_t(0), node.entries.size(), [&]( size_t k ) {
+	dir_node::entry & e = node.entries[k];
+	mode_t mode = stat_entry( fd, e.name.c_str(), e.size, node.path );
+	if( S_ISREG( mode ) ) {
+	    e.path = node.path + '/' + e.name;
+	    e.is_file = true;
+	} else if( S_ISLNK( mode ) ) {
+	    // Link targets are relative to the directory holding the link.
+	    // Only links to regular files are listed, by their target.
+	    std::string lnk = read_link( fd, e.name.c_str(), node.path );
+	    if( lnk[0] != '/' )
+		lnk = node.path + '/' + lnk;
+	    if( S_ISREG( stat_entry( AT_FDCWD, lnk.c_str(), e.size,
+				     node.path ) ) ) {
+		e.path.swap( lnk );
+		e.is_file = true;
+	    }
+	} else if( S_ISDIR( mode ) && recursive ) {
+	    e.sub.reset( new dir_node( node.path + '/' + e.name ) );
+	}
+    }, 256 );
+
+    close( fd );
 
-    closedir(dp);
+    // Walk subdirectories in parallel
+    std::vector<dir_node *> subdirs;
+    for( dir_node::entry & e : node.entries )
+	if( e.sub )
+	    subdirs.push_back( e.sub.get() );
+    par::parallel_for( size_t(0), subdirs.size(), [&]( size_t k ) {
+	walk_dir( *subdirs[k], recursive );
+    }, 1 );
+}
 
+template<typename ContainerTy>
+size_t flatten_dir( dir_node & node, ContainerTy & files,
+		    std::vector<size_t> * sizes ) {
+    size_t total_size = 0;
+    for( dir_node::entry & e : node.entries ) {
+	if( e.is_file ) {
+	    files.index( &e.path[0], e.path.size() );
+	    total_size += e.size;
+	    if( sizes )
+		sizes->push_back( e.size );
+	} else if( e.sub )
+	    total_size += flatten_dir( *e.sub, files, sizes );
+    }
     return total_size;
 }
 
+// If sizes is non-null, the size of every file is appended to it in the
+// order in which the files are appended to files.
+template<typename ContainerTy>
+size_t getdir( const std::string & dirname, ContainerTy & files,
+	       std::vector<size_t> * sizes = nullptr,
+	       bool recursive = true ) {
+    dir_node root( dirname );
+    walk_dir( root, recursive );
+    return flatten_dir( root, files, sizes );
+}
+
 }
 
 template<typename WordListTy>
@@ -106,6 +231,262 @@ size_t get_directory_listing( const std::string & dirname, WordListTy & wl ) {
     return internal::getdir( dirname, wl );
 }
 
+// As above, additionally recording the size of every file in sizes.
+template<typename WordListTy>
+size_t get_directory_listing( const std::string & dirname, WordListTy & wl,
+			      std::vector<size_t> & sizes ) {
+    typedef WordListTy word_list_type;
+
+    static_assert( word_list_type::word_bank_type::is_managed,
+		   "Directory listing word_bank must be self-managed" );
+
+    sizes.clear();
+    return internal::getdir( dirname, wl, &sizes );
+}
+
+/*
+ * file_schedule: order in which to process the files of a directory
+ *                listing, such that the load is balanced when file sizes
+ *                are skewed.
+ *
+ * Files are processed largest first (longest processing time first). Files
+ * smaller than batch_bytes are grouped in batches of at least batch_bytes
+ * to amortise scheduling overhead. Workers claim batches dynamically, in
+ * order, such that small files fill in the tail. Large files are split
+ * further by the word counting routines, which process chunks of a file in
+ * parallel.
+ */
+class file_schedule {
+    std::vector<size_t>	m_order;	// file indices, largest first
+    std::vector<size_t>	m_batch;	// start of each batch in m_order
+
+public:
+    file_schedule( const std::vector<size_t> & sizes,
+		   size_t batch_bytes = size_t(1)<<16 )
+	: m_order( sizes.size() ) {
+	for( size_t i=0; i < m_order.size(); ++i )
+	    m_order[i] = i;
+	std::stable_sort( m_order.begin(), m_order.end(),
+			  [&]( size_t l, size_t r ) {
+			      return sizes[l] > sizes[r];
+			  } );
+
+	size_t bytes = batch_bytes;
+	for( size_t k=0; k < m_order.size(); ++k ) {
+	    if( bytes >= batch_bytes ) {
+		m_batch.push_back( k );
+		bytes = 0;
+	    }
+	    bytes += sizes[m_order[k]];
+	}
+	m_batch.push_back( m_order.size() );
+    }
+
+    size_t size() const { return m_order.size(); }
+    size_t num_batches() const { return m_batch.size() - 1; }
+
+    // The index of the k-th file to process
+    size_t file( size_t k ) const { return m_order[k]; }
+
+    // Apply fn to the index of every file, in parallel
+    template<typename Fn>
+    void parallel_for( Fn && fn ) const {
+	size_t nbatches = num_batches();
+	std::atomic<size_t> next( 0 );
+	size_t nworkers = std::min( par::num_workers(), nbatches );
+	par::parallel_for( size_t(0), nworkers, [&]( size_t ) {
+	    size_t b;
+	    while( ( b = next.fetch_add( 1, std::memory_order_relaxed ) )
+		   < nbatches ) {
+		for( size_t k=m_batch[b]; k < m_batch[b+1]; ++k )
+		    fn( m_order[k] );
+	    }
+	}, 1 );
+    }
+};
+
+namespace internal {
+
+// Free list of file buffers, keyed by capacity. Buffers return to the pool
+// when the last reference to them is dropped, which may happen after the
+// prefetcher has been destroyed, hence the pool is shared.
+class file_buffer_pool {
+    std::mutex			m_mux;
+    std::multimap<size_t, char *> m_free;
+    size_t			m_max_free;
+
+public:
+    file_buffer_pool( size_t max_free ) : m_max_free( max_free ) { }
+    ~file_buffer_pool() {
+	for( auto & f : m_free )
+	    delete[] f.second;
+    }
+
+    static std::shared_ptr<char>
+    get( const std::shared_ptr<file_buffer_pool> & pool, size_t size ) {
+	char * buf = nullptr;
+	size_t capacity = 0;
+	{
+	    std::lock_guard<std::mutex> lock( pool->m_mux );
+	    auto F = pool->m_free.lower_bound( size );
+	    if( F != pool->m_free.end() ) {
+		capacity = F->first;
+		buf = F->second;
+		pool->m_free.erase( F );
+	    }
+	}
+	if( !buf ) {
+	    capacity = ( size + 4095 ) & ~size_t(4095);
+	    buf = new char[capacity];
+	}
+	return std::shared_ptr<char>( buf, [pool,capacity]( char * p ) {
+		pool->put( p, capacity );
+	    } );
+    }
+
+private:
+    void put( char * buf, size_t capacity ) {
+	{
+	    std::lock_guard<std::mutex> lock( m_mux );
+	    if( m_free.size() < m_max_free ) {
+		m_free.emplace( capacity, buf );
+		return;
+	    }
+	}
+	delete[] buf;
+    }
+};
+
+} // namespace internal
+
+/*
+ * file_prefetcher: reads files ahead of their processing on a dedicated
+ *                  pool of I/O threads.
+ *
+ * Files are read in the order of a file_schedule, up to depth files ahead
+ * of the furthest file requested. take() returns the contents of a file,
+ * waiting for its read to complete if necessary. The window advances as
+ * files are requested rather than consumed, such that workers suspended
+ * in nested parallel work cannot hold up others. Buffers are recycled when
+ * released; for word banks that are not self-managed, this happens only
+ * once the word container that refers to the file is destroyed.
+ */
+template<typename WordListTy>
+class file_prefetcher {
+    const WordListTy &				m_files;
+    const file_schedule &			m_schedule;
+    size_t					m_depth;
+    std::shared_ptr<internal::file_buffer_pool>	m_pool;
+
+    std::mutex					m_mux;
+    std::condition_variable			m_space;
+    std::condition_variable			m_ready;
+    std::vector<file_buffer>			m_buf;
+    std::vector<char>				m_is_ready;
+    std::vector<size_t>				m_rank;	// position in schedule
+    size_t					m_issued;
+    size_t					m_frontier;
+    bool					m_stop;
+    std::vector<std::thread>			m_threads;
+
+public:
+    file_prefetcher( const WordListTy & files, const file_schedule & schedule,
+		     size_t depth, size_t nthreads = 2 )
+	: m_files( files ), m_schedule( schedule ),
+	  m_depth( std::max( depth, size_t(1) ) ),
+	  m_pool( std::make_shared<internal::file_buffer_pool>( m_depth ) ),
+	  m_buf( schedule.size() ), m_is_ready( schedule.size(), 0 ),
+	  m_rank( schedule.size() ),
+	  m_issued( 0 ), m_frontier( 0 ), m_stop( false ) {
+	for( size_t k=0; k < schedule.size(); ++k )
+	    m_rank[schedule.file( k )] = k;
+	nthreads = std::max( size_t(1), std::min( nthreads, m_depth ) );
+	for( size_t t=0; t < nthreads; ++t )
+	    m_threads.emplace_back( [this]() { read_loop(); } );
+    }
+    ~file_prefetcher() {
+	{
+	    std::lock_guard<std::mutex> lock( m_mux );
+	    m_stop = true;
+	}
+	m_space.notify_all();
+	for( std::thread & t : m_threads )
+	    t.join();
+    }
+
+    file_prefetcher( const file_prefetcher & ) = delete;
+    file_prefetcher & operator = ( const file_prefetcher & ) = delete;
+
+    // Take the contents of file i
+    file_buffer take( size_t i ) {
+	file_buffer file;
+	std::unique_lock<std::mutex> lock( m_mux );
+	if( m_rank[i] >= m_frontier ) {
+	    m_frontier = m_rank[i] + 1;
+	    m_space.notify_all();
+	}
+	m_ready.wait( lock, [&]() { return m_is_ready[i] != 0; } );
+	std::swap( file, m_buf[i] );
+	return file;
+    }
+
+private:
+    void read_loop() {
+	size_t n = m_schedule.size();
+	while( true ) {
+	    size_t k;
+	    {
+		std::unique_lock<std::mutex> lock( m_mux );
+		m_space.wait( lock, [&]() {
+			return m_stop || m_issued == n
+			    || m_issued < m_frontier + m_depth;
+		    } );
+		if( m_stop || m_issued == n )
+		    return;
+		k = m_issued++;
+	    }
+
+	    size_t i = m_schedule.file( k );
+	    file_buffer file;
+	    internal::read_file( m_files[i], file, [this]( size_t size ) {
+		    return internal::file_buffer_pool::get( m_pool, size );
+		} );
+
+	    {
+		std::lock_guard<std::mutex> lock( m_mux );
+		std::swap( file, m_buf[i] );
+		m_is_ready[i] = 1;
+	    }
+	    m_ready.notify_all();
+	}
+    }
+};
+
+/*
+ * Apply fn( i, file ) to every file i in files, in parallel and in the order
+ * of schedule, where file holds the contents of the file. If depth is
+ * non-zero, files are read ahead by a file_prefetcher. Otherwise, they are
+ * read by the worker that processes them.
+ */
+template<typename WordListTy, typename Fn>
+void parallel_read_files( const WordListTy & files,
+			  const file_schedule & schedule,
+			  size_t depth, Fn && fn ) {
+    if( depth == 0 ) {
+	schedule.parallel_for( [&]( size_t i ) {
+	    file_buffer file;
+	    internal::read_file( files[i], file );
+	    fn( i, file );
+	} );
+    } else {
+	file_prefetcher<WordListTy> prefetch( files, schedule, depth );
+	schedule.parallel_for( [&]( size_t i ) {
+	    file_buffer file = prefetch.take( i );
+	    fn( i, file );
+	} );
+    }
+}
+
 }
 
 #endif // INCLUDED_ASAP_IO_H
@@ -22,8 +22,9 @@
 #include <memory>
 #include <cassert>
 #include <iomanip>
-#include <cilk/reducer_opadd.h>
+#include <type_traits>
 
+#include "asap/par.h"
 #include "asap/dense_vector.h"
 #include "asap/attributes.h"
 #include "asap/data_set.h"
@@ -140,7 +141,7 @@ public:
     typedef dense_vector_set<centre_vector_type> kmeans_dense_vector_set;
 
 private:
-    class dense_vector_set_monoid : public cilk::monoid_base<kmeans_dense_vector_set>
+    class dense_vector_set_monoid : public par::monoid_base<kmeans_dense_vector_set>
     {
 	typedef centre_vector_type vector_type;
 	typedef kmeans_dense_vector_set vector_set_type;
@@ -182,7 +183,8 @@ private:
 	    std::advance( II, pt );
 	    m_centres[c] += *II;
 	    m_centres[c].inc_count(); // will inc to 1 only
-	    if( is_sparse_vector<decltype(*I)>::value )
+	    if( is_sparse_vector<decltype(*I)>::value
+		|| is_compact_sparse_vector<decltype(*I)>::value )
 		m_centres[c].update_sqnorm();
 	    c++;
 	    // std::cerr << "PP: pt " << c << " is " << pt << "\n";
@@ -190,15 +192,15 @@ private:
 	
 	value_type * D = new value_type[num_points]; // zero-init
 	
-	cilk::reducer< cilk::op_add<value_type> > sum( 0 );
-	cilk_for( InputIterator II=I; II != E; ++II ) {
+	par::reducer< par::op_add<value_type> > sum( 0 );
+	par::parallel_for( I, E, [&]( InputIterator II ) {
 	    size_t pos = std::distance(I, II);
 	    value_type distance = II->sq_dist( m_centres[c-1] );
 	    D[pos] = distance;
 	    *sum += distance;
 	    // std::cerr << "sq distance " << distance << " / " << D[pos] << "\n";
 	    assert( distance >= 0 );
-	}
+	} );
 	D[pt] = 0; // zero probability
 	// std::cerr << "sum=" << sum.get_value() << "\n";
 
@@ -213,7 +215,8 @@ private:
 		if( cum >= r ) {
 		    m_centres[c] += *II;
 		    m_centres[c].inc_count(); // will inc to 1 only
-		    if( is_sparse_vector<decltype(*I)>::value )
+		    if( is_sparse_vector<decltype(*I)>::value
+		    || is_compact_sparse_vector<decltype(*I)>::value )
 			m_centres[c].update_sqnorm();
 		    c++;
 		    D[pt] = 0;
@@ -225,14 +228,14 @@ private:
 		break;
 
 	    sum.set_value( 0 );
-	    cilk_for( InputIterator II=I; II != E; ++II ) {
+	    par::parallel_for( I, E, [&]( InputIterator II ) {
 		size_t pos = std::distance(I, II);
 		value_type distance = II->sq_dist( m_centres[c-1] );
 		if( D[pos] > distance )
 		    D[pos] = distance;
 		// if( distance == 0 ) std::cerr << "set D[" << pos << "] to zero\n";
 		*sum += D[pos];
-	    }
+	    } );
 /*
 	    if( sum.get_value() == 0 ) {
 		std::cerr << "NO MORE DISTANCES!\n";
@@ -302,24 +305,25 @@ private:
 
 	std::cerr << "***** ITER ***** " << m_sse << "\n";
 
-	// Use a Cilk reducer to assign points to clusters
-	cilk::reducer<dense_vector_set_monoid>
+	// Use a reducer to assign points to clusters
+	par::reducer<dense_vector_set_monoid>
 	    new_centres( m_num_clusters, m_vector_length );
 	// Set vectors and cluster sizes to 0
 	new_centres->clear();
 
 	// Pre-calculate square norms for the centres
-	if( is_sparse_vector<decltype(*I)>::value ) {
+	if( is_sparse_vector<decltype(*I)>::value
+	    || is_compact_sparse_vector<decltype(*I)>::value ) {
 	    for( size_t c=0; c < m_num_clusters; ++c )
 		m_centres[c].update_sqnorm();
 	}
 
-	cilk::reducer< cilk::op_add<value_type> > sse( 0 );
+	par::reducer< par::op_add<value_type> > sse( 0 );
 
-	cilk_for( InputIterator II=I; II != E; ++II ) {
+	par::parallel_for( I, E, [&]( InputIterator II ) {
 	    size_t pt = std::distance( I, II );
 	    // Possibly a fresh view has been served. Check for initialization.
-	    // This counter-acts a short-coming of Cilk reducers: it is not
+	    // This counter-acts a short-coming of reducers: it is not
 	    // possible to initialize the views with parameters specific to
 	    // the problem instance.
 	    if( new_centres->check_init( m_num_clusters, m_vector_length ) )
@@ -356,16 +360,17 @@ private:
 	    (*new_centres)[new_cluster_id] += *II;
 	    (*new_centres)[new_cluster_id].inc_count();
 	    *sse += smallest_distance; // add up squared distances
-	}
+	} );
 
-	normalize( *new_centres );
+	kmeans_dense_vector_set & centres = new_centres.get_value();
+	normalize( centres );
 
 	// Alternative way of assessing convergence
 	if( std::is_floating_point<value_type>::value && modified ) {
 	    modified = false;
 	    // Note: we have a sqnorm cache on m_centres, not on new_centres
 	    for( int i=0; i < m_num_clusters; ++i ) {
-		value_type d = (*new_centres)[i].sq_dist( m_centres[i] );
+		value_type d = centres[i].sq_dist( m_centres[i] );
 		std::cerr << "centre " << i << " moves over " << d << "\n"; 
 		if( d >= epsilon * epsilon ) {
 		    modified = true;
@@ -374,7 +379,7 @@ private:
 	    }
 	}
 
-	new_centres->swap( m_centres );
+	centres.swap( m_centres );
 	m_sse = sse.get_value();
 	assert( m_sse >= 0 );
 	return modified;
@@ -409,10 +414,15 @@ struct kmeans_data_set_type_creator {
     typedef kmeans_data_set<centre_vector_type, word_container_type> data_set_type;
 };
 
-template<typename DataSetTy>
+// Cluster the points, which hold the vectors of data_set in some other
+// storage, e.g., a compact_sparse_vector_set encoded from them. The result
+// is labelled with the attributes of data_set.
+template<typename DataSetTy, typename PointSetTy,
+	 typename = typename std::enable_if<
+	     !std::is_arithmetic<PointSetTy>::value>::type>
 typename kmeans_data_set_type_creator<DataSetTy>::data_set_type
-kmeans( const DataSetTy & data_set, size_t num_clusters,
-	size_t max_iters = 0,
+kmeans( const DataSetTy & data_set, const PointSetTy & points,
+	size_t num_clusters, size_t max_iters = 0,
 	typename DataSetTy::value_type epsilon = 1e-4 ) {
     typedef typename DataSetTy::vector_type vector_type;
     typedef typename DataSetTy::value_type value_type;
@@ -425,13 +435,10 @@ kmeans( const DataSetTy & data_set, size_t num_clusters,
     typedef typename kmeans_type::kmeans_dense_vector_set kmeans_vector_set;
 
     kmeans_type op( num_clusters, data_set.get_dimensions() );
-    op.cluster( data_set.vector_cbegin(), data_set.vector_cend(),
-		max_iters, epsilon );
+    op.cluster( points.cbegin(), points.cend(), max_iters, epsilon );
 
     typedef typename kmeans_data_set_type_creator<DataSetTy>::data_set_type
 	data_set_type;
-    typedef typename data_set_type::index_list_type index_list_type;
-    typedef typename data_set_type::vector_list_type vector_list_type;
 
     std::shared_ptr<kmeans_vector_set> centres
 	= std::make_shared<kmeans_vector_set>( std::move(op.centres()) );
@@ -440,6 +447,14 @@ kmeans( const DataSetTy & data_set, size_t num_clusters,
 			  data_set.get_index_ptr(), centres );
 }
 
+template<typename DataSetTy>
+typename kmeans_data_set_type_creator<DataSetTy>::data_set_type
+kmeans( const DataSetTy & data_set, size_t num_clusters,
+	size_t max_iters = 0,
+	typename DataSetTy::value_type epsilon = 1e-4 ) {
+    return kmeans( data_set, data_set.get_vectors(), num_clusters,
+		   max_iters, epsilon );
+}
 
 }
 
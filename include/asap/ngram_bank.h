@@ -20,6 +20,9 @@
 #ifndef INCLUDED_ASAP_NGRAM_BANK_H
 #define INCLUDED_ASAP_NGRAM_BANK_H
 
+#include <cassert>
+#include <mutex>
+
 #include "asap/word_bank.h"
 
 namespace asap {
@@ -78,6 +81,22 @@ struct value_cmp<text::ngram<N>> {
     }
 };
 
+template<size_t N>
+struct value_cmp<text::packed_ngram<N>> {
+    bool operator () ( const text::packed_ngram<N> & v1,
+		       const text::packed_ngram<N> & v2 ) const {
+	return text::ngram_cmp()( v1, v2 );
+    }
+};
+
+template<size_t N>
+struct value_cmp<text::ngram_tuple<N>> {
+    bool operator () ( const text::ngram_tuple<N> & v1,
+		       const text::ngram_tuple<N> & v2 ) const {
+	return text::ngram_cmp()( v1, v2 );
+    }
+};
+
 template<typename IndexTy, typename WordBankTy, size_t N_>
 class ngram_map;
 
@@ -140,6 +159,14 @@ public:
     void resize( size_t sz ) { this->m_words.resize( sz ); }
     void reserve( size_t sz ) { this->m_words.reserve( sz ); }
 
+    // Remove the elements for which pred holds, retaining the order
+    template<typename Predicate>
+    void erase_if( Predicate pred ) {
+	this->m_words.erase( std::remove_if( this->m_words.begin(),
+					     this->m_words.end(), pred ),
+			     this->m_words.end() );
+    }
+
     // Retrieve n-th word item in the container.
     const value_type & operator[] ( size_t n ) const {
 	return this->m_words[n];
@@ -151,7 +178,7 @@ public:
     const_iterator cbegin() const { return this->m_words.cbegin(); }
     const_iterator cend() const { return this->m_words.cend(); }
 
-    const_iterator find( const text::ngram<N> & w ) const {
+    const_iterator find( const key_type & w ) const {
 	value_type val
 	    = std::make_pair( w, typename value_type::second_type() );
 	pair_cmp<value_type,value_type> cmp;
@@ -161,7 +188,7 @@ public:
 	return cend();
     }
 
-    const_iterator binary_search( const text::ngram<N> & w ) const {
+    const_iterator binary_search( const key_type & w ) const {
 	value_type val
 	    = std::make_pair( w, typename value_type::second_type() );
 	// val.first = w; // only if std::pair
@@ -370,10 +397,14 @@ public:
 	return this->m_storage.store( p, len );
     }
 
-    void index( const asap::text::ngram<N> & ng ) {
+    void index( const key_type & ng ) {
 	++this->m_words[ng];
     }
 
+    std::pair<iterator,bool> insert( const value_type & kv ) {
+	return this->m_words.insert( kv );
+    }
+
     iterator begin() { return this->m_words.begin(); }
     iterator end() { return this->m_words.end(); }
 
@@ -454,6 +485,9 @@ public:
 	    this->swap( rhs );
 	core_reduce( rhs.cbegin(), rhs.cend(), rhs.storage(),
 		     mapped_add_reducer<mapped_type,mapped_type>() );
+	// After the swap, keys retained in *this may point into storage held
+	// by rhs, even if none of the keys of rhs are new. Retain it always.
+	this->m_storage.reduce( rhs.m_storage );
 	rhs.clear();
     }
 private:
@@ -578,7 +612,7 @@ class ngram_container_reducer {
     typedef WordContainerTy type;
     static const size_t N = type::N;
 
-    struct Monoid : cilk::monoid_base<type> {
+    struct Monoid : par::monoid_base<type> {
 	static void reduce( type * left, type * right ) {
 	    left->reduce( *right );
 	}
@@ -592,13 +626,13 @@ class ngram_container_reducer {
     };
 
 private:
-    cilk::reducer<Monoid> imp_;
+    par::reducer<Monoid> imp_;
 
 public:
     ngram_container_reducer() : imp_() { }
 
     void swap( type & c ) {
-	imp_.view().swap( c );
+	imp_.get_value().swap( c );
     }
 
     template<typename OtherIndexTy, typename OtherWordBankTy>
@@ -610,9 +644,144 @@ public:
 	imp_.view().count_presence( rhs );
     }
 
-    type & get_value() { return imp_.view(); }
+    type & get_value() { return imp_.get_value(); }
 };
 
+/*
+ * ngram_df_reducer: document frequencies of n-grams with a minimum
+ * document frequency applied while merging.
+ *
+ * Every worker counts into its own table, which is split in partitions by
+ * the top bits of the hash. Partition p of all workers is merged by one
+ * task, which keeps only the n-grams that occur in at least min_df
+ * documents. As such, no table holding all n-grams is built, and merging
+ * proceeds in parallel across partitions. Threads that are not workers
+ * share one extra table under a lock.
+ */
+template<typename KeyTy, typename Hash, typename KeyEqual>
+class ngram_df_reducer {
+public:
+    typedef KeyTy key_type;
+    static const size_t partition_bits = 6;
+    static const size_t num_partitions = size_t(1) << partition_bits;
+
+private:
+    typedef hash_table<key_type, size_t, Hash, KeyEqual> table_type;
+
+    struct view {
+	table_type	part[num_partitions];
+	char		pad[64]; // avoid false sharing
+
+	view() {
+	    for( size_t p=0; p < num_partitions; ++p )
+		part[p].set_growth( 1, 2 );
+	}
+    };
+
+    std::vector<std::unique_ptr<view>>	m_views;
+    std::mutex				m_external_lock;
+
+public:
+    ngram_df_reducer() : m_views( par::num_workers() + 1 ) { }
+
+    static size_t partition( const key_type & key ) {
+	return Hash()( key ) >> ( 64 - partition_bits );
+    }
+
+    // Count every key of a per-document catalog once
+    template<typename CatalogTy>
+    void count_presence( const CatalogTy & catalog ) {
+	size_t w = par::worker_id();
+	if( w == par::no_worker ) {
+	    std::lock_guard<std::mutex> g( m_external_lock );
+	    count_presence( m_views.back(), catalog );
+	} else
+	    count_presence( m_views[w], catalog );
+    }
+
+private:
+    template<typename CatalogTy>
+    void count_presence( std::unique_ptr<view> & v,
+			 const CatalogTy & catalog ) {
+	if( !v )
+	    v.reset( new view() );
+	for( auto I=catalog.cbegin(), E=catalog.cend(); I != E; ++I ) {
+	    table_type & t = v->part[partition( I->first )];
+	    std::pair<typename table_type::iterator,bool> ret
+		= t.insert( std::make_pair( I->first, size_t(1) ) );
+	    if( !ret.second )
+		++ret.first->second;
+	}
+    }
+
+public:
+    /*
+     * Merge the per-worker counts and insert every key with a document
+     * frequency of at least min_df in agg, which maps keys to
+     * appear_count. The per-worker tables are released. Returns the
+     * number of keys that were pruned.
+     */
+    template<typename AggTy>
+    size_t merge( AggTy & agg, size_t min_df ) {
+	typedef typename AggTy::value_type value_type;
+	typedef typename AggTy::mapped_type mapped_type;
+
+	std::vector<table_type *> merged( num_partitions, nullptr );
+	std::vector<size_t> kept( num_partitions, 0 );
+
+	par::parallel_for( size_t(0), num_partitions, [&]( size_t p ) {
+	    // Merge into the largest table
+	    table_type * acc = nullptr;
+	    for( auto & v : m_views )
+		if( v && ( !acc || v->part[p].size() > acc->size() ) )
+		    acc = &v->part[p];
+	    if( !acc )
+		return;
+	    for( auto & v : m_views ) {
+		if( !v || &v->part[p] == acc )
+		    continue;
+		table_type & t = v->part[p];
+		for( auto I=t.begin(), E=t.end(); I != E; ++I ) {
+		    std::pair<typename table_type::iterator,bool> ret
+			= acc->insert( *I );
+		    if( !ret.second )
+			ret.first->second += I->second;
+		}
+		t.clear();
+	    }
+
+	    for( auto I=acc->cbegin(), E=acc->cend(); I != E; ++I )
+		if( I->second >= min_df )
+		    ++kept[p];
+	    merged[p] = acc;
+	}, 1 );
+
+	size_t nkept = 0, nall = 0;
+	for( size_t p=0; p < num_partitions; ++p ) {
+	    nkept += kept[p];
+	    nall += merged[p] ? merged[p]->size() : 0;
+	}
+
+	// reserve() rounds down to a power of two; ask for twice the
+	// space to avoid rehashing while inserting.
+	if( nkept > 0 )
+	    agg.reserve( 2 * ( agg.size() + nkept ) );
+	for( size_t p=0; p < num_partitions; ++p ) {
+	    if( !merged[p] )
+		continue;
+	    for( auto I=merged[p]->cbegin(), E=merged[p]->cend(); I != E; ++I ) {
+		if( I->second >= min_df ) {
+		    value_type val( I->first, mapped_type( I->second ) );
+		    agg.insert( val );
+		}
+	    }
+	    merged[p]->clear();
+	}
+	m_views.clear();
+
+	return nall - nkept;
+    }
+};
 
 } // namespace asap
 
@@ -24,6 +24,7 @@
 #include <limits>
 
 #include "asap/data_set.h"
+#include "asap/par.h"
 
 namespace asap {
 
@@ -74,12 +75,12 @@ std::vector<std::pair<typename DataSet::value_type,
     mm.resize( d );
 
     // TODO: tune grainsize
-    cilk_for( index_type i=0; i < d; ++i ) {
+    par::parallel_for( index_type(0), index_type(d), [&]( index_type i ) {
 	// TODO: consider vectorization
 	mm[i] = std::make_pair(
 	    std::numeric_limits<value_type>::max(),
 	    -std::numeric_limits<value_type>::max() );
-    }
+    } );
 
     // Calculate minimum and maximum value
     // TODO: Consider parallelization using reducer on vector
@@ -95,11 +96,11 @@ std::vector<std::pair<typename DataSet::value_type,
     // Correct for sparse vectors: if minimum still at initialized value,
     // then dimension was always zero in the data set, i.e., it did not appear.
     if( is_sparse_vector<vector_type>::value ) {
-	cilk_for( size_t i=0; i < d; ++i ) {
+	par::parallel_for( size_t(0), d, [&]( size_t i ) {
 	    // TODO: consider vectorization
 	    if( mm[i].first == std::numeric_limits<value_type>::max() )
 		mm[i].first = mm[i].second = value_type(0);
-	}
+	} );
     }
 
     return mm;
@@ -163,11 +164,10 @@ std::vector<std::pair<typename DataSet::value_type,
 
     // Scale data
     internal::Scale<vector_type> scale( mm );
-    typename DataSet::vector_iterator E=data.vector_end();
-    cilk_for( typename DataSet::vector_iterator
-	      I=data.vector_begin(); I != E; ++I ) {
+    par::parallel_for( data.vector_begin(), data.vector_end(),
+		       [&]( typename DataSet::vector_iterator I ) {
 	I->map( scale );
-    }
+    } );
 
     return mm;
 }
@@ -182,11 +182,10 @@ void denormalize( const std::vector<std::pair<typename DataSet::value_type,
 
     // Unscale data
     internal::Unscale<vector_type> unscale( extrema );
-    typename DataSet::vector_iterator E=data.vector_end();
-    cilk_for( typename DataSet::vector_iterator
-	     I=data.vector_begin(); I != E; ++I ) {
+    par::parallel_for( data.vector_begin(), data.vector_end(),
+		       [&]( typename DataSet::vector_iterator I ) {
 	I->map( unscale );
-    }
+    } );
 }
 
 }
@@ -0,0 +1,161 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * NUMA placement of memory and threads on top of libnuma (link with
+ * -lnuma). When the system does not support NUMA, all memory and threads
+ * are considered to reside on node 0 and placement requests are ignored.
+ */
+
+#ifndef INCLUDED_ASAP_NUMA_H
+#define INCLUDED_ASAP_NUMA_H
+
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+
+#include <sys/mman.h>
+#include <numa.h>
+
+#include "asap/par.h"
+
+namespace asap {
+
+namespace numa {
+
+inline bool available() {
+    static const bool avail = numa_available() >= 0;
+    return avail;
+}
+
+inline int num_nodes() {
+    return available() ? numa_max_node() + 1 : 1;
+}
+
+// Restrict the calling thread to the CPUs of node. Node -1 removes the
+// restriction.
+inline void run_on_node( int node ) {
+    if( available() )
+	numa_run_on_node( node );
+}
+
+// Page-aligned, zero-initialised allocation. Memory is released with
+// numa::free(), passing the same size. Returns nullptr on failure.
+inline void * alloc_interleaved( size_t bytes ) {
+    if( available() )
+	return numa_alloc_interleaved( bytes );
+    void * p = mmap( nullptr, bytes, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+inline void * alloc_on_node( size_t bytes, int node ) {
+    if( available() )
+	return numa_alloc_onnode( bytes, node % num_nodes() );
+    return alloc_interleaved( bytes );
+}
+
+inline void free( void * p, size_t bytes ) {
+    if( !p )
+	return;
+    if( available() )
+	numa_free( p, bytes );
+    else
+	munmap( p, bytes );
+}
+
+/*
+ * node_replicas: a copy of an array per group of threads, typically one
+ * group per NUMA node, for data that is updated by all threads.
+ *
+ * Threads update the replica of their own group. merge() adds the updates
+ * made to every replica since the previous merge to a reference copy and
+ * copies the result back to all replicas, such that no update is lost but
+ * updates become visible to other groups only at merge points. Updates
+ * that race with merge() may be lost, as is the case for lock-free
+ * (Hogwild) training in general.
+ *
+ * Replica k is placed on node k modulo the number of nodes, the reference
+ * copy is interleaved. All copies are zero-initialised.
+ */
+template<typename T>
+class node_replicas {
+    size_t		m_size;
+    std::vector<T *>	m_replica;
+    T *			m_ref;
+
+public:
+    node_replicas( size_t n, int ngroups = num_nodes() )
+	: m_size( n ), m_replica( ngroups, nullptr ), m_ref( nullptr ) {
+	m_ref = (T *)alloc_interleaved( bytes() );
+	for( int k=0; k < ngroups; ++k )
+	    m_replica[k] = (T *)alloc_on_node( bytes(), k );
+    }
+    node_replicas( const node_replicas & ) = delete;
+    ~node_replicas() {
+	for( T * r : m_replica )
+	    numa::free( r, bytes() );
+	numa::free( m_ref, bytes() );
+    }
+
+    // False if any of the copies could not be allocated
+    bool valid() const {
+	return m_ref && std::find( m_replica.begin(), m_replica.end(),
+				   nullptr ) == m_replica.end();
+    }
+
+    size_t size() const { return m_size; }
+    int num_replicas() const { return m_replica.size(); }
+
+    T * replica( int k ) { return m_replica[k]; }
+    T * reference() { return m_ref; }
+
+    // Set all copies to the values in src
+    void assign( const T * src ) {
+	std::copy( src, src+m_size, m_ref );
+	for( T * r : m_replica )
+	    std::copy( src, src+m_size, r );
+    }
+
+    void merge() {
+	const size_t block = 4096;
+	size_t nblocks = ( m_size + block - 1 ) / block;
+	size_t nrep = m_replica.size();
+	par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	    size_t e = std::min( m_size, (b+1) * block );
+	    for( size_t i=b*block; i < e; ++i ) {
+		T r = m_ref[i];
+		T s = r;
+		for( size_t k=0; k < nrep; ++k )
+		    s += m_replica[k][i] - r;
+		m_ref[i] = s;
+		for( size_t k=0; k < nrep; ++k )
+		    m_replica[k][i] = s;
+	    }
+	} );
+    }
+
+private:
+    size_t bytes() const { return std::max( size_t(1), m_size ) * sizeof(T); }
+};
+
+} // namespace numa
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_NUMA_H
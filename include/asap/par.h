@@ -0,0 +1,652 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Portable parallel runtime layer.
+ *
+ * The operators express parallelism through asap::par:
+ *  + parallel_for( begin, end, fn [, grainsize] ) calls fn(i) for every
+ *    i in [begin,end), where begin and end are integers or random access
+ *    iterators.
+ *  + task_group spawns closures and waits for them in sync().
+ *  + reducer<Monoid> holds a view per worker that is combined by
+ *    get_value(). A monoid derives from monoid_base<T> and supplies
+ *    static reduce( T * left, T * right ) and optionally identity( T * ).
+ *
+ * One of the following backends is selected at compile time:
+ *  + ASAP_PAR_CILK: Cilk Plus keywords and hyperobjects (default when
+ *    compiling with Cilk Plus enabled).
+ *  + ASAP_PAR_OPENMP: OpenMP tasks (compile with -fopenmp).
+ *  + ASAP_PAR_TBB: Intel Threading Building Blocks (link with -ltbb).
+ *  + ASAP_PAR_WS: a built-in work-stealing scheduler on std::thread
+ *    (default otherwise). The number of workers is taken from
+ *    ASAP_NUM_WORKERS, CILK_NWORKERS or the hardware concurrency.
+ *
+ * Threads that the application creates itself, e.g., with pthreads, are
+ * not workers of the TBB and work-stealing backends and worker_id()
+ * returns no_worker for them. Reducers give every such thread a view of
+ * its own. With ASAP_PAR_WS, their parallel loops and task groups execute
+ * serially. OpenMP cannot distinguish them from the initial thread outside
+ * of parallel regions.
+ *
+ * Except with Cilk, views are merged in worker order rather than in the
+ * serial order of the program. Monoids must therefore be commutative,
+ * which all reducers in this library are. Which iterations contribute to
+ * which view depends on the schedule, such that results are reproducible
+ * between runs only up to commutativity: floating-point sums may differ in
+ * the last bits (e.g., K-means centres and hence the number of iterations
+ * of tfidf_kmeans) and containers that are ordered by insertion, such as
+ * hash tables, may enumerate their contents in another order (e.g., the
+ * word IDs of the TF/IDF operators when the vocabulary is not sorted).
+ * Runs with a single worker are reproducible. The tests in src/Makefile
+ * compare outputs irrespective of such order (utils/compareOutput.py).
+ */
+
+#ifndef INCLUDED_ASAP_PAR_H
+#define INCLUDED_ASAP_PAR_H
+
+#if !defined(ASAP_PAR_CILK) && !defined(ASAP_PAR_OPENMP) \
+    && !defined(ASAP_PAR_TBB) && !defined(ASAP_PAR_WS)
+#if defined(__cilk)
+#define ASAP_PAR_CILK 1
+#else
+#define ASAP_PAR_WS 1
+#endif
+#endif
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(ASAP_PAR_CILK)
+#include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+#include <cilk/reducer.h>
+#elif defined(ASAP_PAR_OPENMP)
+#include <omp.h>
+#elif defined(ASAP_PAR_TBB)
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+#include <tbb/task_scheduler_observer.h>
+#elif defined(ASAP_PAR_WS)
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#endif
+
+#if !defined(ASAP_PAR_CILK)
+#include <mutex>
+#include <thread>
+#endif
+
+namespace asap {
+
+namespace par {
+
+template<typename T>
+struct monoid_base {
+    typedef T value_type;
+
+    static void identity( value_type * p ) { new (p) value_type(); }
+    static void destroy( value_type * p ) { p->~value_type(); }
+};
+
+template<typename T>
+struct op_add : monoid_base<T> {
+    static void identity( T * p ) { new (p) T( 0 ); }
+    static void reduce( T * left, T * right ) { *left += *right; }
+};
+
+// Returned by worker_id() for threads that are not workers of the backend
+static const size_t no_worker = ~size_t(0);
+
+namespace internal {
+
+// Grain size for loops where the caller did not specify one, similar
+// to the default of cilk_for.
+inline size_t default_grainsize( size_t n, size_t nworkers ) {
+    size_t g = n / ( 8 * nworkers );
+    return std::max( size_t(1), std::min( size_t(2048), g ) );
+}
+
+} // namespace internal
+
+#if defined(ASAP_PAR_CILK)
+
+inline size_t num_workers() { return __cilkrts_get_nworkers(); }
+inline size_t worker_id() { return __cilkrts_get_worker_number(); }
+
+template<typename IterTy, typename Fn>
+void parallel_for( IterTy begin, IterTy end, Fn && fn, size_t grainsize = 0 ) {
+    size_t n = end - begin;
+    if( grainsize > 0 ) {
+#pragma cilk grainsize = grainsize
+	cilk_for( size_t i=0; i < n; ++i )
+	    fn( begin + i );
+    } else {
+	cilk_for( size_t i=0; i < n; ++i )
+	    fn( begin + i );
+    }
+}
+
+// Spawning within a member function would sync on return. Instead, the
+// closures are collected and executed by a cilk_for at the sync.
+class task_group {
+    std::vector<std::function<void()>> m_tasks;
+
+public:
+    ~task_group() { sync(); }
+
+    template<typename Fn>
+    void spawn( Fn && fn ) { m_tasks.emplace_back( std::forward<Fn>( fn ) ); }
+
+    void sync() {
+	cilk_for( size_t i=0; i < m_tasks.size(); ++i )
+	    m_tasks[i]();
+	m_tasks.clear();
+    }
+};
+
+template<typename Monoid>
+class reducer {
+public:
+    typedef typename Monoid::value_type value_type;
+
+private:
+    struct cilk_monoid : cilk::monoid_base<value_type> {
+	static void reduce( value_type * left, value_type * right ) {
+	    Monoid::reduce( left, right );
+	}
+	static void identity( value_type * p ) { Monoid::identity( p ); }
+    };
+
+    cilk::reducer<cilk_monoid> m_imp;
+
+public:
+    template<typename... Args>
+    reducer( Args &&... args ) : m_imp( std::forward<Args>( args )... ) { }
+
+    value_type & view() { return m_imp.view(); }
+    value_type & operator * () { return view(); }
+    value_type * operator -> () { return &view(); }
+
+    // The leftmost view holds the reduced value after a sync
+    value_type & get_value() { return m_imp.view(); }
+    void set_value( const value_type & v ) { m_imp.set_value( v ); }
+};
+
+#else // not ASAP_PAR_CILK
+
+#if defined(ASAP_PAR_OPENMP)
+
+inline size_t num_workers() { return omp_get_max_threads(); }
+inline size_t worker_id() { return omp_get_thread_num(); }
+
+// Loops are executed as task loops such that nested parallel_for and
+// task_group calls are scheduled by the same team and omp_get_thread_num()
+// uniquely identifies the worker.
+template<typename IterTy, typename Fn>
+void parallel_for( IterTy begin, IterTy end, Fn && fn, size_t grainsize = 0 ) {
+    size_t n = end - begin;
+    if( grainsize == 0 )
+	grainsize = internal::default_grainsize( n, num_workers() );
+    if( omp_in_parallel() ) {
+#pragma omp taskloop grainsize(grainsize)
+	for( size_t i=0; i < n; ++i )
+	    fn( begin + i );
+    } else {
+#pragma omp parallel
+#pragma omp single
+#pragma omp taskloop grainsize(grainsize)
+	for( size_t i=0; i < n; ++i )
+	    fn( begin + i );
+    }
+}
+
+// Closures are collected and executed as a task loop at the sync.
+class task_group {
+    std::vector<std::function<void()>> m_tasks;
+
+public:
+    ~task_group() { sync(); }
+
+    template<typename Fn>
+    void spawn( Fn && fn ) { m_tasks.emplace_back( std::forward<Fn>( fn ) ); }
+
+    void sync() {
+	parallel_for( size_t(0), m_tasks.size(),
+		      [&]( size_t i ) { m_tasks[i](); }, 1 );
+	m_tasks.clear();
+    }
+};
+
+#elif defined(ASAP_PAR_TBB)
+
+namespace internal {
+
+// All parallel work executes in one arena. Threads outside of it report an
+// index in an implicit arena of their own, which is not unique, so an
+// observer records which threads are in the arena.
+inline bool & in_arena() {
+    static thread_local bool in = false;
+    return in;
+}
+
+class arena_observer : public tbb::task_scheduler_observer {
+public:
+    arena_observer( tbb::task_arena & a ) : tbb::task_scheduler_observer( a ) {
+	observe( true );
+    }
+    void on_scheduler_entry( bool ) override { in_arena() = true; }
+    void on_scheduler_exit( bool ) override { in_arena() = false; }
+};
+
+inline tbb::task_arena & arena() {
+    static tbb::task_arena a;
+    static arena_observer obs( a );
+    a.initialize();
+    return a;
+}
+
+} // namespace internal
+
+// The concurrency of the arena may grow while threads wait to execute in
+// it, so the number of views is fixed at the first call. Threads in slots
+// beyond that are not workers either.
+inline size_t num_workers() {
+    static const size_t n = internal::arena().max_concurrency();
+    return n;
+}
+inline size_t worker_id() {
+    if( !internal::in_arena() )
+	return no_worker;
+    int id = tbb::this_task_arena::current_thread_index();
+    return id < 0 || size_t(id) >= num_workers() ? no_worker : id;
+}
+
+template<typename IterTy, typename Fn>
+void parallel_for( IterTy begin, IterTy end, Fn && fn, size_t grainsize = 0 ) {
+    size_t n = end - begin;
+    auto body = [&]( const tbb::blocked_range<size_t> & r ) {
+	for( size_t i=r.begin(); i != r.end(); ++i )
+	    fn( begin + i );
+    };
+    internal::arena().execute( [&]() {
+	if( grainsize > 0 )
+	    tbb::parallel_for( tbb::blocked_range<size_t>( 0, n, grainsize ),
+			       body, tbb::simple_partitioner() );
+	else
+	    tbb::parallel_for( tbb::blocked_range<size_t>( 0, n ), body );
+    } );
+}
+
+class task_group {
+    tbb::task_group m_group;
+
+public:
+    ~task_group() { sync(); }
+
+    // TBB requires a const call operator, which excludes mutable lambdas
+    template<typename Fn>
+    void spawn( Fn && fn ) {
+	std::shared_ptr<typename std::decay<Fn>::type> f
+	    = std::make_shared<typename std::decay<Fn>::type>(
+		std::forward<Fn>( fn ) );
+	internal::arena().execute( [&]() { m_group.run( [f]() { (*f)(); } ); } );
+    }
+
+    void sync() { internal::arena().execute( [&]() { m_group.wait(); } ); }
+};
+
+#elif defined(ASAP_PAR_WS)
+
+namespace internal {
+
+/*
+ * Built-in work-stealing scheduler. Every worker owns a deque of tasks.
+ * The owner pushes and pops at the back, thieves steal from the front,
+ * such that the oldest (and typically largest) tasks are stolen. Workers
+ * that find no work sleep until new tasks are pushed. A thread that waits
+ * for a task group executes tasks in the meantime. The thread that first
+ * uses the scheduler acts as worker 0. Other threads that the scheduler
+ * did not create are not workers; they do not touch the queues.
+ */
+class ws_scheduler {
+public:
+    struct task {
+	std::function<void()> 	  fn;
+	std::atomic<size_t>	* pending;
+    };
+
+private:
+    struct worker_queue {
+	std::mutex	  	  lock;
+	std::deque<task *>	  tasks;
+	char			  pad[64]; // avoid false sharing
+    };
+
+    size_t		  	  m_nworkers;
+    worker_queue		* m_queues;
+    std::vector<std::thread>	  m_threads;
+    std::atomic<size_t>		  m_queued;
+    std::atomic<size_t>		  m_sleepers;
+    std::atomic<bool>		  m_shutdown;
+    std::mutex			  m_sleep_lock;
+    std::condition_variable	  m_wakeup;
+
+    static size_t & my_id() {
+	static thread_local size_t id = no_worker;
+	return id;
+    }
+
+    static size_t configured_workers() {
+	const char * env = getenv( "ASAP_NUM_WORKERS" );
+	if( !env )
+	    env = getenv( "CILK_NWORKERS" );
+	long n = env ? atol( env ) : 0;
+	if( n <= 0 )
+	    n = std::thread::hardware_concurrency();
+	return n <= 0 ? 1 : n;
+    }
+
+    ws_scheduler()
+	: m_nworkers( configured_workers() ), m_queued( 0 ), m_sleepers( 0 ),
+	  m_shutdown( false ) {
+	m_queues = new worker_queue[m_nworkers];
+	my_id() = 0;
+	for( size_t w=1; w < m_nworkers; ++w )
+	    m_threads.emplace_back( [this,w]() { worker_loop( w ); } );
+    }
+
+public:
+    ~ws_scheduler() {
+	m_shutdown = true;
+	{
+	    std::lock_guard<std::mutex> g( m_sleep_lock );
+	    m_wakeup.notify_all();
+	}
+	for( auto & t : m_threads )
+	    t.join();
+	delete[] m_queues;
+    }
+
+    static ws_scheduler & get() {
+	static ws_scheduler sched;
+	return sched;
+    }
+
+    size_t num_workers() const { return m_nworkers; }
+    size_t worker_id() const { return my_id(); }
+
+    void push( task * t ) {
+	assert( my_id() != no_worker );
+	worker_queue & q = m_queues[my_id()];
+	{
+	    std::lock_guard<std::mutex> g( q.lock );
+	    q.tasks.push_back( t );
+	}
+	++m_queued;
+	if( m_sleepers.load() > 0 ) {
+	    std::lock_guard<std::mutex> g( m_sleep_lock );
+	    m_wakeup.notify_one();
+	}
+    }
+
+    // Execute one task: own work first, then steal. Returns false if no
+    // task was found.
+    bool run_one() {
+	size_t self = my_id();
+	assert( self != no_worker );
+	task * t = nullptr;
+	{
+	    worker_queue & q = m_queues[self];
+	    std::lock_guard<std::mutex> g( q.lock );
+	    if( !q.tasks.empty() ) {
+		t = q.tasks.back();
+		q.tasks.pop_back();
+	    }
+	}
+	for( size_t k=1; !t && k < m_nworkers; ++k ) {
+	    worker_queue & q = m_queues[(self + k) % m_nworkers];
+	    std::lock_guard<std::mutex> g( q.lock );
+	    if( !q.tasks.empty() ) {
+		t = q.tasks.front();
+		q.tasks.pop_front();
+	    }
+	}
+	if( !t )
+	    return false;
+
+	--m_queued;
+	t->fn();
+	std::atomic<size_t> * pending = t->pending;
+	delete t;
+	--*pending;
+	return true;
+    }
+
+    // Help executing tasks until all tasks of the group have completed
+    void wait( std::atomic<size_t> & pending ) {
+	while( pending.load() > 0 ) {
+	    if( !run_one() )
+		std::this_thread::yield();
+	}
+    }
+
+private:
+    void worker_loop( size_t w ) {
+	my_id() = w;
+	while( !m_shutdown.load() ) {
+	    if( run_one() )
+		continue;
+	    ++m_sleepers;
+	    {
+		std::unique_lock<std::mutex> g( m_sleep_lock );
+		m_wakeup.wait( g, [this]() {
+			return m_queued.load() > 0 || m_shutdown.load();
+		    } );
+	    }
+	    --m_sleepers;
+	}
+    }
+};
+
+} // namespace internal
+
+inline size_t num_workers() {
+    return internal::ws_scheduler::get().num_workers();
+}
+inline size_t worker_id() {
+    return internal::ws_scheduler::get().worker_id();
+}
+
+class task_group {
+    std::atomic<size_t> m_pending;
+
+public:
+    task_group() : m_pending( 0 ) { }
+    ~task_group() { sync(); }
+
+    // Threads that are not workers execute the closure immediately
+    template<typename Fn>
+    void spawn( Fn && fn ) {
+	if( worker_id() == no_worker ) {
+	    fn();
+	    return;
+	}
+	++m_pending;
+	internal::ws_scheduler::get().push(
+	    new internal::ws_scheduler::task{ std::forward<Fn>( fn ),
+		    &m_pending } );
+    }
+
+    void sync() { internal::ws_scheduler::get().wait( m_pending ); }
+};
+
+namespace internal {
+
+// Recursively split the range, spawning the upper halves
+template<typename IterTy, typename Fn>
+void ws_parallel_for( task_group & tg, IterTy begin, size_t lo, size_t hi,
+		      Fn & fn, size_t grainsize ) {
+    while( hi - lo > grainsize ) {
+	size_t mid = lo + ( hi - lo ) / 2;
+	tg.spawn( [&tg,begin,mid,hi,&fn,grainsize]() {
+		ws_parallel_for( tg, begin, mid, hi, fn, grainsize );
+	    } );
+	hi = mid;
+    }
+    for( size_t i=lo; i < hi; ++i )
+	fn( begin + i );
+}
+
+} // namespace internal
+
+template<typename IterTy, typename Fn>
+void parallel_for( IterTy begin, IterTy end, Fn && fn, size_t grainsize = 0 ) {
+    size_t n = end - begin;
+    if( grainsize == 0 )
+	grainsize = internal::default_grainsize( n, num_workers() );
+    if( n <= grainsize || num_workers() == 1 || worker_id() == no_worker ) {
+	for( size_t i=0; i < n; ++i )
+	    fn( begin + i );
+	return;
+    }
+    task_group tg;
+    internal::ws_parallel_for( tg, begin, 0, n, fn, grainsize );
+    tg.sync();
+}
+
+#endif // backends
+
+// One view per worker. The leftmost view
+// (worker 0) is constructed with the arguments of the reducer; the other
+// views are created from the identity on first use. Threads that are not
+// workers get a view of their own, which is looked up under a lock.
+template<typename Monoid>
+class reducer {
+public:
+    typedef typename Monoid::value_type value_type;
+
+private:
+    struct view_slot {
+	typename std::aligned_storage<sizeof(value_type),
+				      alignof(value_type)>::type m_data;
+	bool m_init;
+	char m_pad[64]; // avoid false sharing
+
+	value_type * ptr() { return reinterpret_cast<value_type *>( &m_data ); }
+    };
+
+    size_t	  m_nviews;
+    view_slot	* m_views;
+    std::mutex	  m_external_lock;
+    std::vector<std::pair<std::thread::id, value_type *>> m_external;
+
+public:
+    template<typename... Args>
+    reducer( Args &&... args ) : m_nviews( num_workers() ) {
+	m_views = new view_slot[m_nviews];
+	for( size_t w=0; w < m_nviews; ++w )
+	    m_views[w].m_init = false;
+	new (m_views[0].ptr()) value_type( std::forward<Args>( args )... );
+	m_views[0].m_init = true;
+    }
+    ~reducer() {
+	for( size_t w=0; w < m_nviews; ++w )
+	    if( m_views[w].m_init )
+		Monoid::destroy( m_views[w].ptr() );
+	delete[] m_views;
+	for( auto & e : m_external ) {
+	    Monoid::destroy( e.second );
+	    ::operator delete( e.second );
+	}
+    }
+
+    reducer( const reducer & ) = delete;
+    reducer & operator = ( const reducer & ) = delete;
+
+    value_type & view() {
+	size_t w = worker_id();
+	if( w == no_worker )
+	    return external_view();
+	view_slot & s = m_views[w];
+	if( !s.m_init ) {
+	    Monoid::identity( s.ptr() );
+	    s.m_init = true;
+	}
+	return *s.ptr();
+    }
+    value_type & operator * () { return view(); }
+    value_type * operator -> () { return &view(); }
+
+    // Merge all views into the leftmost view. Call only outside of
+    // parallel regions. Views are merged in increasing worker order, then
+    // the views of other threads, but the contents of each view depend on
+    // the schedule (see above).
+    value_type & get_value() {
+	for( size_t w=1; w < m_nviews; ++w ) {
+	    if( m_views[w].m_init ) {
+		Monoid::reduce( m_views[0].ptr(), m_views[w].ptr() );
+		Monoid::destroy( m_views[w].ptr() );
+		m_views[w].m_init = false;
+	    }
+	}
+	std::lock_guard<std::mutex> g( m_external_lock );
+	for( auto & e : m_external ) {
+	    Monoid::reduce( m_views[0].ptr(), e.second );
+	    Monoid::destroy( e.second );
+	    ::operator delete( e.second );
+	}
+	m_external.clear();
+	return *m_views[0].ptr();
+    }
+    void set_value( const value_type & v ) { get_value() = v; }
+
+private:
+    value_type & external_view() {
+	std::thread::id self = std::this_thread::get_id();
+	std::lock_guard<std::mutex> g( m_external_lock );
+	for( auto & e : m_external )
+	    if( e.first == self )
+		return *e.second;
+	value_type * p
+	    = static_cast<value_type *>( ::operator new( sizeof(value_type) ) );
+	Monoid::identity( p );
+	m_external.push_back( std::make_pair( self, p ) );
+	return *p;
+    }
+};
+
+#endif // ASAP_PAR_CILK
+
+} // namespace par
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_PAR_H
@@ -0,0 +1,246 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef INCLUDED_ASAP_PERFECT_HASH_H
+#define INCLUDED_ASAP_PERFECT_HASH_H
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "asap/par.h"
+
+namespace asap {
+
+namespace internal {
+
+// Derive the hash for a level from the key's hash (MurmurHash3 finalizer)
+inline uint64_t mph_level_hash( uint64_t h, uint64_t level ) {
+    h ^= ( level + 1 ) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline unsigned popcount64( uint64_t w ) {
+    return __builtin_popcountll( w );
+}
+
+} // namespace internal
+
+/*
+ * perfect_hash_index: a minimal perfect hash over the keys of a frozen,
+ *                     random-access word container (BBHash, Limasset et
+ *                     al., SEA 2017).
+ *
+ * Every level has a bit array of gamma bits per remaining key. Keys that
+ * hash to a bit on their own set it; the others move to the next level.
+ * The rank of a key's bit is its slot, which records the position of the
+ * key in the container. Ranks are stored in the first word of every cache
+ * line of the bit array, such that the bit test and rank calculation
+ * touch one cache line. Keys left after max_levels are kept in a small
+ * hash table.
+ *
+ * find() verifies the key found in the container, such that lookup of
+ * words not in the container returns cend(). The container must not be
+ * modified or moved while the index is in use.
+ */
+template<typename Container, typename Hash, typename KeyEqual>
+class perfect_hash_index {
+public:
+    typedef typename Container::value_type		value_type;
+    typedef typename value_type::first_type		key_type;
+    typedef typename Container::const_iterator		const_iterator;
+
+    static const size_t gamma = 2;
+    static const size_t max_levels = 24;
+    static const size_t npos = ~size_t(0);
+
+private:
+    // Each block of 8 words holds the rank up to the block and 7 words of
+    // bits.
+    static const size_t block_words = 8;
+    static const size_t block_bits = ( block_words - 1 ) * 64;
+
+    const Container *				m_container;
+    std::vector<uint64_t>			m_blocks;
+    std::vector<size_t>				m_level_offset; // in bits
+    std::vector<size_t>				m_level_size;
+    std::vector<size_t>				m_slot;	// rank -> position
+    std::unordered_map<key_type, size_t, Hash, KeyEqual> m_fallback;
+
+public:
+    perfect_hash_index( const Container & c ) : m_container( &c ) {
+	build();
+    }
+
+    size_t size() const { return m_container->size(); }
+    size_t num_levels() const { return m_level_size.size(); }
+
+    // Memory used by the index, excluding the container
+    size_t memory_size() const {
+	return m_blocks.size() * sizeof(uint64_t)
+	    + m_slot.size() * sizeof(size_t);
+    }
+
+    // The position of key in the container, or npos
+    size_t index_of( const key_type & key ) const {
+	uint64_t h = Hash()( key );
+	for( size_t l=0; l < m_level_size.size(); ++l ) {
+	    size_t b = m_level_offset[l]
+		+ internal::mph_level_hash( h, l ) % m_level_size[l];
+	    size_t r;
+	    if( test_and_rank( b, r ) ) {
+		size_t pos = m_slot[r];
+		return KeyEqual()( (*m_container)[pos].first, key ) ? pos : npos;
+	    }
+	}
+	auto F = m_fallback.find( key );
+	return F == m_fallback.end() ? npos : F->second;
+    }
+
+    const_iterator find( const key_type & key ) const {
+	size_t pos = index_of( key );
+	return pos == npos ? cend() : std::next( m_container->cbegin(), pos );
+    }
+
+    const_iterator cbegin() const { return m_container->cbegin(); }
+    const_iterator cend() const { return m_container->cend(); }
+
+private:
+    bool test_and_rank( size_t b, size_t & r ) const {
+	const uint64_t * blk = &m_blocks[( b / block_bits ) * block_words];
+	size_t i = b % block_bits;
+	size_t w = i / 64;
+	uint64_t bit = uint64_t(1) << ( i % 64 );
+	if( !( blk[w+1] & bit ) )
+	    return false;
+	r = blk[0];
+	for( size_t j=0; j < w; ++j )
+	    r += internal::popcount64( blk[j+1] );
+	r += internal::popcount64( blk[w+1] & ( bit - 1 ) );
+	return true;
+    }
+
+    void build() {
+	size_t n = m_container->size();
+	const_iterator I = m_container->cbegin();
+
+	std::vector<uint64_t> hash( n );
+	std::vector<unsigned char> level( n, (unsigned char)max_levels );
+	par::parallel_for( size_t(0), n, [&]( size_t p ) {
+	    hash[p] = Hash()( I[p].first );
+	} );
+
+	std::vector<size_t> remaining( n );
+	for( size_t p=0; p < n; ++p )
+	    remaining[p] = p;
+
+	// Determine the level of every key and the bits it sets
+	std::vector<std::vector<uint64_t>> bits;
+	size_t offset = 0;
+	for( size_t l=0; l < max_levels && !remaining.empty(); ++l ) {
+	    size_t m = ( ( gamma * remaining.size() + 63 ) / 64 ) * 64;
+	    size_t nwords = m / 64;
+	    std::unique_ptr<std::atomic<uint64_t>[]> seen(
+		new std::atomic<uint64_t>[nwords] );
+	    std::unique_ptr<std::atomic<uint64_t>[]> coll(
+		new std::atomic<uint64_t>[nwords] );
+	    for( size_t w=0; w < nwords; ++w ) {
+		seen[w].store( 0, std::memory_order_relaxed );
+		coll[w].store( 0, std::memory_order_relaxed );
+	    }
+
+	    par::parallel_for( size_t(0), remaining.size(), [&]( size_t k ) {
+		size_t b = internal::mph_level_hash( hash[remaining[k]], l ) % m;
+		uint64_t bit = uint64_t(1) << ( b % 64 );
+		if( seen[b/64].fetch_or( bit, std::memory_order_relaxed ) & bit )
+		    coll[b/64].fetch_or( bit, std::memory_order_relaxed );
+	    } );
+
+	    bits.emplace_back( nwords );
+	    std::vector<uint64_t> & lbits = bits.back();
+	    par::parallel_for( size_t(0), nwords, [&]( size_t w ) {
+		lbits[w] = seen[w].load( std::memory_order_relaxed )
+		    & ~coll[w].load( std::memory_order_relaxed );
+	    } );
+
+	    size_t nrem = 0;
+	    for( size_t k=0; k < remaining.size(); ++k ) {
+		size_t p = remaining[k];
+		size_t b = internal::mph_level_hash( hash[p], l ) % m;
+		if( lbits[b/64] & ( uint64_t(1) << ( b % 64 ) ) )
+		    level[p] = l;
+		else
+		    remaining[nrem++] = p;
+	    }
+	    remaining.resize( nrem );
+
+	    m_level_offset.push_back( offset );
+	    m_level_size.push_back( m );
+	    offset += m;
+	}
+
+	// Lay out the levels consecutively, interleaved with ranks. Level
+	// sizes are multiples of 64 bits, so words map onto words.
+	size_t nblocks = ( offset + block_bits - 1 ) / block_bits;
+	m_blocks.assign( nblocks * block_words, 0 );
+	for( size_t l=0; l < bits.size(); ++l ) {
+	    size_t base = m_level_offset[l] / 64;
+	    for( size_t w=0; w < bits[l].size(); ++w ) {
+		size_t g = base + w;
+		m_blocks[( g / (block_words-1) ) * block_words
+			 + g % (block_words-1) + 1] = bits[l][w];
+	    }
+	}
+	size_t rank = 0;
+	for( size_t k=0; k < nblocks; ++k ) {
+	    m_blocks[k * block_words] = rank;
+	    for( size_t j=1; j < block_words; ++j )
+		rank += internal::popcount64( m_blocks[k * block_words + j] );
+	}
+
+	// Record the position of every key in its slot
+	m_slot.resize( rank );
+	par::parallel_for( size_t(0), n, [&]( size_t p ) {
+	    size_t l = level[p];
+	    if( l < max_levels ) {
+		size_t b = m_level_offset[l]
+		    + internal::mph_level_hash( hash[p], l ) % m_level_size[l];
+		size_t r = 0;
+		test_and_rank( b, r );
+		m_slot[r] = p;
+	    }
+	} );
+
+	for( size_t k=0; k < remaining.size(); ++k )
+	    m_fallback[I[remaining[k]].first] = remaining[k];
+    }
+};
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_PERFECT_HASH_H
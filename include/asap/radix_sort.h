@@ -0,0 +1,291 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef INCLUDED_ASAP_RADIX_SORT_H
+#define INCLUDED_ASAP_RADIX_SORT_H
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "asap/par.h"
+
+namespace asap {
+
+// Sorting engines that can be selected for sorting word lists.
+enum sort_engine_t {
+    se_comparison,	// std::sort with strcmp
+    se_radix,		// MSD radix sort
+    se_parallel_radix	// MSD radix sort, buckets sorted in parallel
+};
+
+namespace internal {
+
+// Below these sizes, sorting falls back to simpler algorithms
+static const size_t radix_sort_cutoff = 64;
+static const size_t string_radix_sort_cutoff = 32;
+static const size_t parallel_radix_sort_cutoff = size_t(1) << 16;
+
+/*
+ * LSD radix sort of a sparse vector, i.e., of parallel arrays of values and
+ * indices, by index. One byte is sorted per pass. The histograms of all
+ * passes are collected in a single scan. Passes where all indices have
+ * the same digit are skipped, which includes the high-order bytes of
+ * indices that are small relative to the index type.
+ */
+template<typename IndexTy, typename ValueTy>
+void radix_sort_by_index( ValueTy * v, IndexTy * c, size_t n ) {
+    typedef typename std::make_unsigned<IndexTy>::type key_type;
+    static const unsigned npasses = sizeof(key_type);
+
+    if( n < 2 )
+	return;
+
+    size_t hist[npasses][256];
+    std::fill( &hist[0][0], &hist[0][0] + npasses * 256, size_t(0) );
+    for( size_t i=0; i < n; ++i ) {
+	key_type k = c[i];
+	for( unsigned p=0; p < npasses; ++p )
+	    ++hist[p][(k >> (8*p)) & 255];
+    }
+
+    ValueTy * tv = new ValueTy[n];
+    IndexTy * tc = new IndexTy[n];
+    ValueTy * sv = v, * dv = tv;
+    IndexTy * sc = c, * dc = tc;
+
+    for( unsigned p=0; p < npasses; ++p ) {
+	size_t * h = hist[p];
+	unsigned shift = 8*p;
+	if( h[(key_type(sc[0]) >> shift) & 255] == n )
+	    continue;
+
+	size_t sum = 0;
+	for( unsigned d=0; d < 256; ++d ) {
+	    size_t cnt = h[d];
+	    h[d] = sum;
+	    sum += cnt;
+	}
+	for( size_t i=0; i < n; ++i ) {
+	    size_t pos = h[(key_type(sc[i]) >> shift) & 255]++;
+	    dv[pos] = sv[i];
+	    dc[pos] = sc[i];
+	}
+	std::swap( sv, dv );
+	std::swap( sc, dc );
+    }
+
+    if( sv != v ) {
+	std::copy( &sv[0], &sv[n], v );
+	std::copy( &sc[0], &sc[n], c );
+    }
+
+    delete[] tv;
+    delete[] tc;
+}
+
+/*
+ * Parallel LSD radix sort of a sparse vector. Each pass splits the data
+ * in blocks, one per worker, and builds a histogram per block. The
+ * histograms are prefix-summed in (digit, block) order such that each
+ * block scatters its elements to private positions, retaining stability.
+ */
+template<typename IndexTy, typename ValueTy>
+void parallel_radix_sort_by_index( ValueTy * v, IndexTy * c, size_t n ) {
+    typedef typename std::make_unsigned<IndexTy>::type key_type;
+    static const unsigned npasses = sizeof(key_type);
+
+    if( n < parallel_radix_sort_cutoff ) {
+	radix_sort_by_index( v, c, n );
+	return;
+    }
+
+    // Determine the number of significant bytes
+    key_type kmax = 0;
+    for( size_t i=0; i < n; ++i )
+	kmax |= key_type(c[i]);
+
+    size_t nblocks = par::num_workers();
+    size_t block = ( n + nblocks - 1 ) / nblocks;
+    std::vector<size_t> hist( nblocks * 256 );
+
+    ValueTy * tv = new ValueTy[n];
+    IndexTy * tc = new IndexTy[n];
+    ValueTy * sv = v, * dv = tv;
+    IndexTy * sc = c, * dc = tc;
+
+    for( unsigned p=0; p < npasses && ( kmax >> (8*p) ) != 0; ++p ) {
+	unsigned shift = 8*p;
+	std::fill( hist.begin(), hist.end(), size_t(0) );
+
+	par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	    size_t * h = &hist[b * 256];
+	    size_t e = std::min( n, (b+1) * block );
+	    for( size_t i=b*block; i < e; ++i )
+		++h[(key_type(sc[i]) >> shift) & 255];
+	} );
+
+	size_t sum = 0;
+	for( unsigned d=0; d < 256; ++d ) {
+	    for( size_t b=0; b < nblocks; ++b ) {
+		size_t cnt = hist[b * 256 + d];
+		hist[b * 256 + d] = sum;
+		sum += cnt;
+	    }
+	}
+
+	par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	    size_t * h = &hist[b * 256];
+	    size_t e = std::min( n, (b+1) * block );
+	    for( size_t i=b*block; i < e; ++i ) {
+		size_t pos = h[(key_type(sc[i]) >> shift) & 255]++;
+		dv[pos] = sv[i];
+		dc[pos] = sc[i];
+	    }
+	} );
+	std::swap( sv, dv );
+	std::swap( sc, dc );
+    }
+
+    if( sv != v ) {
+	std::copy( &sv[0], &sv[n], v );
+	std::copy( &sc[0], &sc[n], c );
+    }
+
+    delete[] tv;
+    delete[] tc;
+}
+
+// Retrieve the string to sort on from a word list element: either the
+// element itself or the key of a key-value pair.
+inline const char * sort_key( const char * w ) { return w; }
+
+template<typename PairTy>
+const char * sort_key( const PairTy & kv ) { return kv.first; }
+
+/*
+ * MSD radix sort of strings. The range [I,E) is distributed over 256
+ * buckets on the byte at position depth. Strings that end at this depth
+ * are equal and remain in bucket 0; the other buckets are sorted
+ * recursively on the next byte. The digits are extracted once per level
+ * into digit[], the elements are distributed via tmp[]. Both scratch
+ * arrays have the size of the range.
+ */
+template<typename RandomIt, typename ValueTy>
+void msd_radix_sort( RandomIt I, RandomIt E, size_t depth,
+		     ValueTy * tmp, unsigned char * digit, bool parallel ) {
+    size_t n = std::distance( I, E );
+
+    if( n < string_radix_sort_cutoff ) {
+	// Insertion sort. All strings share their first depth bytes.
+	for( RandomIt J=std::next(I); J < E; ++J ) {
+	    ValueTy val = std::move( *J );
+	    const char * key = sort_key( val ) + depth;
+	    RandomIt K = J;
+	    for( ; K > I && strcmp( key, sort_key( *std::prev(K) ) + depth ) < 0;
+		 --K )
+		*K = std::move( *std::prev(K) );
+	    *K = std::move( val );
+	}
+	return;
+    }
+
+    size_t count[257];
+    std::fill( &count[0], &count[257], size_t(0) );
+    for( size_t i=0; i < n; ++i ) {
+	unsigned char d = sort_key( I[i] )[depth];
+	digit[i] = d;
+	++count[d+1];
+    }
+    for( unsigned d=0; d < 256; ++d )
+	count[d+1] += count[d];
+
+    // All strings share the same digit: skip the scatter
+    unsigned char d0 = digit[0];
+    if( count[d0+1] - count[d0] == n ) {
+	if( d0 != 0 )
+	    msd_radix_sort( I, E, depth+1, tmp, digit, parallel );
+	return;
+    }
+
+    size_t pos[256];
+    std::copy( &count[0], &count[256], &pos[0] );
+    for( size_t i=0; i < n; ++i )
+	tmp[pos[digit[i]]++] = std::move( I[i] );
+    std::move( &tmp[0], &tmp[n], I );
+
+    if( parallel && n >= parallel_radix_sort_cutoff ) {
+	par::parallel_for( unsigned(1), unsigned(256), [&]( unsigned d ) {
+	    if( count[d+1] - count[d] > 1 )
+		msd_radix_sort( I + count[d], I + count[d+1], depth+1,
+				tmp + count[d], digit + count[d], parallel );
+	} );
+    } else {
+	for( unsigned d=1; d < 256; ++d ) {
+	    if( count[d+1] - count[d] > 1 )
+		msd_radix_sort( I + count[d], I + count[d+1], depth+1,
+				tmp + count[d], digit + count[d], false );
+	}
+    }
+}
+
+template<typename RandomIt>
+void msd_radix_sort( RandomIt I, RandomIt E, bool parallel ) {
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    size_t n = std::distance( I, E );
+    if( n < 2 )
+	return;
+
+    value_type * tmp = new value_type[n];
+    unsigned char * digit = new unsigned char[n];
+    msd_radix_sort( I, E, 0, tmp, digit, parallel );
+    delete[] digit;
+    delete[] tmp;
+}
+
+} // namespace internal
+
+// Sort a range of words, or of key-value pairs keyed by words, using the
+// selected engine.
+template<typename RandomIt>
+void sort_words( RandomIt I, RandomIt E, sort_engine_t engine ) {
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    switch( engine ) {
+    case se_comparison:
+	std::sort( I, E, []( const value_type & l, const value_type & r ) {
+		return strcmp( internal::sort_key( l ),
+			       internal::sort_key( r ) ) < 0;
+	    } );
+	break;
+    case se_radix:
+	internal::msd_radix_sort( I, E, false );
+	break;
+    case se_parallel_radix:
+	internal::msd_radix_sort( I, E, true );
+	break;
+    }
+}
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_RADIX_SORT_H
@@ -0,0 +1,316 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Sociometer calling profiles and archetypes.
+ *
+ * A profile record is a line <region>,<user_id>,<profile> where the profile
+ * holds the number of calls of the user in each of 24 time slots. The slot
+ * of a call is <week> * 6 + <is_weekend> * 3 + <timeslot>, over a period of
+ * four weeks. Records may also be written as Python tuples, as produced by
+ * the user profiling job, e.g.:
+ *     ('roma', u'185766346481786976', [0, 0, 0.2, 0, ...])
+ *
+ * An archetype is a line <id>;<name>;<24 values> describing a typical
+ * calling behaviour. Clusters of profiles are labelled with the name of the
+ * nearest archetype.
+ */
+
+#ifndef INCLUDED_ASAP_SOCIOMETER_H
+#define INCLUDED_ASAP_SOCIOMETER_H
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asap/par.h"
+#include "asap/utils.h"
+#include "asap/word_bank.h"
+#include "asap/data_set.h"
+
+namespace asap {
+
+namespace sociometer {
+
+static const size_t num_slots = 24;
+
+// Names of the profile slots: week, weekday (wd) or weekend (we), timeslot
+inline const char * slot_name( size_t i ) {
+    static const char * const names[num_slots] = {
+	"w0_wd_0", "w0_wd_1", "w0_wd_2", "w0_we_0", "w0_we_1", "w0_we_2",
+	"w1_wd_0", "w1_wd_1", "w1_wd_2", "w1_we_0", "w1_we_1", "w1_we_2",
+	"w2_wd_0", "w2_wd_1", "w2_wd_2", "w2_we_0", "w2_we_1", "w2_we_2",
+	"w3_wd_0", "w3_wd_1", "w3_wd_2", "w3_we_0", "w3_we_1", "w3_we_2"
+    };
+    return names[i];
+}
+
+namespace internal {
+
+// Lines that hold a record: not blank and not a comment
+inline bool is_record( const char * p, const char * eol ) {
+    while( p != eol && std::isspace( *p ) )
+	++p;
+    return p != eol && *p != '%' && *p != '#';
+}
+
+inline char * end_of_line( char * p, char * end ) {
+    char * eol = (char *)memchr( p, '\n', end - p );
+    return eol ? eol : end;
+}
+
+// Isolate a comma-separated field, optionally quoted as a Python (unicode)
+// string. The field is '\0'-terminated in place.
+inline const char * parse_field( char * & p, char * eol ) {
+    while( p != eol && ( std::isspace( *p ) || *p == '(' ) )
+	++p;
+    if( p != eol && *p == 'u' && p+1 != eol && ( p[1] == '\'' || p[1] == '"' ) )
+	++p;
+    char * start;
+    if( p != eol && ( *p == '\'' || *p == '"' ) ) {
+	char q = *p++;
+	start = p;
+	while( p != eol && *p != q )
+	    ++p;
+	if( p == eol )
+	    return nullptr;
+	*p++ = '\0';
+	while( p != eol && *p != ',' )
+	    ++p;
+    } else {
+	start = p;
+	while( p != eol && *p != ',' )
+	    ++p;
+	char * e = p;
+	while( e != start && std::isspace( e[-1] ) )
+	    --e;
+	if( p == eol )
+	    return nullptr;
+	*e = '\0';
+    }
+    if( p == eol )
+	return nullptr;
+    ++p; // skip comma
+    return start;
+}
+
+// Parse num_slots values separated by commas and/or spaces, optionally
+// enclosed in brackets. Returns false if the line holds fewer values.
+template<typename ValueTy>
+bool parse_values( char * p, char * eol, ValueTy * v, size_t n ) {
+    for( size_t i=0; i < n; ++i ) {
+	while( p != eol
+	       && ( std::isspace( *p ) || *p == ',' || *p == ';'
+		    || *p == '[' ) )
+	    ++p;
+	if( p == eol || *p == ']' || *p == ')' )
+	    return false;
+	char * q;
+	v[i] = ValueTy( std::strtod( p, &q ) );
+	if( q == p )
+	    return false;
+	p = q;
+    }
+    return true;
+}
+
+// Split [buf,end) into chunks ending on line boundaries
+inline std::vector<char *> split_lines( char * buf, char * end ) {
+    const size_t min_chunk = size_t(1) << 16;
+    size_t size = end - buf;
+    size_t nchunks = std::max( size_t(1),
+			       std::min( size / min_chunk,
+					 size_t(4*par::num_workers()) ) );
+    std::vector<char *> bounds( 1, buf );
+    for( size_t i=1; i < nchunks; ++i ) {
+	char * p = std::max( bounds.back(), buf + i * ( size / nchunks ) );
+	p = end_of_line( p, end );
+	if( p != end )
+	    ++p;
+	bounds.push_back( p );
+    }
+    bounds.push_back( end );
+    return bounds;
+}
+
+} // namespace internal
+
+/*
+ * Read profile records from a file. The file is split into chunks of lines
+ * that are parsed in parallel: a first pass counts the records of each
+ * chunk such that every chunk writes its vectors and names in place on the
+ * second pass. User and region names point into the file contents, which
+ * are owned by the user list.
+ *
+ * DataSetTy is a data set of dense vectors without ownership, with the user
+ * identifiers as second list of names. The region of every record is
+ * stored in regions, e.g., a std::vector<const char *>.
+ */
+template<typename DataSetTy, typename RegionListTy>
+DataSetTy profile_read( const std::string & filename, RegionListTy & regions ) {
+    typedef typename DataSetTy::index_list_type index_list_type;
+    typedef typename DataSetTy::index_list_type2 user_list_type;
+    typedef typename DataSetTy::vector_list_type vector_list_type;
+
+    file_buffer file;
+    asap::internal::read_file( filename.c_str(), file );
+    char * buf = file.data.get();
+    char * end = buf + file.size;
+
+    std::vector<char *> bounds = internal::split_lines( buf, end );
+    size_t nchunks = bounds.size() - 1;
+
+    // Count the records in every chunk
+    std::vector<size_t> offset( nchunks+1, 0 );
+    par::parallel_for( size_t(0), nchunks, [&]( size_t c ) {
+	size_t n = 0;
+	for( char * p=bounds[c]; p != bounds[c+1]; ) {
+	    char * eol = internal::end_of_line( p, bounds[c+1] );
+	    if( internal::is_record( p, eol ) )
+		++n;
+	    p = eol == bounds[c+1] ? eol : eol+1;
+	}
+	offset[c+1] = n;
+    } );
+    for( size_t c=0; c < nchunks; ++c )
+	offset[c+1] += offset[c];
+    size_t num_points = offset[nchunks];
+
+    std::shared_ptr<index_list_type> slots
+	= std::make_shared<index_list_type>();
+    for( size_t i=0; i < num_slots; ++i )
+	slots->index_only( slot_name( i ) );
+
+    std::shared_ptr<user_list_type> users
+	= std::make_shared<user_list_type>();
+    users->enregister( file.data );
+    users->resize( num_points );
+    regions.resize( num_points );
+
+    std::shared_ptr<vector_list_type> vectors
+	= std::make_shared<vector_list_type>( num_points, num_slots );
+
+    // Parse the records
+    par::parallel_for( size_t(0), nchunks, [&]( size_t c ) {
+	size_t r = offset[c];
+	for( char * p=bounds[c]; p != bounds[c+1]; ) {
+	    char * eol = internal::end_of_line( p, bounds[c+1] );
+	    char * next = eol == bounds[c+1] ? eol : eol+1;
+	    if( internal::is_record( p, eol ) ) {
+		const char * region = internal::parse_field( p, eol );
+		const char * user
+		    = region ? internal::parse_field( p, eol ) : nullptr;
+		if( !user )
+		    fatal( "Malformed profile record in '", filename,
+			   "' at offset ", p - buf );
+		if( !internal::parse_values( p, eol, &(*vectors)[r][0],
+					     num_slots ) )
+		    fatal( "Profile of user '", user, "' in '", filename,
+			   "' holds fewer than ", num_slots, " values" );
+		regions[r] = region;
+		users->begin()[r] = user;
+		++r;
+	    }
+	    p = next;
+	}
+    } );
+
+    return DataSetTy( "profiles", slots, users, vectors );
+}
+
+/*
+ * A list of archetypes, read from a file with lines <id>;<name>;<values>.
+ * Blank lines and lines starting with '%' or '#' are ignored.
+ */
+template<typename ValueTy>
+class archetype_set {
+public:
+    typedef ValueTy value_type;
+
+private:
+    std::vector<std::string>	m_names;
+    std::vector<value_type>	m_profiles;
+
+public:
+    archetype_set( const std::string & filename ) {
+	std::ifstream is( filename );
+	if( !is )
+	    fatale( "open", filename.c_str() );
+	std::string line;
+	size_t lineno = 0;
+	while( std::getline( is, line ) ) {
+	    ++lineno;
+	    char * p = &line[0];
+	    char * eol = p + line.size();
+	    if( !internal::is_record( p, eol ) )
+		continue;
+	    char * name = (char *)memchr( p, ';', eol - p );
+	    char * values = name ? (char *)memchr( name+1, ';', eol-name-1 )
+		: nullptr;
+	    if( !values )
+		fatal( "Malformed archetype in '", filename, "' line ", lineno );
+	    size_t pos = m_profiles.size();
+	    m_profiles.resize( pos + num_slots );
+	    if( !internal::parse_values( values+1, eol, &m_profiles[pos],
+					 num_slots ) )
+		fatal( "Archetype in '", filename, "' line ", lineno,
+		       " holds fewer than ", num_slots, " values" );
+	    m_names.emplace_back( name+1, values );
+	}
+	if( m_names.empty() )
+	    fatal( "No archetypes in '", filename, "'" );
+    }
+
+    size_t size() const { return m_names.size(); }
+    const std::string & name( size_t a ) const { return m_names[a]; }
+    const value_type * profile( size_t a ) const {
+	return &m_profiles[a*num_slots];
+    }
+
+    // The archetype at the smallest euclidean distance of the profile p.
+    // Ties are resolved in favour of the archetype listed first.
+    template<typename VectorTy>
+    size_t nearest( const VectorTy & p ) const {
+	size_t best = 0;
+	value_type best_dist = std::numeric_limits<value_type>::max();
+	for( size_t a=0; a < size(); ++a ) {
+	    const value_type * q = profile( a );
+	    value_type d = 0;
+	    for( size_t i=0; i < num_slots; ++i ) {
+		value_type diff = p[i] - q[i];
+		d += diff * diff;
+	    }
+	    if( d < best_dist ) {
+		best_dist = d;
+		best = a;
+	    }
+	}
+	return best;
+    }
+};
+
+} // namespace sociometer
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_SOCIOMETER_H
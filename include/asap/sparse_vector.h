@@ -24,9 +24,15 @@
 #include <memory>
 #include <type_traits>
 #include <limits>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <vector>
 
+#include "asap/par.h"
 #include "asap/traits.h"
 #include "asap/vector_ops.h"
+#include "asap/radix_sort.h"
 
 namespace asap {
 
@@ -197,10 +203,17 @@ public:
     }
     
     void sort_by_index() {
-	internal::sparse_vector_sorter<index_type,value_type>
-	    sorter( m_value, m_coord, m_nonzeros );
-	std::sort( sorter.begin(), sorter.end(), sorter.cmp() );
-	sorter.apply();
+	if( m_nonzeros >= internal::parallel_radix_sort_cutoff )
+	    internal::parallel_radix_sort_by_index( m_value, m_coord,
+						    m_nonzeros );
+	else if( m_nonzeros >= internal::radix_sort_cutoff )
+	    internal::radix_sort_by_index( m_value, m_coord, m_nonzeros );
+	else {
+	    internal::sparse_vector_sorter<index_type,value_type>
+		sorter( m_value, m_coord, m_nonzeros );
+	    std::sort( sorter.begin(), sorter.end(), sorter.cmp() );
+	    sorter.apply();
+	}
     }
 
 #if 0
@@ -222,7 +235,34 @@ public:
 	std::fill( &m_value[0], &m_value[m_nonzeros], value_type(0) );
     }
     void clear_attributes() { }
-    
+
+    // Inner product with a dense vector
+    template<typename VectorTy>
+    typename std::enable_if<is_dense_vector<VectorTy>::value, value_type>::type
+    dot( VectorTy const &p ) const {
+	return mix_vector_ops::dot(
+	    m_value, m_coord, m_nonzeros, p.get_value(), p.length() );
+    }
+    // Inner product with a sparse vector. Both vectors must be sorted by index.
+    template<typename VectorTy>
+    typename std::enable_if<is_sparse_vector<VectorTy>::value, value_type>::type
+    dot( VectorTy const &p ) const {
+	return vector_ops::dot( m_value, m_coord, m_nonzeros,
+				p.get_value(), p.get_coord(), p.nonzeros() );
+    }
+
+    value_type sq_norm() const {
+	return vector_ops::square_norm( m_value, m_nonzeros );
+    }
+
+    // Cosine similarity with a sparse vector; 0 if either vector is zero.
+    template<typename VectorTy>
+    typename std::enable_if<is_sparse_vector<VectorTy>::value, value_type>::type
+    cosine( VectorTy const &p ) const {
+	value_type n = sq_norm() * p.sq_norm();
+	return n > value_type(0) ? dot( p ) / std::sqrt( n ) : value_type(0);
+    }
+
     // Square of Euclidean distance
     template<typename VectorTy>
     typename std::enable_if<is_dense_vector<VectorTy>::value && !is_vector_with_sqnorm_cache<VectorTy>::value, value_type>::type
@@ -246,6 +286,15 @@ public:
 	    m_value, m_coord, m_nonzeros, p.get_value(), p.length() );
 */
     }
+    // Square of Euclidean distance to a sparse vector, in a single merge
+    // over both vectors. Both vectors must be sorted by index.
+    template<typename VectorTy>
+    typename std::enable_if<is_sparse_vector<VectorTy>::value, value_type>::type
+    sq_dist( VectorTy const &p ) const {
+	return vector_ops::square_euclidean_distance(
+	    m_value, m_coord, m_nonzeros,
+	    p.get_value(), p.get_coord(), p.nonzeros() );
+    }
 };
 
 // A sparse vector set with memory allocation optimized such that memory
@@ -333,7 +382,8 @@ public:
 	  m_length(dvs.m_length), m_total_length(dvs.m_total_length) {
 	std::cerr << "SVS move construct\n";
 	dvs.m_vectors = 0;
-	dvs.m_alloc = 0;
+	dvs.m_alloc_v = 0;
+	dvs.m_alloc_i = 0;
 	dvs.m_number = 0;
 	dvs.m_capacity = 0;
 	dvs.m_total_length = 0;
@@ -413,6 +463,112 @@ public:
     value_type * get_alloc_v() { return m_alloc_v; }
     index_type * get_alloc_i() { return m_alloc_i; }
 
+    // Drop the trailing elements of vector idx, retaining nonzeros
+    // elements. This leaves a gap in the storage; call compact() once all
+    // vectors have been shrunk.
+    void shrink( size_t idx, index_type nonzeros ) {
+	assert( idx < m_number );
+	assert( nonzeros <= m_vectors[idx].m_nonzeros );
+	m_vectors[idx].m_nonzeros = nonzeros;
+    }
+
+    // Move the vectors down to close the gaps left by shrink(). Vectors
+    // only move towards the start of the storage, so they are moved in
+    // order.
+    void compact() {
+	value_type * pv = m_alloc_v;
+	index_type * pi = m_alloc_i;
+	for( size_t i=0; i < m_number; ++i ) {
+	    vector_type & v = m_vectors[i];
+	    if( v.m_value != pv ) {
+		std::copy( v.m_value, v.m_value + v.m_nonzeros, pv );
+		std::copy( v.m_coord, v.m_coord + v.m_nonzeros, pi );
+		v.m_value = pv;
+		v.m_coord = pi;
+	    }
+	    pv += v.m_nonzeros;
+	    pi += v.m_nonzeros;
+	}
+    }
+
+    // Total number of nonzeros stored in the vectors
+    size_t nonzeros() const {
+	if( m_number == 0 )
+	    return 0;
+	const vector_type & last = m_vectors[m_number-1];
+	return ( last.m_value + last.m_nonzeros ) - m_alloc_v;
+    }
+
+    // Transpose the matrix formed by the vectors, i.e., convert between
+    // compressed row and compressed column storage. Vector i of the result
+    // holds element i of every vector in this set, sorted by index.
+    // The vectors are split in blocks, one per worker. A histogram per block
+    // counts the elements per output vector, a prefix sum over the
+    // histograms yields a private insertion point for every block and
+    // output vector, and the blocks then scatter their elements without
+    // synchronisation.
+    std::shared_ptr<sparse_vector_set> transpose() const {
+	size_t nrows = m_number;
+	size_t ncols = m_length;
+	size_t nnz = nonzeros();
+	std::shared_ptr<sparse_vector_set> tr_ptr
+	    = std::make_shared<sparse_vector_set>( ncols, nrows, nnz );
+	sparse_vector_set & tr = *tr_ptr;
+
+	// Limit the histograms to about the size of the data
+	size_t nblocks = std::min( par::num_workers(),
+				   std::max( size_t(1), nnz / std::max( ncols, size_t(1) ) ) );
+	nblocks = std::max( size_t(1), std::min( nblocks, nrows ) );
+	size_t rows_per_block = ( nrows + nblocks - 1 ) / nblocks;
+	std::vector<size_t> hist( nblocks * ncols, 0 );
+
+	par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	    size_t * h = hist.data() + b * ncols;
+	    size_t r_end = std::min( nrows, (b+1) * rows_per_block );
+	    for( size_t r=b*rows_per_block; r < r_end; ++r ) {
+		const vector_type & v = m_vectors[r];
+		for( index_type j=0; j < v.m_nonzeros; ++j )
+		    ++h[v.m_coord[j]];
+	    }
+	} );
+
+	// Exclusive prefix sum per output vector across the blocks
+	std::vector<size_t> col_start( ncols+1 );
+	par::parallel_for( size_t(0), ncols, [&]( size_t c ) {
+	    size_t sum = 0;
+	    for( size_t b=0; b < nblocks; ++b ) {
+		size_t cnt = hist[b * ncols + c];
+		hist[b * ncols + c] = sum;
+		sum += cnt;
+	    }
+	    col_start[c+1] = sum;
+	} );
+	col_start[0] = 0;
+	for( size_t c=0; c < ncols; ++c ) {
+	    tr.emplace_back( nrows, col_start[c+1] );
+	    col_start[c+1] += col_start[c];
+	}
+	assert( col_start[ncols] == nnz );
+
+	value_type * tv = tr.m_alloc_v;
+	index_type * ti = tr.m_alloc_i;
+	par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	    size_t * h = hist.data() + b * ncols;
+	    size_t r_end = std::min( nrows, (b+1) * rows_per_block );
+	    for( size_t r=b*rows_per_block; r < r_end; ++r ) {
+		const vector_type & v = m_vectors[r];
+		for( index_type j=0; j < v.m_nonzeros; ++j ) {
+		    index_type c = v.m_coord[j];
+		    size_t pos = col_start[c] + h[c]++;
+		    tv[pos] = v.m_value[j];
+		    ti[pos] = r;
+		}
+	    }
+	} );
+
+	return tr_ptr;
+    }
+
     // TODO: work out iterators
     iterator begin() { return &m_vectors[0]; }
     iterator end() { return &m_vectors[m_number]; }
@@ -0,0 +1,369 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef INCLUDED_ASAP_STRING_DICT_H
+#define INCLUDED_ASAP_STRING_DICT_H
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "asap/par.h"
+#include "asap/radix_sort.h"
+
+namespace asap {
+
+/*
+ * front_coded_dictionary: a read-only, compressed map from words to values.
+ *
+ * The words are stored in lexicographic order in buckets of bucket_size
+ * words. The first word of a bucket is stored in full; every other word is
+ * stored as the length of the prefix it shares with its predecessor and
+ * the remaining suffix. The ID of a word is its rank in lexicographic
+ * order and values are stored in an array indexed by ID.
+ *
+ * Lookup first narrows down the buckets by the first byte of the key,
+ * binary searches the bucket heads and then decodes at most one bucket.
+ *
+ * The dictionary provides the interface of a word container for the
+ * purposes of TF/IDF lookups and ARFF output. Dereferencing an iterator
+ * yields a pair of the word and its value; the word is decoded into the
+ * iterator and remains valid only while the iterator is unchanged.
+ */
+template<typename MappedTy>
+class front_coded_dictionary {
+public:
+    typedef const char *			key_type;
+    typedef MappedTy				mapped_type;
+    typedef std::pair<const char *, mapped_type> value_type;
+    typedef size_t				size_type;
+
+    static const size_t bucket_size = 16;
+    static const size_t npos = ~size_t(0);
+
+private:
+    std::vector<char>		m_data;		// encoded buckets
+    std::vector<size_t>		m_bucket;	// bucket offsets in m_data
+    std::vector<mapped_type>	m_values;	// values indexed by ID
+    size_t			m_first[257];	// bucket range per first byte
+
+public:
+    class const_iterator
+	: public std::iterator<std::forward_iterator_tag, value_type> {
+	friend class front_coded_dictionary;
+
+	const front_coded_dictionary *	m_dict;
+	size_t				m_id;
+	size_t				m_pos;	// offset of next word
+	const char *			m_ext;	// key passed to find()
+	std::string			m_key;
+	value_type			m_val;
+
+	const_iterator( const front_coded_dictionary * dict, size_t id )
+	    : m_dict( dict ), m_id( id ), m_pos( 0 ), m_ext( nullptr ) {
+	    if( m_id < m_dict->size() )
+		decode();
+	}
+	const_iterator( const front_coded_dictionary * dict, size_t id,
+			size_t pos, const char * key )
+	    : m_dict( dict ), m_id( id ), m_pos( pos ), m_ext( key ) { }
+
+	// Decode the word with ID m_id, assuming m_key holds its predecessor
+	// unless it is the first word of a bucket. Iterators returned by
+	// find() refer to the caller's key until they are advanced.
+	void decode() {
+	    if( m_ext ) {
+		m_key.assign( m_ext );
+		m_ext = nullptr;
+	    }
+	    const char * p;
+	    if( m_id % bucket_size == 0 ) {
+		p = &m_dict->m_data[m_dict->m_bucket[m_id / bucket_size]];
+		m_key.assign( p );
+	    } else {
+		p = &m_dict->m_data[m_pos];
+		size_t lcp = decode_length( p );
+		m_key.resize( lcp );
+		m_key.append( p );
+	    }
+	    m_pos = ( p - &m_dict->m_data[0] ) + strlen( p ) + 1;
+	}
+
+    public:
+	const_iterator()
+	    : m_dict( nullptr ), m_id( 0 ), m_pos( 0 ), m_ext( nullptr ) { }
+
+	bool operator == ( const const_iterator & I ) const {
+	    return m_id == I.m_id;
+	}
+	bool operator != ( const const_iterator & I ) const {
+	    return m_id != I.m_id;
+	}
+	const_iterator & operator ++ () {
+	    if( ++m_id < m_dict->size() )
+		decode();
+	    return *this;
+	}
+
+	size_t id() const { return m_id; }
+
+	const value_type & operator * () {
+	    m_val.first = m_ext ? m_ext : m_key.c_str();
+	    m_val.second = m_dict->m_values[m_id];
+	    return m_val;
+	}
+	const value_type * operator -> () { return &**this; }
+    };
+
+public:
+    front_coded_dictionary() {
+	std::fill( &m_first[0], &m_first[257], size_t(0) );
+    }
+
+    size_t size() const { return m_values.size(); }
+
+    // Memory used by the encoded words and the bucket index
+    size_t memory_size() const {
+	return m_data.size() + m_bucket.size() * sizeof(size_t);
+    }
+
+    void clear() {
+	m_data.clear();
+	m_bucket.clear();
+	m_values.clear();
+	std::fill( &m_first[0], &m_first[257], size_t(0) );
+    }
+
+    void swap( front_coded_dictionary & d ) {
+	m_data.swap( d.m_data );
+	m_bucket.swap( d.m_bucket );
+	m_values.swap( d.m_values );
+	for( size_t c=0; c < 257; ++c )
+	    std::swap( m_first[c], d.m_first[c] );
+    }
+
+    /*
+     * Build the dictionary from a range of word-value pairs with unique
+     * words, e.g., an aggregate word map. The words are copied, such that
+     * the source container may be released afterwards. Sorting and
+     * encoding are performed in parallel.
+     */
+    template<typename InputIterator>
+    void build( InputIterator I, InputIterator E ) {
+	std::vector<std::pair<const char *, mapped_type>> words( I, E );
+	sort_words( words.begin(), words.end(), se_parallel_radix );
+	build_sorted( words.begin(), words.end() );
+    }
+
+    // Build from a range of word-value pairs that is sorted by word.
+    template<typename RandomIt>
+    void build_sorted( RandomIt I, RandomIt E ) {
+	size_t n = std::distance( I, E );
+	size_t nbuckets = ( n + bucket_size - 1 ) / bucket_size;
+
+	clear();
+	m_values.resize( n );
+	m_bucket.resize( nbuckets + 1 );
+
+	// Size of each encoded bucket
+	par::parallel_for( size_t(0), nbuckets, [&]( size_t b ) {
+	    size_t s = 0;
+	    encode_bucket( I, n, b, nullptr, s );
+	    m_bucket[b+1] = s;
+	} );
+
+	m_bucket[0] = 0;
+	for( size_t b=0; b < nbuckets; ++b )
+	    m_bucket[b+1] += m_bucket[b];
+	m_data.resize( m_bucket[nbuckets] );
+
+	par::parallel_for( size_t(0), nbuckets, [&]( size_t b ) {
+	    size_t s = 0;
+	    encode_bucket( I, n, b, &m_data[m_bucket[b]], s );
+	    size_t e = std::min( n, (b+1) * bucket_size );
+	    for( size_t i=b*bucket_size; i < e; ++i )
+		m_values[i] = I[i].second;
+	} );
+
+	// Index the bucket heads by first byte
+	size_t b = 0;
+	for( size_t c=0; c < 256; ++c ) {
+	    while( b < nbuckets
+		   && (unsigned char)m_data[m_bucket[b]] < c )
+		++b;
+	    m_first[c] = b;
+	}
+	m_first[256] = nbuckets;
+    }
+
+    // Set the second field of every value to the word's ID, i.e., its
+    // lexicographic rank. This replaces internal::assign_ids.
+    void assign_ids() {
+	par::parallel_for( size_t(0), m_values.size(), [&]( size_t i ) {
+	    m_values[i].second = i;
+	} );
+    }
+
+    // The ID of key, or npos if it does not occur
+    size_t index_of( const char * key ) const {
+	size_t pos;
+	return lookup( key, pos );
+    }
+
+    const mapped_type & operator [] ( size_t id ) const {
+	return m_values[id];
+    }
+
+    const_iterator find( const char * key ) const {
+	size_t pos;
+	size_t id = lookup( key, pos );
+	if( id == npos )
+	    return cend();
+	return const_iterator( this, id, pos, key );
+    }
+
+    // Lookup is always a search on sorted data
+    const_iterator binary_search( const char * key ) const {
+	return find( key );
+    }
+
+    const_iterator begin() const { return const_iterator( this, 0 ); }
+    const_iterator end() const { return const_iterator( this, size() ); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+private:
+    static void encode_length( char * & p, size_t & s, size_t len ) {
+	do {
+	    unsigned char b = len & 127;
+	    len >>= 7;
+	    if( len )
+		b |= 128;
+	    if( p )
+		*p++ = b;
+	    ++s;
+	} while( len );
+    }
+
+    static size_t decode_length( const char * & p ) {
+	size_t len = 0;
+	unsigned shift = 0;
+	unsigned char b;
+	do {
+	    b = *p++;
+	    len |= size_t(b & 127) << shift;
+	    shift += 7;
+	} while( b & 128 );
+	return len;
+    }
+
+    static void encode_string( char * & p, size_t & s, const char * str ) {
+	size_t len = strlen( str ) + 1;
+	if( p ) {
+	    memcpy( p, str, len );
+	    p += len;
+	}
+	s += len;
+    }
+
+    // Encode bucket b to p, or only calculate its size s if p is null
+    template<typename RandomIt>
+    static void encode_bucket( RandomIt I, size_t n, size_t b,
+			       char * p, size_t & s ) {
+	size_t e = std::min( n, (b+1) * bucket_size );
+	const char * prev = I[b*bucket_size].first;
+	encode_string( p, s, prev );
+	for( size_t i=b*bucket_size+1; i < e; ++i ) {
+	    const char * w = I[i].first;
+	    size_t lcp = 0;
+	    while( prev[lcp] != '\0' && prev[lcp] == w[lcp] )
+		++lcp;
+	    encode_length( p, s, lcp );
+	    encode_string( p, s, w + lcp );
+	    prev = w;
+	}
+    }
+
+    // Locate key; returns its ID and the offset of the next encoded word
+    size_t lookup( const char * key, size_t & pos ) const {
+	if( m_values.empty() )
+	    return npos;
+
+	// The bucket holding key is the last bucket with head <= key. Only
+	// buckets with the same first byte as key, and the bucket before
+	// them, qualify.
+	unsigned char c = *key;
+	size_t lo = m_first[c] > 0 ? m_first[c] - 1 : 0;
+	size_t hi = m_first[c+1];
+	if( hi == 0 )
+	    return npos;
+	while( hi - lo > 1 ) {
+	    size_t mid = ( lo + hi ) / 2;
+	    if( strcmp( &m_data[m_bucket[mid]], key ) <= 0 )
+		lo = mid;
+	    else
+		hi = mid;
+	}
+
+	// Scan the bucket. Track the prefix shared between key and the
+	// current word to avoid decoding words.
+	const char * p = &m_data[m_bucket[lo]];
+	size_t id = lo * bucket_size;
+	size_t e = std::min( size(), id + bucket_size );
+	size_t match = 0;
+	while( p[match] != '\0' && p[match] == key[match] )
+	    ++match;
+	if( p[match] == key[match] ) {
+	    pos = ( p - &m_data[0] ) + match + 1;
+	    return id;
+	}
+	if( (unsigned char)p[match] > (unsigned char)key[match] )
+	    return npos;
+	p += strlen( p ) + 1;
+
+	for( ++id; id < e; ++id ) {
+	    size_t lcp = decode_length( p );
+	    // The current word shares lcp bytes with its predecessor, which
+	    // shares match bytes with key and is smaller than key.
+	    if( lcp < match )
+		return npos;
+	    if( lcp == match ) {
+		const char * s = p;
+		while( *s != '\0' && *s == key[match] )
+		    ++s, ++match;
+		if( *s == key[match] ) {
+		    pos = ( s - &m_data[0] ) + 1;
+		    return id;
+		}
+		if( (unsigned char)*s > (unsigned char)key[match] )
+		    return npos;
+	    }
+	    p += strlen( p ) + 1;
+	}
+	return npos;
+    }
+};
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_STRING_DICT_H
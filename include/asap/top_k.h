@@ -0,0 +1,415 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#ifndef INCLUDED_ASAP_TOP_K_H
+#define INCLUDED_ASAP_TOP_K_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "asap/par.h"
+
+namespace asap {
+
+// Order key-value pairs by descending value, i.e., most frequent first
+template<typename Pair>
+struct second_greater {
+    bool operator() ( const Pair & p1, const Pair & p2 ) const {
+	return p1.second > p2.second;
+    }
+};
+
+namespace internal {
+
+// Ranges shorter than this are selected sequentially
+static const size_t top_k_parallel_cutoff = 1 << 16;
+
+// Copy the k first elements of [I,E) according to cmp to out, sorted.
+// partial_sort_copy maintains a bounded heap of k elements while scanning
+// the range once.
+template<typename RandomIt, typename Compare>
+void top_k_seq( RandomIt I, RandomIt E, size_t k, Compare cmp,
+		std::vector<typename std::iterator_traits<RandomIt>::value_type>
+		& out ) {
+    size_t n = std::distance( I, E );
+    k = std::min( k, n );
+    out.resize( k );
+    std::partial_sort_copy( I, E, out.begin(), out.end(), cmp );
+}
+
+} // namespace internal
+
+/*
+ * top_k: select the k first elements of the range according to cmp and
+ *        return them in sorted order.
+ *
+ * The range is split in blocks that are processed in parallel. Each block
+ * selects its k first elements with a bounded heap. The candidates of all
+ * blocks are narrowed down with nth_element, after which only k elements
+ * are sorted. The input range is not modified.
+ */
+template<typename RandomIt, typename Compare>
+std::vector<typename std::iterator_traits<RandomIt>::value_type>
+top_k( RandomIt I, RandomIt E, size_t k, Compare cmp ) {
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    std::vector<value_type> result;
+    size_t n = std::distance( I, E );
+
+    if( k == 0 || n == 0 )
+	return result;
+
+    size_t nblocks = std::min( par::num_workers() * 4,
+			       n / internal::top_k_parallel_cutoff );
+    if( nblocks <= 1 || k * nblocks >= n ) {
+	internal::top_k_seq( I, E, k, cmp, result );
+	return result;
+    }
+
+    size_t block = ( n + nblocks - 1 ) / nblocks;
+    std::vector<std::vector<value_type>> partial( nblocks );
+    par::parallel_for( size_t(0), nblocks, [&]( size_t b ) {
+	RandomIt BI = I + std::min( n, b * block );
+	RandomIt BE = I + std::min( n, (b+1) * block );
+	internal::top_k_seq( BI, BE, k, cmp, partial[b] );
+    }, 1 );
+
+    std::vector<value_type> cand;
+    cand.reserve( k * nblocks );
+    for( size_t b=0; b < nblocks; ++b )
+	cand.insert( cand.end(), partial[b].begin(), partial[b].end() );
+
+    if( cand.size() > k ) {
+	std::nth_element( cand.begin(), cand.begin() + k, cand.end(), cmp );
+	cand.resize( k );
+    }
+    std::sort( cand.begin(), cand.end(), cmp );
+    result.swap( cand );
+    return result;
+}
+
+// The k pairs with the highest counts from a word catalog, most frequent
+// first.
+template<typename Container>
+std::vector<typename Container::value_type>
+top_k( Container & c, size_t k ) {
+    typedef typename Container::value_type value_type;
+    return top_k( c.begin(), c.end(), k, second_greater<value_type>() );
+}
+
+namespace internal {
+
+/*
+ * A min-heap of counters that are also indexed by key, as needed by the
+ * sketches below. Each counter records an estimated count and the maximum
+ * overestimation error.
+ */
+template<typename KeyTy, typename CountTy, typename Hash, typename KeyEqual>
+class indexed_min_heap {
+public:
+    struct entry {
+	KeyTy	key;
+	CountTy	count;
+	CountTy	error;
+    };
+    static const size_t npos = ~size_t(0);
+
+private:
+    std::vector<entry>					m_heap;
+    std::unordered_map<KeyTy, size_t, Hash, KeyEqual>	m_pos;
+
+public:
+    indexed_min_heap( size_t capacity ) {
+	m_heap.reserve( capacity );
+	m_pos.reserve( capacity );
+    }
+
+    size_t size() const { return m_heap.size(); }
+    const entry & min() const { return m_heap[0]; }
+    const std::vector<entry> & entries() const { return m_heap; }
+
+    size_t find( const KeyTy & key ) const {
+	auto F = m_pos.find( key );
+	return F == m_pos.end() ? npos : F->second;
+    }
+
+    void push( const KeyTy & key, CountTy count, CountTy error ) {
+	m_heap.push_back( entry{ key, count, error } );
+	m_pos[key] = m_heap.size() - 1;
+	sift_up( m_heap.size() - 1 );
+    }
+
+    // Raise the count of the entry at position i
+    void update( size_t i, CountTy count ) {
+	m_heap[i].count = count;
+	sift_down( i );
+    }
+
+    // Evict the entry with the lowest count in favour of key
+    void replace_min( const KeyTy & key, CountTy count, CountTy error ) {
+	m_pos.erase( m_heap[0].key );
+	m_heap[0] = entry{ key, count, error };
+	m_pos[key] = 0;
+	sift_down( 0 );
+    }
+
+private:
+    void swap_entries( size_t i, size_t j ) {
+	std::swap( m_heap[i], m_heap[j] );
+	m_pos[m_heap[i].key] = i;
+	m_pos[m_heap[j].key] = j;
+    }
+    void sift_up( size_t i ) {
+	while( i > 0 ) {
+	    size_t p = ( i - 1 ) / 2;
+	    if( !( m_heap[i].count < m_heap[p].count ) )
+		break;
+	    swap_entries( i, p );
+	    i = p;
+	}
+    }
+    void sift_down( size_t i ) {
+	size_t n = m_heap.size();
+	while( true ) {
+	    size_t l = 2 * i + 1, r = l + 1, m = i;
+	    if( l < n && m_heap[l].count < m_heap[m].count )
+		m = l;
+	    if( r < n && m_heap[r].count < m_heap[m].count )
+		m = r;
+	    if( m == i )
+		break;
+	    swap_entries( i, m );
+	    i = m;
+	}
+    }
+};
+
+} // namespace internal
+
+/*
+ * space_saving: streaming heavy hitters in a fixed number of counters
+ *               (Metwally, Agrawal and El Abbadi, ICDT 2005).
+ *
+ * Every key with a frequency above N/capacity is guaranteed to be tracked,
+ * where N is the total count added. Reported counts overestimate the true
+ * counts by at most the recorded error. Keys are stored by value; when
+ * keys are pointers to strings, the strings must outlive the sketch.
+ */
+template<typename KeyTy, typename CountTy = size_t,
+	 typename Hash = std::hash<KeyTy>,
+	 typename KeyEqual = std::equal_to<KeyTy>>
+class space_saving {
+    typedef internal::indexed_min_heap<KeyTy, CountTy, Hash, KeyEqual>
+    heap_type;
+
+public:
+    typedef KeyTy key_type;
+    typedef CountTy count_type;
+    typedef typename heap_type::entry entry;
+
+private:
+    size_t	m_capacity;
+    count_type	m_total;
+    heap_type	m_heap;
+
+public:
+    space_saving( size_t capacity )
+	: m_capacity( capacity ), m_total( 0 ), m_heap( capacity ) { }
+
+    void add( const key_type & key, count_type count = 1 ) {
+	m_total += count;
+	size_t i = m_heap.find( key );
+	if( i != heap_type::npos )
+	    m_heap.update( i, m_heap.entries()[i].count + count );
+	else if( m_heap.size() < m_capacity )
+	    m_heap.push( key, count, 0 );
+	else {
+	    count_type min = m_heap.min().count;
+	    m_heap.replace_min( key, min + count, min );
+	}
+    }
+
+    // Merge another sketch, e.g., one built by another thread (Agarwal et
+    // al., Mergeable summaries, PODS 2012). A key that is missing from a
+    // full sketch may have occurred up to its minimum count, which is
+    // added to both the count and the error. The largest counters are kept.
+    void merge( const space_saving & s ) {
+	count_type mine = min_untracked(), theirs = s.min_untracked();
+	std::vector<entry> all;
+	all.reserve( m_heap.size() + s.m_heap.size() );
+	for( const entry & e : m_heap.entries() ) {
+	    size_t j = s.m_heap.find( e.key );
+	    if( j != heap_type::npos ) {
+		const entry & f = s.m_heap.entries()[j];
+		all.push_back( entry{ e.key, e.count + f.count,
+				      e.error + f.error } );
+	    } else
+		all.push_back( entry{ e.key, e.count + theirs,
+				      e.error + theirs } );
+	}
+	for( const entry & f : s.m_heap.entries() )
+	    if( m_heap.find( f.key ) == heap_type::npos )
+		all.push_back( entry{ f.key, f.count + mine,
+				      f.error + mine } );
+
+	if( all.size() > m_capacity ) {
+	    std::nth_element( all.begin(), all.begin() + m_capacity,
+			      all.end(),
+			      []( const entry & l, const entry & r ) {
+				  return l.count > r.count;
+			      } );
+	    all.resize( m_capacity );
+	}
+	m_heap = heap_type( m_capacity );
+	for( const entry & e : all )
+	    m_heap.push( e.key, e.count, e.error );
+	m_total += s.m_total;
+    }
+
+    count_type total() const { return m_total; }
+
+    // The k most frequent keys, most frequent first
+    std::vector<entry> top( size_t k ) const {
+	std::vector<entry> r( m_heap.entries() );
+	k = std::min( k, r.size() );
+	std::partial_sort( r.begin(), r.begin() + k, r.end(),
+			   []( const entry & l, const entry & r ) {
+			       return l.count > r.count;
+			   } );
+	r.resize( k );
+	return r;
+    }
+
+private:
+    // Upper bound on the count of keys that are not tracked
+    count_type min_untracked() const {
+	return m_heap.size() < m_capacity ? count_type(0) : m_heap.min().count;
+    }
+};
+
+/*
+ * count_min_sketch: approximate counts in depth x width counters
+ *                   (Cormode and Muthukrishnan, 2005).
+ *
+ * Estimates never underestimate and overestimate by at most e*N/width with
+ * probability 1 - exp(-depth). Sketches of equal dimensions can be merged
+ * by adding them. When tracking is non-zero, the sketch additionally keeps
+ * the keys with the highest estimates in as many counters, such that it
+ * reports an approximate top-K.
+ */
+template<typename KeyTy, typename CountTy = size_t,
+	 typename Hash = std::hash<KeyTy>,
+	 typename KeyEqual = std::equal_to<KeyTy>>
+class count_min_sketch {
+    typedef internal::indexed_min_heap<KeyTy, CountTy, Hash, KeyEqual>
+    heap_type;
+
+public:
+    typedef KeyTy key_type;
+    typedef CountTy count_type;
+    typedef typename heap_type::entry entry;
+
+private:
+    size_t			m_width;
+    size_t			m_depth;
+    std::vector<count_type>	m_counters;
+    size_t			m_tracking;
+    heap_type			m_heap;
+
+    // Derive the row hashes from a single hash value (Kirsch and
+    // Mitzenmacher double hashing)
+    size_t column( uint64_t h, size_t row ) const {
+	uint64_t h1 = h * 0x9E3779B97F4A7C15ULL;
+	uint64_t h2 = ( ( h ^ ( h >> 29 ) ) * 0xBF58476D1CE4E5B9ULL ) | 1;
+	return ( ( h1 + row * h2 ) >> 17 ) % m_width;
+    }
+
+public:
+    count_min_sketch( size_t width, size_t depth, size_t tracking = 0 )
+	: m_width( width ), m_depth( depth ),
+	  m_counters( width * depth, 0 ),
+	  m_tracking( tracking ), m_heap( tracking ) { }
+
+    // Add count to key and return the new estimate for key
+    count_type add( const key_type & key, count_type count = 1 ) {
+	uint64_t h = Hash()( key );
+	count_type est = std::numeric_limits<count_type>::max();
+	for( size_t r=0; r < m_depth; ++r ) {
+	    count_type & c = m_counters[r * m_width + column( h, r )];
+	    c += count;
+	    est = std::min( est, c );
+	}
+	track( key, est );
+	return est;
+    }
+
+    count_type estimate( const key_type & key ) const {
+	uint64_t h = Hash()( key );
+	count_type est = std::numeric_limits<count_type>::max();
+	for( size_t r=0; r < m_depth; ++r )
+	    est = std::min( est, m_counters[r * m_width + column( h, r )] );
+	return est;
+    }
+
+    void merge( const count_min_sketch & s ) {
+	assert( m_width == s.m_width && m_depth == s.m_depth );
+	for( size_t i=0; i < m_counters.size(); ++i )
+	    m_counters[i] += s.m_counters[i];
+	for( const entry & e : s.m_heap.entries() )
+	    track( e.key, estimate( e.key ) );
+    }
+
+    // The k tracked keys with the highest estimates, most frequent first
+    std::vector<entry> top( size_t k ) const {
+	std::vector<entry> r( m_heap.entries() );
+	for( entry & e : r )
+	    e.count = estimate( e.key );
+	k = std::min( k, r.size() );
+	std::partial_sort( r.begin(), r.begin() + k, r.end(),
+			   []( const entry & l, const entry & r ) {
+			       return l.count > r.count;
+			   } );
+	r.resize( k );
+	return r;
+    }
+
+private:
+    void track( const key_type & key, count_type est ) {
+	if( m_tracking == 0 )
+	    return;
+	size_t i = m_heap.find( key );
+	if( i != heap_type::npos ) {
+	    if( est > m_heap.entries()[i].count )
+		m_heap.update( i, est );
+	} else if( m_heap.size() < m_tracking )
+	    m_heap.push( key, est, 0 );
+	else if( est > m_heap.min().count )
+	    m_heap.replace_min( key, est, 0 );
+    }
+};
+
+} // namespace asap
+
+#endif // INCLUDED_ASAP_TOP_K_H
@@ -107,6 +107,7 @@ struct tag_dense { };
 struct tag_sparse { };
 struct tag_sqnorm_cache { };
 struct tag_add_counter { };
+struct tag_compact { };
 
 // Check if type T represents a vector
 template<typename T>
@@ -125,6 +126,13 @@ struct is_sparse_vector
     : internal::is_asap_class_with_all_tags<
     typename internal::strip<T>::type, tag_sparse, tag_vector> { };
 
+// Check if type T represents a sparse vector stored in a compact encoding.
+// Such vectors can only be traversed sequentially.
+template<typename T>
+struct is_compact_sparse_vector
+    : internal::is_asap_class_with_all_tags<
+    typename internal::strip<T>::type, tag_compact, tag_vector> { };
+
 // Check if type T represents a vector extended with an additive counter
 template<typename T>
 struct is_vector_with_add_counter
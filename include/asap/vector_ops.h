@@ -20,8 +20,46 @@
 #ifndef INCLUDED_ASAP_VECTOR_OPS_H
 #define INCLUDED_ASAP_VECTOR_OPS_H
 
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 namespace asap {
 
+namespace internal {
+
+// Helpers for the SIMD kernels below, overloaded on the vector type.
+#if defined(__AVX2__) || defined(__AVX512F__)
+inline float simd_hsum( __m128 v ) {
+    __m128 s = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+    s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+    return _mm_cvtss_f32( s );
+}
+inline float simd_hsum( __m256 v ) {
+    return simd_hsum( _mm_add_ps( _mm256_castps256_ps128( v ),
+				  _mm256_extractf128_ps( v, 1 ) ) );
+}
+inline double simd_hsum( __m256d v ) {
+    __m128d s = _mm_add_pd( _mm256_castpd256_pd128( v ),
+			    _mm256_extractf128_pd( v, 1 ) );
+    return _mm_cvtsd_f64( _mm_add_sd( s, _mm_unpackhi_pd( s, s ) ) );
+}
+inline __m128 simd_add( __m128 a, __m128 b ) { return _mm_add_ps( a, b ); }
+inline __m128 simd_sub( __m128 a, __m128 b ) { return _mm_sub_ps( a, b ); }
+inline __m128 simd_mul( __m128 a, __m128 b ) { return _mm_mul_ps( a, b ); }
+inline __m256 simd_add( __m256 a, __m256 b ) { return _mm256_add_ps( a, b ); }
+inline __m256 simd_sub( __m256 a, __m256 b ) { return _mm256_sub_ps( a, b ); }
+inline __m256 simd_mul( __m256 a, __m256 b ) { return _mm256_mul_ps( a, b ); }
+inline __m256d simd_add( __m256d a, __m256d b ) { return _mm256_add_pd( a, b ); }
+inline __m256d simd_sub( __m256d a, __m256d b ) { return _mm256_sub_pd( a, b ); }
+inline __m256d simd_mul( __m256d a, __m256d b ) { return _mm256_mul_pd( a, b ); }
+#endif
+
+} // namespace internal
+
 // Dense vector operations
 template<typename IndexTy, typename ValueTy, bool IsVectorized = false>
 struct dense_vector_operations {
@@ -126,6 +164,264 @@ private:
 };
 #endif
 
+namespace internal {
+
+// Ratio of the number of nonzeros of two sparse vectors beyond which the
+// coordinates are intersected by galloping through the longer vector
+// rather than by a linear merge.
+static const size_t sparse_gallop_ratio = 32;
+
+// Returns the first position p in [lo,n) with c[p] >= key, or n if there
+// is none. The search probes lo, lo+1, lo+3, lo+7, ... before bisecting.
+template<typename IndexTy>
+IndexTy gallop( IndexTy const *c, IndexTy lo, IndexTy n, IndexTy key ) {
+    IndexTy hi = lo, step = 1;
+    while( hi < n && c[hi] < key ) {
+	lo = hi + 1;
+	hi += step;
+	step <<= 1;
+    }
+    return std::lower_bound( &c[lo], &c[std::min( hi+1, n )], key ) - c;
+}
+
+// Kernels on two sparse vectors (a_v, a_c) and (b_v, b_c). Coordinates
+// must be sorted in increasing order and must be distinct.
+template<typename IndexTy, typename ValueTy>
+struct sparse_sparse_scalar_kernels {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+
+    static value_type
+    dot_merge( value_type const *a_v, index_type const *a_c, index_type a_length,
+	       value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	value_type sum = 0;
+	index_type i=0, j=0;
+	while( i < a_length && j < b_length ) {
+	    if( a_c[i] < b_c[j] )
+		++i;
+	    else if( a_c[i] > b_c[j] )
+		++j;
+	    else
+		sum += a_v[i++] * b_v[j++];
+	}
+	return sum;
+    }
+
+    // Assumes that a has (many) fewer nonzeros than b.
+    static value_type
+    dot_gallop( value_type const *a_v, index_type const *a_c, index_type a_length,
+		value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	value_type sum = 0;
+	for( index_type i=0, j=0; i < a_length && j < b_length; ++i ) {
+	    j = gallop( b_c, j, b_length, a_c[i] );
+	    if( j < b_length && b_c[j] == a_c[i] )
+		sum += a_v[i] * b_v[j++];
+	}
+	return sum;
+    }
+
+    static value_type
+    square_euclidean_distance(
+	value_type const *a_v, index_type const *a_c, index_type a_length,
+	value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	value_type sum = 0;
+	index_type i=0, j=0;
+	while( i < a_length && j < b_length ) {
+	    value_type diff;
+	    if( a_c[i] < b_c[j] )
+		diff = a_v[i++];
+	    else if( a_c[i] > b_c[j] )
+		diff = b_v[j++];
+	    else
+		diff = a_v[i++] - b_v[j++];
+	    sum += diff * diff;
+	}
+	for( ; i < a_length; ++i )
+	    sum += a_v[i] * a_v[i];
+	for( ; j < b_length; ++j )
+	    sum += b_v[j] * b_v[j];
+	return sum;
+    }
+};
+
+// Description of the SIMD lanes used to intersect blocks of 4 coordinates
+// of IdxBytes bytes with associated ValueTy values.
+template<size_t IdxBytes, typename ValueTy>
+struct simd_intersect_lanes {
+    static const bool available = false;
+};
+
+#if defined(__AVX2__)
+template<>
+struct simd_intersect_lanes<4, float> {
+    static const bool available = true;
+    typedef __m128i idx_type;
+    typedef __m128 vec_type;
+    static idx_type idx( void const *c ) {
+	return _mm_loadu_si128( (__m128i const *)c );
+    }
+    static vec_type zero() { return _mm_setzero_ps(); }
+    static vec_type load( float const *v ) { return _mm_loadu_ps( v ); }
+    static idx_type rotate_idx( idx_type c ) {
+	return _mm_shuffle_epi32( c, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type rotate_val( vec_type v ) {
+	return _mm_shuffle_ps( v, v, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type select( idx_type a, idx_type b, vec_type v ) {
+	return _mm_and_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( a, b ) ), v );
+    }
+};
+
+template<>
+struct simd_intersect_lanes<8, float> {
+    static const bool available = true;
+    typedef __m256i idx_type;
+    typedef __m128 vec_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm_setzero_ps(); }
+    static vec_type load( float const *v ) { return _mm_loadu_ps( v ); }
+    static idx_type rotate_idx( idx_type c ) {
+	return _mm256_permute4x64_epi64( c, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type rotate_val( vec_type v ) {
+	return _mm_shuffle_ps( v, v, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type select( idx_type a, idx_type b, vec_type v ) {
+	// Narrow the 64-bit lane mask to 32-bit lanes
+	__m256i m = _mm256_permutevar8x32_epi32(
+	    _mm256_cmpeq_epi64( a, b ), _mm256_setr_epi32( 0,2,4,6,1,3,5,7 ) );
+	return _mm_and_ps( _mm_castsi128_ps( _mm256_castsi256_si128( m ) ), v );
+    }
+};
+
+template<>
+struct simd_intersect_lanes<4, double> {
+    static const bool available = true;
+    typedef __m128i idx_type;
+    typedef __m256d vec_type;
+    static idx_type idx( void const *c ) {
+	return _mm_loadu_si128( (__m128i const *)c );
+    }
+    static vec_type zero() { return _mm256_setzero_pd(); }
+    static vec_type load( double const *v ) { return _mm256_loadu_pd( v ); }
+    static idx_type rotate_idx( idx_type c ) {
+	return _mm_shuffle_epi32( c, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type rotate_val( vec_type v ) {
+	return _mm256_permute4x64_pd( v, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type select( idx_type a, idx_type b, vec_type v ) {
+	// Widen the 32-bit lane mask to 64-bit lanes
+	__m256i m = _mm256_cvtepi32_epi64( _mm_cmpeq_epi32( a, b ) );
+	return _mm256_and_pd( _mm256_castsi256_pd( m ), v );
+    }
+};
+
+template<>
+struct simd_intersect_lanes<8, double> {
+    static const bool available = true;
+    typedef __m256i idx_type;
+    typedef __m256d vec_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm256_setzero_pd(); }
+    static vec_type load( double const *v ) { return _mm256_loadu_pd( v ); }
+    static idx_type rotate_idx( idx_type c ) {
+	return _mm256_permute4x64_epi64( c, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type rotate_val( vec_type v ) {
+	return _mm256_permute4x64_pd( v, _MM_SHUFFLE(0,3,2,1) );
+    }
+    static vec_type select( idx_type a, idx_type b, vec_type v ) {
+	return _mm256_and_pd(
+	    _mm256_castsi256_pd( _mm256_cmpeq_epi64( a, b ) ), v );
+    }
+};
+
+// Block-wise intersection: all 16 pairs of coordinates in blocks of 4 of
+// a and b are compared by rotating the block of b through the lanes. The
+// block with the smaller last coordinate is then advanced.
+template<typename IndexTy, typename ValueTy>
+struct sparse_sparse_simd_kernels
+    : public sparse_sparse_scalar_kernels<IndexTy, ValueTy> {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef simd_intersect_lanes<sizeof(IndexTy), ValueTy> lanes;
+    typedef typename lanes::idx_type idx_type;
+    typedef typename lanes::vec_type vec_type;
+    typedef sparse_sparse_scalar_kernels<IndexTy, ValueTy> scalar;
+
+    static value_type
+    dot_merge( value_type const *a_v, index_type const *a_c, index_type a_length,
+	       value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	vec_type acc = lanes::zero();
+	index_type i=0, j=0;
+	while( i+4 <= a_length && j+4 <= b_length ) {
+	    idx_type ai = lanes::idx( &a_c[i] );
+	    idx_type bi = lanes::idx( &b_c[j] );
+	    vec_type av = lanes::load( &a_v[i] );
+	    vec_type bv = lanes::load( &b_v[j] );
+	    for( int r=0; r < 4; ++r ) {
+		acc = simd_add( acc, simd_mul( av, lanes::select( ai, bi, bv ) ) );
+		bi = lanes::rotate_idx( bi );
+		bv = lanes::rotate_val( bv );
+	    }
+	    index_type a_max = a_c[i+3], b_max = b_c[j+3];
+	    if( a_max <= b_max )
+		i += 4;
+	    if( b_max <= a_max )
+		j += 4;
+	}
+	return simd_hsum( acc )
+	    + scalar::dot_merge( &a_v[i], &a_c[i], a_length-i,
+				 &b_v[j], &b_c[j], b_length-j );
+    }
+};
+#endif
+
+// Selects between linear merge and galloping depending on the relative
+// number of nonzeros, and uses SIMD intersection for the linear merge
+// when the target supports it for the index and value types.
+template<typename IndexTy, typename ValueTy, typename Enable = void>
+struct sparse_sparse_merge_kernels
+    : public sparse_sparse_scalar_kernels<IndexTy, ValueTy> { };
+
+#if defined(__AVX2__)
+template<typename IndexTy, typename ValueTy>
+struct sparse_sparse_merge_kernels<IndexTy, ValueTy,
+    typename std::enable_if<std::is_integral<IndexTy>::value
+			    && simd_intersect_lanes<sizeof(IndexTy),
+						    ValueTy>::available>::type>
+    : public sparse_sparse_simd_kernels<IndexTy, ValueTy> { };
+#endif
+
+template<typename IndexTy, typename ValueTy>
+struct sparse_sparse_kernels
+    : public sparse_sparse_merge_kernels<IndexTy, ValueTy> {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef sparse_sparse_merge_kernels<IndexTy, ValueTy> merge;
+
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	if( a_length > b_length )
+	    return dot( b_v, b_c, b_length, a_v, a_c, a_length );
+	if( a_length == 0 || b_c[b_length-1] < a_c[0]
+	    || a_c[a_length-1] < b_c[0] )
+	    return value_type(0);
+	if( size_t(a_length) * sparse_gallop_ratio < size_t(b_length) )
+	    return merge::dot_gallop( a_v, a_c, a_length, b_v, b_c, b_length );
+	return merge::dot_merge( a_v, a_c, a_length, b_v, b_c, b_length );
+    }
+};
+
+} // namespace internal
+
 // Sparse vector operations
 template<typename IndexTy, typename ValueTy, bool IsVectorized = false>
 struct sparse_vector_operations {
@@ -150,6 +446,31 @@ struct sparse_vector_operations {
 	for( value_type *I=src_v, *E=src_v+length; I != E; ++I )
 	    *I *= alpha;
     }
+
+    static value_type
+    square_norm( value_type const *v, index_type length ) {
+	value_type sq_norm = 0;
+	for( value_type const *I=v, *E=v+length; I != E; ++I )
+	    sq_norm += *I * *I;
+	return sq_norm;
+    }
+
+    // The operations below assume that both vectors are sorted by index
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	return internal::sparse_sparse_kernels<index_type, value_type>::dot(
+	    a_v, a_c, a_length, b_v, b_c, b_length );
+    }
+
+    static value_type
+    square_euclidean_distance(
+	value_type const *a_v, index_type const *a_c, index_type a_length,
+	value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	return internal::sparse_sparse_kernels<index_type, value_type>
+	    ::square_euclidean_distance( a_v, a_c, a_length,
+					 b_v, b_c, b_length );
+    }
 };
 
 #ifdef __INTEL_COMPILER
@@ -176,17 +497,356 @@ struct sparse_vector_operations<IndexTy,ValueTy,true> {
     scale( value_type *a, index_type length, value_type alpha ) {
 	a[0:length] *= alpha;
     }
+
+    static value_type
+    square_norm( value_type const *v, index_type length ) {
+	return __sec_reduce_add( v[0:length] * v[0:length] );
+    }
+
+    // Intersections are not expressible in array notation
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	return internal::sparse_sparse_kernels<index_type, value_type>::dot(
+	    a_v, a_c, a_length, b_v, b_c, b_length );
+    }
+
+    static value_type
+    square_euclidean_distance(
+	value_type const *a_v, index_type const *a_c, index_type a_length,
+	value_type const *b_v, index_type const *b_c, index_type b_length ) {
+	return internal::sparse_sparse_kernels<index_type, value_type>
+	    ::square_euclidean_distance( a_v, a_c, a_length,
+					 b_v, b_c, b_length );
+    }
 };
 #endif
 
-// Note: there are currently no overloads for the vectorized variants of
-//       the operations on a sparse and a dense vector.
+namespace internal {
+
+// Number of nonzeros ahead of the current position for which the dense
+// vector elements d[a_c[j]] are prefetched. The dense operand is typically
+// a cluster centre over the full vocabulary, which does not fit in L1.
+static const size_t sparse_dense_prefetch_distance = 32;
+
+// Scalar kernels for operations that combine a sparse vector (a_v, a_c)
+// with a dense vector d. They are also the fallback for index/value
+// types for which no gather instructions are available.
+template<typename IndexTy, typename ValueTy>
+struct sparse_dense_scalar_kernels {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *d ) {
+	value_type sum = 0;
+	index_type j = 0;
+	for( ; j + sparse_dense_prefetch_distance < a_length; ++j ) {
+	    __builtin_prefetch( &d[a_c[j+sparse_dense_prefetch_distance]] );
+	    sum += a_v[j] * d[a_c[j]];
+	}
+	for( ; j < a_length; ++j )
+	    sum += a_v[j] * d[a_c[j]];
+	return sum;
+    }
+
+    // Calculates sum_j a_v[j] * ( a_v[j] - 2 * d[a_c[j]] ), which is the
+    // square Euclidean distance between a and d minus the square norm of d.
+    static value_type
+    sq_dist_minus_sqnorm( value_type const *a_v, index_type const *a_c,
+			  index_type a_length, value_type const *d ) {
+	value_type sum = 0;
+	index_type j = 0;
+	for( ; j + sparse_dense_prefetch_distance < a_length; ++j ) {
+	    __builtin_prefetch( &d[a_c[j+sparse_dense_prefetch_distance]] );
+	    sum += a_v[j] * ( a_v[j] - value_type(2) * d[a_c[j]] );
+	}
+	for( ; j < a_length; ++j )
+	    sum += a_v[j] * ( a_v[j] - value_type(2) * d[a_c[j]] );
+	return sum;
+    }
+
+    static void
+    add( value_type *d, value_type const *a_v, index_type const *a_c,
+	 index_type a_length ) {
+	index_type j = 0;
+	for( ; j + sparse_dense_prefetch_distance < a_length; ++j ) {
+	    __builtin_prefetch( &d[a_c[j+sparse_dense_prefetch_distance]], 1 );
+	    d[a_c[j]] += a_v[j];
+	}
+	for( ; j < a_length; ++j )
+	    d[a_c[j]] += a_v[j];
+    }
+};
+
+// Description of the SIMD lanes used to gather ValueTy elements with
+// indices of IdxBytes bytes. Only specializations with available set to
+// true are used. The gather instructions interpret the indices as signed
+// integers, which restricts 32-bit indices to dense vectors shorter than
+// 2^31 elements.
+template<size_t IdxBytes, typename ValueTy>
+struct simd_gather_lanes {
+    static const bool available = false;
+};
+
+#if defined(__AVX512F__)
+inline float simd_hsum( __m512 v ) { return _mm512_reduce_add_ps( v ); }
+inline double simd_hsum( __m512d v ) { return _mm512_reduce_add_pd( v ); }
+inline __m512 simd_add( __m512 a, __m512 b ) { return _mm512_add_ps( a, b ); }
+inline __m512 simd_sub( __m512 a, __m512 b ) { return _mm512_sub_ps( a, b ); }
+inline __m512 simd_mul( __m512 a, __m512 b ) { return _mm512_mul_ps( a, b ); }
+inline __m512d simd_add( __m512d a, __m512d b ) { return _mm512_add_pd( a, b ); }
+inline __m512d simd_sub( __m512d a, __m512d b ) { return _mm512_sub_pd( a, b ); }
+inline __m512d simd_mul( __m512d a, __m512d b ) { return _mm512_mul_pd( a, b ); }
+
+// AVX-512 has scatter instructions, which are safe for add as the
+// coordinates of a sparse vector are distinct.
+template<>
+struct simd_gather_lanes<4, float> {
+    static const bool available = true;
+    static const size_t width = 16;
+    typedef __m512 vec_type;
+    typedef __m512i idx_type;
+    static idx_type idx( void const *c ) { return _mm512_loadu_si512( c ); }
+    static vec_type zero() { return _mm512_setzero_ps(); }
+    static vec_type set1( float v ) { return _mm512_set1_ps( v ); }
+    static vec_type load( float const *v ) { return _mm512_loadu_ps( v ); }
+    static vec_type gather( float const *d, idx_type i ) {
+	return _mm512_i32gather_ps( i, d, 4 );
+    }
+    static void scatter( float *d, idx_type i, vec_type v ) {
+	_mm512_i32scatter_ps( d, i, v, 4 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<8, float> {
+    static const bool available = true;
+    static const size_t width = 8;
+    typedef __m256 vec_type;
+    typedef __m512i idx_type;
+    static idx_type idx( void const *c ) { return _mm512_loadu_si512( c ); }
+    static vec_type zero() { return _mm256_setzero_ps(); }
+    static vec_type set1( float v ) { return _mm256_set1_ps( v ); }
+    static vec_type load( float const *v ) { return _mm256_loadu_ps( v ); }
+    static vec_type gather( float const *d, idx_type i ) {
+	return _mm512_i64gather_ps( i, d, 4 );
+    }
+    static void scatter( float *d, idx_type i, vec_type v ) {
+	_mm512_i64scatter_ps( d, i, v, 4 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<4, double> {
+    static const bool available = true;
+    static const size_t width = 8;
+    typedef __m512d vec_type;
+    typedef __m256i idx_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm512_setzero_pd(); }
+    static vec_type set1( double v ) { return _mm512_set1_pd( v ); }
+    static vec_type load( double const *v ) { return _mm512_loadu_pd( v ); }
+    static vec_type gather( double const *d, idx_type i ) {
+	return _mm512_i32gather_pd( i, d, 8 );
+    }
+    static void scatter( double *d, idx_type i, vec_type v ) {
+	_mm512_i32scatter_pd( d, i, v, 8 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<8, double> {
+    static const bool available = true;
+    static const size_t width = 8;
+    typedef __m512d vec_type;
+    typedef __m512i idx_type;
+    static idx_type idx( void const *c ) { return _mm512_loadu_si512( c ); }
+    static vec_type zero() { return _mm512_setzero_pd(); }
+    static vec_type set1( double v ) { return _mm512_set1_pd( v ); }
+    static vec_type load( double const *v ) { return _mm512_loadu_pd( v ); }
+    static vec_type gather( double const *d, idx_type i ) {
+	return _mm512_i64gather_pd( i, d, 8 );
+    }
+    static void scatter( double *d, idx_type i, vec_type v ) {
+	_mm512_i64scatter_pd( d, i, v, 8 );
+    }
+};
+#elif defined(__AVX2__)
+// AVX2 has no scatter instructions; add uses the scalar kernel.
+template<>
+struct simd_gather_lanes<4, float> {
+    static const bool available = true;
+    static const size_t width = 8;
+    typedef __m256 vec_type;
+    typedef __m256i idx_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm256_setzero_ps(); }
+    static vec_type set1( float v ) { return _mm256_set1_ps( v ); }
+    static vec_type load( float const *v ) { return _mm256_loadu_ps( v ); }
+    static vec_type gather( float const *d, idx_type i ) {
+	return _mm256_i32gather_ps( d, i, 4 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<8, float> {
+    static const bool available = true;
+    static const size_t width = 4;
+    typedef __m128 vec_type;
+    typedef __m256i idx_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm_setzero_ps(); }
+    static vec_type set1( float v ) { return _mm_set1_ps( v ); }
+    static vec_type load( float const *v ) { return _mm_loadu_ps( v ); }
+    static vec_type gather( float const *d, idx_type i ) {
+	return _mm256_i64gather_ps( d, i, 4 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<4, double> {
+    static const bool available = true;
+    static const size_t width = 4;
+    typedef __m256d vec_type;
+    typedef __m128i idx_type;
+    static idx_type idx( void const *c ) {
+	return _mm_loadu_si128( (__m128i const *)c );
+    }
+    static vec_type zero() { return _mm256_setzero_pd(); }
+    static vec_type set1( double v ) { return _mm256_set1_pd( v ); }
+    static vec_type load( double const *v ) { return _mm256_loadu_pd( v ); }
+    static vec_type gather( double const *d, idx_type i ) {
+	return _mm256_i32gather_pd( d, i, 8 );
+    }
+};
+
+template<>
+struct simd_gather_lanes<8, double> {
+    static const bool available = true;
+    static const size_t width = 4;
+    typedef __m256d vec_type;
+    typedef __m256i idx_type;
+    static idx_type idx( void const *c ) {
+	return _mm256_loadu_si256( (__m256i const *)c );
+    }
+    static vec_type zero() { return _mm256_setzero_pd(); }
+    static vec_type set1( double v ) { return _mm256_set1_pd( v ); }
+    static vec_type load( double const *v ) { return _mm256_loadu_pd( v ); }
+    static vec_type gather( double const *d, idx_type i ) {
+	return _mm256_i64gather_pd( d, i, 8 );
+    }
+};
+#endif
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+// Gather-based kernels. Each iteration processes Lanes::width nonzeros
+// and prefetches the dense elements for the block that is
+// sparse_dense_prefetch_distance nonzeros ahead. The remaining nonzeros
+// are handled by the scalar kernels.
+template<typename IndexTy, typename ValueTy>
+struct sparse_dense_gather_kernels {
+    typedef IndexTy index_type;
+    typedef ValueTy value_type;
+    typedef simd_gather_lanes<sizeof(IndexTy), ValueTy> lanes;
+    typedef typename lanes::vec_type vec_type;
+    typedef sparse_dense_scalar_kernels<IndexTy, ValueTy> scalar;
+    static const size_t width = lanes::width;
+
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *d ) {
+	vec_type acc = lanes::zero();
+	index_type j = 0;
+	for( ; j + width <= a_length; j += width ) {
+	    prefetch( d, a_c, j, a_length );
+	    vec_type g = lanes::gather( d, lanes::idx( &a_c[j] ) );
+	    acc = simd_add( acc, simd_mul( lanes::load( &a_v[j] ), g ) );
+	}
+	return simd_hsum( acc )
+	    + scalar::dot( &a_v[j], &a_c[j], a_length-j, d );
+    }
+
+    static value_type
+    sq_dist_minus_sqnorm( value_type const *a_v, index_type const *a_c,
+			  index_type a_length, value_type const *d ) {
+	const vec_type two = lanes::set1( value_type(2) );
+	vec_type acc = lanes::zero();
+	index_type j = 0;
+	for( ; j + width <= a_length; j += width ) {
+	    prefetch( d, a_c, j, a_length );
+	    vec_type g = lanes::gather( d, lanes::idx( &a_c[j] ) );
+	    vec_type v = lanes::load( &a_v[j] );
+	    acc = simd_add( acc, simd_mul( v, simd_sub( v, simd_mul( two, g ) ) ) );
+	}
+	return simd_hsum( acc )
+	    + scalar::sq_dist_minus_sqnorm( &a_v[j], &a_c[j], a_length-j, d );
+    }
+
+    // Without scatter instructions (AVX2), writing back the sums element
+    // by element is slower than the scalar kernel.
+    static void
+    add( value_type *d, value_type const *a_v, index_type const *a_c,
+	 index_type a_length ) {
+	index_type j = 0;
+#if defined(__AVX512F__)
+	for( ; j + width <= a_length; j += width ) {
+	    prefetch( d, a_c, j, a_length );
+	    typename lanes::idx_type i = lanes::idx( &a_c[j] );
+	    vec_type s = simd_add( lanes::gather( d, i ), lanes::load( &a_v[j] ) );
+	    lanes::scatter( d, i, s );
+	}
+#endif
+	scalar::add( d, &a_v[j], &a_c[j], a_length-j );
+    }
+
+private:
+    static void prefetch( value_type const *d, index_type const *a_c,
+			  index_type j, index_type a_length ) {
+	index_type p = j + sparse_dense_prefetch_distance;
+	if( p + width <= a_length ) {
+	    for( size_t k=0; k < width; ++k )
+		_mm_prefetch( (char const *)&d[a_c[p+k]], _MM_HINT_T0 );
+	}
+    }
+};
+#endif
+
+// Selects the gather-based kernels when the target supports them for
+// the index and value types, and the scalar kernels otherwise.
+template<typename IndexTy, typename ValueTy, typename Enable = void>
+struct sparse_dense_kernels
+    : public sparse_dense_scalar_kernels<IndexTy, ValueTy> { };
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+template<typename IndexTy, typename ValueTy>
+struct sparse_dense_kernels<IndexTy, ValueTy,
+    typename std::enable_if<std::is_integral<IndexTy>::value
+			    && simd_gather_lanes<sizeof(IndexTy),
+						 ValueTy>::available>::type>
+    : public sparse_dense_gather_kernels<IndexTy, ValueTy> { };
+#endif
+
+} // namespace internal
+
+// Operations on a sparse and a dense vector. These do not depend on
+// IsVectorized: the index-driven accesses to the dense vector are
+// vectorized using gather instructions when compiling for AVX2 or
+// AVX-512 (see internal::sparse_dense_kernels).
 template<typename IndexTy, typename ValueTy, bool IsVectorized = false>
 struct sparse_dense_vector_operations {
     typedef IndexTy index_type;
     typedef ValueTy value_type;
     static const bool is_vectorized = false;
     typedef dense_vector_operations<index_type, value_type, is_vectorized> dense_ops;
+    typedef internal::sparse_dense_kernels<index_type, value_type> kernels;
 
     static void
     copy( value_type const *src_v, index_type const *src_c,
@@ -200,8 +860,13 @@ struct sparse_dense_vector_operations {
     add( value_type *dst_v, index_type dst_length,
 	 value_type const *src_v, index_type const *src_c,
 	 index_type src_length ) {
-	for( index_type i=0; i < src_length; ++i )
-	    dst_v[src_c[i]] += src_v[i];
+	kernels::add( dst_v, src_v, src_c, src_length );
+    }
+
+    static value_type
+    dot( value_type const *a_v, index_type const *a_c, index_type a_length,
+	 value_type const *d, index_type d_length ) {
+	return kernels::dot( a_v, a_c, a_length, d );
     }
 
     static value_type
@@ -225,31 +890,9 @@ struct sparse_dense_vector_operations {
     square_euclidean_distance(
 	value_type const *a_v, index_type const *a_c, index_type a_length,
 	value_type const *d, index_type d_length, value_type d_sqnorm ) {
-	value_type sum = 0;
-	for( index_type j=0; j < a_length; ++j )
-	    sum += a_v[j] * ( a_v[j] - value_type(2) * d[a_c[j]] );
-	return sum + d_sqnorm;
+	return kernels::sq_dist_minus_sqnorm( a_v, a_c, a_length, d )
+	    + d_sqnorm;
     }
-
-#if 0
-    // Attempt to vectorize. Not noticably faster than non-vectorized code
-    static value_type
-    square_euclidean_distance(
-	value_type const *a_v, index_type const *a_c, index_type a_length,
-	value_type const *d, index_type d_length, value_type d_sqnorm ) {
-	value_type dd[a_length];
-	for( index_type j=0; j < a_length; ++j )
-	    dd[j] = d[a_c[j]];
-	value_type sum
-	    = __sec_reduce_add( sqadd( a_v[0:a_length], dd[0:a_length] ) );
-	return sum + d_sqnorm;
-    }
-
-private:
-    static value_type sqadd( value_type a, value_type b ) {
-	return a * ( a - value_type(2) * b );
-    }
-#endif
 };
 
 }
@@ -23,16 +23,20 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <string>
+#include <cassert>
 #include <list>
 #include <map>
 #include <utility>
 #include <memory>
 
+#include "asap/par.h"
 #include "asap/traits.h"
 #include "asap/hashtable.h"
 #include "asap/hashindex.h"
+#include "asap/radix_sort.h"
 
 namespace asap {
 
@@ -65,6 +69,30 @@ void reserve_space( Container & c, size_t s ) {
     c.reserve( s );
 }
 
+// Remove the elements of an associative container for which pred holds;
+// returns the number of elements removed.
+template<typename Container, typename Predicate>
+typename std::enable_if<is_specialization_of<hash_table, Container>::value,
+			size_t>::type
+erase_entries_if( Container & c, Predicate pred ) {
+    return c.erase_if( pred );
+}
+
+template<typename Container, typename Predicate>
+typename std::enable_if<!is_specialization_of<hash_table, Container>::value,
+			size_t>::type
+erase_entries_if( Container & c, Predicate pred ) {
+    size_t erased = 0;
+    for( auto I=c.begin(); I != c.end(); ) {
+	if( pred( *I ) ) {
+	    I = c.erase( I );
+	    ++erased;
+	} else
+	    ++I;
+    }
+    return erased;
+}
+
 class word_bank_base {
     // list of all chunks of text
     std::list<std::shared_ptr<char>> m_store;
@@ -514,6 +542,11 @@ public:
 	return ret.second ? ret.first : cend();
     }
 
+    // Sort the words (or the keys) in strcmp() order
+    void sort( sort_engine_t engine = se_parallel_radix ) {
+	sort_words( begin(), end(), engine );
+    }
+
 #if 0
     // TODO: this is imprecise:
     // + Not clear if range [I,E) is all of wb, or only part of it
@@ -720,6 +753,11 @@ public:
 	return ret.second ? ret.first : cend();
     }
 
+    // Sort the key-value pairs by key in strcmp() order
+    void sort( sort_engine_t engine = se_parallel_radix ) {
+	sort_words( begin(), end(), engine );
+    }
+
     // TODO: this is imprecise:
     // + Not clear if range [I,E) is all of wb, or only part of it
     // + As such, copying over all of wb may be too much
@@ -998,6 +1036,12 @@ public:
 
     void reserve( size_t n ) { reserve_space( this->m_words, n ); }
 
+    // Remove the words for which pred holds. The word bank is retained.
+    template<typename Predicate>
+    size_t erase_if( Predicate pred ) {
+	return erase_entries_if( this->m_words, pred );
+    }
+
     iterator find( const key_type & w ) {
 	return this->m_words.find( w );
     }
@@ -1196,7 +1240,7 @@ private:
 template<typename WordContainerTy>
 class word_container_reducer {
     typedef WordContainerTy type;
-    struct Monoid : cilk::monoid_base<type> {
+    struct Monoid : par::monoid_base<type> {
 	static void reduce( type * left, type * right ) {
 	    left->reduce( *right );
 	}
@@ -1209,13 +1253,13 @@ class word_container_reducer {
     };
 
 private:
-    cilk::reducer<Monoid> imp_;
+    par::reducer<Monoid> imp_;
 
 public:
     word_container_reducer() : imp_() { }
 
     void swap( type & c ) {
-	imp_.view().swap( c );
+	imp_.get_value().swap( c );
     }
 
 /*
@@ -1235,9 +1279,59 @@ public:
 	imp_.view().count_presence( rhs );
     }
 
-    type & get_value() { return imp_.view(); }
+    type & get_value() { return imp_.get_value(); }
+};
+
+
+// A file read into memory. The buffer holds size bytes followed by a
+// terminating null character and may be modified.
+struct file_buffer {
+    std::shared_ptr<char>	data;
+    size_t			size;
+
+    file_buffer() : size( 0 ) { }
 };
 
+namespace internal {
+
+inline std::shared_ptr<char> new_file_storage( size_t size ) {
+    return std::shared_ptr<char>( new char[size], std::default_delete<char[]>() );
+}
+
+// Read the file into a buffer obtained from alloc( size )
+// TODO: replace mmap( PROT_READ | PROT_WRITE, MAP_PRIVATE );
+template<typename Alloc>
+void read_file( const char * fname, file_buffer & file, Alloc && alloc ) {
+    struct stat finfo;
+    int fd;
+
+    if( (fd = open( fname, O_RDONLY )) < 0 )
+	fatale( "open", fname );
+    if( fstat( fd, &finfo ) < 0 )
+	fatale( "fstat", fname );
+
+    std::shared_ptr<char> sp = alloc( finfo.st_size + 1 );
+    char * buf = sp.get();
+    uint64_t r = 0;
+    while( r < (uint64_t)finfo.st_size ) {
+	uint64_t rr = pread( fd, buf + r, finfo.st_size - r, r );
+	if( rr == (uint64_t)-1 )
+	    fatale( "pread", fname );
+	r += rr;
+    }
+    buf[finfo.st_size] = '\0';
+
+    close( fd );
+
+    file.data = sp;
+    file.size = finfo.st_size;
+}
+
+inline void read_file( const char * fname, file_buffer & file ) {
+    read_file( fname, file, new_file_storage );
+}
+
+} // namespace internal
 
 template<typename WordContainerTy>
 class word_container_file_builder {
@@ -1255,6 +1349,12 @@ public:
 	: m_container( container ) {
 	open_file( filename );
     }
+    word_container_file_builder( const file_buffer & file,
+				 word_container_type & container )
+	: m_container( container ), m_buf( file.data ), m_size( file.size ) {
+	if( !word_container_type::is_managed )
+	    m_container.enregister( m_buf );
+    }
     ~word_container_file_builder() { }
 
     void swap( word_container_file_builder & w ) {
@@ -1278,42 +1378,13 @@ public:
 
 private:
     // Read the file into memory.
-    // TODO: replace mmap( PROT_READ | PROT_WRITE, MAP_PRIVATE );
     void open_file( const std::string & filename ) {
-	struct stat finfo;
-	int fd;
-
-	const char * fname = filename.c_str();
-
-	if( (fd = open( fname, O_RDONLY )) < 0 )
-	    fatale( "open", fname );
-	if( fstat( fd, &finfo ) < 0 )
-	    fatale( "fstat", fname );
-
-#if 0
-	char * buf = (char*)mmap(0, finfo.st_size + 1, 
-				 PROT_READ | PROT_WRITE,
-				 MAP_PRIVATE | MAP_POPULATE, fd, 0);
-#else
-	char * buf = new char[finfo.st_size+1];
-	uint64_t r = 0;
-	while( r < (uint64_t)finfo.st_size ) {
-	    uint64_t rr = pread( fd, buf + r, finfo.st_size - r, r );
-	    if( rr == (uint64_t)-1 )
-		fatale( "pread", fname );
-	    r += rr;
-	}
-#endif
-	buf[finfo.st_size] = '\0';
-
-	close( fd );
-
-	m_size = finfo.st_size;
-
-	std::shared_ptr<char> sp( buf, std::default_delete<char[]>() );
-	m_buf = sp;
+	file_buffer file;
+	internal::read_file( filename.c_str(), file );
+	m_size = file.size;
+	m_buf = file.data;
 	if( !word_container_type::is_managed )
-	    m_container.enregister( sp );
+	    m_container.enregister( m_buf );
     }
 };
 
@@ -25,12 +25,17 @@
 #include <cctype>
 #include <map>
 #include <cmath>
+#include <cassert>
 #include <type_traits>
 #include <iterator>
-#include <cilk/cilk.h>
-#include <cilk/reducer_opadd.h>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include "asap/par.h"
 
 #include "asap/word_bank.h"
+#include "asap/perfect_hash.h"
 
 namespace asap {
 
@@ -123,7 +128,7 @@ class map_reducer {
     typedef typename MapTy::mapped_type mapped_type;
     typedef typename MapTy::value_type value_type;
 
-    struct Monoid : cilk::monoid_base<type> {
+    struct Monoid : par::monoid_base<type> {
 #if 1
 	static void reduce( type * left, type * right ) {
 	    if( left->size() < right->size() )
@@ -192,13 +197,13 @@ class map_reducer {
     };
 
 private:
-    cilk::reducer<Monoid> imp_;
+    par::reducer<Monoid> imp_;
 
 public:
     map_reducer() : imp_() { }
 
     void swap( type & c ) {
-	imp_.view().swap( c );
+	imp_.get_value().swap( c );
     }
 
     mapped_type & operator [] ( const key_type & key ) {
@@ -208,13 +213,13 @@ public:
 	return imp_.view()[key];
     }
 
-    type & get_value() { return imp_.view(); }
+    type & get_value() { return imp_.get_value(); }
 };
 
 template<typename WordListTy>
 class word_list_reducer {
     typedef WordListTy type;
-    struct Monoid : cilk::monoid_base<type> {
+    struct Monoid : par::monoid_base<type> {
 	static void reduce( type * left, type * right ) {
 	    left->reduce( *right );
 	}
@@ -227,7 +232,7 @@ class word_list_reducer {
     };
 
 private:
-    cilk::reducer<Monoid> imp_;
+    par::reducer<Monoid> imp_;
 
 public:
     word_list_reducer() : imp_() { }
@@ -236,7 +241,7 @@ public:
     }
 
     void swap( type & c ) {
-	imp_.view().swap( c );
+	imp_.get_value().swap( c );
     }
 
     const char * index( char * p, size_t len ) {
@@ -280,6 +285,331 @@ private:
     const char * words[N];
 };
 
+/*
+ * word_interner: maps words to dense 32-bit IDs, shared by all threads.
+ *
+ * Every thread looks up words in a private cache without locking. Only
+ * words that the thread has not seen before are looked up in the shared
+ * table, which is split in shards that are protected by a lock and that
+ * keep their own copies of the words. The reverse mapping from ID to word
+ * is a two-level array that is extended without locks, such that words
+ * can be retrieved concurrently with interning.
+ *
+ * IDs are handed out in the order in which words first arrive and thus
+ * vary between parallel runs. They serve only as identity: n-grams hash
+ * on the FNV-1a hashes of their words and sort on the words, such that
+ * the contents and order of the n-gram containers do not depend on IDs.
+ */
+class word_interner {
+    static const size_t num_shards = 64;
+    static const size_t dir_bits = 16;
+    static const size_t dir_size = size_t(1) << dir_bits;
+    static const size_t block_size = size_t(1) << 16;
+
+    struct shard {
+	std::mutex						mux;
+	std::unordered_map<const char *, uint32_t,
+			   charp_hash, charp_eql>		ids;
+	std::vector<char *>					blocks;
+	size_t							used;
+	char							pad[64];
+
+	shard() : used( block_size ) { }
+	~shard() {
+	    for( char * b : blocks )
+		delete[] b;
+	}
+
+	const char * store( const char * w, size_t len ) {
+	    if( len + 1 > block_size ) {
+		blocks.insert( blocks.begin(), new char[len+1] );
+		memcpy( blocks.front(), w, len+1 );
+		return blocks.front();
+	    }
+	    if( used + len + 1 > block_size ) {
+		blocks.push_back( new char[block_size] );
+		used = 0;
+	    }
+	    char * p = &blocks.back()[used];
+	    memcpy( p, w, len+1 );
+	    used += len + 1;
+	    return p;
+	}
+    };
+
+    struct dir_entry {
+	const char	* word;
+	uint64_t	  hash;
+    };
+
+    // Open addressing table private to a thread. Entries point to the
+    // copies of the words in the shards, which live as long as the
+    // interner.
+    struct local_cache {
+	struct entry {
+	    uint64_t	  hash;
+	    const char	* word;	// nullptr if the slot is free
+	    uint32_t	  id;
+	    uint32_t	  len;
+	};
+
+	const word_interner	* owner;
+	std::vector<entry>	  table;
+	size_t			  used;
+
+	local_cache() : owner( nullptr ), used( 0 ) { }
+
+	void reset( const word_interner * wi ) {
+	    owner = wi;
+	    table.assign( size_t(1) << 12, entry{ 0, nullptr, 0, 0 } );
+	    used = 0;
+	}
+
+	static size_t slot( uint64_t hash, size_t mask ) {
+	    return ( hash ^ ( hash >> 32 ) ) & mask;
+	}
+
+	const entry * find( const char * w, size_t len, uint64_t hash ) const {
+	    size_t mask = table.size() - 1;
+	    for( size_t p=slot( hash, mask ); ; p = ( p + 1 ) & mask ) {
+		const entry & e = table[p];
+		if( !e.word )
+		    return nullptr;
+		if( e.hash == hash && e.len == len && !memcmp( e.word, w, len ) )
+		    return &e;
+	    }
+	}
+
+	void insert( const entry & n ) {
+	    if( 2 * ( used + 1 ) > table.size() ) {
+		std::vector<entry> old( table.size() * 2, entry{ 0, nullptr, 0, 0 } );
+		old.swap( table );
+		for( const entry & e : old )
+		    if( e.word )
+			place( e );
+	    }
+	    place( n );
+	    ++used;
+	}
+
+	void place( const entry & n ) {
+	    size_t mask = table.size() - 1;
+	    size_t p = slot( n.hash, mask );
+	    while( table[p].word )
+		p = ( p + 1 ) & mask;
+	    table[p] = n;
+	}
+    };
+
+    shard					m_shards[num_shards];
+    std::atomic<uint32_t>			m_next;
+    std::atomic<dir_entry *>			m_dir[size_t(1) << (32-dir_bits)];
+
+public:
+    word_interner() : m_next( 0 ) {
+	for( auto & d : m_dir )
+	    d.store( nullptr, std::memory_order_relaxed );
+    }
+    ~word_interner() {
+	for( auto & d : m_dir )
+	    delete[] d.load( std::memory_order_relaxed );
+    }
+
+    // The interner shared by all packed n-grams
+    static word_interner & global() {
+	static word_interner wi;
+	return wi;
+    }
+
+    size_t size() const { return m_next.load(); }
+
+    // Intern the NUL-terminated word w of length len. The FNV-1a hash of
+    // the word is returned in hash.
+    uint32_t intern( const char * w, size_t len, uint64_t & hash ) {
+	hash = charp_hash()( w );
+
+	local_cache & c = cache();
+	if( c.owner != this )
+	    c.reset( this );
+	if( const local_cache::entry * e = c.find( w, len, hash ) )
+	    return e->id;
+
+	const char * copy;
+	uint32_t id = intern_shared( w, len, hash, copy );
+	c.insert( local_cache::entry{ hash, copy, id, uint32_t(len) } );
+	return id;
+    }
+
+    uint32_t intern( const char * w, size_t len ) {
+	uint64_t hash;
+	return intern( w, len, hash );
+    }
+
+    const char * word( uint32_t id ) const { return at( id ).word; }
+    uint64_t hash( uint32_t id ) const { return at( id ).hash; }
+
+private:
+    static local_cache & cache() {
+	static thread_local local_cache c;
+	return c;
+    }
+
+    uint32_t intern_shared( const char * w, size_t len, uint64_t hash,
+			    const char * & copy ) {
+	shard & s = m_shards[hash % num_shards];
+	std::lock_guard<std::mutex> lock( s.mux );
+	auto F = s.ids.find( w );
+	if( F != s.ids.end() ) {
+	    copy = F->first;
+	    return F->second;
+	}
+
+	copy = s.store( w, len );
+	uint32_t id = m_next.fetch_add( 1 );
+	if( id == ~uint32_t(0) )
+	    fatal( "word_interner: out of IDs" );
+	s.ids.emplace( copy, id );
+	dir_entry & d = directory( id )[id & (dir_size-1)];
+	d.word = copy;
+	d.hash = hash;
+	return id;
+    }
+
+    const dir_entry & at( uint32_t id ) const {
+	return m_dir[id >> dir_bits].load( std::memory_order_acquire )
+	    [id & (dir_size-1)];
+    }
+
+    dir_entry * directory( uint32_t id ) {
+	std::atomic<dir_entry *> & d = m_dir[id >> dir_bits];
+	dir_entry * chunk = d.load( std::memory_order_acquire );
+	if( !chunk ) {
+	    dir_entry * fresh = new dir_entry[dir_size];
+	    if( d.compare_exchange_strong( chunk, fresh,
+					   std::memory_order_acq_rel ) )
+		chunk = fresh;
+	    else
+		delete[] fresh;
+	}
+	return chunk;
+    }
+};
+
+/*
+ * packed_ngram: an n-gram stored as the IDs of its words in the global
+ * word_interner, together with a polynomial hash over the hashes of the
+ * words that is updated as the n-gram slides over the text. Hashing and
+ * equality checks do not dereference the words.
+ */
+template<size_t N_>
+class packed_ngram {
+public:
+    static const size_t N = N_;
+    static const uint32_t empty = ~uint32_t(0);
+    static const uint64_t base = 0x100000001B3ULL;
+
+    packed_ngram() : m_hash( 0 ) { std::fill( &m_ids[0], &m_ids[N], empty ); }
+
+    // The i-th word
+    const char * operator[]( size_t i ) const {
+	return word_interner::global().word( m_ids[i] );
+    }
+
+    uint32_t id( size_t i ) const { return m_ids[i]; }
+    uint64_t hash() const { return m_hash; }
+
+    bool push_back( const char * w ) {
+	uint64_t h;
+	uint32_t id = word_interner::global().intern( w, strlen( w ), h );
+	return push_back_id( id, h );
+    }
+
+    // Append the word with the given ID and hash, dropping the first word
+    bool push_back_id( uint32_t id, uint64_t h ) {
+	if( N == 1 )
+	    m_hash = h;
+	else {
+	    if( m_ids[0] != empty )
+		m_hash -= word_interner::global().hash( m_ids[0] ) * top_power();
+	    m_hash = m_hash * base + h;
+	}
+	for( size_t i=0; i < N-1; ++i )
+	    m_ids[i] = m_ids[i+1];
+	m_ids[N-1] = id;
+	return m_ids[0] != empty; // all have been initialised
+    }
+
+    bool operator == ( const packed_ngram & ng ) const {
+	if( m_hash != ng.m_hash )
+	    return false;
+	for( size_t i=0; i < N; ++i )
+	    if( m_ids[i] != ng.m_ids[i] )
+		return false;
+	return true;
+    }
+
+private:
+    static uint64_t top_power() {
+	uint64_t p = 1;
+	for( size_t i=1; i < N; ++i )
+	    p *= base;
+	return p;
+    }
+
+private:
+    uint32_t m_ids[N];
+    uint64_t m_hash;
+};
+
+/*
+ * ngram_tuple: an n-gram of up to Max_ words, stored as the IDs of its
+ * words in the global word_interner. N-grams of different lengths share
+ * one dictionary. The hash covers the hashes of the words and the length
+ * and is calculated once on construction.
+ */
+template<size_t Max_>
+class ngram_tuple {
+public:
+    static const size_t N = Max_;
+    static const uint64_t base = 0x100000001B3ULL;
+
+    ngram_tuple() : m_hash( 0 ), m_len( 0 ) { }
+    ngram_tuple( const uint32_t * ids, const uint64_t * hashes, size_t len )
+	: m_len( len ) {
+	assert( len <= N );
+	uint64_t h = len;
+	for( size_t i=0; i < len; ++i ) {
+	    m_ids[i] = ids[i];
+	    h = h * base + hashes[i];
+	}
+	m_hash = h;
+    }
+
+    size_t size() const { return m_len; }
+
+    // The i-th word
+    const char * operator[]( size_t i ) const {
+	return word_interner::global().word( m_ids[i] );
+    }
+
+    uint32_t id( size_t i ) const { return m_ids[i]; }
+    uint64_t hash() const { return m_hash; }
+
+    bool operator == ( const ngram_tuple & ng ) const {
+	if( m_hash != ng.m_hash || m_len != ng.m_len )
+	    return false;
+	for( size_t i=0; i < m_len; ++i )
+	    if( m_ids[i] != ng.m_ids[i] )
+		return false;
+	return true;
+    }
+
+private:
+    uint64_t m_hash;
+    uint32_t m_ids[N];
+    uint32_t m_len;
+};
+
 struct ngram_hash {
     template<size_t N>
     size_t operator()( const ngram<N> & key ) const {
@@ -289,6 +619,22 @@ struct ngram_hash {
 	    h = ch.append( h, key[i] );
 	return h;
     }
+    // Mix the polynomial hash, as hash tables index by the low bits
+    template<size_t N>
+    size_t operator()( const packed_ngram<N> & key ) const {
+	return mix( key.hash() );
+    }
+    template<size_t N>
+    size_t operator()( const ngram_tuple<N> & key ) const {
+	return mix( key.hash() );
+    }
+private:
+    static size_t mix( uint64_t h ) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+    }
 };
 	
 struct ngram_cmp {
@@ -303,6 +649,29 @@ struct ngram_cmp {
 	}
 	return false;
     }
+    // Sort packed n-grams by their words, as for ngram<N>
+    template<size_t N>
+    bool operator () ( const packed_ngram<N> & lhs,
+		       const packed_ngram<N> & rhs ) const {
+	for( size_t i=0; i < N; ++i ) {
+	    if( lhs.id( i ) == rhs.id( i ) )
+		continue;
+	    return strcmp( lhs[i], rhs[i] ) < 0;
+	}
+	return false;
+    }
+    // Sort by words; an n-gram sorts before the longer n-grams it prefixes
+    template<size_t N>
+    bool operator () ( const ngram_tuple<N> & lhs,
+		       const ngram_tuple<N> & rhs ) const {
+	size_t n = std::min( lhs.size(), rhs.size() );
+	for( size_t i=0; i < n; ++i ) {
+	    if( lhs.id( i ) == rhs.id( i ) )
+		continue;
+	    return strcmp( lhs[i], rhs[i] ) < 0;
+	}
+	return lhs.size() < rhs.size();
+    }
 };
 
 struct ngram_eql {
@@ -314,12 +683,23 @@ struct ngram_eql {
 	}
 	return true;
     }
+    template<size_t N>
+    bool operator () ( const packed_ngram<N> & lhs,
+		       const packed_ngram<N> & rhs ) const {
+	return lhs == rhs;
+    }
+    template<size_t N>
+    bool operator () ( const ngram_tuple<N> & lhs,
+		       const ngram_tuple<N> & rhs ) const {
+	return lhs == rhs;
+    }
 };
 
+
 template<typename WordListTy>
 class ngram_list_reducer {
     typedef WordListTy type;
-    struct Monoid : cilk::monoid_base<type> {
+    struct Monoid : par::monoid_base<type> {
 	static void reduce( type * left, type * right ) {
 	    left->reduce( *right );
 	}
@@ -332,7 +712,7 @@ class ngram_list_reducer {
     };
 
 private:
-    cilk::reducer<Monoid> imp_;
+    par::reducer<Monoid> imp_;
 
 public:
     ngram_list_reducer() : imp_() { }
@@ -341,14 +721,14 @@ public:
     }
 
     void swap( type & c ) {
-	imp_.view().swap( c );
+	imp_.get_value().swap( c );
     }
 
     const char * store( char * p, size_t len ) {
 	return imp_.view().store( p, len );
     }
 
-    void index( const ngram<type::N> & ng ) {
+    void index( const typename type::key_type & ng ) {
 	return imp_.view().index( ng );
     }
 };
@@ -359,11 +739,12 @@ size_t word_catalog( char * data, size_t data_size,
 		   MapTy & catalog, size_t chunk_size ) {
     // Create a reducer hyperobject and prime it with the existing content
     word_list_reducer<MapTy> reduce_catalog(1<<16);
-    cilk::reducer< cilk::op_add<size_t> > reduce_num_words(0);
+    par::reducer< par::op_add<size_t> > reduce_num_words(0);
     reduce_catalog.swap( catalog );
 
     char * const data_end = &data[data_size];
     char * split = data;
+    par::task_group tg;
 
     while( split != data_end ) {
 	// Split the data at the chunk_size.
@@ -378,7 +759,7 @@ size_t word_catalog( char * data, size_t data_size,
 	    *end = '\0';
 
 	// Process the chunk from split to end
-	cilk_spawn [&] ( char * split, char * end ) {
+	tg.spawn( [&,split,end] () mutable {
 	    // TODO: is it better for locality to move toupper() into the
 	    //       inner loop, transforming while checking?
 	    // Or better: use a word_bank with self-allocated storage and
@@ -412,11 +793,86 @@ size_t word_catalog( char * data, size_t data_size,
 		    *reduce_num_words += 1;
 		}
 	    }
-        }( split, end );
+        } );
+        
+        split = end;
+    }
+    tg.sync();
+
+    reduce_catalog.swap( catalog );
+    return reduce_num_words.get_value();
+}
+
+// Variant of word_catalog that splits words on white space only and
+// preserves case. Carriage returns are dropped. If eol is non-null, every
+// line end is counted as an occurrence of the word eol, which must remain
+// valid as long as the catalog. This is the tokenisation of word2vec.
+template<typename MapTy>
+size_t token_catalog( char * data, size_t data_size,
+		      MapTy & catalog, size_t chunk_size,
+		      const char * eol = nullptr ) {
+    word_list_reducer<MapTy> reduce_catalog(1<<16);
+    par::reducer< par::op_add<size_t> > reduce_num_words(0);
+    reduce_catalog.swap( catalog );
+
+    size_t eol_len = eol ? strlen( eol ) : 0;
+    char * const data_end = &data[data_size];
+    char * split = data;
+    par::task_group tg;
+
+    while( split != data_end ) {
+	// Split the data at the chunk_size, adjusted to a line end, such that
+	// the last word of the chunk is followed by a delimiter we own.
+        char * end = std::min(split + chunk_size, data_end);
+	while( end != data_end && *end != '\n' )
+	    ++end;
+	if( end != data_end )
+	    ++end;
+
+	tg.spawn( [&,split,end] () mutable {
+	    while( split != end ) {
+		char c = *split;
+		if( c == ' ' || c == '\t' || c == '\r' ) {
+		    ++split;
+		    continue;
+		}
+		if( c == '\n' ) {
+		    if( eol ) {
+			reduce_catalog.index( const_cast<char *>( eol ), eol_len );
+			*reduce_num_words += 1;
+		    }
+		    ++split;
+		    continue;
+		}
+
+		// Pass over word, squeezing out carriage returns
+		char * w = split, * q = split;
+		while( split != end && *split != ' ' && *split != '\t'
+		       && *split != '\n' ) {
+		    if( *split != '\r' )
+			*q++ = *split;
+		    ++split;
+		}
+		// Consume the delimiter, which the terminator may overwrite
+		if( split != end ) {
+		    if( *split == '\n' && eol ) {
+			reduce_catalog.index( const_cast<char *>( eol ), eol_len );
+			*reduce_num_words += 1;
+		    }
+		    ++split;
+		}
+		*q = '\0'; // terminate
+
+		if( q != w ) {
+		    reduce_catalog.index( w, q-w );
+		    *reduce_num_words += 1;
+		}
+	    }
+        } );
         
         split = end;
     }
-    cilk_sync;
+    tg.sync();
 
     reduce_catalog.swap( catalog );
     return reduce_num_words.get_value();
@@ -427,11 +883,12 @@ size_t ngram_catalog( char * data, size_t data_size,
 		      MapTy & catalog, size_t chunk_size ) {
     // Create a reducer hyperobject and prime it with the existing content
     ngram_list_reducer<MapTy> reduce_catalog(1<<16);
-    cilk::reducer< cilk::op_add<size_t> > reduce_num_ngrams(0);
+    par::reducer< par::op_add<size_t> > reduce_num_ngrams(0);
     reduce_catalog.swap( catalog );
 
     char * const data_end = &data[data_size];
     char * split = data;
+    par::task_group tg;
 
     while( split != data_end ) {
 	// Split the data at the chunk_size.
@@ -446,8 +903,8 @@ size_t ngram_catalog( char * data, size_t data_size,
 	    *end = '\0';
 
 	// Process the chunk from split to end
-	cilk_spawn [&] ( char * split, char * end ) {
-	    ngram<MapTy::N> ng;
+	tg.spawn( [&,split,end] () mutable {
+	    typename MapTy::key_type ng;
 
 	    // TODO: is it better for locality to move toupper() into the
 	    //       inner loop, transforming while checking?
@@ -484,16 +941,173 @@ size_t ngram_catalog( char * data, size_t data_size,
 		    }
 		}
 	    }
-        }( split, end );
+        } );
         
         split = end;
     }
-    cilk_sync;
+    tg.sync();
 
     reduce_catalog.swap( catalog );
     return reduce_num_ngrams.get_value();
 }
 
+namespace internal {
+
+// Index all n-grams that start with ids[0], end in hist[last] and take
+// their n-2 interior words, in order, from hist[from..last-1]. The
+// positions of the interior words are enumerated in lexicographic order.
+// Returns the number of n-grams indexed.
+template<typename Reducer, typename KeyTy>
+size_t index_skip_grams( Reducer & reduce_catalog, const uint32_t * hist,
+			 const uint64_t * hist_hash, size_t last, size_t from,
+			 uint32_t * ids, uint64_t * hashes, size_t n ) {
+    static const size_t N = KeyTy::N;
+    assert( n >= 2 && n <= N );
+    const size_t k = n - 2;
+    if( from + k > last )
+	return 0;
+
+    size_t pos[N];
+    for( size_t i=0; i < k; ++i )
+	pos[i] = from + i;
+    ids[n-1] = hist[last];
+    hashes[n-1] = hist_hash[last];
+
+    size_t count = 0;
+    while( true ) {
+	for( size_t i=0; i < k; ++i ) {
+	    ids[1+i] = hist[pos[i]];
+	    hashes[1+i] = hist_hash[pos[i]];
+	}
+	reduce_catalog.index( KeyTy( ids, hashes, n ) );
+	++count;
+
+	// Advance the rightmost position that has room to move; pos[i] can
+	// go up to last-k+i
+	size_t i = k;
+	while( i > 0 && pos[i-1] == last - k + i - 1 )
+	    --i;
+	if( i == 0 )
+	    break;
+	++pos[i-1];
+	for( size_t j=i; j < k; ++j )
+	    pos[j] = pos[j-1] + 1;
+    }
+    return count;
+}
+
+} // namespace internal
+
+/*
+ * ngram_tuple_catalog: count the n-grams of nmin up to nmax words in a
+ * single pass over the text. If kskip is non-zero, k-skip-n-grams are
+ * counted as well, i.e., n-grams where up to kskip words are left out
+ * between the first and last word (Guthrie et al., LREC 2006). Every
+ * subsequence of words is counted once, at its last word.
+ *
+ * MapTy::key_type must be an ngram_tuple of at least nmax words.
+ */
+template<typename MapTy>
+size_t ngram_tuple_catalog( char * data, size_t data_size,
+			    MapTy & catalog, size_t chunk_size,
+			    size_t nmin, size_t nmax, size_t kskip ) {
+    typedef typename MapTy::key_type key_type;
+
+    if( nmin < 1 || nmin > nmax || nmax > key_type::N )
+	fatal( "ngram_tuple_catalog: n-gram lengths out of range" );
+
+    // Create a reducer hyperobject and prime it with the existing content
+    ngram_list_reducer<MapTy> reduce_catalog(1<<16);
+    par::reducer< par::op_add<size_t> > reduce_num_ngrams(0);
+    reduce_catalog.swap( catalog );
+
+    // The most recent words, enough for the longest skip-grams
+    const size_t window = nmax + kskip;
+
+    char * const data_end = &data[data_size];
+    char * split = data;
+    par::task_group tg;
+
+    while( split != data_end ) {
+	// Split the data at the chunk_size.
+        char * end = std::min(split + chunk_size, data_end);
+	// Adjust the split to word boundaries.
+	while( end != data_end &&
+	       *end != ' ' && *end != '\t' &&
+	       *end != '\r' && *end != '\n' )
+	    ++end;
+	if( end != data_end )
+	    *end = '\0';
+
+	// Process the chunk from split to end
+	tg.spawn( [&,split,end] () mutable {
+	    std::vector<uint32_t> hist( window );
+	    std::vector<uint64_t> hist_hash( window );
+	    uint32_t ids[key_type::N];
+	    uint64_t hashes[key_type::N];
+	    size_t have = 0;
+	    size_t ngrams = 0;
+
+	    for( char *I=split; I != end; ++I ) {
+		if( *I >= 'a' && *I <= 'z' )
+		    *I = ( *I - 'a' ) + 'A';
+	    }
+
+	    while( split != end ) {
+		// Skip non-upper characters
+		while( split != end && !(*split >= 'A' && *split <= 'Z') )
+		    ++split;
+		// Pass over word
+		char * w = split;
+		while( split != end
+		       && ((*split >= 'A' && *split <= 'Z') || *split == '\'') )
+		    ++split;
+		*split = '\0'; // terminate
+
+		if( split == w )
+		    continue;
+
+		// Slide the window; hist[window-1] is the current word
+		for( size_t i=1; i < window; ++i ) {
+		    hist[i-1] = hist[i];
+		    hist_hash[i-1] = hist_hash[i];
+		}
+		hist[window-1] = word_interner::global().intern(
+		    w, split-w, hist_hash[window-1] );
+		if( have < window )
+		    ++have;
+
+		const size_t last = window-1;
+		for( size_t n=nmin; n <= nmax && n <= have; ++n ) {
+		    if( n == 1 ) {
+			ids[0] = hist[last];
+			hashes[0] = hist_hash[last];
+			reduce_catalog.index( key_type( ids, hashes, 1 ) );
+			++ngrams;
+			continue;
+		    }
+		    // span is the distance from the first to the last word
+		    for( size_t span=n-1; span <= n-1+kskip && span < have;
+			 ++span ) {
+			ids[0] = hist[last-span];
+			hashes[0] = hist_hash[last-span];
+			ngrams += internal::index_skip_grams<
+			    ngram_list_reducer<MapTy>, key_type>(
+				reduce_catalog, &hist[0], &hist_hash[0], last,
+				last-span+1, ids, hashes, n );
+		    }
+		}
+	    }
+	    *reduce_num_ngrams += ngrams;
+        } );
+
+        split = end;
+    }
+    tg.sync();
+
+    reduce_catalog.swap( catalog );
+    return reduce_num_ngrams.get_value();
+}
 
 } // namespace text
 
@@ -553,6 +1167,42 @@ word_catalog( const std::string & filename,
 			       builder.get_word_list(), chunk_size );
 }
 
+// Variants of the above operating on a file that has been read already
+template<typename InternalContainerTy,
+	 typename WordContainerTy = InternalContainerTy>
+typename std::enable_if<!std::is_same<InternalContainerTy,WordContainerTy>::value, size_t>::type
+word_catalog( const file_buffer & file,
+	      WordContainerTy & word_container,
+	      size_t chunk_size = size_t(1)<<20 ) {
+    typedef InternalContainerTy word_container_type;
+    word_container_type intl_container;
+    word_container_file_builder<word_container_type>
+	builder( file, intl_container );
+    size_t nwords =
+	text::word_catalog( builder.get_buffer(),
+			    builder.get_buffer_end()-builder.get_buffer(),
+			    builder.get_word_list(), chunk_size );
+
+    internal::move_word_container( word_container, std::move(intl_container) );
+    intl_container.mark_clear();
+
+    return nwords;
+}
+
+template<typename InternalContainerTy,
+	 typename WordContainerTy = InternalContainerTy>
+typename std::enable_if<std::is_same<InternalContainerTy,WordContainerTy>::value, size_t>::type
+word_catalog( const file_buffer & file,
+	      WordContainerTy & word_container,
+	      size_t chunk_size = size_t(1)<<20 ) {
+    typedef WordContainerTy word_container_type;
+    word_container_file_builder<word_container_type>
+	builder( file, word_container );
+    return text::word_catalog( builder.get_buffer(),
+			       builder.get_buffer_end()-builder.get_buffer(),
+			       builder.get_word_list(), chunk_size );
+}
+
 template<typename InternalContainerTy,
 	 typename WordContainerTy = InternalContainerTy>
 typename std::enable_if<!std::is_same<InternalContainerTy,WordContainerTy>::value, size_t>::type
@@ -587,6 +1237,42 @@ ngram_catalog( const std::string & filename,
 				builder.get_word_list(), chunk_size );
 }
 
+template<typename InternalContainerTy,
+	 typename WordContainerTy = InternalContainerTy>
+typename std::enable_if<!std::is_same<InternalContainerTy,WordContainerTy>::value, size_t>::type
+ngram_tuple_catalog( const std::string & filename,
+		     WordContainerTy & word_container,
+		     size_t nmin, size_t nmax, size_t kskip = 0,
+		     size_t chunk_size = size_t(1)<<20 ) {
+    typedef InternalContainerTy word_container_type;
+    word_container_type intl_container;
+    word_container_file_builder<word_container_type>
+	builder( filename, intl_container );
+    size_t ngrams =
+	text::ngram_tuple_catalog(
+	    builder.get_buffer(), builder.get_buffer_end()-builder.get_buffer(),
+	    builder.get_word_list(), chunk_size, nmin, nmax, kskip );
+
+    internal::move_word_container( word_container, intl_container );
+
+    return ngrams;
+}
+
+template<typename InternalContainerTy,
+	 typename WordContainerTy = InternalContainerTy>
+typename std::enable_if<std::is_same<InternalContainerTy,WordContainerTy>::value, size_t>::type
+ngram_tuple_catalog( const std::string & filename,
+		     WordContainerTy & word_container,
+		     size_t nmin, size_t nmax, size_t kskip = 0,
+		     size_t chunk_size = size_t(1)<<20 ) {
+    typedef WordContainerTy word_container_type;
+    word_container_file_builder<word_container_type>
+	builder( filename, word_container );
+    return text::ngram_tuple_catalog(
+	builder.get_buffer(), builder.get_buffer_end()-builder.get_buffer(),
+	builder.get_word_list(), chunk_size, nmin, nmax, kskip );
+}
+
 
 template<typename MapTy>
 struct SizeCounter {
@@ -682,8 +1368,9 @@ template<typename Iterator,
 	     std::is_same<typename std::iterator_traits<Iterator>::iterator_tag,
 			  std::random_access_iterator_tag>::value>::type>
 void clear_ids( Iterator I, Iterator E ) {
-    cilk_for( Iterator JI=I; JI != E; ++JI )
+    par::parallel_for( I, E, []( Iterator JI ) {
 	JI->second.second = 0;
+    } );
 }
 
 template<typename Iterator, typename Functor>
@@ -706,12 +1393,193 @@ template<typename Iterator,
 	     std::is_same<typename std::iterator_traits<Iterator>::iterator_tag,
 			  std::random_access_iterator_tag>::value>::type>
 void assign_ids( Iterator I, Iterator E ) {
-    cilk_for( Iterator JI=I; JI != E; ++JI )
+    par::parallel_for( I, E, [&]( Iterator JI ) {
 	JI->second.second = std::distance(JI,I);
+    } );
 }
 
 } // internal
 
+/*
+ * df_filter: document frequency pruning of the joint word map. Words that
+ * occur in fewer than min_df documents, or in more than a fraction max_df
+ * of the documents, are removed. Of the remaining words, only the
+ * max_features words with highest document frequency are retained, if
+ * max_features is non-zero. Ties at the cut-off are broken in the
+ * iteration order of the word map.
+ */
+struct df_filter {
+    size_t min_df;
+    double max_df;
+    size_t max_features;
+
+    df_filter( size_t min_df_ = 1, double max_df_ = 1.0,
+	       size_t max_features_ = 0 )
+	: min_df( min_df_ ), max_df( max_df_ ),
+	  max_features( max_features_ ) { }
+
+    bool is_trivial() const {
+	return min_df <= 1 && max_df >= 1.0 && max_features == 0;
+    }
+};
+
+namespace internal {
+
+// The document frequency range [lo,hi] retained by a df_filter, and the
+// cut-off imposed by max_features: words with document frequency above
+// cut are retained, as are the first ties words with frequency cut.
+struct df_bounds {
+    size_t lo, hi, cut, ties;
+
+    bool in_range( size_t df ) const { return lo <= df && df <= hi; }
+};
+
+template<typename Iterator>
+df_bounds df_prepare( Iterator I, Iterator E, size_t num_docs,
+		      const df_filter & filter ) {
+    df_bounds b;
+    b.lo = std::max( filter.min_df, size_t(1) );
+    b.hi = std::min( num_docs, size_t( filter.max_df * double(num_docs) ) );
+    b.cut = b.lo;
+    b.ties = ~size_t(0);
+    if( filter.max_features == 0 || b.lo > b.hi )
+	return b;
+
+    // Histogram of document frequencies in range, highest first
+    std::vector<size_t> hist( b.hi - b.lo + 1, 0 );
+    for( Iterator JI=I; JI != E; ++JI )
+	if( b.in_range( JI->second.first ) )
+	    ++hist[b.hi - JI->second.first];
+
+    size_t acc = 0;
+    for( size_t k=0; k < hist.size(); ++k ) {
+	if( acc + hist[k] >= filter.max_features ) {
+	    b.cut = b.hi - k;
+	    b.ties = filter.max_features - acc;
+	    break;
+	}
+	acc += hist[k];
+    }
+    return b;
+}
+
+} // namespace internal
+
+/*
+ * prune_vocabulary: apply a df_filter to the joint word map and assign
+ * IDs to the retained words. Pruned words are removed, so they do not
+ * receive an ID and are skipped when calculating TF/IDF scores. Returns
+ * the number of words removed.
+ *
+ * This replaces internal::assign_ids. Word maps with random access
+ * iterators are pruned and numbered in parallel, other word maps are
+ * rebuilt.
+ */
+template<typename WordContainerTy>
+typename std::enable_if<
+    !std::is_same<typename std::iterator_traits<
+		      typename WordContainerTy::iterator>::iterator_category,
+		  std::random_access_iterator_tag>::value, size_t>::type
+prune_vocabulary( WordContainerTy & c, size_t num_docs,
+		  const df_filter & filter ) {
+    size_t erased = 0;
+    if( !filter.is_trivial() ) {
+	internal::df_bounds b
+	    = internal::df_prepare( c.begin(), c.end(), num_docs, filter );
+	size_t ties = b.ties;
+	erased = c.erase_if(
+	    [&]( const typename WordContainerTy::value_type & val ) {
+		size_t df = val.second.first;
+		if( !b.in_range( df ) || df < b.cut )
+		    return true;
+		if( df == b.cut ) {
+		    if( ties == 0 )
+			return true;
+		    --ties;
+		}
+		return false;
+	    } );
+    }
+    internal::assign_ids( c.begin(), c.end() );
+    return erased;
+}
+
+template<typename WordContainerTy>
+typename std::enable_if<
+    std::is_same<typename std::iterator_traits<
+		     typename WordContainerTy::iterator>::iterator_category,
+		 std::random_access_iterator_tag>::value, size_t>::type
+prune_vocabulary( WordContainerTy & c, size_t num_docs,
+		  const df_filter & filter ) {
+    typedef typename WordContainerTy::value_type value_type;
+    typedef typename WordContainerTy::iterator iterator;
+
+    iterator I = c.begin();
+    size_t n = c.size();
+    if( filter.is_trivial() ) {
+	par::parallel_for( size_t(0), n, [&]( size_t j ) {
+	    I[j].second.second = j;
+	} );
+	return 0;
+    }
+
+    // The histogram for max_features is built sequentially, as per-block
+    // histograms would be as large as the number of documents.
+    internal::df_bounds b = internal::df_prepare( I, c.end(), num_docs, filter );
+
+    // Count retained words and ties per block
+    size_t nblocks = std::max( size_t(1), std::min( n / 4096 + 1,
+						    4 * par::num_workers() ) );
+    size_t bsize = ( n + nblocks - 1 ) / nblocks;
+    std::vector<size_t> kept( nblocks+1, 0 ), ties( nblocks+1, 0 );
+    par::parallel_for( size_t(0), nblocks, [&]( size_t k ) {
+	size_t e = std::min( n, (k+1) * bsize );
+	for( size_t j=k*bsize; j < e; ++j ) {
+	    size_t df = I[j].second.first;
+	    if( b.in_range( df ) && df >= b.cut ) {
+		if( df == b.cut )
+		    ++ties[k+1];
+		else
+		    ++kept[k+1];
+	    }
+	}
+    }, 1 );
+
+    // Every block retains the ties not taken by blocks before it, up to
+    // the tie budget.
+    for( size_t k=0; k < nblocks; ++k ) {
+	ties[k+1] += ties[k];
+	size_t t = std::min( ties[k+1], b.ties )
+	    - std::min( ties[k], b.ties );
+	kept[k+1] += kept[k] + t;
+    }
+    size_t nkept = kept[nblocks];
+
+    // Move the retained words into place and number them
+    std::vector<value_type> words( nkept );
+    par::parallel_for( size_t(0), nblocks, [&]( size_t k ) {
+	size_t e = std::min( n, (k+1) * bsize );
+	size_t pos = kept[k];
+	size_t tie = ties[k];
+	for( size_t j=k*bsize; j < e; ++j ) {
+	    size_t df = I[j].second.first;
+	    if( !b.in_range( df ) || df < b.cut )
+		continue;
+	    if( df == b.cut && tie++ >= b.ties )
+		continue;
+	    words[pos] = I[j];
+	    words[pos].second.second = pos;
+	    ++pos;
+	}
+    }, 1 );
+    par::parallel_for( size_t(0), nkept, [&]( size_t j ) {
+	I[j] = words[j];
+    } );
+    c.resize( nkept );
+
+    return n - nkept;
+}
+
 template<bool enable_bin_search, typename lookup_type>
 typename std::enable_if<enable_bin_search, typename lookup_type::const_iterator>::type
 tfidf_lookup( lookup_type & joint_word_map, const char * key, bool is_sorted ) {
@@ -740,21 +1608,51 @@ tfidf_lookup( lookup_type & joint_word_map, const text::ngram<lookup_type::N> &
     return joint_word_map.find( key );
 }
 
+template<bool enable_bin_search, typename lookup_type>
+typename std::enable_if<enable_bin_search, typename lookup_type::const_iterator>::type
+tfidf_lookup( lookup_type & joint_word_map, const text::packed_ngram<lookup_type::N> & key, bool is_sorted ) {
+    return is_sorted
+	? joint_word_map.binary_search( key )
+	: joint_word_map.find( key );
+}
+
+template<bool enable_bin_search, typename lookup_type>
+typename std::enable_if<!enable_bin_search, typename lookup_type::const_iterator>::type
+tfidf_lookup( lookup_type & joint_word_map, const text::packed_ngram<lookup_type::N> & key, bool is_sorted ) {
+    return joint_word_map.find( key );
+}
+
+template<bool enable_bin_search, typename lookup_type>
+typename std::enable_if<enable_bin_search, typename lookup_type::const_iterator>::type
+tfidf_lookup( lookup_type & joint_word_map, const text::ngram_tuple<lookup_type::N> & key, bool is_sorted ) {
+    return is_sorted
+	? joint_word_map.binary_search( key )
+	: joint_word_map.find( key );
+}
+
+template<bool enable_bin_search, typename lookup_type>
+typename std::enable_if<!enable_bin_search, typename lookup_type::const_iterator>::type
+tfidf_lookup( lookup_type & joint_word_map, const text::ngram_tuple<lookup_type::N> & key, bool is_sorted ) {
+    return joint_word_map.find( key );
+}
+
 
+// Calculate the TF/IDF score of a word. Returns false if the word does not
+// occur in the joint word map, i.e., it was pruned.
 template<bool WordContSameAsLookup, typename ValueTy, typename IndexTy,
 	 typename InputIterator, typename WordLookupTy>
-void
+bool
 tfidf_map_word( ValueTy *v, IndexTy *c, InputIterator MI,
 		WordLookupTy & joint_word_map,
 		size_t num_points, bool is_sorted ) {
     typedef ValueTy value_type;
 
-    // Should always find the word!
     typename WordLookupTy::const_iterator F
 	= tfidf_lookup<
 	    /*std::is_same<WordContainerTy,WordLookupTy>::value*/
 	    WordContSameAsLookup>( joint_word_map, MI->first, is_sorted );
-    assert( F != joint_word_map.cend() );
+    if( F == joint_word_map.cend() )
+	return false;
 
     size_t tcount = F->second.first;
     size_t id = F->second.second;
@@ -764,21 +1662,26 @@ tfidf_map_word( ValueTy *v, IndexTy *c, InputIterator MI,
 	= log10(value_type(num_points + 1) / value_type(tcount + 1)); 
     *c = id;
     *v = value_type(tf) * norm; // tfidf
+    return true;
 }
 
+// Returns the number of scores stored, which is less than the size of the
+// catalog if the joint word map has been pruned.
 template<bool WordContSameAsLookup, typename ValueTy, typename IndexTy,
 	 typename InputIterator, typename WordLookupTy>
-void
+size_t
 tfidf_map_catalog( ValueTy *v, IndexTy *c,
 		   InputIterator I, InputIterator E,
 		   WordLookupTy & joint_word_map,
 		   size_t num_points, bool is_sorted ) {
     size_t f = 0;
     for( InputIterator MI=I, ME=E; MI != ME; ++MI ) {
-	tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI, joint_word_map,
-					      num_points, is_sorted );
-	++f;
+	if( tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI,
+						  joint_word_map,
+						  num_points, is_sorted ) )
+	    ++f;
     }
+    return f;
 }
 
 template<bool WordContSameAsLookup, typename ValueTy, typename IndexTy,
@@ -786,7 +1689,7 @@ template<bool WordContSameAsLookup, typename ValueTy, typename IndexTy,
 	 typename = typename std::enable_if<
 	     std::is_same<typename std::iterator_traits<InputIterator>::iterator_tag,
 			  std::random_access_iterator_tag>::value>::type>
-void
+size_t
 tfidf_map_catalog( ValueTy *v, IndexTy *c,
 		   InputIterator I, InputIterator E,
 		   WordLookupTy & joint_word_map,
@@ -794,18 +1697,35 @@ tfidf_map_catalog( ValueTy *v, IndexTy *c,
     typedef ValueTy value_type;
 
     if( std::distance( I, E ) > 1000 ) {
-	cilk_for( InputIterator MI=I; MI != E; ++MI ) {
+	// Scores are stored by position; pruned words are marked and
+	// squeezed out afterwards.
+	const IndexTy pruned = ~IndexTy(0);
+	par::parallel_for( I, E, [&]( InputIterator MI ) {
 	    size_t f = std::distance( I, MI ); // O(1) for random access iterator
-	    tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI, joint_word_map,
-						  num_points, is_sorted );
+	    if( !tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI,
+						       joint_word_map,
+						       num_points, is_sorted ) )
+		c[f] = pruned;
+	} );
+	size_t n = std::distance( I, E );
+	size_t f = 0;
+	for( size_t j=0; j < n; ++j ) {
+	    if( c[j] != pruned ) {
+		v[f] = v[j];
+		c[f] = c[j];
+		++f;
+	    }
 	}
+	return f;
     } else {
 	size_t f = 0;
 	for( InputIterator MI=I; MI != E; ++MI ) {
-	    tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI, joint_word_map,
-						  num_points, is_sorted );
-	    ++f;
+	    if( tfidf_map_word<WordContSameAsLookup>( &v[f], &c[f], MI,
+						      joint_word_map,
+						      num_points, is_sorted ) )
+		++f;
 	}
+	return f;
     }
 }
 
@@ -882,34 +1802,66 @@ tfidf( InputIterator I, InputIterator E,
 #endif
 
     // Calculate TF/IDF scores
-    cilk_for( size_t i=0; i < num_points; ++i ) {
+    std::atomic<bool> any_pruned( false );
+    par::parallel_for( size_t(0), num_points, [&]( size_t i ) {
 	auto PI = std::next( I, i ); // Get word map to operate on
 	size_t fcount = PI->size();
 
 	value_type *v = &vectors.get_alloc_v()[vec_start[i]];
 	index_type *c = &vectors.get_alloc_i()[vec_start[i]];
 
-	tfidf_map_catalog<
+	size_t n = tfidf_map_catalog<
 	    std::is_same<WordContainerTy,WordLookupTy>::value>(
 		v, c, PI->cbegin(), PI->cend(), joint_word_map,
 		num_points, is_sorted );
+	if( n < fcount ) {
+	    vectors.shrink( i, n );
+	    any_pruned = true;
+	}
 
 	// In case of collections where IDs have not been assigned in the
 	// natural iteration order, we need to now sort the sparse vectors.
 	if( !iterate_ascending )
 	    vectors[i].sort_by_index();
-    }
+    } );
 
     delete[] vec_start;
 
+    // Close the gaps left by words that were pruned from the joint word map
+    if( any_pruned )
+	vectors.compact();
+
     const char * name = "tfidf";
     return data_set_type( name, joint_word_map_ptr, vec_names_ptr, vectors_ptr,
 			  false );
 }
 
+namespace internal {
+
+// Word containers with random access to words can be frozen into a
+// perfect_hash_index for lookup. Some iterators claim random access
+// without supporting it, hence check for the operations used.
+template<typename WordContainerTy, typename = void>
+struct can_freeze : std::false_type { };
+
+template<typename WordContainerTy>
+struct can_freeze<WordContainerTy, typename std::enable_if<
+    std::is_same<typename std::decay<
+		     decltype(std::declval<const WordContainerTy &>()
+			      .cbegin()[size_t(0)].first)>::type,
+		 const char *>::value
+    && std::is_same<typename std::decay<
+			decltype(std::declval<const WordContainerTy &>()
+				 [size_t(0)].first)>::type,
+		    const char *>::value>::type>
+    : std::true_type { };
+
+} // namespace internal
+
 template<typename VectorTy, typename InputIterator, typename WordContainerTy,
 	 typename VectorNameTy>
-data_set<VectorTy, WordContainerTy, VectorNameTy>
+typename std::enable_if<!internal::can_freeze<WordContainerTy>::value,
+			data_set<VectorTy, WordContainerTy, VectorNameTy>>::type
 tfidf( InputIterator I, InputIterator E,
        std::shared_ptr<WordContainerTy> & joint_word_map_ptr,
        std::shared_ptr<VectorNameTy> & vec_names_ptr,
@@ -919,6 +1871,29 @@ tfidf( InputIterator I, InputIterator E,
 				vec_names_ptr, is_sorted, iterate_ascending );
 }
 
+// The joint word map is read-only from here on. Rather than binary
+// searching it for every word, freeze it into a minimal perfect hash.
+template<typename VectorTy, typename InputIterator, typename WordContainerTy,
+	 typename VectorNameTy>
+typename std::enable_if<internal::can_freeze<WordContainerTy>::value,
+			data_set<VectorTy, WordContainerTy, VectorNameTy>>::type
+tfidf( InputIterator I, InputIterator E,
+       std::shared_ptr<WordContainerTy> & joint_word_map_ptr,
+       std::shared_ptr<VectorNameTy> & vec_names_ptr,
+       bool is_sorted, bool iterate_ascending ) {
+    if( !is_sorted )
+	return tfidf<VectorTy, InputIterator, WordContainerTy, WordContainerTy,
+		     VectorNameTy>( I, E, joint_word_map_ptr, *joint_word_map_ptr,
+				    vec_names_ptr, is_sorted, iterate_ascending );
+
+    typedef perfect_hash_index<WordContainerTy, text::charp_hash,
+			       text::charp_eql> lookup_type;
+    lookup_type lookup( *joint_word_map_ptr );
+    return tfidf<VectorTy, InputIterator, WordContainerTy, lookup_type,
+		 VectorNameTy>( I, E, joint_word_map_ptr, lookup,
+				vec_names_ptr, is_sorted, iterate_ascending );
+}
+
 /*
  * tfidf_by_words: construct TF/IDF scores and structure output as one vector
  *                 per word.
@@ -950,74 +1925,51 @@ tfidf_by_words( InputIterator I, InputIterator E,
 
     // Construct set of vectors, either dense or sparse
     static_assert( is_sparse_vector<VectorTy>::value, "must be sparse - constructor" );
-    std::shared_ptr<vector_list_type> vectors_ptr
-	= std::make_shared<vector_list_type>( num_points, num_dimensions, nonzeros );
-    vector_list_type & vectors = *vectors_ptr;
 
-    // Prepare for parallel access. Vectors are by word, so we need to know
-    // the number of files each word occurs in.
     // As we are iterating over all word in this version of TF/IDF, assign
     // unique IDs to each word in the process.
-    size_t * vec_start = new size_t[num_points];
-    size_t inc_nonzeros = 0;
-    size_t i=0;
     decltype(joint_word_map.begin()->second.second) uniq_id = 0;
     // TODO: measure time spent specifically in the next loop
     // 	     if promising, consider parallelising this loop
     for( typename index_list_type::iterator JI=joint_word_map.begin(),
-	     JE=joint_word_map.end(); JI != JE; ++JI, ++i ) {
-	size_t fcount = JI->second.first; // number of documents containing word
+	     JE=joint_word_map.end(); JI != JE; ++JI )
+	JI->second.second = uniq_id++; // set unique ID for the word
+
+    // Calculate the TF/IDF scores by file first. This is the natural
+    // orientation of the input and allows each file to be processed
+    // independently.
+    vector_list_type by_file( num_dimensions, num_points, nonzeros );
+    size_t * vec_start = new size_t[num_dimensions];
+    size_t inc_nonzeros = 0;
+    size_t i=0;
+    for( auto II=I; II != E; ++II, ++i ) {
+	size_t fcount = II->size();
 	vec_start[i] = inc_nonzeros;
 	inc_nonzeros += fcount;
 
-	vectors.emplace_back( num_dimensions, fcount );
-
-	JI->second.second = uniq_id++; // set unique ID for the word
+	by_file.emplace_back( num_points, fcount );
     }
     assert( nonzeros == inc_nonzeros );
 
-    // Counters for concurrent access
-    size_t * word_ctr = new size_t [num_points];
-    std::fill( &word_ctr[0], &word_ctr[num_points], 0 );
+    par::parallel_for( size_t(0), num_dimensions, [&]( size_t i ) {
+	auto PI = std::next( I, i ); // The i-th file
 
-    // Calculate word-to-file mapping
-    // For each file
-    cilk_for( size_t i=0; i < num_dimensions; ++i ) {
-	// The i-th file
-	auto PI = std::next( I, i );
+	value_type *v = &by_file.get_alloc_v()[vec_start[i]];
+	index_type *c = &by_file.get_alloc_i()[vec_start[i]];
 
-	// For each word in the file
-	for( typename its_const_type<InputIterator>::const_iterator
-		 MI=PI->cbegin(), ME=PI->cend(); MI != ME; ++MI ) {
-	    // Should always find the word!
-	    typename index_list_type::const_iterator F = is_sorted
-		? joint_word_map.binary_search( MI->first )
-		: joint_word_map.find( MI->first );
-	    assert( F != joint_word_map.cend() );
-
-	    size_t fcount = F->second.first; // Number of files involved in.
-	    value_type norm
-		= log10(value_type(num_dimensions + 1) / value_type(fcount + 1)); 
-	    size_t id = F->second.second; // Word ID
-	
-	    size_t pos = __sync_fetch_and_add( &word_ctr[id], 1 );
-	    assert( pos < fcount );
-
-	    value_type *v = &vectors.get_alloc_v()[vec_start[id]];
-	    index_type *c = &vectors.get_alloc_i()[vec_start[id]];
-
-	    size_t tf = MI->second; // Term frequency
-	    v[pos] = value_type(tf) * norm; // tfidf
-	    c[pos] = i;
-	}
-    }
-
-    // Note: sort vectors if needed, as we have stored them concurrently.
-    cilk_for( size_t i=0; i < num_points; ++i )
-	vectors[i].sort_by_index();
+	size_t n = tfidf_map_catalog<true>( v, c, PI->cbegin(), PI->cend(),
+					    joint_word_map, num_dimensions,
+					    is_sorted );
+	if( n < PI->size() )
+	    by_file.shrink( i, n );
+    } );
 
     delete[] vec_start;
-    delete[] word_ctr;
+    by_file.compact();
+
+    // Restructure as one vector per word. The transpose visits the files
+    // in order, hence the vectors are sorted by file.
+    std::shared_ptr<vector_list_type> vectors_ptr = by_file.transpose();
 
     const char * name = "tfidf-by-words";
     return data_set_type( name, joint_word_map_ptr, vec_names_ptr, vectors_ptr,
@@ -1067,7 +2019,7 @@ tfidf_inplace( InputIterator I, InputIterator E,
     //   (i) no new storage required
     //  (ii) seq loop over maps for preparing vectors is avoided
     // (iii) seq loop over joint_word_map setting IDs is avoided
-    cilk_for( size_t i=0; i < num_points; ++i ) {
+    par::parallel_for( size_t(0), num_points, [&]( size_t i ) {
 	auto PI = std::next( I, i ); // Get word map to operate on
 	size_t fcount = PI->size();
 
@@ -1086,7 +2038,7 @@ tfidf_inplace( InputIterator I, InputIterator E,
 		= log10(value_type(num_points + 1) / value_type(tcount + 1)); 
 	    MI->second = value_type(tf) * norm; // tfidf
 	}
-    }
+    } );
 }
 
 template<typename Type1, typename Type2>
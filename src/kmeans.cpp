@@ -22,10 +22,7 @@
 #include <unistd.h>
 #include <climits>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -135,7 +132,7 @@ int main(int argc, char **argv) {
     //read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     typedef asap::sparse_vector<size_t, float, true, asap::mm_ownership_policy>
 	vector_type;
@@ -0,0 +1,244 @@
+/* -*-C++-*-
+*/
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Sociometer clustering: cluster calling profiles with K-Means, label every
+ * cluster with the nearest archetype and output the label of every user.
+ * This is the single-node counterpart of forth/clustering.py.
+ *
+ * The output holds a line <region>,<user_id>,<label>,<cluster> per user.
+ * Optionally, the labelled cluster centres are written in the format of
+ * forth/clustering.py, i.e., ('<label>', [<centre>]) per cluster.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <limits>
+#include <unistd.h>
+
+#include "asap/par.h"
+#include "asap/utils.h"
+#include "asap/dense_vector.h"
+#include "asap/word_bank.h"
+#include "asap/data_set.h"
+#include "asap/kmeans.h"
+#include "asap/sociometer.h"
+
+#include <stddefines.h>
+
+size_t num_clusters = 100;
+size_t num_runs = 5;
+size_t max_iters = 20;
+unsigned seed = 1;
+char const * infile = nullptr;
+char const * outfile = nullptr;
+char const * archfile = nullptr;
+char const * centresfile = nullptr;
+
+static void help(char *progname) {
+    std::cout << "Usage: " << progname
+	      << " -i <profiles> -a <archetypes> -o <outfile>"
+	      << " [-C <centres-file>] [-c <numclusters>] [-r <runs>]"
+	      << " [-m <maxiters>] [-s <seed>]\n";
+}
+
+static void parse_args(int argc, char **argv) {
+    int c;
+    extern char *optarg;
+
+    while ((c = getopt(argc, argv, "i:a:o:C:c:r:m:s:")) != EOF) {
+	switch (c) {
+	case 'i':
+	    infile = optarg;
+	    break;
+	case 'a':
+	    archfile = optarg;
+	    break;
+	case 'o':
+	    outfile = optarg;
+	    break;
+	case 'C':
+	    centresfile = optarg;
+	    break;
+	case 'c':
+	    num_clusters = atoi(optarg);
+	    break;
+	case 'r':
+	    num_runs = atoi(optarg);
+	    break;
+	case 'm':
+	    max_iters = atoi(optarg);
+	    break;
+	case 's':
+	    seed = atoi(optarg);
+	    break;
+	case '?':
+	    help(argv[0]);
+	    exit(1);
+	}
+    }
+
+    if( num_clusters <= 0 )
+	fatal( "Number of clusters must be larger than 0." );
+    if( num_runs <= 0 )
+	fatal( "Number of runs must be larger than 0." );
+    if( !infile )
+	fatal( "Input file must be supplied." );
+    if( !archfile )
+	fatal( "Archetypes file must be supplied." );
+    if( !outfile )
+	fatal( "Output file must be supplied." );
+
+    std::cerr << "Number of clusters = " << num_clusters << '\n';
+    std::cerr << "Number of runs = " << num_runs << '\n';
+    std::cerr << "Input file = " << infile << '\n';
+    std::cerr << "Archetypes file = " << archfile << '\n';
+    std::cerr << "Output file = " << outfile << '\n';
+}
+
+typedef float real;
+
+int main(int argc, char **argv) {
+    struct timespec begin, end;
+    struct timespec veryStart;
+
+    get_time( begin );
+    get_time( veryStart );
+
+    parse_args( argc, argv );
+
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
+
+    typedef asap::dense_vector<size_t, real, true, asap::mm_no_ownership_policy>
+	vector_type;
+    typedef asap::word_list<std::vector<const char *>, asap::word_bank_pre_alloc>
+	word_list;
+    typedef asap::data_set<vector_type, word_list, word_list> data_set_type;
+
+    std::vector<const char *> regions;
+    data_set_type data_set
+	= asap::sociometer::profile_read<data_set_type>( infile, regions );
+    asap::sociometer::archetype_set<real> archetypes( archfile );
+
+    size_t num_points = data_set.get_num_points();
+    std::cout << "Points: " << num_points << std::endl;
+    std::cout << "Archetypes: " << archetypes.size() << std::endl;
+    if( num_points == 0 )
+	fatal( "No profiles in input file '", infile, "'" );
+    if( num_clusters > num_points ) {
+	std::cerr << "Reducing number of clusters to number of points\n";
+	num_clusters = num_points;
+    }
+
+    get_time( end );
+    print_time( "input", begin, end );
+
+    // K-means, retaining the run with the smallest within-cluster SSE
+    get_time( begin );
+    srand( seed );
+    typedef decltype(asap::kmeans( data_set, num_clusters, max_iters ))
+	kmeans_type;
+    std::unique_ptr<kmeans_type> best;
+    for( size_t r=0; r < num_runs; ++r ) {
+	std::unique_ptr<kmeans_type> km( new kmeans_type(
+	    asap::kmeans( data_set, num_clusters, max_iters ) ) );
+	std::cerr << "run " << r << ": within cluster SSE "
+		  << km->within_sse() << "\n";
+	if( !best || km->within_sse() < best->within_sse() )
+	    best = std::move( km );
+    }
+    get_time( end );
+    print_time( "kmeans", begin, end );
+
+    fprintf( stdout, "iterations: %d\n", (int)best->num_iterations() );
+    fprintf( stdout, "within cluster SSE: %11.4lf\n",
+	     (double)best->within_sse() );
+
+    // Label the centres and assign every user to the nearest centre
+    get_time( begin );
+    const auto & centres = best->centres();
+    std::vector<size_t> centre_label( num_clusters );
+    for( size_t k=0; k < num_clusters; ++k )
+	centre_label[k] = archetypes.nearest( centres[k] );
+
+    std::vector<size_t> assignment( num_points );
+    auto points = data_set.vector_cbegin();
+    asap::par::parallel_for( size_t(0), num_points, [&]( size_t i ) {
+	real smallest = std::numeric_limits<real>::max();
+	size_t nearest = 0;
+	for( size_t k=0; k < num_clusters; ++k ) {
+	    real d = points[i].sq_dist( centres[k] );
+	    if( d < smallest ) {
+		smallest = d;
+		nearest = k;
+	    }
+	}
+	assignment[i] = nearest;
+    } );
+    get_time( end );
+    print_time( "labelling", begin, end );
+
+    // Output
+    get_time( begin );
+    std::vector<size_t> label_count( archetypes.size(), 0 );
+    {
+	std::ofstream of( outfile, std::ios_base::out );
+	if( !of )
+	    fatale( "open", outfile );
+	auto users = data_set.index2_cbegin();
+	for( size_t i=0; i < num_points; ++i, ++users ) {
+	    size_t a = centre_label[assignment[i]];
+	    ++label_count[a];
+	    of << regions[i] << ',' << *users << ','
+	       << archetypes.name( a ) << ',' << assignment[i] << '\n';
+	}
+    }
+
+    if( centresfile ) {
+	std::ofstream of( centresfile, std::ios_base::out );
+	if( !of )
+	    fatale( "open", centresfile );
+	for( size_t k=0; k < num_clusters; ++k ) {
+	    of << "('" << archetypes.name( centre_label[k] ) << "', [";
+	    for( size_t i=0; i < asap::sociometer::num_slots; ++i )
+		of << ( i ? ", " : "" ) << centres[k][i];
+	    of << "])\n";
+	}
+    }
+
+    // Users per label, listing each label once
+    for( size_t a=0; a < archetypes.size(); ++a ) {
+	size_t count = label_count[a];
+	bool first = true;
+	for( size_t b=0; b < a; ++b )
+	    first &= archetypes.name( b ) != archetypes.name( a );
+	if( !first )
+	    continue;
+	for( size_t b=a+1; b < archetypes.size(); ++b )
+	    if( archetypes.name( b ) == archetypes.name( a ) )
+		count += label_count[b];
+	std::cout << archetypes.name( a ) << ": " << count << '\n';
+    }
+    get_time( end );
+    print_time( "output", begin, end );
+
+    print_time( "complete time", veryStart, end );
+
+    return 0;
+}
@@ -23,11 +23,9 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
 //#include "cilkpub/sort.h"
 
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -37,6 +35,7 @@
 #include "asap/io.h"
 #include "asap/hashtable.h"
 #include "asap/hashindex.h"
+#include "asap/string_dict.h"
 #include "asap/traits.h"
 
 #include <stddefines.h>
@@ -46,16 +45,22 @@
 enum algorithm_t {
     a_baseline,
     a_unsorted_fast,
-    a_sorted_fast
+    a_sorted_fast,
+    a_dictionary
 };
 
 char const * indir = nullptr;
 char const * outfile = nullptr;
 bool do_sort = false;
 algorithm_t algo = a_baseline;
+asap::sort_engine_t sort_engine = asap::se_parallel_radix;
+asap::df_filter df_pruning;
+size_t prefetch_depth = 16;
 
 static void help(char *progname) {
-    std::cout << "Usage: " << progname << " -i <indir> -o <outfile> [-a {hus}] [-w] [-s]\n";
+    std::cout << "Usage: " << progname << " -i <indir> -o <outfile> [-a {husd}] [-w] [-s] [-e {crp}]"
+	" [-f <min-df>] [-F <max-df-fraction>] [-x <max-features>]"
+	" [-p <files-in-flight>]\n";
 }
 
 algorithm_t decode_char( char c ) {
@@ -63,7 +68,17 @@ algorithm_t decode_char( char c ) {
     case 'h': return a_baseline;
     case 'u': return a_unsorted_fast;
     case 's': return a_sorted_fast;
-    default: fatal( "configuration string can only be h, u or s" );
+    case 'd': return a_dictionary;
+    default: fatal( "configuration string can only be h, u, s or d" );
+    }
+}
+
+asap::sort_engine_t decode_engine( char c ) {
+    switch(std::tolower(c)) {
+    case 'c': return asap::se_comparison;
+    case 'r': return asap::se_radix;
+    case 'p': return asap::se_parallel_radix;
+    default: fatal( "sort engine can only be c, r or p" );
     }
 }
 
@@ -71,7 +86,7 @@ static void parse_args(int argc, char **argv) {
     int c;
     extern char *optarg;
     
-    while ((c = getopt(argc, argv, "i:o:wsa:")) != EOF) {
+    while ((c = getopt(argc, argv, "i:o:wsa:e:f:F:x:p:")) != EOF) {
         switch (c) {
 	case 'i':
 	    indir = optarg;
@@ -85,6 +100,21 @@ static void parse_args(int argc, char **argv) {
 	case 'a':
 	    algo = decode_char(*optarg);
 	    break;
+	case 'e':
+	    sort_engine = decode_engine(*optarg);
+	    break;
+	case 'f':
+	    df_pruning.min_df = atoi( optarg );
+	    break;
+	case 'F':
+	    df_pruning.max_df = atof( optarg );
+	    break;
+	case 'x':
+	    df_pruning.max_features = atoi( optarg );
+	    break;
+	case 'p':
+	    prefetch_depth = atoi( optarg );
+	    break;
 	case '?':
 	    help(argv[0]);
 	    exit(1);
@@ -105,6 +135,13 @@ static void parse_args(int argc, char **argv) {
     else
 	std::cerr << "Output file = " << outfile << '\n';
     std::cerr << "TF/IDF list sorted = " << ( do_sort ? "true\n" : "false\n" );
+    std::cerr << "Minimum document frequency = " << df_pruning.min_df
+	      << " documents\n";
+    std::cerr << "Maximum document frequency = " << df_pruning.max_df
+	      << " of documents\n";
+    if( df_pruning.max_features )
+	std::cerr << "Maximum features = " << df_pruning.max_features << '\n';
+    std::cerr << "Files read ahead = " << prefetch_depth << '\n';
 }
 
 
@@ -112,7 +149,8 @@ static void parse_args(int argc, char **argv) {
 
 template<typename directory_listing_type, typename vector_type,
 	 typename word_bank_type>
-void tfidf_all_hash( directory_listing_type & dir_list, const char * outfile,
+void tfidf_all_hash( directory_listing_type & dir_list,
+		     const asap::file_schedule & schedule, const char * outfile,
 		     size_t total_size, timespec veryStart ) {
     typedef asap::hash_table<const char*, size_t, asap::text::charp_hash,
 			     asap::text::charp_eql> wc_map_type;
@@ -140,18 +178,16 @@ void tfidf_all_hash( directory_listing_type & dir_list, const char * outfile,
     // map type is not automatically sorted.
 
     asap::word_container_reducer<aggregate_map_type> allwords;
-    cilk::reducer< cilk::op_add<size_t> > total_num_words(0);
+    asap::par::reducer< asap::par::op_add<size_t> > total_num_words(0);
 
-    cilk_for( size_t i=0; i < num_files; ++i ) {
-	// File to read
-	std::string filename = *std::next(dir_list.cbegin(),i);
+    asap::parallel_read_files( dir_list, schedule, prefetch_depth,
+			       [&]( size_t i, asap::file_buffer & file ) {
 	// Internally use the type internal_map_type, then merge into the catalog[i]
 	size_t num_words =
-	    asap::word_catalog<internal_map_type>( std::string(filename),
-						   catalog[i] );
+	    asap::word_catalog<internal_map_type>( file, catalog[i] );
 	*total_num_words += num_words;
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     // Aggregate map has 4 phases:
@@ -160,8 +196,8 @@ void tfidf_all_hash( directory_listing_type & dir_list, const char * outfile,
     // 3. assign_ids
     // 4. random lookup
     // Phases 2 and 3 are similar; a single data structure suffices.
-    asap::internal::assign_ids( allwords.get_value().begin(),
-				allwords.get_value().end() );
+    size_t pruned = asap::prune_vocabulary( allwords.get_value(), num_files,
+					    df_pruning );
     get_time( sort_end );
 
     std::shared_ptr<aggregate_map_type> allwords_ptr
@@ -186,6 +222,7 @@ void tfidf_all_hash( directory_listing_type & dir_list, const char * outfile,
     print_time("word sort", wc_end, sort_end);
     print_time("TF/IDF", sort_end, tfidf_end);
     std::cerr << "Total words: " << total_num_words.get_value() << '\n';
+    std::cerr << "Words pruned: " << pruned << '\n';
     std::cerr << "TF/IDF vectors: " << tfidf.get_num_points() << '\n';
     std::cerr << "TF/IDF dimensions: " << tfidf.get_dimensions() << '\n';
     std::cerr << "TF/IDF indices sorted by word: " << false << '\n';
@@ -210,6 +247,7 @@ void tfidf_all_hash( directory_listing_type & dir_list, const char * outfile,
 template<typename directory_listing_type, typename vector_type,
 	 typename word_bank_type>
 void tfidf_switch_hash_list( directory_listing_type & dir_list,
+			     const asap::file_schedule & schedule,
 			     const char * outfile,
 			     size_t total_size, timespec veryStart ) {
     typedef asap::hash_table<const char*, size_t, asap::text::charp_hash,
@@ -242,19 +280,17 @@ void tfidf_switch_hash_list( directory_listing_type & dir_list,
     // Sorting the intermediate lists achieves this goal only if the aggregate
     // map type is not automatically sorted.
     asap::word_container_reducer<aggregate_map_type> allwords;
-    cilk::reducer< cilk::op_add<size_t> > total_num_words(0);
+    asap::par::reducer< asap::par::op_add<size_t> > total_num_words(0);
 
-    cilk_for( size_t i=0; i < num_files; ++i ) {
-	// File to read
-	std::string filename = *std::next(dir_list.cbegin(),i);
+    asap::parallel_read_files( dir_list, schedule, prefetch_depth,
+			       [&]( size_t i, asap::file_buffer & file ) {
 	// Internally use the type internal_map_type, then merge
 	// into the catalog[i]
 	size_t num_words =
-	    asap::word_catalog<internal_map_type>( std::string(filename),
-						   catalog[i] );
+	    asap::word_catalog<internal_map_type>( file, catalog[i] );
 	*total_num_words += num_words;
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     // Aggregate map has 4 phases:
@@ -264,8 +300,8 @@ void tfidf_switch_hash_list( directory_listing_type & dir_list,
     // 4. random lookup
     // Phases 2 and 3 are similar; a single data structure suffices.
     assert( !do_sort );
-    asap::internal::assign_ids( allwords.get_value().begin(),
-				allwords.get_value().end() );
+    size_t pruned = asap::prune_vocabulary( allwords.get_value(), num_files,
+					    df_pruning );
     get_time( sort_end );
 
     std::shared_ptr<directory_listing_type> dir_list_ptr
@@ -289,6 +325,7 @@ void tfidf_switch_hash_list( directory_listing_type & dir_list,
     print_time("word sort", wc_end, sort_end);
     print_time("TF/IDF", sort_end, tfidf_end);
     std::cerr << "Total words: " << total_num_words.get_value() << '\n';
+    std::cerr << "Words pruned: " << pruned << '\n';
     std::cerr << "TF/IDF vectors: " << tfidf.get_num_points() << '\n';
     std::cerr << "TF/IDF dimensions: " << tfidf.get_dimensions() << '\n';
     std::cerr << "TF/IDF indices sorted by word: " << false << '\n';
@@ -310,7 +347,8 @@ void tfidf_switch_hash_list( directory_listing_type & dir_list,
 
 template<typename directory_listing_type, typename vector_type,
 	 typename word_bank_type>
-void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outfile,
+void tfidf_switch_sortable( directory_listing_type & dir_list,
+			    const asap::file_schedule & schedule, const char * outfile,
 			    size_t total_size, timespec veryStart ) {
     typedef asap::hash_table<const char*, size_t, asap::text::charp_hash,
 			     asap::text::charp_eql> intl_map_type;
@@ -328,8 +366,10 @@ void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outf
 				  asap::appear_count<size_t,size_t>>> agg2_map_type;
     typedef asap::kv_list<agg2_map_type, word_bank_type> aggregate2_map_type;
 
-    // Just a hash table, no word bank associated
-    typedef agg1_map_type aggregate3_map_type;
+    // Minimal perfect hash over the frozen list, no word bank associated
+    typedef asap::perfect_hash_index<aggregate2_map_type,
+				     asap::text::charp_hash,
+				     asap::text::charp_eql> aggregate3_map_type;
 
     typedef asap::data_set<vector_type, aggregate2_map_type,
 			   directory_listing_type> data_set_type;
@@ -343,22 +383,20 @@ void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outf
     catalog.resize( num_files );
 
     asap::word_container_reducer<aggregate1_map_type> allwords;
-    cilk::reducer< cilk::op_add<size_t> > total_num_words(0);
+    asap::par::reducer< asap::par::op_add<size_t> > total_num_words(0);
 
-    cilk_for( size_t i=0; i < num_files; ++i ) {
-	// File to read
-	std::string filename = *std::next(dir_list.cbegin(),i);
+    asap::parallel_read_files( dir_list, schedule, prefetch_depth,
+			       [&]( size_t i, asap::file_buffer & file ) {
 	// Internally use the type internal_map_type, then merge
 	// into the catalog[i]. This uses a hash table (internal_map_type)
 	// to calculate term frequency, then converts to a list (intermediate).
 	size_t num_words =
-	    asap::word_catalog<internal_map_type>( std::string(filename),
-						   catalog[i] );
+	    asap::word_catalog<internal_map_type>( file, catalog[i] );
 	// Reductions. Merge catalog[i] (list, intermediate_map_type)
 	// into the document frequency (hash table, aggregate1_map_type).
 	*total_num_words += num_words;
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     // Aggregate map has 4 phases:
@@ -372,33 +410,23 @@ void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outf
     allwords2.insert( std::move(allwords.get_value()) );
     allwords.get_value().clear();
 
-    if( do_sort ) {
-	/*
-	cilkpub::cilk_sort( allwords2.begin(), allwords2.end(),
-			    asap::pair_cmp<typename aggregate2_map_type::value_type,
-			    typename aggregate2_map_type::value_type>() );
-	 */
-	std::sort( allwords2.begin(), allwords2.end(),
-		   asap::pair_cmp<typename aggregate2_map_type::value_type,
-		   typename aggregate2_map_type::value_type>() );
-    }
+    if( do_sort )
+	allwords2.sort( sort_engine );
+
+    size_t pruned = asap::prune_vocabulary( allwords2, num_files, df_pruning );
 
-    asap::internal::assign_ids( allwords2.begin(), allwords2.end() );
+    std::shared_ptr<aggregate2_map_type> allwords_ptr
+	= std::make_shared<aggregate2_map_type>();
+    allwords_ptr->swap( allwords2 );
 
-    // Construct an index (hash table) for fast lookup
-    aggregate3_map_type allwords3;
-    asap::reserve_space( allwords3, allwords2.size() );
-    allwords3.insert( allwords2.begin(), allwords2.end() );
+    // Freeze the list and construct an index for fast lookup
+    aggregate3_map_type allwords3( *allwords_ptr );
     get_time( sort_end );
 
     std::shared_ptr<directory_listing_type> dir_list_ptr
 	= std::make_shared<directory_listing_type>();
     dir_list_ptr->swap( dir_list );
 
-    std::shared_ptr<aggregate2_map_type> allwords_ptr
-	= std::make_shared<aggregate2_map_type>();
-    allwords_ptr->swap( allwords2 );
-
     data_set_type
 	tfidf = asap::tfidf<typename data_set_type::vector_type>(
 	    catalog.cbegin(), catalog.cend(), allwords_ptr,
@@ -413,6 +441,7 @@ void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outf
     print_time("word sort", wc_end, sort_end);
     print_time("TF/IDF", sort_end, tfidf_end);
     std::cerr << "Total words: " << total_num_words.get_value() << '\n';
+    std::cerr << "Words pruned: " << pruned << '\n';
     std::cerr << "TF/IDF vectors: " << tfidf.get_num_points() << '\n';
     std::cerr << "TF/IDF dimensions: " << tfidf.get_dimensions() << '\n';
     std::cerr << "TF/IDF indices sorted by word: " << do_sort << '\n';
@@ -433,12 +462,107 @@ void tfidf_switch_sortable( directory_listing_type & dir_list, const char * outf
 	      << " MB/s\n";
 }
 
+template<typename directory_listing_type, typename vector_type,
+	 typename word_bank_type>
+void tfidf_dictionary( directory_listing_type & dir_list,
+		       const asap::file_schedule & schedule, const char * outfile,
+		       size_t total_size, timespec veryStart ) {
+    typedef asap::hash_table<const char*, size_t, asap::text::charp_hash,
+			     asap::text::charp_eql> intl_map_type;
+    typedef asap::word_map<intl_map_type, word_bank_type> internal_map_type;
+
+    typedef std::vector<std::pair<const char *, size_t>> intm_map_type;
+    typedef asap::kv_list<intm_map_type, word_bank_type> intermediate_map_type;
+
+    typedef asap::hash_table<const char *,
+			     asap::appear_count<size_t, size_t>,
+			     asap::text::charp_hash, asap::text::charp_eql> agg1_map_type;
+    typedef asap::word_map<agg1_map_type, word_bank_type> aggregate1_map_type;
+
+    // Front-coded dictionary, replaces the word bank and hash table
+    typedef asap::front_coded_dictionary<asap::appear_count<size_t,size_t>>
+	aggregate2_map_type;
+
+    typedef asap::data_set<vector_type, aggregate2_map_type,
+			   directory_listing_type> data_set_type;
+
+    struct timespec wc_end, sort_end, tfidf_begin, tfidf_end;
+
+    // word count
+    get_time( tfidf_begin );
+    size_t num_files = dir_list.size();
+    std::vector<intermediate_map_type> catalog;
+    catalog.resize( num_files );
+
+    asap::word_container_reducer<aggregate1_map_type> allwords;
+    asap::par::reducer< asap::par::op_add<size_t> > total_num_words(0);
+
+    asap::parallel_read_files( dir_list, schedule, prefetch_depth,
+			       [&]( size_t i, asap::file_buffer & file ) {
+	size_t num_words =
+	    asap::word_catalog<internal_map_type>( file, catalog[i] );
+	*total_num_words += num_words;
+	allwords.count_presence( catalog[i] );
+    } );
+    get_time( wc_end );
+
+    // Build the dictionary: sort, encode and assign IDs in lexicographic
+    // order. The aggregate map and its word bank are released afterwards.
+    size_t pruned = 0;
+    if( !df_pruning.is_trivial() )
+	pruned = asap::prune_vocabulary( allwords.get_value(), num_files,
+					 df_pruning );
+    std::shared_ptr<aggregate2_map_type> allwords_ptr
+	= std::make_shared<aggregate2_map_type>();
+    allwords_ptr->build( allwords.get_value().begin(),
+			 allwords.get_value().end() );
+    allwords_ptr->assign_ids();
+    allwords.get_value().clear();
+    get_time( sort_end );
+
+    std::shared_ptr<directory_listing_type> dir_list_ptr
+	= std::make_shared<directory_listing_type>();
+    dir_list_ptr->swap( dir_list );
+
+    data_set_type
+	tfidf = asap::tfidf<typename data_set_type::vector_type>(
+	    catalog.cbegin(), catalog.cend(), allwords_ptr, dir_list_ptr,
+	    true, // whether joint_word_map is sorted
+	    false );  // whether catalogs are sorted
+    get_time(tfidf_end);
+
+    print_time("word count", tfidf_begin, wc_end);
+    std::cerr << "word count sort intm: " << false << '\n';
+    std::cerr << "word count is sorted: " << false << '\n';
+    print_time("dictionary", wc_end, sort_end);
+    print_time("TF/IDF", sort_end, tfidf_end);
+    std::cerr << "Total words: " << total_num_words.get_value() << '\n';
+    std::cerr << "Words pruned: " << pruned << '\n';
+    std::cerr << "Dictionary bytes: " << allwords_ptr->memory_size() << '\n';
+    std::cerr << "TF/IDF vectors: " << tfidf.get_num_points() << '\n';
+    std::cerr << "TF/IDF dimensions: " << tfidf.get_dimensions() << '\n';
+    std::cerr << "TF/IDF indices sorted by word: " << true << '\n';
+    std::cerr << "TF/IDF iterate catalog in ascending order: "
+	      << false << '\n';
+    print_time("library", tfidf_begin, tfidf_end);
+
+    struct timespec begin, end;
+    get_time( begin );
+    if( outfile )
+	asap::arff_write( outfile, tfidf );
+    get_time (end);
+    print_time("output", begin, end);
+    print_time("complete time", veryStart, begin); // no output
+    std::cerr << "Rate: "
+	      << double(total_size)/double(time_diff(begin,veryStart))
+	/double(1024*2014)
+	      << " MB/s\n";
+}
+
 /*
  * TODO:
- *  + sort files by descending size prior to processing.
- *    advantages:
- *     - parallelization (bin packing)
- *     - merge: global list size >> per-file size
+ *  + exploit the order of files by descending size in the merge:
+ *    global list size >> per-file size
  */
 int main(int argc, char **argv) {
     struct timespec begin, end;
@@ -452,7 +576,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -462,11 +586,17 @@ int main(int argc, char **argv) {
     typedef asap::word_list<std::deque<const char*>, asap::word_bank_managed>
 	directory_listing_type;
     directory_listing_type dir_list;
-    size_t total_size = asap::get_directory_listing( indir, dir_list );
+    std::vector<size_t> file_sizes;
+    size_t total_size = asap::get_directory_listing( indir, dir_list,
+						     file_sizes );
     get_time (end);
     print_time("directory listing", begin, end);
     std::cerr << "total bytes: " << total_size << '\n';
 
+    // Process large files first, batching small files
+    asap::file_schedule schedule( file_sizes );
+    std::cerr << "file batches: " << schedule.num_batches() << '\n';
+
     typedef size_t index_type;
 #if MEM == 0 // default
     typedef asap::word_bank_pre_alloc word_bank_type;
@@ -482,18 +612,21 @@ int main(int argc, char **argv) {
 
 #define CMD(intm,agg2,agg3)				      \
     tfidf_switch<directory_listing_type, vector_type, word_bank_type, \
-		 intm,agg2,agg3>( dir_list, outfile, total_size, veryStart );
+		 intm,agg2,agg3>( dir_list, schedule, outfile, total_size, veryStart );
 
     switch( algo ) {
     case a_baseline:
 	tfidf_all_hash<directory_listing_type, vector_type, word_bank_type>(
-	    dir_list, outfile, total_size, veryStart );
+	    dir_list, schedule, outfile, total_size, veryStart );
 	break;
     case a_unsorted_fast:
-	tfidf_switch_hash_list<directory_listing_type, vector_type, word_bank_type>( dir_list, outfile, total_size, veryStart );
+	tfidf_switch_hash_list<directory_listing_type, vector_type, word_bank_type>( dir_list, schedule, outfile, total_size, veryStart );
 	break;
     case a_sorted_fast:
-	tfidf_switch_sortable<directory_listing_type, vector_type, word_bank_type>( dir_list, outfile, total_size, veryStart );
+	tfidf_switch_sortable<directory_listing_type, vector_type, word_bank_type>( dir_list, schedule, outfile, total_size, veryStart );
+	break;
+    case a_dictionary:
+	tfidf_dictionary<directory_listing_type, vector_type, word_bank_type>( dir_list, schedule, outfile, total_size, veryStart );
 	break;
     default:
 	fatal( "unsupported configuration." );
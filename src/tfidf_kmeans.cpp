@@ -23,14 +23,12 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
 #include "asap/sparse_vector.h"
+#include "asap/compact_vector.h"
 #include "asap/word_count.h"
 #include "asap/normalize.h"
 #include "asap/io.h"
@@ -46,18 +44,19 @@ char const * indir = nullptr;
 char const * outfile = nullptr;
 bool by_words = false;
 bool do_sort = false;
+bool compact = false;
 unsigned int rnd_init = 1;
 
 static void help(char *progname) {
     std::cout << "Usage: " << progname
-	      << " -i <indir> -o <outfile> -c <numclusters> [-m <maxiters>] [-w] [-s] [-r <rnd-init>]\n";
+	      << " -i <indir> -o <outfile> -c <numclusters> [-m <maxiters>] [-w] [-s] [-q] [-r <rnd-init>]\n";
 }
 
 static void parse_args(int argc, char **argv) {
     int c;
     extern char *optarg;
     
-    while ((c = getopt(argc, argv, "i:o:c:m:wsr:")) != EOF) {
+    while ((c = getopt(argc, argv, "i:o:c:m:wsqr:")) != EOF) {
         switch (c) {
 	case 'i':
 	    indir = optarg;
@@ -80,6 +79,9 @@ static void parse_args(int argc, char **argv) {
 	case 's':
 	    do_sort = true;
 	    break;
+	case 'q':
+	    compact = true;
+	    break;
 	case '?':
 	    help(argv[0]);
 	    exit(1);
@@ -101,6 +103,7 @@ static void parse_args(int argc, char **argv) {
     std::cerr << "srand(" << rnd_init << ")\n";
     std::cerr << "TF/IDF by words = " << ( by_words ? "true\n" : "false\n" );
     std::cerr << "TF/IDF sort = " << ( do_sort ? "true\n" : "false\n" );
+    std::cerr << "K-Means on compact vectors = " << ( compact ? "true\n" : "false\n" );
     std::cerr << "K-Means number of clusters = " << num_clusters << '\n';
     std::cerr << "K-Means maximum iterations = " << max_iters << '\n';
 }
@@ -117,7 +120,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -163,7 +166,7 @@ int main(int argc, char **argv) {
     catalog.resize( num_files );
 
     asap::word_container_reducer<word_map_type2> allwords;
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	// std::cerr << "Read file " << filename;
 	{
@@ -186,7 +189,7 @@ int main(int argc, char **argv) {
 	// Reading from std::vector rather than std::map should be faster...
 	// Validated: about 10% on word count, 20% on TF/IDF, 16 threads
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time (end);
     print_time("word count", begin, end);
 
@@ -229,9 +232,27 @@ int main(int argc, char **argv) {
     get_time( end );
     print_time("normalize", begin, end);
 
-    // K-means clustering
+    // K-means clustering, optionally on a copy of the vectors with 32-bit
+    // coordinates and half-precision values
+    typedef asap::compact_sparse_vector_set<
+	asap::index_u32, asap::value_fp16,
+	data_set_type::index_type, data_set_type::value_type>
+	compact_vector_set_type;
+    compact_vector_set_type points;
+    if( compact ) {
+	get_time( begin );
+	points = compact_vector_set_type( data_set.vector_cbegin(),
+					  data_set.vector_cend() );
+	get_time( end );
+	print_time("compact", begin, end);
+	std::cerr << "Compact vectors: " << points.storage_bytes()
+		  << " bytes\n";
+    }
+
     get_time( begin );
-    auto kmeans_op = asap::kmeans( data_set, num_clusters, max_iters );
+    auto kmeans_op = compact
+	? asap::kmeans( data_set, points, num_clusters, max_iters )
+	: asap::kmeans( data_set, num_clusters, max_iters );
     get_time( end );
     print_time("K-Means", begin, end);
     std::cerr << "K-Means iterations: " << kmeans_op.num_iterations()
@@ -22,10 +22,7 @@
 #include <fstream>
 #include <deque>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -82,7 +79,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -114,7 +111,7 @@ int main(int argc, char **argv) {
     catalog.resize( num_files );
 
     asap::word_container_reducer<word_map_type2> allwords;
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	// std::cerr << "Read file " << filename;
 	{
@@ -131,7 +128,7 @@ int main(int argc, char **argv) {
 	// Reading from std::vector rather than std::map should be faster...
 	// Validated: about 10% on word count, 20% on TF/IDF, 16 threads
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time (end);
     print_time("word count", begin, end);
 
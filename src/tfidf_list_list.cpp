@@ -22,10 +22,7 @@
 #include <fstream>
 #include <deque>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -87,7 +84,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -123,7 +120,7 @@ int main(int argc, char **argv) {
     catalog.resize( num_files );
 
     asap::word_container_reducer<word_map_type2> allwords;
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	// std::cerr << "Read file " << filename;
 	{
@@ -153,7 +150,7 @@ int main(int argc, char **argv) {
 	//  ... Seems like the time increase here for merging sorted lists
 	//      is much higher than the total time taken by TF/IDF below.
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time (end);
     print_time("word count", begin, end);
 
@@ -23,10 +23,7 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -115,7 +112,7 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
     catalog.resize( num_files );
 
     asap::word_container_reducer<agg_map_type> allwords;
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	// File to read
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	// Internally use the type intl_map_type, then merge into the catalog[i]
@@ -132,7 +129,7 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
 	// Validated: about 10% on word count, 20% on TF/IDF, 16 threads
 	// TODO: replace by post-processing parallel multi-way merge?
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     std::shared_ptr<agg_map_type> allwords_ptr
@@ -213,7 +210,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -23,11 +23,9 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
 //#include "cilkpub/sort.h"
 
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -268,9 +266,9 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
 	&& agg1_map_type::can_sort;
 
     asap::word_container_reducer<agg1_map_type> allwords;
-    cilk::reducer< cilk::op_add<size_t> > total_num_words(0);
+    asap::par::reducer< asap::par::op_add<size_t> > total_num_words(0);
 
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	// File to read
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	// Internally use the type intl_map_type, then merge into the catalog[i]
@@ -299,7 +297,7 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
 
 	// TODO: replace by post-processing parallel multi-way merge?
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     // Aggregate map has 4 phases:
@@ -528,7 +526,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -21,10 +21,7 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -45,21 +42,28 @@ static const size_t N = 3;
 static const size_t N = N_IN_NGRAM;
 #endif
 
+// Longest n-gram counted in a single pass with -n
+static const size_t N_MAX = 5;
+
 char const * indir = nullptr;
 char const * outfile = nullptr;
 bool by_words = false;
 bool do_sort = false;
 bool intm_map = false;
+size_t nmax = 0;
+size_t kskip = 0;
+size_t min_df = 1;
 
 static void help(char *progname) {
-    std::cout << "Usage: " << progname << " -i <indir> -o <outfile> [-w] [-s] [-m]\n";
+    std::cout << "Usage: " << progname << " -i <indir> -o <outfile> [-w] [-s] [-m]"
+	" [-n <nmax> [-k <skip>] [-f <min-df>]]\n";
 }
 
 static void parse_args(int argc, char **argv) {
     int c;
     extern char *optarg;
     
-    while ((c = getopt(argc, argv, "i:o:wsm")) != EOF) {
+    while ((c = getopt(argc, argv, "i:o:wsmn:k:f:")) != EOF) {
         switch (c) {
 	case 'i':
 	    indir = optarg;
@@ -76,6 +80,15 @@ static void parse_args(int argc, char **argv) {
 	case 'm':
 	    intm_map = true;
 	    break;
+	case 'n':
+	    nmax = atoi( optarg );
+	    break;
+	case 'k':
+	    kskip = atoi( optarg );
+	    break;
+	case 'f':
+	    min_df = atoi( optarg );
+	    break;
 	case '?':
 	    help(argv[0]);
 	    exit(1);
@@ -84,6 +97,12 @@ static void parse_args(int argc, char **argv) {
     
     if( !indir )
 	fatal( "Input directory must be supplied." );
+    if( nmax > N_MAX )
+	fatal( "N-grams are limited to length ", N_MAX );
+    if( nmax == 0 && ( kskip > 0 || min_df > 1 ) )
+	fatal( "Skip-grams and minimum document frequency require -n" );
+    if( nmax > 0 && intm_map )
+	fatal( "Option -m is not supported with -n" );
     
     std::cerr << "Input directory = " << indir << '\n';
     if( !outfile )
@@ -94,7 +113,12 @@ static void parse_args(int argc, char **argv) {
 	std::cerr << "Output file = " << outfile << '\n';
     std::cerr << "TF/IDF by words = " << ( by_words ? "true\n" : "false\n" );
     std::cerr << "TF/IDF list sorted = " << ( do_sort ? "true\n" : "false\n" );
-    std::cerr << "N-grams, N = " << N << '\n';
+    if( nmax > 0 ) {
+	std::cerr << "N-grams, N = 1.." << nmax << '\n';
+	std::cerr << "Skip-grams, k = " << kskip << '\n';
+	std::cerr << "Minimum document frequency = " << min_df << '\n';
+    } else
+	std::cerr << "N-grams, N = " << N << '\n';
 }
 
 template<typename map_type, bool can_sort = true>
@@ -123,7 +147,7 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
     asap::ngram_container_reducer<agg_map_type> allwords;
     allwords.get_value().set_growth( 1, 2 );
 
-    cilk_for( size_t i=0; i < num_files; ++i ) {
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
 	// File to read
 	std::string filename = *std::next(dir_list.cbegin(),i);
 	catalog[i].set_growth( 1, 2 );
@@ -136,7 +160,7 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
 
 	// std::cerr << filename << ": " << ngrams << " ngrams\n";
 	allwords.count_presence( catalog[i] );
-    }
+    } );
     get_time( wc_end );
 
     std::shared_ptr<agg_map_type> allwords_ptr
@@ -170,6 +194,111 @@ data_set_type tfidf_driver( directory_listing_type & dir_list ) {
     return tfidf;
 }
 
+// Count all n-grams up to nmax words, and skip-grams, in a single pass over
+// every file. N-grams occurring in fewer than min_df files are dropped while
+// the document frequencies are merged.
+template<typename directory_listing_type, typename intl_map_type, typename intm_map_type, typename agg_map_type, typename data_set_type>
+data_set_type tfidf_tuple_driver( directory_listing_type & dir_list ) {
+    typedef typename agg_map_type::key_type key_type;
+    struct timespec wc_end, tfidf_begin, tfidf_end;
+
+    // n-gram count
+    get_time( tfidf_begin );
+    size_t num_files = dir_list.size();
+    std::vector<intm_map_type> catalog;
+    catalog.resize( num_files );
+
+    asap::ngram_df_reducer<key_type, asap::text::ngram_hash,
+			   asap::text::ngram_eql> allngrams;
+
+    asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
+	// File to read
+	std::string filename = *std::next(dir_list.cbegin(),i);
+	catalog[i].set_growth( 1, 2 );
+	asap::ngram_tuple_catalog<intl_map_type>( filename, catalog[i],
+						  1, nmax, kskip );
+	if( do_sort )
+	    kv_sort<intm_map_type,true>( catalog[i] );
+
+	allngrams.count_presence( catalog[i] );
+    } );
+
+    std::shared_ptr<agg_map_type> allwords_ptr
+	= std::make_shared<agg_map_type>();
+    size_t pruned = allngrams.merge( *allwords_ptr, min_df );
+
+    // Drop the pruned n-grams from the per-file counts
+    if( pruned > 0 ) {
+	const agg_map_type & allwords = *allwords_ptr;
+	asap::par::parallel_for( size_t(0), num_files, [&]( size_t i ) {
+	    catalog[i].erase_if(
+		[&]( const typename intm_map_type::value_type & val ) {
+		    return allwords.find( val.first ) == allwords.cend();
+		} );
+	} );
+    }
+    get_time( wc_end );
+
+    std::shared_ptr<directory_listing_type> dir_list_ptr
+	= std::make_shared<directory_listing_type>();
+    dir_list_ptr->swap( dir_list );
+
+    asap::internal::assign_ids( allwords_ptr->begin(), allwords_ptr->end() );
+
+    data_set_type tfidf(
+	by_words
+	? asap::tfidf_by_words<typename data_set_type::vector_type>(
+	    catalog.cbegin(), catalog.cend(), allwords_ptr, dir_list_ptr,
+	    do_sort ) // whether catalogs are sorted
+	: asap::tfidf<typename data_set_type::vector_type>(
+	    catalog.cbegin(), catalog.cend(), allwords_ptr, dir_list_ptr,
+	    false, // IDs follow hash order
+	    false )
+	);
+    get_time(tfidf_end);
+
+    print_time("ngram count", tfidf_begin, wc_end);
+    print_time("TF/IDF", wc_end, tfidf_end);
+    std::cerr << "N-grams pruned: " << pruned << '\n';
+    std::cerr << "TF/IDF vectors: " << tfidf.get_num_points() << '\n';
+    std::cerr << "TF/IDF dimensions: " << tfidf.get_dimensions() << '\n';
+    print_time("library", tfidf_begin, tfidf_end);
+
+    return tfidf;
+}
+
+template<typename directory_listing_type, typename vector_type,
+	 typename word_bank_type, typename index_type>
+void tfidf_tuple( directory_listing_type & dir_list ) {
+    typedef asap::text::ngram_tuple<N_MAX> key_type;
+    typedef asap::hash_table<key_type, size_t, asap::text::ngram_hash,
+			     asap::text::ngram_eql> wc_unordered_map;
+    typedef asap::hash_table<key_type,
+			     asap::appear_count<size_t, index_type>,
+			     asap::text::ngram_hash, asap::text::ngram_eql>
+	dc_unordered_map;
+    typedef asap::ngram_map<dc_unordered_map, word_bank_type, N_MAX>
+	aggregate_map_type;
+    typedef asap::ngram_map<wc_unordered_map, word_bank_type, N_MAX>
+	internal_map_type;
+    typedef asap::ngram_kv_list<std::vector<std::pair<key_type, size_t>>,
+				word_bank_type, N_MAX> intermediate_map_type;
+    typedef asap::data_set<vector_type, aggregate_map_type,
+			   directory_listing_type> data_set_type;
+
+    data_set_type tfidf
+	= tfidf_tuple_driver<directory_listing_type, internal_map_type,
+			     intermediate_map_type, aggregate_map_type,
+			     data_set_type>( dir_list );
+
+    struct timespec begin, end;
+    get_time( begin );
+    if( outfile )
+	asap::arff_write( outfile, tfidf );
+    get_time (end);
+    print_time("output", begin, end);
+}
+
 #if 0
 // a single null-terminated word
 struct wc_word {
@@ -218,7 +347,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -239,6 +368,14 @@ int main(int argc, char **argv) {
 				asap::mm_no_ownership_policy>
 	vector_type;
 
+    if( nmax > 0 ) {
+	tfidf_tuple<directory_listing_type, vector_type, word_bank_type,
+		    index_type>( dir_list );
+	get_time( end );
+	print_time("complete time", veryStart, end);
+	return 0;
+    }
+
 /*
     typedef asap::word_map<
 	std::unordered_map<const char *, size_t, asap::text::charp_hash,
@@ -254,19 +391,19 @@ int main(int argc, char **argv) {
 			   asap::text::charp_hash, asap::text::charp_eql>,
 	word_bank_type> aggregate_map_type;
 */
-    typedef asap::hash_table<asap::text::ngram<N>, size_t, asap::text::ngram_hash, asap::text::ngram_eql> wc_unordered_map;
-    typedef asap::hash_table<asap::text::ngram<N>,
+    typedef asap::hash_table<asap::text::packed_ngram<N>, size_t, asap::text::ngram_hash, asap::text::ngram_eql> wc_unordered_map;
+    typedef asap::hash_table<asap::text::packed_ngram<N>,
 		       asap::appear_count<size_t, index_type>,
 		       asap::text::ngram_hash, asap::text::ngram_eql> dc_unordered_map;
     typedef asap::ngram_map<dc_unordered_map, word_bank_type, N> aggregate_map_type;
 /*
-    typedef std::vector<std::pair<asap::text::ngram<N>,
+    typedef std::vector<std::pair<asap::text::packed_ngram<N>,
 				  asap::appear_count<size_t, index_type>>> dc_unordered_map;
     typedef asap::ngram_kv_list<dc_unordered_map, word_bank_type, N> aggregate_map_type;
 */
 
     typedef asap::ngram_map<wc_unordered_map, word_bank_type, N> internal_map_type;
-    typedef asap::ngram_kv_list<std::vector<std::pair<asap::text::ngram<N>, size_t>>,
+    typedef asap::ngram_kv_list<std::vector<std::pair<asap::text::packed_ngram<N>, size_t>>,
 				word_bank_type, N> intermediate_map_type;
 
     typedef asap::data_set<vector_type, aggregate_map_type,
@@ -22,10 +22,7 @@
 #include <deque>
 #include <unordered_map>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/arff.h"
 #include "asap/dense_vector.h"
@@ -33,6 +30,7 @@
 #include "asap/word_count.h"
 #include "asap/normalize.h"
 #include "asap/io.h"
+#include "asap/top_k.h"
 
 #include <stddefines.h>
 #include <container.h>
@@ -147,13 +145,6 @@ struct wc_word_hash
 };
 
 
-template<typename Pair>
-struct cmp_2nd_rev {
-    bool operator() ( const Pair & p1, const Pair & p2 ) const {
-	return p1.second > p2.second;
-    }
-};
-
 int main(int argc, char **argv) {
     struct timespec begin, end;
     struct timespec veryStart;
@@ -166,7 +157,7 @@ int main(int argc, char **argv) {
     // read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
     get_time (end);
     print_time("init", begin, end);
@@ -188,10 +179,14 @@ int main(int argc, char **argv) {
 
     get_time( begin );
     // The list of pairs is sorted if word_map_type is based on std::map
-    // but it is not sorted if based on std::unordered_map
+    // but it is not sorted if based on std::unordered_map. Only the words
+    // that are displayed need to be ordered by frequency.
+    size_t dn = std::min(disp_num, catalog.size());
+    std::vector<typename word_list_type::value_type> top;
     if( do_sort )
-	std::sort( catalog.begin(), catalog.end(),
-		   cmp_2nd_rev<typename word_list_type::value_type>() );
+	top = asap::top_k( catalog, dn );
+    else
+	top.assign( catalog.cbegin(), catalog.cbegin() + dn );
     get_time( end );
     print_time("sort", begin, end);
 
@@ -202,16 +197,12 @@ int main(int argc, char **argv) {
 	    fatale( "fopen", outfile );
     }
 
-    size_t dn = std::min(disp_num, catalog.size());
     fprintf( fp, "\nWordcount: Results (TOP %d of %lu):\n", dn, catalog.size());
-    uint64_t total = 0;
-    auto I = catalog.cbegin();
-    auto E = catalog.cend();
-    for( size_t i=0; I != E && i < dn; ++i, ++I ) {
+    for( auto I=top.cbegin(), E=top.cend(); I != E; ++I )
         fprintf( fp, "%15s - %lu\n", (char *)I->first, I->second );
-	total += I->second;
-    }
-    for( ; I != E; ++I )
+
+    uint64_t total = 0;
+    for( auto I=catalog.cbegin(), E=catalog.cend(); I != E; ++I )
 	total += I->second;
 
     fprintf( fp, "Total: %lu\n", total );
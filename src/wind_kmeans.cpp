@@ -23,16 +23,14 @@
 #include <climits>
 #include <limits>
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/cilk_api.h>
-
+#include "asap/par.h"
 #include "asap/utils.h"
 #include "asap/imrformat.h"
 #include "asap/dense_vector.h"
 #include "asap/sparse_vector.h"
 #include "asap/kmeans.h"
 #include "asap/normalize.h"
+#include "asap/sociometer.h"
 
 #include <stddefines.h>
 
@@ -45,11 +43,12 @@ size_t max_iters;
 bool force_dense;
 char const * infile = nullptr;
 char const * outfile = nullptr;
+char const * archfile = "archetypes.txt";
 
 static void help(char *progname) {
     std::cout << "Usage: " << progname
 	      << " [-d] -i <infile> -o <outfile> -c <numclusters> "
-	      << " -m <maxiters>\n";
+	      << " -m <maxiters> [-a <archetypes>]\n";
 }
 
 static void parse_args(int argc, char **argv) {
@@ -61,9 +60,9 @@ static void parse_args(int argc, char **argv) {
     max_iters = 20; // default
    
 #ifndef NOFLAGS
-       while ((c = getopt(argc, argv, "c:i:o:m:r:d")) != EOF) {
+       while ((c = getopt(argc, argv, "c:i:o:m:r:a:d")) != EOF) {
 #else
-       while ((c = getopt(argc, argv, "c:m:r:d")) != EOF) {
+       while ((c = getopt(argc, argv, "c:m:r:a:d")) != EOF) {
 #endif
          switch (c) {
 	        case 'd':
@@ -78,6 +77,9 @@ static void parse_args(int argc, char **argv) {
                 case 'r':
                    num_runs = atoi(optarg);
                    break;
+                case 'a':
+                   archfile = optarg;
+                   break;
 #ifndef NOFLAGS
         case 'i':
             infile = optarg;
@@ -136,7 +138,7 @@ int main(int argc, char **argv) {
     //read args
     parse_args(argc,argv);
 
-    std::cerr << "Available threads: " << __cilkrts_get_nworkers() << "\n";
+    std::cerr << "Available threads: " << asap::par::num_workers() << "\n";
 
 #if 0
     typedef asap::dense_vector<size_t, real, true, asap::mm_ownership_policy>
@@ -212,57 +214,8 @@ int main(int argc, char **argv) {
 
     std::ofstream of( outfile, std::ios_base::out );
 
-    // Setup datastructure to hold the training/model data
-    typedef asap::dense_vector<size_t, real, true, asap::mm_ownership_policy> centres_vector_type;
-    std::vector<int> ids = {0,1,2,3,4,5,5,6,7,8,9,10,11,12,13,14,15};
-    std::vector<std::string> cats = {"resident","resident","resident","dynamic_resident",
-		"dynamic_resident","dynamic_resident","commuter","commuter","commuter","visitor",
-		"visitor","visitor","resident","resident","visitor","visitor","visitor"};
-    real modelFloats[17][24] = {
-        {0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5,0.5},
-	{0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1},
-	{0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0},
-	{0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5},
-	{0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1},
-	{1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0},
-	{0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0},
-	{0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0},
-	{1.0,1.0,1.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.5,0.5,0.5,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.1, 0.1, 0.1,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{1.0,1.0,1.0,1.0,1.0,1.0,0.5,0.5,0.5,0.5,0.5,0.5, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.5,0.5,0.5,0.5,0.5,0.5, 0.1, 0.1, 0.1, 0.1, 0.1, 0.1,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.0,0.0,0.0,1.0,1.0,1.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.0,0.0,0.0,0.5,0.5,0.5,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0},
-	{0.0,0.0,0.0, 0.1, 0.1, 0.1,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0}
-    };
-
-    // Struct to hold each training record together in a struct with dense vector for the centres
-    struct archetipiRecord {
-        // archetipiRecord(int i, std::string str, centres_vector_type cvt) 
-        archetipiRecord(int i, std::string str, real * cvt) 
-              : id(i), name(str), centres(cvt) {}
-        int id;
-        std::string name;
-        // centres_vector_type centres;
-        real * centres;
-    };
-
-    // Vector of training records
-    std::vector<archetipiRecord> archetipi;
-    std::vector<int>::iterator itid ;
-    std::vector<std::string>::iterator itname = cats.begin();
-    int ct=0;
-    // centres_vector_type cvt(17);
-    real* cvt;
-    for(itid = ids.begin(); itid != ids.end(); ++itid, ++itname, ++ct) {
-        real * fPtr = modelFloats[ct];
-
-        // cvt[ct] = modelFloats[ct];
-        // archetipiRecord rec(*itid, *itname, cvt);
-        archetipiRecord rec(*itid, *itname, modelFloats[ct]);
-        archetipi.push_back( rec );
-    }
+    // The archetypes (training/model data) that label the clusters
+    asap::sociometer::archetype_set<real> archetipi( archfile );
 
 #if 1
     // For each test cluster, find the minimum euclidean distance of the provided training clusters
@@ -270,25 +223,11 @@ int main(int argc, char **argv) {
     auto E = kmeans_op->centres().cend(); 
     int cnt=0;
     for( auto II=I; II != E; ++II ) {
-
-        real lowestDistance = std::numeric_limits<real>::max();
-        std::vector<archetipiRecord>::iterator targetCategory;
-	// std::cout << "Classifications from Centres number " << cnt << ":" << std::endl;
-        for(std::vector<archetipiRecord>::iterator it = archetipi.begin(); it != archetipi.end(); ++it) {
-            // std::cout << "[ centres- " << (*II).get_value()<< std::endl;
-            // std::cout << "[ archi- " << (*it).centres << std::endl;
-
-	    real distance = sq_dist((*II).get_value(), (*it).centres, 17 );
-            // std::cout << "II : " << *II << std::endl << "it: " << (*it).centres << std::endl;
-            // std::cout << "Category : " << (*it).name << "Distance: " << distance << std::endl;
- 	    if (distance < lowestDistance) { 
-		lowestDistance = distance; 
-		targetCategory = it; 
-	    }
-        }
+	// For each cluster, the archetype at minimum euclidean distance
+	size_t targetCategory = archetipi.nearest( *II );
 
 	std::ostringstream os;
-	os << "('" << (*targetCategory).name << "', "  << *II << ")" << std::endl;
+	os << "('" << archetipi.name( targetCategory ) << "', "  << *II << ")" << std::endl;
   	std::string s = os.str();
         std::replace( s.begin(), s.end(), '{', '[');
         std::replace( s.begin(), s.end(), '}', ']');
@@ -297,41 +236,6 @@ int main(int argc, char **argv) {
     }
 #endif
 
-// Check that classifies datapoints directly with training data:
-#if 0
-    auto Idata = data_set.vector_cbegin();
-    auto Edata = data_set.vector_cend();
-
-    for( auto II=Idata; II != Edata; ++II ) {
-
-        real lowestDistance = std::numeric_limits<real>::max();
-        std::vector<archetipiRecord>::iterator targetCategory;
-	std::cout << "Classifications from Data point" << ":" << std::endl;
-        for(std::vector<archetipiRecord>::iterator it = archetipi.begin(); it != archetipi.end(); ++it) {
-	    real distance = sq_dist((*II).get_value(), &(*it).centres[0], 24 );
-            std::cout << "II : " << *II << std::endl << "it: " << (*it).centres << std::endl;
-            std::cout << "Category : " << (*it).name << "  Distance: " << distance << std::endl;
- 	    if (distance < lowestDistance) { 
-		lowestDistance = distance; 
-		targetCategory = it; 
-	    }
-        }
-
-	// os << std::endl << "Classifications from Data Points" << std::endl;
-	std::ostringstream os;
-	os << "('" << (*targetCategory).name << "', "  << *II << ")";
-  	std::string s = os.str();
-        std::replace( s.begin(), s.end(), '{', '[');
-        std::replace( s.begin(), s.end(), '}', ']');
-  	of << s << std::endl;
-
-
-        // *II == or within mcentres[?] 
-      
-    }
-
-#endif
-
     of.close();
     get_time (end);
     print_time("output", begin, end);
@@ -0,0 +1,140 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Microbenchmark for the sparse-dense vector kernels. The sparse vectors
+// mimic TF/IDF documents: the number of nonzeros per document follows a
+// log-normal distribution and the terms follow a Zipf distribution over
+// the vocabulary. The dense vector plays the role of a cluster centre.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "asap/vector_ops.h"
+
+#include <stddefines.h>
+
+template<typename IndexTy, typename ValueTy>
+struct corpus {
+    std::vector<ValueTy> value;
+    std::vector<IndexTy> coord;
+    std::vector<size_t> offset;
+    std::vector<ValueTy> centre;
+};
+
+template<typename IndexTy, typename ValueTy>
+void generate( corpus<IndexTy,ValueTy> &c, size_t vocab, size_t ndocs,
+	       double median_nnz ) {
+    std::mt19937 rng( 1 );
+    std::vector<double> cdf( vocab );
+    double sum = 0;
+    for( size_t i=0; i < vocab; ++i ) {
+	sum += 1.0 / double(i+1);
+	cdf[i] = sum;
+    }
+    std::uniform_real_distribution<double> uniform( 0, sum );
+    std::lognormal_distribution<double> nnz_dist( std::log( median_nnz ), 1.0 );
+    std::uniform_real_distribution<ValueTy> val_dist( 0, 1 );
+
+    std::vector<IndexTy> terms;
+    c.offset.push_back( 0 );
+    for( size_t d=0; d < ndocs; ++d ) {
+	size_t nnz = std::min( vocab, std::max( size_t(1),
+						size_t( nnz_dist( rng ) ) ) );
+	terms.clear();
+	for( size_t k=0; k < nnz; ++k )
+	    terms.push_back( IndexTy( std::lower_bound( cdf.begin(), cdf.end(),
+							uniform( rng ) )
+				      - cdf.begin() ) );
+	std::sort( terms.begin(), terms.end() );
+	terms.erase( std::unique( terms.begin(), terms.end() ), terms.end() );
+	for( auto t : terms ) {
+	    c.coord.push_back( t );
+	    c.value.push_back( val_dist( rng ) );
+	}
+	c.offset.push_back( c.coord.size() );
+    }
+    c.centre.resize( vocab );
+    for( auto & v : c.centre )
+	v = val_dist( rng );
+}
+
+template<typename Kernels, typename IndexTy, typename ValueTy>
+double run( corpus<IndexTy,ValueTy> &c, int op, ValueTy &result ) {
+    struct timespec begin, end;
+    ValueTy sum = 0;
+    get_time( begin );
+    for( size_t d=0, e=c.offset.size()-1; d < e; ++d ) {
+	ValueTy const *v = &c.value[c.offset[d]];
+	IndexTy const *i = &c.coord[c.offset[d]];
+	IndexTy n = c.offset[d+1] - c.offset[d];
+	switch( op ) {
+	case 0: sum += Kernels::dot( v, i, n, &c.centre[0] ); break;
+	case 1: sum += Kernels::sq_dist_minus_sqnorm( v, i, n, &c.centre[0] ); break;
+	case 2: Kernels::add( &c.centre[0], v, i, n ); break;
+	}
+    }
+    get_time( end );
+    result = op == 2 ? c.centre[c.coord[0]] : sum;
+    return time_diff( end, begin );
+}
+
+template<typename IndexTy, typename ValueTy>
+void bench( size_t vocab, size_t ndocs, double median_nnz, char const *msg ) {
+    typedef asap::internal::sparse_dense_scalar_kernels<IndexTy,ValueTy> scalar;
+    typedef asap::internal::sparse_dense_kernels<IndexTy,ValueTy> kernels;
+    static char const * const ops[] = { "dot", "sqdist", "add" };
+
+    corpus<IndexTy,ValueTy> c;
+    generate( c, vocab, ndocs, median_nnz );
+    double nnz = c.coord.size();
+
+    for( int op=0; op < 3; ++op ) {
+	ValueTy rs, rk;
+	std::vector<ValueTy> saved = c.centre;
+	double ts = run<scalar>( c, op, rs );
+	c.centre = saved;
+	double tk = run<kernels>( c, op, rk );
+	c.centre = saved;
+	double err = std::abs( rs - rk ) / std::max( std::abs( rs ), ValueTy(1) );
+	std::cout << std::setw(24) << msg << " V=" << std::setw(8) << vocab
+		  << ' ' << std::setw(6) << ops[op]
+		  << " scalar " << std::setw(7) << std::setprecision(3)
+		  << 1e9*ts/nnz << " ns/nnz"
+		  << " kernel " << std::setw(7) << std::setprecision(3)
+		  << 1e9*tk/nnz << " ns/nnz"
+		  << " rel.err " << err
+		  << ( err > 1e-3 ? " MISMATCH" : "" ) << std::endl;
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    size_t ndocs = argc > 1 ? atol( argv[1] ) : 20000;
+
+    for( size_t vocab : { size_t(10000), size_t(100000), size_t(1000000) } ) {
+	bench<uint32_t, float>( vocab, ndocs, 150, "float[uint32_t]" );
+	bench<size_t, float>( vocab, ndocs, 150, "float[size_t]" );
+	bench<uint32_t, double>( vocab, ndocs, 150, "double[uint32_t]" );
+	bench<size_t, double>( vocab, ndocs, 150, "double[size_t]" );
+    }
+
+    return 0;
+}
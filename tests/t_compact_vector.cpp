@@ -0,0 +1,176 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "asap/utils.h"
+#include "asap/compact_vector.h"
+
+// Encode the coordinates and decode them again
+template<typename IndexEnc, typename IndexTy>
+void check_index( const char * name, const std::vector<IndexTy> & c ) {
+    typedef typename IndexEnc::unit_type unit_type;
+    size_t units = IndexEnc::units( c.data(), c.size() );
+    std::vector<unit_type> enc( units + 1 );
+    unit_type * end = IndexEnc::encode( c.data(), c.size(), enc.data() );
+    if( size_t( end - enc.data() ) != units )
+	fatal( name, ": encoding takes ", end - enc.data(),
+	       " units, expected ", units );
+    typename IndexEnc::template decoder<IndexTy> dec( enc.data() );
+    for( size_t i=0; i < c.size(); ++i ) {
+	IndexTy v = dec.next();
+	if( v != c[i] )
+	    fatal( name, ": coordinate ", i, " decodes to ", v,
+		   ", expected ", c[i] );
+    }
+}
+
+template<typename IndexEnc, typename IndexTy>
+void check_indices( const char * name, IndexTy max, std::mt19937 & rng ) {
+    check_index<IndexEnc>( name, std::vector<IndexTy>() );
+    check_index<IndexEnc>( name, std::vector<IndexTy>{ 0 } );
+    check_index<IndexEnc>( name, std::vector<IndexTy>{ max } );
+    check_index<IndexEnc>( name, std::vector<IndexTy>{ 0, 1, 2, 3, 4 } );
+    // Gaps around the boundaries of the varint groups
+    check_index<IndexEnc>( name, std::vector<IndexTy>{
+	    127, 255, 383, 16383, 32767, 32768, 2097151, 4194303, max } );
+
+    std::uniform_int_distribution<IndexTy> coord( 0, max );
+    for( size_t n=1; n < 2000; n = n * 3 + 1 ) {
+	std::vector<IndexTy> c( n );
+	for( IndexTy & x : c )
+	    x = coord( rng );
+	std::sort( c.begin(), c.end() );
+	c.erase( std::unique( c.begin(), c.end() ), c.end() );
+	check_index<IndexEnc>( name, c );
+    }
+}
+
+// Encode the values and decode them again, within the given relative
+// error, or absolute error for subnormal values. Scaled encodings are
+// accurate to half the scale.
+template<typename ValueEnc>
+void check_values( const char * name, const std::vector<float> & v,
+		   float rel_err, float abs_err ) {
+    float scale = ValueEnc::scale( v.data(), v.size() );
+    for( size_t i=0; i < v.size(); ++i ) {
+	float d = scale * ValueEnc::decode( ValueEnc::encode( v[i], 1/scale ) );
+	float err = ValueEnc::is_scaled ? scale / 2
+	    : std::max( rel_err * std::abs( v[i] ), abs_err );
+	if( !( std::abs( d - v[i] ) <= err ) )
+	    fatal( name, ": value ", v[i], " decodes to ", d );
+    }
+}
+
+template<typename ValueEnc>
+void check_values( const char * name, float rel_err, float abs_err,
+		   std::mt19937 & rng ) {
+    check_values<ValueEnc>( name, std::vector<float>(), rel_err, abs_err );
+    check_values<ValueEnc>( name, std::vector<float>{ 0, 1, -1, 0.5f, -0.25f,
+		2, 3, 127, -128, 1024 }, rel_err, abs_err );
+    std::uniform_real_distribution<float> mantissa( -1, 1 );
+    std::uniform_int_distribution<int> exponent( -12, 12 );
+    std::vector<float> v( 1000 );
+    for( float & x : v )
+	x = std::ldexp( mantissa( rng ), exponent( rng ) );
+    check_values<ValueEnc>( name, v, rel_err, abs_err );
+}
+
+// The kernels on the encoded vector agree with the decoded values, for
+// lengths that are not a multiple of the vector width
+template<typename IndexEnc, typename ValueEnc>
+void check_kernels( const char * name, std::mt19937 & rng ) {
+    typedef asap::internal::compact_dense_kernels<IndexEnc, ValueEnc,
+						  size_t, float> kernels;
+    const size_t length = 5000;
+    std::vector<float> d( length );
+    std::uniform_real_distribution<float> uniform( -1, 1 );
+    for( float & x : d )
+	x = uniform( rng );
+
+    std::uniform_int_distribution<size_t> coord( 0, length-1 );
+    for( size_t n : { 0, 1, 7, 8, 9, 31, 100, 1001 } ) {
+	std::vector<size_t> c( n );
+	for( size_t & x : c )
+	    x = coord( rng );
+	std::sort( c.begin(), c.end() );
+	c.erase( std::unique( c.begin(), c.end() ), c.end() );
+	n = c.size();
+
+	std::vector<typename IndexEnc::unit_type>
+	    enc( IndexEnc::units( c.data(), n ) + 1 );
+	IndexEnc::encode( c.data(), n, enc.data() );
+	std::vector<typename ValueEnc::storage_type> s( n + 1 );
+	for( size_t j=0; j < n; ++j )
+	    s[j] = ValueEnc::encode( uniform( rng ), 1 );
+
+	double dot = 0, ss = 0;
+	for( size_t j=0; j < n; ++j ) {
+	    double v = ValueEnc::decode( s[j] );
+	    dot += v * d[c[j]];
+	    ss += v * v;
+	}
+	float k_ss, k_sd;
+	float k_dot = kernels::dot( enc.data(), s.data(), n, d.data() );
+	kernels::sq_and_dot( enc.data(), s.data(), n, d.data(), k_ss, k_sd );
+	if( std::abs( k_dot - dot ) > 1e-3 || std::abs( k_sd - dot ) > 1e-3
+	    || std::abs( k_ss - ss ) > 1e-3 )
+	    fatal( name, ": kernels disagree for ", n, " nonzeros" );
+
+	std::vector<float> sum( d );
+	kernels::add( sum.data(), enc.data(), s.data(), n, 2 );
+	for( size_t j=0; j < n; ++j ) {
+	    float e = d[c[j]] + 2 * ValueEnc::decode( s[j] );
+	    if( std::abs( sum[c[j]] - e ) > 1e-5 )
+		fatal( name, ": add disagrees for ", n, " nonzeros" );
+	}
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    std::mt19937 rng( 42 );
+
+    check_indices<asap::index_u32, uint32_t>(
+	"u32", std::numeric_limits<int32_t>::max(), rng );
+    check_indices<asap::index_u32, size_t>(
+	"u32", std::numeric_limits<int32_t>::max(), rng );
+    check_indices<asap::index_delta_varint, uint32_t>(
+	"varint", std::numeric_limits<uint32_t>::max(), rng );
+    check_indices<asap::index_delta_varint, size_t>(
+	"varint", size_t(1) << 48, rng );
+
+    check_values<asap::value_fp32>( "fp32", 0, 0, rng );
+    check_values<asap::value_fp16>( "fp16", std::ldexp( 1.0f, -11 ),
+				    std::ldexp( 1.0f, -25 ), rng );
+    check_values<asap::value_bf16>( "bf16", std::ldexp( 1.0f, -8 ), 0, rng );
+    check_values<asap::value_int8>( "int8", 0, 0, rng );
+
+    check_kernels<asap::index_u32, asap::value_fp32>( "u32/fp32", rng );
+    check_kernels<asap::index_u32, asap::value_fp16>( "u32/fp16", rng );
+    check_kernels<asap::index_u32, asap::value_bf16>( "u32/bf16", rng );
+    check_kernels<asap::index_u32, asap::value_int8>( "u32/int8", rng );
+    check_kernels<asap::index_delta_varint, asap::value_fp32>( "varint/fp32", rng );
+    check_kernels<asap::index_delta_varint, asap::value_int8>( "varint/int8", rng );
+
+    std::cout << "compact_vector: ok\n";
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "asap/utils.h"
+#include "asap/embedding.h"
+
+int main( int argc, char *argv[] ) {
+    const size_t n = 5000, d = 37, k = 10;
+    std::mt19937 rng( 42 );
+    std::normal_distribution<float> normal( 0, 1 );
+    std::vector<float> vec( n * d );
+    for( float & x : vec )
+	x = normal( rng );
+    std::vector<std::string> words( n );
+    for( size_t i=0; i < n; ++i )
+	words[i] = "w" + std::to_string( ( i * 7919 ) % n );
+
+    char fname[] = "/tmp/t_embedding_XXXXXX";
+    int fd = mkstemp( fname );
+    if( fd < 0 )
+	fatale( "mkstemp", fname );
+    close( fd );
+    asap::write_embeddings( fname, n, d, vec.data(),
+			    [&]( size_t i ) { return words[i].c_str(); } );
+
+    asap::embedding_store store( fname );
+    unlink( fname );
+    if( store.get_num_points() != n || store.get_dimensions() != d )
+	fatal( "embedding store has wrong shape" );
+    for( size_t i=0; i < n; ++i ) {
+	if( store.index_of( words[i].c_str() ) != i )
+	    fatal( "word lookup failed for ", words[i] );
+    }
+    if( store.index_of( "missing" ) != asap::embedding_store::npos )
+	fatal( "lookup of missing word succeeded" );
+
+    asap::embedding_index index( store );
+    for( size_t qi=0; qi < 20; ++qi ) {
+	size_t q = ( qi * 613 ) % n;
+	std::vector<asap::neighbour> nn
+	    = index.most_similar( words[q].c_str(), k );
+
+	// Brute force reference
+	std::vector<asap::neighbour> ref;
+	for( size_t i=0; i < n; ++i ) {
+	    if( i == q )
+		continue;
+	    double dot = 0, nq = 0, ni = 0;
+	    for( size_t c=0; c < d; ++c ) {
+		dot += vec[q*d+c] * vec[i*d+c];
+		nq += vec[q*d+c] * vec[q*d+c];
+		ni += vec[i*d+c] * vec[i*d+c];
+	    }
+	    ref.push_back( asap::neighbour( i, dot / std::sqrt( nq * ni ) ) );
+	}
+	std::sort( ref.begin(), ref.end(),
+		   asap::second_greater<asap::neighbour>() );
+	if( nn.size() != k )
+	    fatal( "search returned wrong number of neighbours" );
+	for( size_t j=0; j < k; ++j ) {
+	    if( std::abs( nn[j].second - ref[j].second ) > 1e-4 )
+		fatal( "search differs from brute force for ", words[q] );
+	}
+    }
+
+    // Probing all lists is exhaustive
+    index.build_ivf( 16, 5 );
+    index.set_nprobe( 16 );
+    for( size_t qi=0; qi < 20; ++qi ) {
+	size_t q = ( qi * 613 ) % n;
+	std::vector<asap::neighbour> nn
+	    = index.search( store.vector( q ), k, q );
+	asap::embedding_index exact( store );
+	std::vector<asap::neighbour> ref
+	    = exact.search( store.vector( q ), k, q );
+	for( size_t j=0; j < k; ++j ) {
+	    if( nn[j].second != ref[j].second )
+		fatal( "IVF search with all lists probed is not exact" );
+	}
+    }
+
+    std::cout << "embedding: ok\n";
+    return 0;
+}
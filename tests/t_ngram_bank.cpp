@@ -0,0 +1,148 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "asap/par.h"
+#include "asap/utils.h"
+#include "asap/data_set.h"
+#include "asap/hashtable.h"
+#include "asap/word_count.h"
+#include "asap/ngram_bank.h"
+
+typedef asap::text::ngram<1> key_type;
+typedef asap::hash_table<key_type, size_t, asap::text::ngram_hash,
+			 asap::text::ngram_eql> wc_map;
+typedef asap::hash_table<key_type, asap::appear_count<size_t, size_t>,
+			 asap::text::ngram_hash, asap::text::ngram_eql> dc_map;
+typedef asap::ngram_map<wc_map, asap::word_bank_pre_alloc, 1> internal_map_type;
+typedef asap::ngram_map<dc_map, asap::word_bank_pre_alloc, 1> aggregate_map_type;
+
+// A buffer holding the '\0'-terminated words w<i> for i in [from,to)
+std::shared_ptr<char> make_buffer( size_t from, size_t to,
+				   std::vector<const char *> & words ) {
+    std::string s;
+    std::vector<size_t> pos;
+    for( size_t i=from; i < to; ++i ) {
+	pos.push_back( s.size() );
+	s += "w" + std::to_string( i );
+	s.push_back( '\0' );
+    }
+    std::shared_ptr<char> buf( new char[s.size()], std::default_delete<char[]>() );
+    memcpy( buf.get(), s.data(), s.size() );
+    words.clear();
+    for( size_t p : pos )
+	words.push_back( buf.get() + p );
+    return buf;
+}
+
+template<typename MapTy>
+void index_words( MapTy & m, const std::vector<const char *> & words ) {
+    for( const char * w : words ) {
+	key_type ng;
+	ng[0] = w;
+	m.index( ng );
+    }
+}
+
+size_t count_of( internal_map_type & m, const char * w ) {
+    key_type ng;
+    ng[0] = w;
+    auto I = m.find( ng );
+    return I == m.end() ? 0 : I->second;
+}
+
+int main( int argc, char *argv[] ) {
+    // Several workers, such that the views of the reducer are merged
+    setenv( "ASAP_NUM_WORKERS", "4", 0 );
+
+    // A smaller map that owns the words reduced with a larger map that
+    // refers to the same words: the larger map is retained and the words
+    // must survive it.
+    {
+	std::vector<const char *> words;
+	std::shared_ptr<char> buf = make_buffer( 0, 16, words );
+	std::weak_ptr<char> alive( buf );
+
+	internal_map_type small, large;
+	small.enregister( buf );
+	buf.reset();
+	index_words( small,
+		     std::vector<const char *>( words.begin(), words.begin()+4 ) );
+	index_words( large, words );
+
+	small.reduce( large );
+	if( alive.expired() )
+	    fatal( "reduce released the words of the reduced map" );
+	if( small.size() != 16 || large.size() != 0 )
+	    fatal( "reduce produced wrong sizes" );
+	for( size_t i=0; i < words.size(); ++i )
+	    if( count_of( small, words[i] ) != ( i < 4 ? 2 : 1 ) )
+		fatal( "reduce produced wrong count for ", words[i] );
+    }
+
+    // Parallel catalog of a document: the words of all workers point into
+    // the document, which is held only by the catalog passed in. The first
+    // half of the document holds all words, the second half a few, such
+    // that the views holding the document are often the smaller ones.
+    {
+	const size_t nwords = 20000, vocabulary = 500;
+	std::string text;
+	std::vector<size_t> expected( vocabulary, 0 );
+	for( size_t i=0; i < nwords; ++i ) {
+	    size_t v = i < nwords/2 ? i % vocabulary : i % 10;
+	    ++expected[v];
+	    text += "W" + std::string( 1, 'A' + v % 26 )
+		+ std::string( 1, 'A' + v / 26 ) + ' ';
+	}
+	std::shared_ptr<char> buf( new char[text.size()+1],
+				   std::default_delete<char[]>() );
+	memcpy( buf.get(), text.c_str(), text.size()+1 );
+	std::weak_ptr<char> alive( buf );
+
+	internal_map_type catalog;
+	catalog.enregister( buf );
+	char * data = buf.get();
+	buf.reset();
+	size_t ngrams = asap::text::ngram_catalog( data, text.size(), catalog,
+						   256 );
+
+	if( alive.expired() )
+	    fatal( "catalog released the document" );
+	if( ngrams != nwords )
+	    fatal( "catalog holds ", ngrams, " n-grams, expected ", nwords );
+	size_t total = 0;
+	for( auto I=catalog.begin(), E=catalog.end(); I != E; ++I ) {
+	    const char * w = I->first[0];
+	    if( strlen( w ) != 3 || w[0] != 'W' )
+		fatal( "catalog holds corrupted word" );
+	    size_t v = ( w[1] - 'A' ) + 26 * ( w[2] - 'A' );
+	    if( v >= vocabulary || I->second != expected[v] )
+		fatal( "wrong count for ", w );
+	    total += I->second;
+	}
+	if( total != nwords )
+	    fatal( "catalog counts ", total, " words, expected ", nwords );
+    }
+
+    std::cout << "ngram_bank: ok\n";
+    return 0;
+}
@@ -0,0 +1,109 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "asap/utils.h"
+#include "asap/perfect_hash.h"
+
+// FNV-1a
+struct fnv_hash {
+    size_t operator () ( const char * s ) const {
+	uint64_t v = 14695981039346656037ULL;
+	while( *s )
+	    v = ( v ^ (unsigned char)*s++ ) * 1099511628211ULL;
+	return v;
+    }
+};
+
+// Few distinct hash values, such that keys remain after all levels
+struct poor_hash {
+    size_t operator () ( const char * s ) const {
+	return fnv_hash()( s ) % 4;
+    }
+};
+
+struct charp_eql {
+    bool operator () ( const char * a, const char * b ) const {
+	return !strcmp( a, b );
+    }
+};
+
+typedef std::vector<std::pair<const char *, size_t>> container_type;
+
+template<typename Hash>
+void check( const std::vector<std::string> & words,
+	    const std::vector<std::string> & misses ) {
+    container_type c;
+    for( size_t i=0; i < words.size(); ++i )
+	c.push_back( std::make_pair( words[i].c_str(), i ) );
+
+    asap::perfect_hash_index<container_type, Hash, charp_eql> index( c );
+    if( index.size() != words.size() )
+	fatal( "index holds ", index.size(), " keys, expected ", words.size() );
+
+    for( size_t i=0; i < words.size(); ++i ) {
+	const char * w = words[i].c_str();
+	if( index.index_of( w ) != i )
+	    fatal( "index_of('", w, "') = ", index.index_of( w ),
+		   ", expected ", i );
+	auto I = index.find( w );
+	if( I == index.cend() || I->second != i )
+	    fatal( "find('", w, "') failed" );
+    }
+
+    for( const std::string & m : misses ) {
+	if( index.index_of( m.c_str() ) != index.npos
+	    || index.find( m.c_str() ) != index.cend() )
+	    fatal( "lookup of missing key '", m, "' succeeded" );
+    }
+}
+
+template<typename Hash>
+void check_sizes( size_t max ) {
+    // Sizes around the 64-bit words and 448-bit blocks of the bit arrays
+    for( size_t n : { 0, 1, 2, 5, 16, 31, 32, 33, 63, 64, 65, 223, 224, 225,
+		1000, 20000 } ) {
+	if( n > max )
+	    break;
+	std::vector<std::string> words, misses;
+	for( size_t i=0; i < n; ++i ) {
+	    words.push_back( "k" + std::to_string( i ) );
+	    // Extensions of keys and keys in another case
+	    misses.push_back( "k" + std::to_string( i ) + "0x" );
+	    misses.push_back( "K" + std::to_string( i ) );
+	}
+	misses.push_back( "" );
+	misses.push_back( "k" );
+	check<Hash>( words, misses );
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    check_sizes<fnv_hash>( 20000 );
+    // Keys placed in the levels and in the fallback table
+    check_sizes<poor_hash>( 1000 );
+
+    // Keys that are prefixes of other keys
+    check<fnv_hash>( std::vector<std::string>{ "a", "ab", "abc", "abcd", "b" },
+		     std::vector<std::string>{ "", "aa", "abd", "abcde", "c" } );
+
+    std::cout << "perfect_hash: ok\n";
+    return 0;
+}
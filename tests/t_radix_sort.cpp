@@ -0,0 +1,196 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "asap/utils.h"
+#include "asap/radix_sort.h"
+
+// Sort the indices with both radix sorts. The sorts are stable, hence the
+// values must appear in the same order as after std::stable_sort.
+template<typename IndexTy>
+void check_index( const char * name, const std::vector<IndexTy> & c ) {
+    size_t n = c.size();
+    std::vector<std::pair<IndexTy, float>> ref;
+    for( size_t i=0; i < n; ++i )
+	ref.push_back( std::make_pair( c[i], float(i) ) );
+    std::stable_sort( ref.begin(), ref.end(),
+		      []( const std::pair<IndexTy, float> & l,
+			  const std::pair<IndexTy, float> & r ) {
+			  return l.first < r.first;
+		      } );
+
+    for( int parallel=0; parallel < 2; ++parallel ) {
+	std::vector<IndexTy> sc( c );
+	std::vector<float> sv( n );
+	for( size_t i=0; i < n; ++i )
+	    sv[i] = float(i);
+	// Non-null pointers for empty vectors
+	sc.reserve( 1 );
+	sv.reserve( 1 );
+	if( parallel )
+	    asap::internal::parallel_radix_sort_by_index( sv.data(), sc.data(), n );
+	else
+	    asap::internal::radix_sort_by_index( sv.data(), sc.data(), n );
+	for( size_t i=0; i < n; ++i )
+	    if( sc[i] != ref[i].first || sv[i] != ref[i].second )
+		fatal( name, parallel ? ": parallel" : ": sequential",
+		       " sort of ", n, " indices differs at ", i );
+    }
+}
+
+template<typename IndexTy>
+void check_indices( const char * name, std::mt19937 & rng ) {
+    IndexTy max = std::numeric_limits<IndexTy>::max();
+    check_index<IndexTy>( name, std::vector<IndexTy>() );
+    check_index<IndexTy>( name, std::vector<IndexTy>{ 3 } );
+    check_index<IndexTy>( name, std::vector<IndexTy>{ max, 0, max, 0 } );
+
+    // Sizes around the cutoffs, on small keys, keys with the high bits set,
+    // few distinct keys and keys that differ only in the high byte
+    for( size_t n : { 2, 63, 64, 65, 1000, 65535, 65536, 100001 } ) {
+	std::uniform_int_distribution<IndexTy> small( 0, 300 );
+	std::uniform_int_distribution<IndexTy> any( 0, max );
+	std::uniform_int_distribution<IndexTy> few( 0, 3 );
+	std::vector<IndexTy> c( n );
+
+	for( IndexTy & x : c )
+	    x = small( rng );
+	check_index<IndexTy>( name, c );
+	for( IndexTy & x : c )
+	    x = any( rng );
+	check_index<IndexTy>( name, c );
+	for( IndexTy & x : c )
+	    x = few( rng );
+	check_index<IndexTy>( name, c );
+	for( IndexTy & x : c )
+	    x = IndexTy( few( rng ) ) << ( 8 * sizeof(IndexTy) - 2 );
+	check_index<IndexTy>( name, c );
+
+	// Sorted, reverse sorted and all equal
+	for( size_t i=0; i < n; ++i )
+	    c[i] = IndexTy(i);
+	check_index<IndexTy>( name, c );
+	std::reverse( c.begin(), c.end() );
+	check_index<IndexTy>( name, c );
+	std::fill( c.begin(), c.end(), max );
+	check_index<IndexTy>( name, c );
+    }
+}
+
+typedef std::pair<const char *, size_t> word_pair;
+
+bool str_less( const char * a, const char * b ) {
+    return strcmp( a, b ) < 0;
+}
+
+// Sort the words with all engines, as plain strings and as key-value pairs.
+// The radix sorts are not stable; the values must remain with their keys.
+void check_words( const std::vector<std::string> & words ) {
+    size_t n = words.size();
+    std::vector<const char *> ref;
+    for( const std::string & w : words )
+	ref.push_back( w.c_str() );
+    std::sort( ref.begin(), ref.end(), str_less );
+
+    static const char * engine_name[3]
+	= { "comparison", "radix", "parallel radix" };
+    for( int e=0; e < 3; ++e ) {
+	asap::sort_engine_t engine = asap::sort_engine_t( e );
+
+	std::vector<const char *> w;
+	for( const std::string & s : words )
+	    w.push_back( s.c_str() );
+	asap::sort_words( w.begin(), w.end(), engine );
+	for( size_t i=0; i < n; ++i )
+	    if( strcmp( w[i], ref[i] ) )
+		fatal( engine_name[e], " sort of ", n, " words yields '", w[i],
+		       "' at ", i, ", expected '", ref[i], "'" );
+
+	std::vector<word_pair> kv;
+	for( size_t i=0; i < n; ++i )
+	    kv.push_back( word_pair( words[i].c_str(), i ) );
+	asap::sort_words( kv.begin(), kv.end(), engine );
+	std::vector<bool> seen( n, false );
+	for( size_t i=0; i < n; ++i ) {
+	    if( strcmp( kv[i].first, ref[i] ) )
+		fatal( engine_name[e], " sort of ", n, " pairs yields '",
+		       kv[i].first, "' at ", i, ", expected '", ref[i], "'" );
+	    if( kv[i].second >= n || seen[kv[i].second]
+		|| kv[i].first != words[kv[i].second].c_str() )
+		fatal( engine_name[e], " sort of ", n,
+		       " pairs separates the value of '", kv[i].first, "'" );
+	    seen[kv[i].second] = true;
+	}
+    }
+}
+
+// Random words over a small alphabet, including bytes above 127, such that
+// words share prefixes and are duplicated
+std::vector<std::string> random_words( size_t n, size_t maxlen,
+				       std::mt19937 & rng ) {
+    std::uniform_int_distribution<size_t> len( 0, maxlen );
+    std::uniform_int_distribution<int> chr( 0, 5 );
+    const char alphabet[] = "abcA\xc3\xff";
+    std::vector<std::string> words( n );
+    for( std::string & w : words )
+	for( size_t k=len( rng ); k > 0; --k )
+	    w.push_back( alphabet[chr( rng )] );
+    return words;
+}
+
+int main( int argc, char *argv[] ) {
+    // Several workers, such that the parallel sorts split their input
+    setenv( "ASAP_NUM_WORKERS", "4", 0 );
+
+    std::mt19937 rng( 3 );
+
+    check_indices<uint32_t>( "u32", rng );
+    check_indices<uint64_t>( "u64", rng );
+    check_indices<uint16_t>( "u16", rng );
+
+    check_words( std::vector<std::string>() );
+    check_words( std::vector<std::string>{ "" } );
+    check_words( std::vector<std::string>{ "b", "", "a", "" } );
+    // Words that are prefixes of other words
+    check_words( std::vector<std::string>{ "abcd", "ab", "abc", "a", "abcd",
+		"abce", "abc", "b" } );
+
+    // Sizes around the cutoffs
+    for( size_t n : { 2, 31, 32, 33, 100, 5000, 65535, 65536, 100001 } )
+	check_words( random_words( n, 8, rng ) );
+
+    // Long shared prefixes, such that the radix sort recurses deeply
+    std::vector<std::string> words = random_words( 70000, 3, rng );
+    for( std::string & w : words )
+	w = std::string( 40, 'p' ) + w;
+    check_words( words );
+
+    // All words equal
+    check_words( std::vector<std::string>( 100, "same" ) );
+    check_words( std::vector<std::string>( 70000, "" ) );
+
+    std::cout << "radix_sort: ok\n";
+    return 0;
+}
@@ -0,0 +1,215 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "asap/utils.h"
+#include "asap/vector_ops.h"
+
+// Values are small integers, such that all sums are exact and the kernels
+// must agree with the reference regardless of the order of summation.
+template<typename IndexTy, typename ValueTy>
+struct sparse {
+    std::vector<IndexTy> c;
+    std::vector<ValueTy> v;
+
+    sparse( const std::vector<IndexTy> & c_, std::mt19937 & rng ) : c( c_ ) {
+	std::uniform_int_distribution<int> val( -4, 4 );
+	for( size_t i=0; i < c.size(); ++i ) {
+	    int x = val( rng );
+	    v.push_back( x ? x : 5 );
+	}
+    }
+
+    ValueTy at( IndexTy i ) const {
+	auto I = std::lower_bound( c.begin(), c.end(), i );
+	return I != c.end() && *I == i ? v[I - c.begin()] : ValueTy(0);
+    }
+};
+
+template<typename IndexTy, typename ValueTy>
+ValueTy ref_dot( const sparse<IndexTy, ValueTy> & a,
+		 const sparse<IndexTy, ValueTy> & b ) {
+    std::vector<IndexTy> common;
+    std::set_intersection( a.c.begin(), a.c.end(), b.c.begin(), b.c.end(),
+			   std::back_inserter( common ) );
+    ValueTy sum = 0;
+    for( IndexTy i : common )
+	sum += a.at( i ) * b.at( i );
+    return sum;
+}
+
+template<typename IndexTy, typename ValueTy>
+ValueTy ref_sq_dist( const sparse<IndexTy, ValueTy> & a,
+		     const sparse<IndexTy, ValueTy> & b ) {
+    std::vector<IndexTy> all;
+    std::set_union( a.c.begin(), a.c.end(), b.c.begin(), b.c.end(),
+		    std::back_inserter( all ) );
+    ValueTy sum = 0;
+    for( IndexTy i : all ) {
+	ValueTy d = a.at( i ) - b.at( i );
+	sum += d * d;
+    }
+    return sum;
+}
+
+// Checks the dispatching kernel, the linear merge (SIMD where available),
+// the scalar merge and galloping on a pair of vectors, in both orders.
+template<typename IndexTy, typename ValueTy>
+void check( const char * name, const std::vector<IndexTy> & ac,
+	    const std::vector<IndexTy> & bc, std::mt19937 & rng ) {
+    typedef asap::internal::sparse_sparse_kernels<IndexTy, ValueTy> kernels;
+    typedef asap::internal::sparse_sparse_scalar_kernels<IndexTy, ValueTy>
+	scalar;
+    typedef typename kernels::merge merge;
+
+    sparse<IndexTy, ValueTy> a( ac, rng ), b( bc, rng );
+    // Non-null pointers for empty vectors
+    a.c.reserve( 1 ); a.v.reserve( 1 );
+    b.c.reserve( 1 ); b.v.reserve( 1 );
+    ValueTy dot = ref_dot( a, b ), dist = ref_sq_dist( a, b );
+    IndexTy al = a.c.size(), bl = b.c.size();
+
+    for( int swap=0; swap < 2; ++swap ) {
+	const sparse<IndexTy, ValueTy> & x = swap ? b : a;
+	const sparse<IndexTy, ValueTy> & y = swap ? a : b;
+	IndexTy xl = swap ? bl : al, yl = swap ? al : bl;
+	ValueTy r[4] = {
+	    kernels::dot( x.v.data(), x.c.data(), xl, y.v.data(), y.c.data(), yl ),
+	    merge::dot_merge( x.v.data(), x.c.data(), xl,
+			      y.v.data(), y.c.data(), yl ),
+	    scalar::dot_merge( x.v.data(), x.c.data(), xl,
+			       y.v.data(), y.c.data(), yl ),
+	    scalar::dot_gallop( x.v.data(), x.c.data(), xl,
+				y.v.data(), y.c.data(), yl ),
+	};
+	static const char * kernel[4]
+	    = { "dot", "dot_merge", "scalar dot_merge", "dot_gallop" };
+	for( int k=0; k < 4; ++k )
+	    if( r[k] != dot )
+		fatal( name, ": ", kernel[k], " of ", xl, " and ", yl,
+		       " nonzeros is ", r[k], ", expected ", dot );
+	ValueTy d = kernels::square_euclidean_distance(
+	    x.v.data(), x.c.data(), xl, y.v.data(), y.c.data(), yl );
+	if( d != dist )
+	    fatal( name, ": square_euclidean_distance of ", xl, " and ", yl,
+		   " nonzeros is ", d, ", expected ", dist );
+    }
+}
+
+// Distinct sorted coordinates drawn from [0,max]
+template<typename IndexTy>
+std::vector<IndexTy> random_coords( size_t n, IndexTy max, std::mt19937 & rng ) {
+    std::uniform_int_distribution<IndexTy> coord( 0, max );
+    std::vector<IndexTy> c( n );
+    for( IndexTy & x : c )
+	x = coord( rng );
+    std::sort( c.begin(), c.end() );
+    c.erase( std::unique( c.begin(), c.end() ), c.end() );
+    return c;
+}
+
+template<typename IndexTy>
+std::vector<IndexTy> stride_coords( size_t n, IndexTy from, IndexTy step ) {
+    std::vector<IndexTy> c;
+    for( size_t i=0; i < n; ++i )
+	c.push_back( from + IndexTy(i) * step );
+    return c;
+}
+
+template<typename IndexTy, typename ValueTy>
+void check_all( const char * name, std::mt19937 & rng ) {
+    typedef std::vector<IndexTy> coords;
+
+    // Lengths around the block size of 4
+    const size_t lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 33 };
+    for( size_t n : lengths ) {
+	for( size_t m : lengths ) {
+	    // Equal coordinates, or a prefix of the other
+	    check<IndexTy, ValueTy>( name, stride_coords<IndexTy>( n, 0, 1 ),
+				     stride_coords<IndexTy>( m, 0, 1 ), rng );
+	    // Interleaved without overlap
+	    check<IndexTy, ValueTy>( name, stride_coords<IndexTy>( n, 0, 2 ),
+				     stride_coords<IndexTy>( m, 1, 2 ), rng );
+	    // Disjoint ranges
+	    check<IndexTy, ValueTy>( name, stride_coords<IndexTy>( n, 0, 1 ),
+				     stride_coords<IndexTy>( m, 100, 1 ), rng );
+	    // Subset, overlapping only in every third coordinate
+	    check<IndexTy, ValueTy>( name, stride_coords<IndexTy>( n, 3, 3 ),
+				     stride_coords<IndexTy>( m * 3, 1, 1 ), rng );
+	    // Dense random overlap
+	    check<IndexTy, ValueTy>( name, random_coords<IndexTy>( n, 40, rng ),
+				     random_coords<IndexTy>( m, 40, rng ), rng );
+	}
+    }
+
+    // Skewed lengths, such that dot selects galloping
+    for( size_t n : { 1, 3, 4, 5, 9, 30 } ) {
+	coords b = random_coords<IndexTy>( 2000, 100000, rng );
+	// Hits, misses and coordinates beyond either end of b
+	coords a( b );
+	std::shuffle( a.begin(), a.end(), rng );
+	a.resize( n );
+	std::sort( a.begin(), a.end() );
+	a.push_back( b.back() + 1 );
+	if( b.front() > 0 )
+	    a.insert( a.begin(), b.front() - 1 );
+	check<IndexTy, ValueTy>( name, a, b, rng );
+	check<IndexTy, ValueTy>( name, random_coords<IndexTy>( n, 100000, rng ),
+				 b, rng );
+    }
+
+    // Coordinates with the high bits set
+    IndexTy max = std::numeric_limits<IndexTy>::max();
+    for( size_t n : { 5, 13, 64 } ) {
+	coords a = random_coords<IndexTy>( n, 200, rng );
+	coords b = random_coords<IndexTy>( n * 2, 200, rng );
+	for( IndexTy & x : a )
+	    x = max - 200 + x;
+	for( IndexTy & x : b )
+	    x = max - 200 + x;
+	check<IndexTy, ValueTy>( name, a, b, rng );
+    }
+
+    // Random vectors of various densities
+    for( size_t i=0; i < 200; ++i ) {
+	std::uniform_int_distribution<size_t> len( 0, 300 );
+	std::uniform_int_distribution<IndexTy> range( 1, 2000 );
+	IndexTy r = range( rng );
+	check<IndexTy, ValueTy>( name, random_coords<IndexTy>( len( rng ), r, rng ),
+				 random_coords<IndexTy>( len( rng ), r, rng ),
+				 rng );
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    std::mt19937 rng( 7 );
+
+    check_all<uint32_t, float>( "u32/float", rng );
+    check_all<uint32_t, double>( "u32/double", rng );
+    check_all<uint64_t, float>( "u64/float", rng );
+    check_all<uint64_t, double>( "u64/double", rng );
+    check_all<int, float>( "int/float", rng );
+
+    std::cout << "sparse_sparse: ok\n";
+    return 0;
+}
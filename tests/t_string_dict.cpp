@@ -0,0 +1,154 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "asap/utils.h"
+#include "asap/string_dict.h"
+
+typedef std::pair<size_t, size_t> mapped_type;
+typedef asap::front_coded_dictionary<mapped_type> dict_type;
+
+bool str_less( const std::string & a, const std::string & b ) {
+    return strcmp( a.c_str(), b.c_str() ) < 0;
+}
+
+// Build the dictionary from words in arbitrary order and check lookups of
+// all words, iteration in lexicographic order and lookups of misses.
+void check( const std::vector<std::string> & words,
+	    const std::vector<std::string> & misses ) {
+    std::vector<std::pair<const char *, mapped_type>> kv;
+    for( size_t i=0; i < words.size(); ++i )
+	kv.push_back( std::make_pair( words[i].c_str(), mapped_type( i, 0 ) ) );
+
+    dict_type dict;
+    dict.build( kv.begin(), kv.end() );
+    dict.assign_ids();
+    if( dict.size() != words.size() )
+	fatal( "dictionary holds ", dict.size(), " words, expected ",
+	       words.size() );
+
+    std::vector<std::string> sorted( words );
+    std::sort( sorted.begin(), sorted.end(), str_less );
+
+    // Iteration yields the words in lexicographic order, with their values
+    size_t id = 0;
+    for( auto I=dict.cbegin(), E=dict.cend(); I != E; ++I, ++id ) {
+	if( I.id() != id || sorted[id] != I->first )
+	    fatal( "iteration yields '", I->first, "' at ", I.id(),
+		   ", expected '", sorted[id], "' at ", id );
+	if( words[I->second.first] != sorted[id] || I->second.second != id )
+	    fatal( "wrong value for '", I->first, "'" );
+    }
+    if( id != words.size() )
+	fatal( "iteration yields ", id, " words" );
+
+    // Hits, including iteration onwards from the word found
+    for( size_t i=0; i < sorted.size(); ++i ) {
+	const char * w = sorted[i].c_str();
+	if( dict.index_of( w ) != i )
+	    fatal( "index_of('", w, "') = ", dict.index_of( w ),
+		   ", expected ", i );
+	auto I = dict.find( w );
+	if( I == dict.cend() || strcmp( I->first, w ) || I->second.second != i )
+	    fatal( "find('", w, "') failed" );
+	if( i % dict_type::bucket_size == dict_type::bucket_size - 1
+	    || i + 3 >= sorted.size() ) {
+	    for( size_t j=i+1; j < sorted.size(); ++j ) {
+		++I;
+		if( I == dict.cend() || sorted[j] != I->first )
+		    fatal( "iteration from find('", w, "') failed" );
+	    }
+	    if( ++I != dict.cend() )
+		fatal( "iteration from find('", w, "') does not end" );
+	}
+    }
+
+    for( const std::string & m : misses ) {
+	if( dict.index_of( m.c_str() ) != dict_type::npos
+	    || dict.find( m.c_str() ) != dict.cend() )
+	    fatal( "lookup of missing word '", m, "' succeeded" );
+    }
+
+    // Building from sorted input gives the same dictionary
+    std::vector<std::pair<const char *, mapped_type>> skv;
+    for( size_t i=0; i < sorted.size(); ++i )
+	skv.push_back( std::make_pair( sorted[i].c_str(), mapped_type( i, i ) ) );
+    dict_type sdict;
+    sdict.build_sorted( skv.begin(), skv.end() );
+    if( sdict.memory_size() != dict.memory_size() )
+	fatal( "sorted build differs" );
+    for( size_t i=0; i < sorted.size(); ++i )
+	if( sdict.index_of( sorted[i].c_str() ) != i || sdict[i].first != i )
+	    fatal( "sorted build lookup of '", sorted[i], "' failed" );
+}
+
+int main( int argc, char *argv[] ) {
+    // Empty dictionary
+    check( std::vector<std::string>(),
+	   std::vector<std::string>{ "", "a", "zzz" } );
+
+    // Keys that are prefixes of other keys
+    check( std::vector<std::string>{ "abc", "a", "abcd", "ab", "b", "abd",
+		"abcde", "ba" },
+	std::vector<std::string>{ "", "aa", "abb", "abcc", "abcdef", "abce",
+		"bb", "c", "A", "\x80" } );
+
+    // Sizes around the bucket boundaries; words with shared prefixes
+    for( size_t n : { 1, 15, 16, 17, 31, 32, 33, 48 } ) {
+	std::vector<std::string> words, misses;
+	for( size_t i=0; i < n; ++i ) {
+	    words.push_back( "w" + std::to_string( i * 7 ) );
+	    misses.push_back( "w" + std::to_string( i * 7 + 1 ) + "x" );
+	}
+	misses.push_back( "w" );
+	misses.push_back( "v" );
+	misses.push_back( "x" );
+	check( words, misses );
+    }
+
+    // Random words over a small alphabet, including bytes above 127
+    std::mt19937 rng( 1 );
+    std::uniform_int_distribution<int> len( 1, 12 );
+    std::uniform_int_distribution<int> chr( 0, 5 );
+    const char alphabet[] = "abcd\xc3\xe9";
+    std::vector<std::string> words, misses;
+    for( size_t i=0; i < 5000; ++i ) {
+	std::string w;
+	for( int k=len( rng ); k > 0; --k )
+	    w.push_back( alphabet[chr( rng )] );
+	words.push_back( w );
+    }
+    std::sort( words.begin(), words.end(), str_less );
+    words.erase( std::unique( words.begin(), words.end() ), words.end() );
+    for( size_t i=0; i < 2000; ++i ) {
+	std::string w;
+	for( int k=len( rng ); k > 0; --k )
+	    w.push_back( alphabet[chr( rng )] );
+	if( !std::binary_search( words.begin(), words.end(), w, str_less ) )
+	    misses.push_back( w );
+    }
+    std::shuffle( words.begin(), words.end(), rng );
+    check( words, misses );
+
+    std::cout << "string_dict: ok\n";
+    return 0;
+}
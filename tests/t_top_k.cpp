@@ -0,0 +1,107 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <iostream>
+#include <random>
+#include <vector>
+#include "asap/utils.h"
+#include "asap/top_k.h"
+
+typedef std::pair<size_t,size_t> pair_type;
+
+int main( int argc, char *argv[] ) {
+    // Zipf-like counts: key i occurs about n/(i+1) times
+    const size_t nkeys = 200000, k = 10;
+    std::vector<pair_type> catalog( nkeys );
+    for( size_t i=0; i < nkeys; ++i )
+	catalog[i] = pair_type( i, nkeys / (i+1) );
+    std::shuffle( catalog.begin(), catalog.end(), std::mt19937( 42 ) );
+
+    std::vector<pair_type> top = asap::top_k( catalog, k );
+    std::vector<pair_type> ref( catalog );
+    std::sort( ref.begin(), ref.end(), asap::second_greater<pair_type>() );
+    if( top.size() != k )
+	fatal( "top_k returned wrong number of elements" );
+    for( size_t i=0; i < k; ++i ) {
+	if( top[i].second != ref[i].second )
+	    fatal( "top_k differs from full sort" );
+    }
+
+    // Stream the same counts through the sketches in random order
+    std::vector<size_t> stream;
+    for( size_t i=0; i < 2000; ++i )
+	stream.insert( stream.end(), 2000 / (i+1), i );
+    std::shuffle( stream.begin(), stream.end(), std::mt19937( 43 ) );
+
+    asap::space_saving<size_t> ss( 100 );
+    asap::count_min_sketch<size_t> cms( 1024, 4, 100 );
+    for( size_t key : stream ) {
+	ss.add( key );
+	cms.add( key );
+    }
+    if( ss.total() != stream.size() )
+	fatal( "space_saving total incorrect" );
+
+    auto sst = ss.top( k );
+    auto cmt = cms.top( k );
+    for( size_t i=0; i < k; ++i ) {
+	std::cout << sst[i].key << ": " << sst[i].count
+		  << " (error " << sst[i].error << ") "
+		  << cmt[i].key << ": " << cmt[i].count << "\n";
+	if( sst[i].key != i || cmt[i].key != i )
+	    fatal( "heavy hitters not identified" );
+	if( cms.estimate( i ) < 2000 / (i+1) )
+	    fatal( "count-min underestimates" );
+    }
+
+    // Merge sketches of two halves of the stream. Every counter must
+    // bound the true count from above, and from below after subtracting
+    // its error.
+    asap::space_saving<size_t> ssl( 100 ), ssr( 100 );
+    for( size_t j=0; j < stream.size(); ++j )
+	( j % 2 ? ssr : ssl ).add( stream[j] );
+    ssl.merge( ssr );
+    if( ssl.total() != stream.size() )
+	fatal( "space_saving merged total incorrect" );
+    for( const auto & e : ssl.top( 100 ) ) {
+	size_t freq = 2000 / (e.key+1);
+	if( e.count < freq || e.count - e.error > freq )
+	    fatal( "space_saving merge: key ", e.key, " count ", e.count,
+		   " error ", e.error, " does not bound frequency ", freq );
+    }
+    auto mt = ssl.top( k );
+    for( size_t i=0; i < k; ++i )
+	if( mt[i].key != i )
+	    fatal( "heavy hitters not identified after merge" );
+
+    // A key that is missing from the other, full, sketch may have been
+    // evicted from it
+    asap::space_saving<size_t> ssa( 2 ), ssb( 2 );
+    ssa.add( 100, 10 );
+    ssb.add( 1 );
+    ssb.add( 2 );
+    ssb.add( 3 );
+    ssa.merge( ssb );
+    for( const auto & e : ssa.top( 2 ) ) {
+	size_t freq = e.key == 100 ? 10 : 1;
+	if( e.count < freq || e.count - e.error > freq )
+	    fatal( "space_saving merge: key ", e.key, " count ", e.count,
+		   " error ", e.error, " does not bound frequency ", freq );
+    }
+
+    return 0;
+}
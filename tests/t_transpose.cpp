@@ -0,0 +1,138 @@
+/* -*-C++-*- */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "asap/utils.h"
+#include "asap/par.h"
+#include "asap/memory.h"
+#include "asap/sparse_vector.h"
+
+typedef asap::sparse_vector<uint32_t, float, false,
+			    asap::mm_no_ownership_policy> vector_type;
+typedef asap::sparse_vector_set<vector_type> vector_set_type;
+
+// A random matrix in compressed row storage with sorted coordinates
+std::shared_ptr<vector_set_type>
+random_rows( size_t nrows, size_t ncols, double density, std::mt19937 & rng ) {
+    std::bernoulli_distribution nonzero( density );
+    std::uniform_real_distribution<float> value( -1, 1 );
+    std::vector<std::vector<uint32_t>> coords( nrows );
+    size_t nnz = 0;
+    for( size_t r=0; r < nrows; ++r ) {
+	for( size_t c=0; c < ncols; ++c )
+	    if( nonzero( rng ) )
+		coords[r].push_back( c );
+	nnz += coords[r].size();
+    }
+
+    std::shared_ptr<vector_set_type> rows
+	= std::make_shared<vector_set_type>( nrows, ncols, nnz );
+    size_t pos = 0;
+    for( size_t r=0; r < nrows; ++r ) {
+	rows->emplace_back( ncols, coords[r].size() );
+	for( uint32_t c : coords[r] ) {
+	    rows->get_alloc_v()[pos] = value( rng );
+	    rows->get_alloc_i()[pos] = c;
+	    ++pos;
+	}
+    }
+    return rows;
+}
+
+// The transpose as tfidf_by_words used to build it: atomic counters hand
+// out positions in every column, after which the columns are sorted.
+std::shared_ptr<vector_set_type>
+reference_transpose( const vector_set_type & rows ) {
+    size_t nrows = rows.number(), ncols = rows.length();
+    std::vector<size_t> col_start( ncols+1, 0 );
+    for( size_t r=0; r < nrows; ++r )
+	for( size_t j=0; j < rows[r].nonzeros(); ++j )
+	    ++col_start[rows[r].get_coord()[j]+1];
+    for( size_t c=0; c < ncols; ++c )
+	col_start[c+1] += col_start[c];
+
+    std::shared_ptr<vector_set_type> cols
+	= std::make_shared<vector_set_type>( ncols, nrows, col_start[ncols] );
+    for( size_t c=0; c < ncols; ++c )
+	cols->emplace_back( nrows, col_start[c+1] - col_start[c] );
+
+    std::vector<size_t> ctr( ncols, 0 );
+    asap::par::parallel_for( size_t(0), nrows, [&]( size_t r ) {
+	for( size_t j=0; j < rows[r].nonzeros(); ++j ) {
+	    uint32_t c = rows[r].get_coord()[j];
+	    size_t pos = col_start[c] + __sync_fetch_and_add( &ctr[c], 1 );
+	    cols->get_alloc_v()[pos] = rows[r].get_value()[j];
+	    cols->get_alloc_i()[pos] = r;
+	}
+    } );
+    asap::par::parallel_for( size_t(0), ncols, [&]( size_t c ) {
+	(*cols)[c].sort_by_index();
+    } );
+    return cols;
+}
+
+void check_equal( const char * what, const vector_set_type & a,
+		  const vector_set_type & b ) {
+    if( a.number() != b.number() || a.length() != b.length() )
+	fatal( what, ": shape ", a.number(), 'x', a.length(),
+	       ", expected ", b.number(), 'x', b.length() );
+    if( a.nonzeros() != b.nonzeros() )
+	fatal( what, ": ", a.nonzeros(), " nonzeros, expected ",
+	       b.nonzeros() );
+    for( size_t i=0; i < a.number(); ++i ) {
+	if( a[i].length() != b[i].length()
+	    || a[i].nonzeros() != b[i].nonzeros() )
+	    fatal( what, ": vector ", i, " differs in size" );
+	for( size_t j=0; j < a[i].nonzeros(); ++j )
+	    if( a[i].get_coord()[j] != b[i].get_coord()[j]
+		|| a[i].get_value()[j] != b[i].get_value()[j] )
+		fatal( what, ": vector ", i, " differs at element ", j );
+    }
+}
+
+void check_transpose( size_t nrows, size_t ncols, double density,
+		      std::mt19937 & rng ) {
+    std::shared_ptr<vector_set_type> rows
+	= random_rows( nrows, ncols, density, rng );
+    std::shared_ptr<vector_set_type> cols = rows->transpose();
+    check_equal( "transpose", *cols, *reference_transpose( *rows ) );
+    check_equal( "round trip", *cols->transpose(), *rows );
+}
+
+int main( int argc, char *argv[] ) {
+    std::mt19937 rng( 42 );
+
+    check_transpose( 0, 10, 0.5, rng );
+    check_transpose( 10, 0, 0.5, rng );
+    check_transpose( 1, 1, 1.0, rng );
+    check_transpose( 1, 100, 0.3, rng );
+    check_transpose( 100, 1, 0.3, rng );
+    check_transpose( 50, 50, 0.0, rng );
+    check_transpose( 50, 50, 1.0, rng );
+    // Several blocks of rows, with empty rows and columns
+    check_transpose( 1000, 300, 0.01, rng );
+    check_transpose( 3000, 40, 0.2, rng );
+    check_transpose( 200, 5000, 0.05, rng );
+
+    std::cout << "transpose: ok\n";
+    return 0;
+}
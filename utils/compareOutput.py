@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+#
+# Compare the output of an operator with a reference irrespective of the
+# order in which attributes, data rows and lines appear. This order depends
+# on the directory order of the file system and, except with Cilk, on the
+# schedule (see include/asap/par.h).
+#
+#  + ARFF files: attributes are identified by name rather than by position,
+#    such that renumbering the attributes is allowed. Data rows are compared
+#    as sets of (attribute name, value) pairs and are matched on their
+#    trailing comment, which names the input file.
+#  + Cluster summaries of the K-means operators: attributes are identified
+#    by name and clusters are compared as a set, such that renumbering the
+#    clusters is allowed.
+#  + Other files: the lines are compared as multisets.
+#
+# Exits with status 0 if the files are equivalent and 1 otherwise.
+
+import sys, getopt
+import re
+
+attribute = re.compile(r"\s*@attribute\s+(\S+)\s+(\S+)\s*(?:%\s*(.*))?$",
+                       re.IGNORECASE)
+attribute_id = re.compile(r",?\s*\bid=\d+")
+
+def canonical_arff(lines):
+    names = []
+    attrs = []
+    rows = []
+    other = []
+    in_data = False
+    for line in lines:
+        s = line.strip()
+        if not s:
+            continue
+        if in_data:
+            body, _, comment = s.partition('%')
+            body = body.strip()
+            if body.startswith('{'):
+                pairs = []
+                for e in body.strip('{}').split(','):
+                    e = e.split()
+                    if e:
+                        pairs.append((names[int(e[0])], e[1]))
+            else:
+                pairs = list(zip(names, body.split(',')))
+            rows.append((comment.strip(), tuple(sorted(pairs))))
+            continue
+        m = attribute.match(s)
+        if m:
+            names.append(m.group(1))
+            comment = attribute_id.sub('', m.group(3) or '')
+            attrs.append((m.group(1), m.group(2), comment))
+        elif s.lower() == '@data':
+            in_data = True
+        else:
+            other.append(s)
+    return (other, sorted(attrs), sorted(rows))
+
+def canonical_clusters(lines):
+    header = []
+    rows = []
+    in_table = False
+    for line in lines:
+        s = line.split()
+        if not s:
+            continue
+        if in_table:
+            rows.append((s[0], s[1:]))
+        elif s[0].startswith('='):
+            in_table = True
+        else:
+            header.append(s)
+    # The last header line holds the size of the full data and the clusters
+    sizes = header[-1] if header else []
+    rows.sort()
+    ncols = len(sizes)
+    columns = []
+    for c in range(ncols):
+        columns.append((sizes[c], tuple((r[0], r[1][c] if c < len(r[1]) else None)
+                                        for r in rows)))
+    return (columns[:1], sorted(columns[1:]))
+
+def canonical(fname):
+    with open(fname) as f:
+        lines = f.read().splitlines()
+    if any(l.strip().lower().startswith('@relation') for l in lines):
+        return canonical_arff(lines)
+    if any(l.strip() == 'Cluster#' for l in lines):
+        return canonical_clusters(lines)
+    return sorted(lines)
+
+def main(argv):
+    inf1 = None
+    inf2 = None
+    try:
+        opts, args = getopt.getopt(argv, "hi:j:", ["ifile=", "jfile="])
+    except getopt.GetoptError:
+        print('compareOutput.py -i <infile1> -j <infile2>')
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt == '-h':
+            print('compareOutput.py -i <infile1> -j <infile2>')
+            sys.exit(2)
+        elif opt in ("-i", "--ifile"):
+            inf1 = arg
+        elif opt in ("-j", "--jfile"):
+            inf2 = arg
+    if not inf1 or not inf2:
+        print('Must specify 2 input files: compareOutput.py -i <infile1> -j <infile2>')
+        sys.exit(2)
+    sys.exit(0 if canonical(inf1) == canonical(inf2) else 1)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,119 @@
+/* -*-C++-*-
+ */
+/*
+ * Copyright 2016 EU Project ASAP 619706.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Most similar words by cosine similarity, using an embedding store
+ * written by word2vec -store <file>. Query words are taken from the
+ * command line, or one per line from standard input.
+ */
+
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "asap/par.h"
+#include "asap/utils.h"
+#include "asap/embedding.h"
+
+#include <stddefines.h>
+
+size_t num_neighbours = 40;
+size_t num_lists = 0;
+size_t num_probes = 8;
+char const * infile = nullptr;
+
+static void help(char *progname) {
+    std::cout << "Usage: " << progname
+	      << " -i <store> [-k <neighbours>] [-l <ivf-lists>]"
+	      << " [-p <lists-probed>] [word ...]\n";
+}
+
+static void parse_args(int argc, char **argv) {
+    int c;
+    extern char *optarg;
+
+    while ((c = getopt(argc, argv, "i:k:l:p:")) != EOF) {
+	switch (c) {
+	case 'i':
+	    infile = optarg;
+	    break;
+	case 'k':
+	    num_neighbours = atoi(optarg);
+	    break;
+	case 'l':
+	    num_lists = atoi(optarg);
+	    break;
+	case 'p':
+	    num_probes = atoi(optarg);
+	    break;
+	case '?':
+	    help(argv[0]);
+	    exit(1);
+	}
+    }
+
+    if( !infile )
+	fatal( "Input file must be supplied." );
+}
+
+static void query( const asap::embedding_store & store,
+		   const asap::embedding_index & index, const char * word ) {
+    struct timespec begin, end;
+    get_time( begin );
+    std::vector<asap::neighbour> nn
+	= index.most_similar( word, num_neighbours );
+    get_time( end );
+    if( nn.empty() ) {
+	std::cout << "Out of dictionary word: " << word << "\n";
+	return;
+    }
+    std::cout << "Word: " << word << "\n";
+    for( const asap::neighbour & n : nn )
+	std::cout << '\t' << store.word( n.first ) << '\t' << n.second << '\n';
+    print_time( "query", begin, end );
+}
+
+int main(int argc, char **argv) {
+    struct timespec begin, end;
+
+    parse_args( argc, argv );
+
+    get_time( begin );
+    asap::embedding_store store( infile );
+    asap::embedding_index index( store );
+    std::cerr << "Words: " << store.get_num_points()
+	      << " dimensions: " << store.get_dimensions() << "\n";
+    if( num_lists > 0 ) {
+	index.build_ivf( num_lists );
+	index.set_nprobe( num_probes );
+    }
+    get_time( end );
+    print_time( "open", begin, end );
+
+    if( optind < argc ) {
+	for( int i=optind; i < argc; ++i )
+	    query( store, index, argv[i] );
+    } else {
+	std::string word;
+	while( std::getline( std::cin, word ) )
+	    if( !word.empty() )
+		query( store, index, word.c_str() );
+    }
+
+    return 0;
+}
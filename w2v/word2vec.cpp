@@ -37,18 +37,25 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stddefines.h>
+#include <iostream>
+#include <fstream>
+#include "asap/par.h"
+#include "asap/utils.h"
+#include "asap/arff.h"
+#include "asap/dense_vector.h"
+#include "asap/sparse_vector.h"
+#include "asap/word_count.h"
+#include "asap/hashtable.h"
+#include "asap/numa.h"
+#include "asap/embedding.h"
 #include <pthread.h>
-#if !SEQUENTIAL
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/reducer_opadd.h>
-#include "cilkpub/sort.h"
-#else
-#define cilk_sync
-#define cilk_spawn
-#define cilk_for for
-#endif
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
@@ -69,8 +76,9 @@ struct vocab_word {
 
 char train_file[MAX_STRING], output_file[MAX_STRING];
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
+char corpus_file[MAX_STRING], store_file[MAX_STRING];
 struct vocab_word *vocab;
-int binary = 0, cbow = 1, debug_mode = 2, window = 5, min_count = 5, num_threads = 12, min_reduce = 1;
+int binary = 0, cbow = 1, debug_mode = 2, window = 5, min_count = 5, num_threads = 12;
 int *vocab_hash;
 long long vocab_max_size = 1000, vocab_size = 0, layer1_size = 100;
 long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0, classes = 0;
@@ -78,33 +86,120 @@ real alpha = 0.025, starting_alpha, sample = 1e-3;
 real *syn0, *syn1, *syn1neg, *expTable;
 clock_t start;
 
-int hs = 0, negative = 5;
+int hs = 0, negative = 5, batch = 0, alias = 1;
 const int table_size = 1e8;
 int *table;
+real *alias_prob;
+int *alias_index;
+
+// NUMA placement: -numa 1 interleaves the weight matrices across the nodes,
+// -numa 2 additionally keeps a replica of the output layer per node that is
+// merged every numa_sync words. Threads are partitioned over the nodes.
+int numa = 0, numa_nodes = 0;
+long long numa_sync = 1000000;
+asap::numa::node_replicas<real> *syn1_rep, *syn1neg_rep;
+std::atomic<long long> next_merge(0);
+long long *thread_words;
+double *thread_secs, train_begin;
+
+// The training text encoded as vocabulary IDs. Words not in the vocabulary
+// are dropped and every end of line is encoded as </s> (ID 0).
+struct corpus_header {
+  char magic[8];
+  long long vocab_size;
+  unsigned long long vocab_hash;
+  long long num_tokens;
+};
+const char corpus_magic[8] = "W2VCRP1";
+int *corpus;
+long long corpus_size = 0;
+size_t corpus_map_size = 0;  // non-zero if the corpus is mapped from file
+
+// Unnormalised cumulative distribution of the word counts raised to the
+// power, calculated by a blocked parallel prefix sum.
+double *CumulativeUnigram(double power) {
+  long long nblocks = asap::par::num_workers() * 8, bs;
+  double *cum = (double *)malloc(vocab_size * sizeof(double));
+  double *block_sum = (double *)calloc(nblocks + 1, sizeof(double));
+  if (nblocks > vocab_size) nblocks = vocab_size;
+  bs = (vocab_size + nblocks - 1) / nblocks;
+  asap::par::parallel_for((long long)0, nblocks, [&](long long k) {
+    long long a, e = std::min(vocab_size, (k + 1) * bs);
+    double sum = 0;
+    for (a = k * bs; a < e; a++) sum += cum[a] = pow(vocab[a].cn, power);
+    block_sum[k + 1] = sum;
+  }, 1);
+  for (long long k = 0; k < nblocks; k++) block_sum[k + 1] += block_sum[k];
+  asap::par::parallel_for((long long)0, nblocks, [&](long long k) {
+    long long a, e = std::min(vocab_size, (k + 1) * bs);
+    double sum = block_sum[k];
+    for (a = k * bs; a < e; a++) cum[a] = sum += cum[a];
+  }, 1);
+  free(block_sum);
+  return cum;
+}
 
 void InitUnigramTable() {
-  int a, i;
-  double train_words_pow = 0;
-  double d1, power = 0.75;
+  double power = 0.75;
+  double *cum = CumulativeUnigram(power);
+  double train_words_pow = cum[vocab_size - 1];
   table = (int *)malloc(table_size * sizeof(int));
-#if KTEST
-  cilk::reducer< cilk::op_add<double> > twp_sum(0); 
-  cilk_for (a = 0; a < vocab_size; a++) *twp_sum += pow(vocab[a].cn, power);
-  train_words_pow = twp_sum.get_value();
-#else
-  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
-#endif
-  i = 0;
-  d1 = pow(vocab[i].cn, power) / train_words_pow;
-  // dependency of d1 within loop, so not eligible for cilk_for - khere ??
-  for (a = 0; a < table_size; a++) {
-    table[a] = i;
-    if (a / (double)table_size > d1) {
-      i++;
-      d1 += pow(vocab[i].cn, power) / train_words_pow;
-    }
-    if (i >= vocab_size) i = vocab_size - 1;
+  // Word a fills the entries from the cumulative probability of the words
+  // before it up to its own; these ranges are independent.
+  asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+    long long lo = a == 0 ? 0 : (long long)(cum[a - 1] / train_words_pow * table_size);
+    long long hi = a == vocab_size - 1 ? table_size
+      : (long long)(cum[a] / train_words_pow * table_size);
+    for (long long t = lo; t < hi; t++) table[t] = a;
+  });
+  free(cum);
+}
+
+// Walker's alias method (Vose's construction): every word has a bucket
+// holding its own probability and an alias that fills the remainder, such
+// that a draw takes O(1) time and memory is proportional to vocab_size.
+void InitAliasTable() {
+  double power = 0.75;
+  double *cum = CumulativeUnigram(power);
+  double scale = vocab_size / cum[vocab_size - 1];
+  long long nsmall = 0, nlarge = 0, s, l;
+  long long *small = (long long *)malloc(vocab_size * sizeof(long long));
+  long long *large = (long long *)malloc(vocab_size * sizeof(long long));
+  alias_prob = (real *)malloc(vocab_size * sizeof(real));
+  alias_index = (int *)malloc(vocab_size * sizeof(int));
+  double *p = cum;  // scaled probabilities overwrite the prefix sums
+  for (long long a = vocab_size - 1; a > 0; a--) p[a] = (cum[a] - cum[a - 1]) * scale;
+  p[0] *= scale;
+  for (long long a = 0; a < vocab_size; a++) {
+    alias_index[a] = a;
+    if (p[a] < 1) small[nsmall++] = a;
+    else large[nlarge++] = a;
+  }
+  while (nsmall > 0 && nlarge > 0) {
+    s = small[--nsmall];
+    l = large[--nlarge];
+    alias_prob[s] = p[s];
+    alias_index[s] = l;
+    p[l] -= 1 - p[s];
+    if (p[l] < 1) small[nsmall++] = l;
+    else large[nlarge++] = l;
   }
+  // Remaining buckets are full, up to rounding
+  while (nlarge > 0) alias_prob[large[--nlarge]] = 1;
+  while (nsmall > 0) alias_prob[small[--nsmall]] = 1;
+  free(small);
+  free(large);
+  free(cum);
+}
+
+// Draw a word from the unigram distribution
+inline long long SampleUnigram(unsigned long long &next_random) {
+  long long a;
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  if (!alias) return table[(next_random >> 16) % table_size];
+  a = (next_random >> 16) % vocab_size;
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  return ((next_random >> 16) & 0xFFFFFF) < alias_prob[a] * 16777216.0 ? a : alias_index[a];
 }
 
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
@@ -176,9 +271,12 @@ int AddWordToVocab(char *word) {
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
+// Used later for sorting by word counts. Ties are broken by the word, as
+// the order in which words are found is not deterministic.
 int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+    long long d = ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+    if (d) return d < 0 ? -1 : 1;
+    return strcmp(((struct vocab_word *)a)->word, ((struct vocab_word *)b)->word);
 }
 
 #if 1
@@ -207,13 +305,10 @@ void SortVocab() {
   int a, size;
   unsigned int hash;
   // Sort the vocabulary and keep </s> at the first position
-//#ifdef KTEST
-  // cilkpub::cilk_sort(&vocab[1], &vocab[vocab_size - 1], w2v_sort_pred());
-//#else
   qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-// #endif
 #ifdef KTEST
-  cilk_for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  asap::par::parallel_for((long long)0, (long long)vocab_hash_size,
+                          [&](long long a) { vocab_hash[a] = -1; });
 #else
   for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
 #endif
@@ -235,98 +330,52 @@ void SortVocab() {
   vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
   // Allocate memory for the binary tree construction
 #ifdef KTEST
-  cilk_for (a = 0; a < vocab_size; a++) {
+  asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
+    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+  });
 #else
   for (a = 0; a < vocab_size; a++) {
-#endif
     vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
     vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
   }
-}
-
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
-    vocab[b].word = vocab[a].word;
-    b++;
-  } else free(vocab[a].word);
-  vocab_size = b;
-#ifdef KTEST
-  cilk_for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  cilk_for (a = 0; a < vocab_size; a++) {
-#else
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
 #endif
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
-  }
-  fflush(stdout);
-  min_reduce++;
 }
 
 // Create binary Huffman tree using the word counts
 // Frequent words will have short uniqe binary codes
+// The vocabulary is sorted by decreasing count, so the leaves form a queue
+// in increasing order from the back, and the internal nodes are created in
+// increasing order; the two smallest nodes are found at the heads of these
+// two queues, which builds the tree in linear time. Codes are assigned to
+// the words in parallel.
 void CreateBinaryTree() {
-  long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
-  char code[MAX_CODE_LENGTH];
+  long long a, pos1, pos2, min1i, min2i;
   long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+  char *binary = (char *)calloc(vocab_size * 2 + 1, sizeof(char));
   long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-#ifdef KTEST
-  cilk_for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
-  cilk_for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
-#else
-  for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
-  for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
-#endif
+  asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+    count[a] = vocab[a].cn;
+    count[vocab_size + a] = 1e15;
+  });
   pos1 = vocab_size - 1;
   pos2 = vocab_size;
   // Following algorithm constructs the Huffman tree by adding one node at a time
-// #ifdef KTEST
-  // cilk_for (a = 0; a < vocab_size - 1; a++) {
-// #else
   for (a = 0; a < vocab_size - 1; a++) {
-// #endif
     // First, find two smallest nodes 'min1, min2'
-    if (pos1 >= 0) {
-      if (count[pos1] < count[pos2]) {
-        min1i = pos1;
-        pos1--;
-      } else {
-        min1i = pos2;
-        pos2++;
-      }
-    } else {
-      min1i = pos2;
-      pos2++;
-    }
-    if (pos1 >= 0) {
-      if (count[pos1] < count[pos2]) {
-        min2i = pos1;
-        pos1--;
-      } else {
-        min2i = pos2;
-        pos2++;
-      }
-    } else {
-      min2i = pos2;
-      pos2++;
-    }
+    if (pos1 >= 0 && count[pos1] < count[pos2]) min1i = pos1--;
+    else min1i = pos2++;
+    if (pos1 >= 0 && count[pos1] < count[pos2]) min2i = pos1--;
+    else min2i = pos2++;
     count[vocab_size + a] = count[min1i] + count[min2i];
     parent_node[min1i] = vocab_size + a;
     parent_node[min2i] = vocab_size + a;
     binary[min2i] = 1;
   }
   // Now assign binary code to each vocabulary word
-  for (a = 0; a < vocab_size; a++) {
-    b = a;
-    i = 0;
+  asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+    long long b = a, i = 0, point[MAX_CODE_LENGTH];
+    char code[MAX_CODE_LENGTH];
     while (1) {
       code[i] = binary[b];
       point[i] = b;
@@ -340,51 +389,62 @@ void CreateBinaryTree() {
       vocab[a].code[i - b - 1] = code[b];
       vocab[a].point[i - b] = point[b] - vocab_size;
     }
-  }
+  });
   free(count);
   free(binary);
   free(parent_node);
 }
 
+// Word counts are collected in parallel with the asap word catalog, using
+// a hash table per worker that is merged on completion.
+typedef asap::word_map<asap::hash_table<const char *, size_t,
+                                        asap::text::charp_hash,
+                                        asap::text::charp_eql>,
+                       asap::word_bank_managed> vocab_catalog_type;
+
 void LearnVocabFromTrainFile() {
   char word[MAX_STRING];
-  FILE *fin;
-  long long a, i;
-#ifdef KTEST
-  cilk_for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-#else
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-#endif
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+  long long a, i, kept = 0;
+  asap::file_buffer file;
+  vocab_catalog_type catalog;
+  asap::par::parallel_for((long long)0, (long long)vocab_hash_size,
+                          [&](long long a) { vocab_hash[a] = -1; });
+  if (access(train_file, R_OK) != 0) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
+  asap::internal::read_file(train_file, file);
+  train_words = asap::text::token_catalog(file.data.get(), file.size, catalog,
+                                          size_t(1) << 20, "</s>");
+  file_size = file.size;
+  file.data.reset();
+  // Only words that survive min_count are added. Words longer than
+  // ReadWord allows are truncated as it would, which may merge them.
+  for (vocab_catalog_type::const_iterator I = catalog.cbegin(), E = catalog.cend(); I != E; ++I)
+    if ((long long)I->second >= min_count || strlen(I->first) >= MAX_STRING - 2) kept++;
+  vocab_max_size = kept + 3;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
   vocab_size = 0;
   AddWordToVocab((char *)"</s>");
-  // khere todo - cilk_spawn ??
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    train_words++;
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("%lldK%c", train_words / 1000, 13);
-      fflush(stdout);
+  for (vocab_catalog_type::const_iterator I = catalog.cbegin(), E = catalog.cend(); I != E; ++I) {
+    if ((long long)I->second < min_count && strlen(I->first) < MAX_STRING - 2) continue;
+    if (!strcmp(I->first, "</s>")) {
+      vocab[0].cn += I->second;
+      continue;
     }
+    strncpy(word, I->first, MAX_STRING - 2);
+    word[MAX_STRING - 2] = 0;
     i = SearchVocab(word);
     if (i == -1) {
       a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+      vocab[a].cn = I->second;
+    } else vocab[i].cn += I->second;
   }
   SortVocab();
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
 }
 
 void SaveVocab() {
@@ -428,32 +488,153 @@ void ReadVocab() {
   fclose(fin);
 }
 
+// Fingerprint of the vocabulary, used to validate a saved corpus
+unsigned long long VocabFingerprint() {
+  unsigned long long h = 14695981039346656037ULL;
+  long long a;
+  char *p;
+  for (a = 0; a < vocab_size; a++) {
+    for (p = vocab[a].word; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ (unsigned long long)vocab[a].cn) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// Map a corpus saved by an earlier run, provided it was encoded with the
+// same vocabulary. Returns 1 on success.
+int MapCorpus() {
+  struct corpus_header hdr;
+  struct stat finfo;
+  void *map;
+  int fd = open(corpus_file, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &finfo) < 0 || finfo.st_size < (off_t)sizeof(hdr)
+      || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+      || memcmp(hdr.magic, corpus_magic, sizeof(corpus_magic))
+      || hdr.vocab_size != vocab_size || hdr.vocab_hash != VocabFingerprint()
+      || finfo.st_size != (off_t)(sizeof(hdr) + hdr.num_tokens * sizeof(int))) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+  madvise(map, finfo.st_size, MADV_SEQUENTIAL);
+  corpus = (int *)((char *)map + sizeof(hdr));
+  corpus_size = hdr.num_tokens;
+  corpus_map_size = finfo.st_size;
+  return 1;
+}
+
+// Encode the training file as vocabulary IDs, once. If a corpus file is
+// given, the encoding is reused across runs with the same vocabulary.
+void EncodeTrainFile() {
+  long long capacity = train_words + 1;
+  int word;
+  FILE *fin, *fo;
+  struct corpus_header hdr;
+  if (corpus_file[0] != 0 && MapCorpus()) {
+    if (debug_mode > 0) printf("Corpus mapped from %s: %lld tokens\n", corpus_file, corpus_size);
+    return;
+  }
+  fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  corpus = (int *)malloc(capacity * sizeof(int));
+  corpus_size = 0;
+  while (1) {
+    word = ReadWordIndex(fin);
+    if (feof(fin)) break;
+    if (word == -1) continue;
+    if (corpus_size == capacity) {
+      capacity *= 2;
+      corpus = (int *)realloc(corpus, capacity * sizeof(int));
+    }
+    if (corpus == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    corpus[corpus_size++] = word;
+  }
+  fclose(fin);
+  if (debug_mode > 0) printf("Corpus encoded: %lld tokens\n", corpus_size);
+  if (corpus_file[0] != 0) {
+    fo = fopen(corpus_file, "wb");
+    if (fo == NULL) {
+      printf("ERROR: cannot write corpus file %s\n", corpus_file);
+      exit(1);
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, corpus_magic, sizeof(corpus_magic));
+    hdr.vocab_size = vocab_size;
+    hdr.vocab_hash = VocabFingerprint();
+    hdr.num_tokens = corpus_size;
+    fwrite(&hdr, sizeof(hdr), 1, fo);
+    fwrite(corpus, sizeof(int), corpus_size, fo);
+    fclose(fo);
+  }
+}
+
+void FreeCorpus() {
+  if (corpus_map_size) munmap((char *)corpus - sizeof(struct corpus_header), corpus_map_size);
+  else free(corpus);
+  corpus = NULL;
+  corpus_map_size = 0;
+}
+
+double WallSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The node of a training thread; threads are assigned in consecutive groups
+int ThreadNode(long long id) {
+  return numa ? id * numa_nodes / num_threads : 0;
+}
+
+// Allocate a vocab_size x layer1_size matrix. With -numa the pages are
+// interleaved across the nodes. With -numa 2, a matrix allocated with rep is
+// replicated per node and the reference copy is returned.
+real *AllocMatrix(asap::numa::node_replicas<real> **rep) {
+  long long n = vocab_size * layer1_size;
+  real *m = NULL;
+  if (numa == 2 && rep) {
+    *rep = new asap::numa::node_replicas<real>(n, numa_nodes);
+    if ((*rep)->valid()) m = (*rep)->reference();
+  } else if (numa) m = (real *)asap::numa::alloc_interleaved(n * sizeof(real));
+  else if (posix_memalign((void **)&m, 128, n * sizeof(real))) m = NULL;
+  if (m == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  return m;
+}
+
+void MergeReplicas() {
+  if (syn1_rep) syn1_rep->merge();
+  if (syn1neg_rep) syn1neg_rep->merge();
+}
+
 void InitNet() {
   long long a, b;
   unsigned long long next_random = 1;
-  a = posix_memalign((void **)&syn0, 128, (long long)vocab_size * layer1_size * sizeof(real));
-  if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  syn0 = AllocMatrix(NULL);
   if (hs) {
-    a = posix_memalign((void **)&syn1, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    syn1 = AllocMatrix(&syn1_rep);
 #if KTEST
-    cilk_for (a = 0; a < vocab_size; a++) {
-        for (b = 0; b < layer1_size; b++)
+    asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+        for (long long b = 0; b < layer1_size; b++)
             syn1[a * layer1_size + b] = 0;
-    }
+    });
 #else
     for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
         syn1[a * layer1_size + b] = 0;
 #endif
   }
   if (negative>0) {
-    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    syn1neg = AllocMatrix(&syn1neg_rep);
 #if KTEST
-    cilk_for (a = 0; a < vocab_size; a++) {
-        for (b = 0; b < layer1_size; b++)
+    asap::par::parallel_for((long long)0, vocab_size, [&](long long a) {
+        for (long long b = 0; b < layer1_size; b++)
             syn1neg[a * layer1_size + b] = 0;
-    }
+    });
 #else
     for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
         syn1neg[a * layer1_size + b] = 0;
@@ -466,19 +647,129 @@ void InitNet() {
   CreateBinaryTree();
 }
 
+// Dense kernels for batched negative sampling. Matrices are stored by rows
+// of d elements. The loops over d are innermost and unit-stride such that
+// they vectorise; four rows are processed at once to reuse loads.
+
+// C[i][j] = A[i] . B[j] for i < m, j < n
+void GemmABt(const real *A, const real *B, real *C, int m, int n, long long d) {
+  int i, j;
+  long long c;
+  for (i = 0; i < m; i++) {
+    const real *x = A + i * d;
+    for (j = 0; j + 4 <= n; j += 4) {
+      const real *b0 = B + j * d, *b1 = b0 + d, *b2 = b1 + d, *b3 = b2 + d;
+      real s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      for (c = 0; c < d; c++) {
+        s0 += x[c] * b0[c];
+        s1 += x[c] * b1[c];
+        s2 += x[c] * b2[c];
+        s3 += x[c] * b3[c];
+      }
+      C[i * n + j] = s0;
+      C[i * n + j + 1] = s1;
+      C[i * n + j + 2] = s2;
+      C[i * n + j + 3] = s3;
+    }
+    for (; j < n; j++) {
+      const real *y = B + j * d;
+      real s = 0;
+      for (c = 0; c < d; c++) s += x[c] * y[c];
+      C[i * n + j] = s;
+    }
+  }
+}
+
+// C[i] = sum_j G[i*gi + j*gj] * B[j] for i < m, j < n
+void GemmGB(const real *G, long long gi, long long gj, const real *B, real *C,
+            int m, int n, long long d) {
+  int i, j;
+  long long c;
+  for (i = 0; i < m; i++) {
+    real *z = C + i * d;
+    for (c = 0; c < d; c++) z[c] = 0;
+    for (j = 0; j + 4 <= n; j += 4) {
+      const real *b0 = B + j * d, *b1 = b0 + d, *b2 = b1 + d, *b3 = b2 + d;
+      real g0 = G[i * gi + j * gj], g1 = G[i * gi + (j + 1) * gj];
+      real g2 = G[i * gi + (j + 2) * gj], g3 = G[i * gi + (j + 3) * gj];
+      for (c = 0; c < d; c++) z[c] += g0 * b0[c] + g1 * b1[c] + g2 * b2[c] + g3 * b3[c];
+    }
+    for (; j < n; j++) {
+      const real *y = B + j * d;
+      real g = G[i * gi + j * gj];
+      for (c = 0; c < d; c++) z[c] += g * y[c];
+    }
+  }
+}
+
+// Skip-gram with negative sampling where the negative samples are shared
+// by all context words of a window (Ji et al., pSGNScc). The m context
+// words in rows_in and the n output words in rows_out (the word itself,
+// followed by the negative samples) give an m x n matrix of dot products,
+// such that the updates are matrix products. Updates are computed from a
+// copy of the rows and then added to the shared weights (Hogwild). The
+// output layer is passed as wout.
+void TrainBatch(long long *rows_in, int m, long long *rows_out, int n, real *wout, real *buf) {
+  int i, j;
+  long long c;
+  real f, g;
+  real *in = buf, *out = in + 2 * window * layer1_size;
+  real *din = out + (negative + 1) * layer1_size, *dout = din + 2 * window * layer1_size;
+  real *G = dout + (negative + 1) * layer1_size;
+  for (i = 0; i < m; i++) memcpy(in + i * layer1_size, syn0 + rows_in[i] * layer1_size, layer1_size * sizeof(real));
+  for (j = 0; j < n; j++) memcpy(out + j * layer1_size, wout + rows_out[j] * layer1_size, layer1_size * sizeof(real));
+  GemmABt(in, out, G, m, n, layer1_size);
+  for (i = 0; i < m; i++) for (j = 0; j < n; j++) {
+    f = G[i * n + j];
+    if (f > MAX_EXP) g = ((j == 0) - 1) * alpha;
+    else if (f < -MAX_EXP) g = ((j == 0) - 0) * alpha;
+    else g = ((j == 0) - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+    G[i * n + j] = g;
+  }
+  GemmGB(G, n, 1, out, din, m, n, layer1_size);
+  GemmGB(G, 1, n, in, dout, n, m, layer1_size);
+  for (i = 0; i < m; i++) {
+    real *w = syn0 + rows_in[i] * layer1_size;
+    for (c = 0; c < layer1_size; c++) w[c] += din[i * layer1_size + c];
+  }
+  for (j = 0; j < n; j++) {
+    real *w = wout + rows_out[j] * layer1_size;
+    for (c = 0; c < layer1_size; c++) w[c] += dout[j * layer1_size + c];
+  }
+}
+
 void *TrainModelThread(void *id) {
 // void *TrainModelThread() {
   long long a, b, d, cw, word, last_word, sentence_length = 0, sentence_position = 0;
   long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
   long long l1, l2, c, target, label, local_iter = iter;
   unsigned long long next_random = (long long)id;
+  // Each thread trains on an equal slice of the encoded corpus
+  long long slice_begin = corpus_size / num_threads * (long long)id;
+  long long slice_end = (long long)id == num_threads - 1 ? corpus_size
+    : corpus_size / num_threads * ((long long)id + 1);
+  long long pos = slice_begin, words_done = 0;
+  // The output layers updated by this thread; replicas local to its node
+  // with -numa 2
+  int node = ThreadNode((long long)id);
+  real *syn1 = syn1_rep ? syn1_rep->replica(node) : ::syn1;
+  real *syn1neg = syn1neg_rep ? syn1neg_rep->replica(node) : ::syn1neg;
   real f, g;
   clock_t now;
   real *neu1 = (real *)calloc(layer1_size, sizeof(real));
   real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  // Rows and scratch space for batched training
+  int nin, nout;
+  long long *rows_in = (long long *)malloc(2 * window * sizeof(long long));
+  long long *rows_out = (long long *)malloc((negative + 1) * sizeof(long long));
+  real *batch_buf = NULL;
+  if (batch && posix_memalign((void **)&batch_buf, 128, ((4 * window + 2 * (negative + 1)) * layer1_size
+                     + 2 * window * (negative + 1)) * sizeof(real))) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  if (numa) asap::numa::run_on_node(node % asap::numa::num_nodes());
 #if 1
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
   while (1) {
     if (word_count - last_word_count > 10000) {
       word_count_actual += word_count - last_word_count;
@@ -492,12 +783,24 @@ void *TrainModelThread(void *id) {
       }
       alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
       if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+      // One thread merges the replicas when due; the others carry on
+      long long due = next_merge;
+      if (numa == 2 && word_count_actual >= due
+          && next_merge.compare_exchange_strong(due, word_count_actual + numa_sync)) MergeReplicas();
     }
     if (sentence_length == 0) {
-      while (1) {
-        word = ReadWordIndex(fi);
-        if (feof(fi)) break;
-        if (word == -1) continue;
+      if (pos == slice_end) {
+        word_count_actual += word_count - last_word_count;
+        words_done += word_count;
+        local_iter--;
+        if (local_iter == 0) break;
+        word_count = 0;
+        last_word_count = 0;
+        pos = slice_begin;
+        continue;
+      }
+      while (pos < slice_end) {
+        word = corpus[pos++];
         word_count++;
         if (word == 0) break;
         // The subsampling randomly discards frequent words while keeping the ranking same
@@ -511,16 +814,7 @@ void *TrainModelThread(void *id) {
         if (sentence_length >= MAX_SENTENCE_LENGTH) break;
       }
       sentence_position = 0;
-    }
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-      continue;
+      if (sentence_length == 0) continue;
     }
     word = sen[sentence_position];
     if (word == -1) continue;
@@ -563,8 +857,7 @@ void *TrainModelThread(void *id) {
             target = word;
             label = 1;
           } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
+            target = SampleUnigram(next_random);
             if (target == 0) target = next_random % (vocab_size - 1) + 1;
             if (target == word) continue;
             label = 0;
@@ -588,6 +881,27 @@ void *TrainModelThread(void *id) {
           for (c = 0; c < layer1_size; c++) syn0[c + last_word * layer1_size] += neu1e[c];
         }
       }
+    } else if (batch && negative > 0 && !hs) {  //train skip-gram, batched
+      nin = 0;
+      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+        c = sentence_position - window + a;
+        if (c < 0) continue;
+        if (c >= sentence_length) continue;
+        last_word = sen[c];
+        if (last_word == -1) continue;
+        rows_in[nin++] = last_word;
+      }
+      if (nin) {
+        nout = 0;
+        rows_out[nout++] = word;
+        for (d = 0; d < negative; d++) {
+          target = SampleUnigram(next_random);
+          if (target == 0) target = next_random % (vocab_size - 1) + 1;
+          if (target == word) continue;
+          rows_out[nout++] = target;
+        }
+        TrainBatch(rows_in, nin, rows_out, nout, syn1neg, batch_buf);
+      }
     } else {  //train skip-gram
       for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
         c = sentence_position - window + a;
@@ -619,8 +933,7 @@ void *TrainModelThread(void *id) {
             target = word;
             label = 1;
           } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
+            target = SampleUnigram(next_random);
             if (target == 0) target = next_random % (vocab_size - 1) + 1;
             if (target == word) continue;
             label = 0;
@@ -644,14 +957,38 @@ void *TrainModelThread(void *id) {
       continue;
     }
   }
-  fclose(fi);
   free(neu1);
   free(neu1e);
+  free(rows_in);
+  free(rows_out);
+  free(batch_buf);
+  thread_words[(long long)id] = words_done;
+  thread_secs[(long long)id] = WallSeconds() - train_begin;
+  if (numa) asap::numa::run_on_node(-1);
   // pthread_exit(NULL);
 #endif
   return 0;
 }
 
+// Training throughput of the threads on each node, over the time until the
+// last of them finished
+void ReportNodeThroughput() {
+  long long a, n, threads, words;
+  double secs;
+  for (n = 0; n < numa_nodes; n++) {
+    threads = 0;
+    words = 0;
+    secs = 0;
+    for (a = 0; a < num_threads; a++) if (ThreadNode(a) == n) {
+      threads++;
+      words += thread_words[a];
+      if (thread_secs[a] > secs) secs = thread_secs[a];
+    }
+    printf("Node %lld: %lld threads, %lld words, %.2fk words/sec\n", n, threads, words,
+           words / (secs + 1e-9) / 1000);
+  }
+}
+
 void TrainModel() {
   long a, b, c, d;
   FILE *fo;
@@ -661,14 +998,25 @@ void TrainModel() {
   if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
   if (save_vocab_file[0] != 0) SaveVocab();
   if (output_file[0] == 0) return;
+  EncodeTrainFile();
   InitNet();
-  if (negative > 0) InitUnigramTable();
+  if (negative > 0) {
+    if (alias) InitAliasTable();
+    else InitUnigramTable();
+  }
+  thread_words = (long long *)calloc(num_threads, sizeof(long long));
+  thread_secs = (double *)calloc(num_threads, sizeof(double));
+  next_merge = numa_sync;
   start = clock();
-// HV: TODO: Potentially split highly parallel loop across more chunks
-//           to allow for load balancing; do proper cilk_for loop
-  cilk_for (a = 0; a < num_threads; a++) TrainModelThread((void *) a);
-  // for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  // for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  train_begin = WallSeconds();
+  // One thread per slice of the corpus, such that every thread stays on
+  // the node it is placed on with -numa
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+  FreeCorpus();
+  MergeReplicas();
+  if (numa) ReportNodeThroughput();
   fo = fopen(output_file, "wb");
   if (classes == 0) {
     // Save the word vectors
@@ -724,6 +1072,9 @@ void TrainModel() {
     free(cl);
   }
   fclose(fo);
+  if (store_file[0] != 0)
+    asap::write_embeddings(store_file, vocab_size, layer1_size, syn0,
+                           [](size_t i) { return (const char *)vocab[i].word; });
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -759,6 +1110,18 @@ int main(int argc, char **argv) {
     printf("\t\tUse Hierarchical Softmax; default is 0 (not used)\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
+    printf("\t-alias <int>\n");
+    printf("\t\tDraw negative examples with the alias method rather than a table of 1e8 entries; default is 1\n");
+    printf("\t-batch <int>\n");
+    printf("\t\tShare negative examples across the window and train with matrix products (skip-gram with\n");
+    printf("\t\tnegative sampling only); default is 0 (off)\n");
+    printf("\t-numa <int>\n");
+    printf("\t\tPartition the threads over the NUMA nodes and interleave the weights across the nodes (1), or\n");
+    printf("\t\tadditionally replicate the output layer per node (2); default is 0 (off)\n");
+    printf("\t-numa-nodes <int>\n");
+    printf("\t\tNumber of groups the threads are partitioned in with -numa; default is the number of nodes\n");
+    printf("\t-numa-sync <int>\n");
+    printf("\t\tMerge the replicas of the output layer every <int> words with -numa 2; default is 1000000\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
     printf("\t-iter <int>\n");
@@ -777,6 +1140,11 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-corpus <file>\n");
+    printf("\t\tThe training data encoded as word IDs will be saved to <file>, or mapped from <file>\n");
+    printf("\t\tif it was saved with the same vocabulary\n");
+    printf("\t-store <file>\n");
+    printf("\t\tAlso save the word vectors to <file> in the binary format read by nearest\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
     printf("\nExamples:\n");
@@ -786,10 +1154,14 @@ int main(int argc, char **argv) {
   output_file[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
+  corpus_file[0] = 0;
+  store_file[0] = 0;
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-corpus", argc, argv)) > 0) strcpy(corpus_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-store", argc, argv)) > 0) strcpy(store_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]);
@@ -800,10 +1172,24 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-alias", argc, argv)) > 0) alias = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa", argc, argv)) > 0) numa = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa-nodes", argc, argv)) > 0) numa_nodes = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa-sync", argc, argv)) > 0) numa_sync = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
+  if (batch && (cbow || hs || negative == 0)) {
+    printf("Batched training applies to skip-gram with negative sampling only; ignoring -batch\n");
+    batch = 0;
+  }
+  if (numa) {
+    if (!asap::numa::available()) printf("NUMA is not supported on this system; memory and threads are not placed\n");
+    if (numa_nodes <= 0) numa_nodes = asap::numa::num_nodes();
+    if (numa_nodes > num_threads) numa_nodes = num_threads;
+  }
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
   vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));